@@ -0,0 +1,441 @@
+// Benchmarks of the ray tracer, for tracking performance from one version to the next
+//
+// Micro-benchmarks time the inner operations (box and sphere tests, Perlin turbulence, image texture lookups,
+//  BVH builds) in this process, on fixed pseudo-random inputs.
+// Macro-benchmarks render every built-in scene with the RayTracer executable (built by the same CMake project)
+//  at a fixed seed, resolution and samples per pixel. Each render runs in its own process, so its peak memory
+//  (maximum resident set size) is its own.
+// The results are written as JSON (to standard output, or --output FILE); progress goes to standard error.
+//
+// Usage (from the build directory):
+//     cmake --build . --target rt_bench && ./rt_bench > results.json
+//     ./rt_bench --width 400 --spp 16 --threads 1 --runs 3 --scenes 1,5 --skip-micro
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <regex>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "sphere.h"
+#include "material.h"
+#include "perlin.h"
+#include "texture.h"
+#include "bvh.h"
+#include "simd.h"
+
+// Where the RayTracer executable and the project's images are (set by CMakeLists.txt)
+#ifndef RT_BENCH_RAYTRACER
+#define RT_BENCH_RAYTRACER "./RayTracer"
+#endif
+#ifndef RT_BENCH_SOURCE_DIR
+#define RT_BENCH_SOURCE_DIR "."
+#endif
+
+struct bench_options {
+    // Macro-benchmarks: the render settings of every scene
+    int width = 400;
+    int samples_per_pixel = 16;
+    int num_threads = 1;
+    int seed = 0;
+    std::vector<int> scenes = {1, 2, 3, 4, 5, 6, 7};
+    // Every benchmark runs this many times; the fastest run is reported
+    int runs = 3;
+    bool micro = true;
+    bool macro = true;
+    std::string raytracer = RT_BENCH_RAYTRACER;
+    // JSON file to write (empty = standard out)
+    std::string output_path;
+};
+
+// Results written into this are never optimized away
+volatile double benchmark_sink = 0.0;
+
+// Result of one micro-benchmark
+struct micro_result {
+    std::string name;
+    // Operations per run, and the time per operation of the fastest run
+    size_t operations;
+    double nanoseconds_per_operation;
+};
+
+// Run `body()` (which does `operations` operations and returns a value to keep) `runs` times
+micro_result time_micro(const std::string& name, size_t operations, int runs, const std::function<double()>& body) {
+    double best = infinity;
+    for (int run=0; run<runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        benchmark_sink = benchmark_sink + body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    std::cerr << "  " << name << ": " << 1e9 * best / operations << " ns" << std::endl;
+    return {name, operations, 1e9 * best / operations};
+}
+
+// Fixed pseudo-random inputs (the same on every run, independent of the renderer's generator)
+struct bench_random {
+    uint64_t state;
+    explicit bench_random(uint64_t seed): state(seed * 0x9e3779b97f4a7c15ull + 1) {}
+    // [0, 1)
+    double next() {
+        // xorshift64*
+        this->state ^= this->state >> 12;
+        this->state ^= this->state << 25;
+        this->state ^= this->state >> 27;
+        return static_cast<double>((this->state * 0x2545f4914f6cdd1dull) >> 11) * 0x1.0p-53;
+    }
+    double next(double min, double max) { return min + (max - min) * this->next(); }
+    vec3 next_vec3(double min, double max) { return vec3(this->next(min, max), this->next(min, max), this->next(min, max)); }
+};
+
+std::vector<micro_result> run_micro_benchmarks(const bench_options& options) {
+    std::vector<micro_result> results;
+    bench_random random(1);
+    // Rays from around the origin toward the objects (which are in a 20 x 20 x 20 cube)
+    const size_t ray_count = 1024;
+    std::vector<ray> rays;
+    for (size_t i=0; i<ray_count; i++) {
+        rays.push_back(ray(random.next_vec3(-1, 1), random.next_vec3(-1, 1), random.next()));
+    }
+
+    // aabb::hit: every ray against every box
+    {
+        const size_t box_count = 1024;
+        std::vector<aabb> boxes;
+        for (size_t i=0; i<box_count; i++) {
+            point3 center = random.next_vec3(-10, 10);
+            vec3 extent = random.next_vec3(0.1, 2);
+            boxes.push_back(aabb(center - extent, center + extent));
+        }
+        results.push_back(time_micro("aabb_hit", ray_count * box_count, options.runs, [&]() {
+            size_t hits = 0;
+            for (const ray& r : rays) {
+                for (const aabb& box : boxes) hits += box.hit(r, 0.001, infinity);
+            }
+            return static_cast<double>(hits);
+        }));
+    }
+
+    // sphere::hit (the closest-hit test and, on a hit, the surface interaction)
+    {
+        const size_t sphere_count = 1024;
+        shared_ptr<material> mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        std::vector<sphere> spheres;
+        for (size_t i=0; i<sphere_count; i++) spheres.emplace_back(random.next_vec3(-10, 10), random.next(0.5, 3), mat);
+        results.push_back(time_micro("sphere_hit", ray_count * sphere_count, options.runs, [&]() {
+            double sum = 0.0;
+            hit_record rec;
+            for (const ray& r : rays) {
+                for (const sphere& s : spheres) {
+                    if (s.hit(r, 0.001, infinity, rec)) sum += rec.u;
+                }
+            }
+            return sum;
+        }));
+    }
+
+    // perlin::turbulence, one point at a time and batched (see perlin.h)
+    {
+        const size_t point_count = 1 << 16;
+        perlin noise;
+        std::vector<point3> points;
+        for (size_t i=0; i<point_count; i++) points.push_back(random.next_vec3(-50, 50));
+        results.push_back(time_micro("perlin_turbulence", point_count, options.runs, [&]() {
+            double sum = 0.0;
+            for (const point3& p : points) sum += noise.turbulence(p);
+            return sum;
+        }));
+        std::vector<double> out(point_count);
+        results.push_back(time_micro("perlin_turbulence_batch", point_count, options.runs, [&]() {
+            noise.turbulence(points.data(), out.data(), static_cast<int>(point_count));
+            return out[point_count / 2];
+        }));
+    }
+
+    // image_texture::value at random (u, v)
+    {
+        const size_t lookup_count = 1 << 20;
+        image_texture earth(RT_BENCH_SOURCE_DIR "/images/earthmap.jpeg");
+        std::vector<double> uv;
+        for (size_t i=0; i<2*lookup_count; i++) uv.push_back(random.next());
+        const point3 p(0, 0, 0);
+        results.push_back(time_micro("image_texture_value", lookup_count, options.runs, [&]() {
+            double sum = 0.0;
+            for (size_t i=0; i<lookup_count; i++) sum += earth.value(uv[2*i], uv[2*i + 1], p).x();
+            return sum;
+        }));
+    }
+
+    // BVH build (binned SAH, see bvh.h) over 100,000 small boxes, on one thread and on the render threads
+    {
+        const size_t box_count = 100000;
+        std::vector<aabb> boxes;
+        for (size_t i=0; i<box_count; i++) {
+            point3 center = random.next_vec3(-100, 100);
+            vec3 extent = random.next_vec3(0.1, 1);
+            boxes.push_back(aabb(center - extent, center + extent));
+        }
+        for (int threads : {1, options.num_threads}) {
+            bvh_builder::options opts;
+            opts.max_leaf_size = 4;
+            opts.num_threads = threads;
+            std::string name = "bvh_build_" + std::to_string(threads) + "_thread" + (threads == 1 ? "" : "s");
+            results.push_back(time_micro(name, box_count, options.runs, [&]() {
+                bvh_builder builder(boxes, opts);
+                std::unique_ptr<bvh_build_node> root = builder.build();
+                return root->box.surface_area();
+            }));
+            if (options.num_threads == 1) break;
+        }
+    }
+
+    return results;
+}
+
+// Result of one macro-benchmark (a scene rendered by RayTracer)
+struct macro_result {
+    int scene;
+    bool ok;
+    // Of the fastest run
+    double render_seconds;
+    double million_rays_per_second;
+    // Sum of the "built in N ms" of every BVH the renderer built
+    double build_milliseconds;
+    // The largest of all runs, in KiB
+    long peak_rss_kib;
+};
+
+// Run the renderer with `args` in the project directory (where the scenes find their images)
+// Returns its standard error; `status` and `peak_rss_kib` are its exit status and maximum resident set size
+std::string run_raytracer(const std::string& executable, const std::vector<std::string>& args, int& status, long& peak_rss_kib) {
+    int error_pipe[2];
+    if (pipe(error_pipe) != 0) {
+        status = -1;
+        return "";
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        // (the image goes to standard out, which is not needed)
+        int null_output = open("/dev/null", O_WRONLY);
+        dup2(null_output, STDOUT_FILENO);
+        dup2(error_pipe[1], STDERR_FILENO);
+        close(error_pipe[0]);
+        close(error_pipe[1]);
+        if (chdir(RT_BENCH_SOURCE_DIR) != 0) _exit(127);
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(executable.c_str()));
+        for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        execv(executable.c_str(), argv.data());
+        _exit(127);
+    }
+    close(error_pipe[1]);
+    std::string log;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(error_pipe[0], buffer, sizeof(buffer))) > 0) log.append(buffer, count);
+    close(error_pipe[0]);
+
+    struct rusage usage = {};
+    status = -1;
+    if (child < 0 || wait4(child, &status, 0, &usage) < 0) return log;
+    // (ru_maxrss is in KiB on Linux)
+    peak_rss_kib = usage.ru_maxrss;
+    return log;
+}
+
+std::vector<macro_result> run_macro_benchmarks(const bench_options& options) {
+    // The executable is started from the project directory
+    std::string executable = options.raytracer;
+    if (!executable.empty() && executable[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd))) executable = std::string(cwd) + "/" + executable;
+    }
+
+    const std::regex rendered(R"(Rendered in ([0-9.eE+-]+) seconds \(([0-9.eE+-]+) million rays/second\))");
+    const std::regex built(R"(built in ([0-9.eE+-]+) ms)");
+    std::vector<macro_result> results;
+    for (int scene : options.scenes) {
+        macro_result result = {scene, false, infinity, 0.0, 0.0, 0};
+        const std::vector<std::string> args = {
+            "--scene", std::to_string(scene), "--seed", std::to_string(options.seed),
+            "--width", std::to_string(options.width), "--spp", std::to_string(options.samples_per_pixel),
+            "--threads", std::to_string(options.num_threads)
+        };
+        for (int run=0; run<options.runs; run++) {
+            int status;
+            long peak_rss_kib = 0;
+            const std::string log = run_raytracer(executable, args, status, peak_rss_kib);
+            std::smatch match;
+            if (status != 0 || !std::regex_search(log, match, rendered)) {
+                std::cerr << "  scene " << scene << ": RayTracer failed (" << executable << ")" << std::endl << log;
+                result.ok = false;
+                break;
+            }
+            result.ok = true;
+            result.peak_rss_kib = std::max(result.peak_rss_kib, peak_rss_kib);
+            const double seconds = std::stod(match[1]);
+            if (seconds < result.render_seconds) {
+                result.render_seconds = seconds;
+                result.million_rays_per_second = std::stod(match[2]);
+                result.build_milliseconds = 0.0;
+                for (std::sregex_iterator it(log.begin(), log.end(), built), end; it != end; ++it) {
+                    result.build_milliseconds += std::stod((*it)[1]);
+                }
+            }
+        }
+        if (result.ok) {
+            std::cerr << "  scene " << scene << ": " << result.million_rays_per_second << " Mrays/s, BVH build "
+                << result.build_milliseconds << " ms, peak RSS " << result.peak_rss_kib << " KiB" << std::endl;
+        }
+        results.push_back(result);
+    }
+    return results;
+}
+
+void write_json(
+    std::ostream& out, const bench_options& options,
+    const std::vector<micro_result>& micro, const std::vector<macro_result>& macro
+) {
+    out.precision(6);
+    out << "{\n";
+    out << "  \"format_version\": 1,\n";
+    out << "  \"config\": {\"precision\": \"" << RT_PRECISION_NAME << "\", \"simd\": \""
+        << simd_level_name(detect_simd_level()) << "\", \"compiler\": \"" << __VERSION__ << "\", \"runs\": " << options.runs
+        << ", \"width\": " << options.width << ", \"spp\": " << options.samples_per_pixel
+        << ", \"threads\": " << options.num_threads << ", \"seed\": " << options.seed << "},\n";
+
+    out << "  \"micro\": [";
+    for (size_t i=0; i<micro.size(); i++) {
+        out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << micro[i].name << "\", \"operations\": " << micro[i].operations
+            << ", \"ns_per_op\": " << micro[i].nanoseconds_per_operation << "}";
+    }
+    out << (micro.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"macro\": [";
+    for (size_t i=0; i<macro.size(); i++) {
+        const macro_result& m = macro[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"scene\": " << m.scene << ", \"ok\": " << (m.ok ? "true" : "false");
+        if (m.ok) {
+            out << ", \"render_seconds\": " << m.render_seconds << ", \"mrays_per_second\": " << m.million_rays_per_second
+                << ", \"bvh_build_ms\": " << m.build_milliseconds << ", \"peak_rss_kib\": " << m.peak_rss_kib;
+        }
+        out << "}";
+    }
+    out << (macro.empty() ? "]\n" : "\n  ]\n");
+    out << "}" << std::endl;
+}
+
+void print_usage() {
+    std::cerr << "Usage: rt_bench [options] > results.json" << std::endl;
+    std::cerr << "  --width N       macro: image width in pixels (default: 400)" << std::endl;
+    std::cerr << "  --spp N         macro: samples per pixel (default: 16)" << std::endl;
+    std::cerr << "  --threads N     macro: render threads, and the threads of the parallel BVH build (default: 1)" << std::endl;
+    std::cerr << "  --seed N        macro: random seed (default: 0)" << std::endl;
+    std::cerr << "  --scenes LIST   macro: scenes to render, ex. 1,5 (default: 1,2,3,4,5,6,7)" << std::endl;
+    std::cerr << "  --runs N        runs of every benchmark; the fastest is reported (default: 3)" << std::endl;
+    std::cerr << "  --skip-micro    only the macro-benchmarks" << std::endl;
+    std::cerr << "  --skip-macro    only the micro-benchmarks" << std::endl;
+    std::cerr << "  --raytracer F   RayTracer executable to render with (default: the one built with rt_bench)" << std::endl;
+    std::cerr << "  --output FILE   write the JSON to FILE instead of standard out" << std::endl;
+}
+
+bool parse_options(int argc, char* argv[], bench_options& options) {
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (std::strcmp(arg, "--width") == 0 && has_value) {
+            options.width = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--spp") == 0 && has_value) {
+            options.samples_per_pixel = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--threads") == 0 && has_value) {
+            options.num_threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--seed") == 0 && has_value) {
+            options.seed = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--scenes") == 0 && has_value) {
+            options.scenes.clear();
+            std::stringstream list(argv[++i]);
+            std::string scene;
+            while (std::getline(list, scene, ',')) {
+                char* end = nullptr;
+                const long id = std::strtol(scene.c_str(), &end, 10);
+                if (scene.empty() || *end != '\0' || id < 1 || id > 7) {
+                    std::cerr << "--scenes: \"" << scene << "\" is not a scene (1 to 7)" << std::endl;
+                    return false;
+                }
+                options.scenes.push_back(static_cast<int>(id));
+            }
+            if (options.scenes.empty()) {
+                std::cerr << "--scenes: no scenes given" << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(arg, "--runs") == 0 && has_value) {
+            options.runs = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--skip-micro") == 0) {
+            options.micro = false;
+        } else if (std::strcmp(arg, "--skip-macro") == 0) {
+            options.macro = false;
+        } else if (std::strcmp(arg, "--raytracer") == 0 && has_value) {
+            options.raytracer = argv[++i];
+        } else if (std::strcmp(arg, "--output") == 0 && has_value) {
+            options.output_path = argv[++i];
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+    if (options.width < 1 || options.samples_per_pixel < 1 || options.num_threads < 1 || options.runs < 1) {
+        std::cerr << "--width, --spp, --threads and --runs must be at least 1" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    if (!parse_options(argc, argv, options)) return 1;
+
+    std::vector<micro_result> micro;
+    std::vector<macro_result> macro;
+    // The renders go first: a forked child's peak RSS starts at this process's (Linux keeps it through exec),
+    //  which is small until the micro-benchmarks allocate their inputs
+    if (options.macro) {
+        std::cerr << "Macro-benchmarks (" << options.width << "px, " << options.samples_per_pixel << " spp, "
+            << options.num_threads << " threads, best of " << options.runs << ")" << std::endl;
+        macro = run_macro_benchmarks(options);
+    }
+    if (options.micro) {
+        std::cerr << "Micro-benchmarks (best of " << options.runs << ")" << std::endl;
+        micro = run_micro_benchmarks(options);
+    }
+
+    if (options.output_path.empty()) {
+        write_json(std::cout, options, micro, macro);
+    } else {
+        std::ofstream out(options.output_path);
+        write_json(out, options, micro, macro);
+        if (!out) {
+            std::cerr << "Cannot write " << options.output_path << std::endl;
+            return 1;
+        }
+    }
+
+    // A failed render fails the benchmark (ex. in a CI job)
+    for (const macro_result& m : macro) {
+        if (!m.ok) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+'''
+Compare the double and float precision builds (cmake -DRT_PRECISION=..., see include/precision.h)
+
+Builds both variants, renders every scene with each of them (same seed, so the same samples),
+and prints what each variant stores in which type, then a table of the render times and of the
+difference of the float images from the double image (MSE and PSNR, from the renderer's --reference option).
+
+Usage (from this directory):
+    python3 benchmark_precision.py [--width 400] [--spp 16] [--threads 1] [--runs 3] [--scenes 1 3 4 5 6] [--accel linear]
+'''
+
+import argparse
+import os
+import re
+import subprocess
+import tempfile
+
+VARIANTS = ["double", "float"]
+
+# What each variant changes (see include/precision.h)
+GEOMETRY = "vec3, ray, aabb, sphere soup centers/radii, mesh vertex positions"
+DESCRIPTIONS = {
+    "double": f"{GEOMETRY} in double",
+    "float": f"{GEOMETRY} in float (intersection math still in double)",
+}
+
+
+def build(variant, build_root):
+    """Configure and build one variant; returns the path of its executable"""
+    build_dir = os.path.join(build_root, f"build-{variant}")
+    subprocess.run(
+        ["cmake", "-S", ".", "-B", build_dir, f"-DRT_PRECISION={variant}"],
+        check=True, stdout=subprocess.DEVNULL
+    )
+    subprocess.run(["cmake", "--build", build_dir], check=True, stdout=subprocess.DEVNULL)
+    return os.path.join(build_dir, "RayTracer")
+
+
+def render(executable, scene, args, output, reference=None):
+    """Render one scene; returns (seconds, PSNR against `reference` or None)"""
+    command = [
+        executable, "--scene", str(scene), "--width", str(args.width), "--spp", str(args.spp),
+        "--threads", str(args.threads), "--accel", args.accel, "--output", output
+    ]
+    if reference:
+        command += ["--reference", reference]
+    # (the renderer reports on standard error)
+    log = subprocess.run(command, check=True, capture_output=True, text=True).stderr
+    seconds = float(re.search(r"Rendered in ([0-9.e+-]+)", log).group(1))
+    error = re.search(r"Rendered vs\. reference: MSE ([0-9.e+-]+|inf|nan), .*PSNR ([0-9.e+-]+|inf|nan) dB", log)
+    return seconds, (float(error.group(1)), float(error.group(2))) if error else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare the double and float precision renderers")
+    parser.add_argument("--width", type=int, default=400)
+    parser.add_argument("--spp", type=int, default=16)
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--runs", type=int, default=3, help="renders per scene and variant (the fastest is kept)")
+    parser.add_argument("--scenes", type=int, nargs="+", default=[1, 3, 4, 5, 6])
+    # (linear, bvh4 and bvh8 keep their boxes in float in both variants; bvh uses aabb)
+    parser.add_argument("--accel", default="linear")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as work:
+        executables = {variant: build(variant, work) for variant in VARIANTS}
+
+        for variant in VARIANTS:
+            print(f"- `{variant}`: {DESCRIPTIONS[variant]}")
+        print()
+        print("| Scene | Variant | Time (s) | vs. double |")
+        print("| --- | --- | --- | --- |")
+        for scene in args.scenes:
+            reference = os.path.join(work, f"scene{scene}-double.pfm")
+            for variant in VARIANTS:
+                output = os.path.join(work, f"scene{scene}-{variant}.pfm")
+                # The double image is the reference of the float one
+                compare_to = reference if variant != "double" else None
+                runs = [render(executables[variant], scene, args, output, compare_to) for _ in range(args.runs)]
+                seconds = min(run[0] for run in runs)
+                error = runs[0][1]
+                difference = f"MSE {error[0]:.3g}, PSNR {error[1]:.1f} dB" if error else "(reference)"
+                print(f"| {scene} | {variant} | {seconds:.2f} | {difference} |", flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,65 @@
+'''
+Write a large text scene (see include/scene_file.h): the cover of the first book, with a
+2N x 2N grid of small spheres instead of 22 x 22 (and, with --motion, spheres that move further)
+
+Usage (from this directory):
+    python3 generate_scene.py [--grid 11] [--seed 0] > scenes/large.scene
+    ./build/RayTracer --scene-file scenes/large.scene --write-scene scenes/large.rtscene
+    ./build/RayTracer --scene-file scenes/large.rtscene ...
+'''
+
+import argparse
+import random
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Write a text scene with a grid of random spheres")
+    parser.add_argument("--grid", type=int, default=11, help="spheres from -N to N-1 along x and z")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--motion", type=float, default=1.0,
+                        help="scale of the moving spheres' rise (1: up to 0.5, as in random_scene())")
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+    n = args.grid
+
+    lines = [
+        f"# {2*n} x {2*n} random spheres (generate_scene.py --grid {n} --seed {args.seed} --motion {args.motion:g})",
+        # Far enough back to see the whole grid
+        f"camera lookfrom {13*n/11:.6g} {2*n/11:.6g} {3*n/11:.6g} lookat 0 0 0 vfov 20 aperture 0.1",
+        "texture even solid 0.2 0.3 0.1",
+        "texture odd solid 0.9 0.9 0.9",
+        "texture checker checker even odd",
+        "material ground lambertian checker",
+        "material glass dielectric 1.5",
+        f"sphere 0 {-1000*n/11:.6g} 0 {1000*n/11:.6g} ground",
+    ]
+    # One material per sphere, as in random_scene()
+    for x in range(-n, n):
+        for z in range(-n, n):
+            cx, cz = x + 0.9*rng.random(), z + 0.9*rng.random()
+            if (cx - 4)**2 + (cz)**2 <= 0.81:
+                continue
+            name = f"m{x + n}_{z + n}"
+            choose = rng.random()
+            if choose < 0.8:
+                albedo = " ".join(f"{rng.random()*rng.random():.4f}" for _ in range(3))
+                lines.append(f"material {name} lambertian {albedo}")
+                lines.append(f"moving_sphere {cx:.4f} 0.2 {cz:.4f} {cx:.4f} {0.2 + 0.5*args.motion*rng.random():.4f} {cz:.4f} 0 1 0.2 {name}")
+            elif choose < 0.95:
+                albedo = " ".join(f"{0.5 + 0.5*rng.random():.4f}" for _ in range(3))
+                lines.append(f"material {name} metal {albedo} {0.5*rng.random():.4f}")
+                lines.append(f"sphere {cx:.4f} 0.2 {cz:.4f} 0.2 {name}")
+            else:
+                lines.append(f"sphere {cx:.4f} 0.2 {cz:.4f} 0.2 glass")
+    lines += [
+        "material brown lambertian 0.4 0.2 0.1",
+        "material mirror metal 0.7 0.6 0.5 0.0",
+        "sphere 0 1 0 1 glass",
+        "sphere -4 1 0 1 brown",
+        "sphere 4 1 0 1 mirror",
+    ]
+    print("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,25 +1,58 @@
 #ifndef AABB_H
 #define AABB_H
 
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
 #include "rtweekend.h"
 
 // Axis-aligned bounding box
 // Specifically: Axis-aligned bounding rectangular parallelepiped
-class aabb {
+// A template on the scalar type of its corners; the renderer uses aabb = aabb_t<real> (see precision.h)
+template <typename T>
+class aabb_t {
     public:
         // The intervals of the AABB
         // The minimum value in each axis (x,y,z)
-        point3 minimum;
+        vec3_t<T> minimum;
         // The maximum value in each axis (x,y,z)
-        point3 maximum;
+        vec3_t<T> maximum;
 
         // Constructors
-        aabb() {}
-        aabb(const point3& a, const point3& b): minimum(a), maximum(b) {}
+        aabb_t() {}
+        aabb_t(const vec3_t<T>& a, const vec3_t<T>& b): minimum(a), maximum(b) {}
+        // From corners of another precision
+        // Narrowing (double to float) rounds outward, so the box still contains everything it did
+        template <typename U, typename std::enable_if<!std::is_same<U, T>::value, int>::type = 0>
+        aabb_t(const vec3_t<U>& a, const vec3_t<U>& b) {
+            for (int i=0; i<3; i++) {
+                this->minimum[i] = aabb_t::round_down(a[i]);
+                this->maximum[i] = aabb_t::round_up(b[i]);
+            }
+        }
 
         // Getters
-        point3 min() const { return minimum; }
-        point3 max() const { return maximum; }
+        vec3_t<T> min() const { return minimum; }
+        vec3_t<T> max() const { return maximum; }
+
+        // A box that contains nothing; surrounding_box(empty(), b) is b
+        static aabb_t empty() {
+            const T inf = std::numeric_limits<T>::infinity();
+            return aabb_t(vec3_t<T>(inf, inf, inf), vec3_t<T>(-inf, -inf, -inf));
+        }
+
+        // The center of the box
+        vec3_t<T> centroid() const { return 0.5 * (this->minimum + this->maximum); }
+
+        // Surface area of the box (0 for an empty box)
+        // The chance that a random ray that hits a parent box also hits a box inside it
+        //  is the ratio of their surface areas (used by the surface area heuristic in bvh.h)
+        double surface_area() const {
+            vec3 d = this->maximum - this->minimum;
+            if (d.x() < 0 || d.y() < 0 || d.z() < 0) return 0.0;
+            return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
 
         // Original implementation of ray hitting the AABB
         //bool hit(const ray& r, double t_min, double t_max) const {
@@ -51,14 +84,18 @@ class aabb {
 
         // Optimized AABB hit method by Andrew Kensler at Pixar (すごい)
         // The compiler optimizes this implementation well apparently
-        inline bool hit(const ray& r, double t_min, double t_max) const {
+        // The slabs are intersected in the box's precision
+        // (a float box can miss a ray that grazes it by a rounding error, so its exits are moved out a little,
+        //  like the float boxes of linear_bvh.h)
+        template <typename R>
+        inline bool hit(const ray_t<R>& r, double t_min, double t_max) const {
             // For each axis
             for (int a=0; a<3; a++) {
                 // Reciprocal of the ray's direction
                 // Also the denominator of finding the t value that intersects the slabs
-                double inverse_direction = 1.0f / r.direction()[a];
-                double t0 = (this->min()[a] - r.origin()[a]) * inverse_direction;
-                double t1 = (this->max()[a] - r.origin()[a]) * inverse_direction;
+                T inverse_direction = 1.0f / T(r.direction()[a]);
+                T t0 = (this->min()[a] - T(r.origin()[a])) * inverse_direction;
+                T t1 = (this->max()[a] - T(r.origin()[a])) * inverse_direction;
 
                 // If the ray was going into the negative direction,
                 // we swap the intervals so that t0 < t1
@@ -67,6 +104,10 @@ class aabb {
                     std::swap(t0, t1);
                 }
 
+                if (!std::is_same<T, double>::value) {
+                    t1 *= aabb_t::exit_scale;
+                }
+
                 // Update the running min/max
                 // If t0 is greater than t_min, set t_min to t0. Otherwise, set t_min to t_min
                 // This logic is the same as fmax(t0, t_min), but optimized for the compiler? 🤷‍♀️
@@ -81,25 +122,43 @@ class aabb {
 
             return true;
         }
+
+    private:
+        // 1 + 4 units in the last place of 1: more than the rounding error of the slab test in T
+        static constexpr T exit_scale = T(1) + 4 * std::numeric_limits<T>::epsilon();
+
+        // The closest T at or below (above) x
+        static T round_down(double x) {
+            T y = static_cast<T>(x);
+            return y > x ? std::nextafter(y, -std::numeric_limits<T>::infinity()) : y;
+        }
+        static T round_up(double x) {
+            T y = static_cast<T>(x);
+            return y < x ? std::nextafter(y, std::numeric_limits<T>::infinity()) : y;
+        }
 };
 
+// The bounding boxes of the renderer (see precision.h)
+using aabb = aabb_t<real>;
+
 // Create a bounding box that holds box0 and box1
-aabb surrounding_box(aabb box0, aabb box1) {
+template <typename T>
+inline aabb_t<T> surrounding_box(const aabb_t<T>& box0, const aabb_t<T>& box1) {
     // Holds the minimum bounds of the new slabs
-    point3 min_box(
+    vec3_t<T> min_box(
         fmin(box0.min().x(), box1.min().x()),
         fmin(box0.min().y(), box1.min().y()),
         fmin(box0.min().z(), box1.min().z())
     );
 
     // Holds the maximum bounds of the new slabs
-    point3 max_box(
+    vec3_t<T> max_box(
         fmax(box0.max().x(), box1.max().x()),
         fmax(box0.max().y(), box1.max().y()),
         fmax(box0.max().z(), box1.max().z())
     );
 
-    return aabb(min_box, max_box);
+    return aabb_t<T>(min_box, max_box);
 }
 
 #endif // header guard
@@ -1,15 +1,22 @@
 #ifndef AARECT_H
 #define AARECT_H
 
-// Axis-aligned rectangle
+// Axis-aligned rectangles
+// Each rectangle lies in a plane where one axis is constant (ex. z = k for xy_rect),
+//  bounded by [a0, a1] x [b0, b1] along the other two axes
+
+#include <cmath>
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "material_table.h"
 
 class xy_rect: public hittable {
     public:
         // "mp"
         shared_ptr<material> material_ptr;
+        // Its ID in the scene's material table
+        uint32_t material_id = 0;
         // Boundaries (lines) on the x-axis
         double x0, x1;
         // Boundaries on the y-axis
@@ -21,10 +28,11 @@ class xy_rect: public hittable {
         // Constructors
         xy_rect() {}
         xy_rect(double _x0, double _x1, double _y0, double _y1, double _depth, shared_ptr<material> _material_ptr):
-            x0(_x0), x1(_x1), y0(_y0), y1(_y1), z_depth(_depth), material_ptr(_material_ptr) {}
+            material_ptr(_material_ptr), x0(_x0), x1(_x1), y0(_y0), y1(_y1), z_depth(_depth) {}
 
         // Implement abstract base class virtual methods
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // Since this rectangle is flat (no depth), we need to add some padding in the bounding-box
@@ -37,6 +45,201 @@ class xy_rect: public hittable {
             // Able to create bounding box, so return true
             return true;
         }
+
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->material_ptr);
+        }
+
+        virtual const material* get_material() const override { return this->material_ptr.get(); }
+
+        virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+        virtual vec3 sample_direction(const point3& origin, double u1, double u2) const override {
+            point3 on_light(this->x0 + u1*(this->x1 - this->x0), this->y0 + u2*(this->y1 - this->y0), this->z_depth);
+            return on_light - origin;
+        }
+};
+
+class xz_rect: public hittable {
+    public:
+        shared_ptr<material> material_ptr;
+        // Its ID in the scene's material table
+        uint32_t material_id = 0;
+        double x0, x1;
+        double z0, z1;
+        // The height (y-axis) where the rectangle is
+        double y_height;
+
+        // Constructors
+        xz_rect() {}
+        xz_rect(double _x0, double _x1, double _z0, double _z1, double _height, shared_ptr<material> _material_ptr):
+            material_ptr(_material_ptr), x0(_x0), x1(_x1), z0(_z0), z1(_z1), y_height(_height) {}
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            double padding = 0.0001;
+            output_box = aabb(
+                point3(this->x0, this->y_height - padding, this->z0),
+                point3(this->x1, this->y_height + padding, this->z1)
+            );
+            return true;
+        }
+
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->material_ptr);
+        }
+
+        virtual const material* get_material() const override { return this->material_ptr.get(); }
+
+        virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+        virtual vec3 sample_direction(const point3& origin, double u1, double u2) const override {
+            point3 on_light(this->x0 + u1*(this->x1 - this->x0), this->y_height, this->z0 + u2*(this->z1 - this->z0));
+            return on_light - origin;
+        }
+};
+
+class yz_rect: public hittable {
+    public:
+        shared_ptr<material> material_ptr;
+        // Its ID in the scene's material table
+        uint32_t material_id = 0;
+        double y0, y1;
+        double z0, z1;
+        // The position on the x-axis where the rectangle is
+        double x_position;
+
+        // Constructors
+        yz_rect() {}
+        yz_rect(double _y0, double _y1, double _z0, double _z1, double _position, shared_ptr<material> _material_ptr):
+            material_ptr(_material_ptr), y0(_y0), y1(_y1), z0(_z0), z1(_z1), x_position(_position) {}
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            double padding = 0.0001;
+            output_box = aabb(
+                point3(this->x_position - padding, this->y0, this->z0),
+                point3(this->x_position + padding, this->y1, this->z1)
+            );
+            return true;
+        }
+
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->material_ptr);
+        }
+
+        virtual const material* get_material() const override { return this->material_ptr.get(); }
+
+        virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+        virtual vec3 sample_direction(const point3& origin, double u1, double u2) const override {
+            point3 on_light(this->x_position, this->y0 + u1*(this->y1 - this->y0), this->z0 + u2*(this->z1 - this->z0));
+            return on_light - origin;
+        }
+};
+
+// Hit test shared by the three rectangles
+// `axis` is the constant axis (k = its value); a and b are the other two axes, in the order (x, y, z)
+// The ray hits the plane at t = (k - origin[axis]) / direction[axis], then we check that the hit point
+//  is inside the rectangle's bounds
+inline bool aarect_intersect(
+    const ray& r, double t_min, double t_max, int axis, double k,
+    double a0, double a1, double b0, double b1, const hittable* object, closest_hit& hit
+) {
+    const int a = (axis == 0) ? 1 : 0;
+    const int b = (axis == 2) ? 1 : 2;
+    double t = (k - r.origin()[axis]) / r.direction()[axis];
+    // (a ray parallel to the plane gives t = +-inf or NaN, which fails this test)
+    if (!(t >= t_min && t <= t_max)) return false;
+
+    double hit_a = r.origin()[a] + t*r.direction()[a];
+    double hit_b = r.origin()[b] + t*r.direction()[b];
+    if (hit_a < a0 || hit_a > a1 || hit_b < b0 || hit_b > b1) return false;
+
+    hit.t = t;
+    hit.object = object;
+    hit.primitive = 0;
+    return true;
+}
+
+// The surface interaction of the closest hit, shared by the three rectangles
+// (the hit point along a and b is recomputed from hit.t, the same way aarect_intersect() found it)
+inline void aarect_interaction(
+    const ray& r, int axis, double a0, double a1, double b0, double b1, uint32_t material_id,
+    const closest_hit& hit, surface_interaction& surface
+) {
+    const int a = (axis == 0) ? 1 : 0;
+    const int b = (axis == 2) ? 1 : 2;
+    const double t = hit.t;
+    double hit_a = r.origin()[a] + t*r.direction()[a];
+    double hit_b = r.origin()[b] + t*r.direction()[b];
+
+    // Texture coordinates: where in the rectangle the ray hit, from 0 to 1 along each side
+    surface.u = (hit_a - a0) / (a1 - a0);
+    surface.v = (hit_b - b0) / (b1 - b0);
+    surface.dpdu = vec3(0, 0, 0);
+    surface.dpdu[a] = a1 - a0;
+    surface.dpdv = vec3(0, 0, 0);
+    surface.dpdv[b] = b1 - b0;
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = 1;
+    surface.set_face_normal(r, outward_normal);
+    surface.material_id = material_id;
+    surface.p = r.at(t);
+}
+
+// Solid angle pdf of sampling `direction` from `origin` by picking a uniform point on a rectangle:
+//  the area pdf 1/area, converted to solid angle by distance^2 / cos(angle at the rectangle)
+// Both sides of the rectangle count (lights emit from both sides)
+// Only `t` is needed, and the normal is the constant axis, so the surface interaction is skipped
+inline double aarect_pdf_value(
+    const hittable& rect, int axis, const point3& origin, const vec3& direction, double area
+) {
+    closest_hit hit;
+    if (!rect.intersect(ray(origin, direction), 0.001, infinity, hit)) return 0.0;
+
+    double length_squared = direction.length_squared();
+    double distance_squared = hit.t * hit.t * length_squared;
+    double cosine = std::fabs(direction[axis]) / std::sqrt(length_squared);
+    if (cosine < 1e-8) return 0.0;
+    return distance_squared / (cosine * area);
+}
+
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
+    return aarect_intersect(r, t_min, t_max, 2, this->z_depth, this->x0, this->x1, this->y0, this->y1, this, hit);
+}
+
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
+    return aarect_intersect(r, t_min, t_max, 1, this->y_height, this->x0, this->x1, this->z0, this->z1, this, hit);
+}
+
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
+    return aarect_intersect(r, t_min, t_max, 0, this->x_position, this->y0, this->y1, this->z0, this->z1, this, hit);
+}
+
+void xy_rect::compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {
+    aarect_interaction(r, 2, this->x0, this->x1, this->y0, this->y1, this->material_id, hit, surface);
+}
+
+void xz_rect::compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {
+    aarect_interaction(r, 1, this->x0, this->x1, this->z0, this->z1, this->material_id, hit, surface);
+}
+
+void yz_rect::compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {
+    aarect_interaction(r, 0, this->y0, this->y1, this->z0, this->z1, this->material_id, hit, surface);
+}
+
+double xy_rect::pdf_value(const point3& origin, const vec3& direction) const {
+    return aarect_pdf_value(*this, 2, origin, direction, (this->x1 - this->x0) * (this->y1 - this->y0));
+}
+
+double xz_rect::pdf_value(const point3& origin, const vec3& direction) const {
+    return aarect_pdf_value(*this, 1, origin, direction, (this->x1 - this->x0) * (this->z1 - this->z0));
+}
+
+double yz_rect::pdf_value(const point3& origin, const vec3& direction) const {
+    return aarect_pdf_value(*this, 0, origin, direction, (this->y1 - this->y0) * (this->z1 - this->z0));
 }
 
 #endif // header guard
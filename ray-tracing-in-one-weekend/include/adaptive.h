@@ -0,0 +1,173 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "framebuffer.h"
+#include "image_io.h"
+
+// Adaptive sampling
+// Every pixel keeps the running mean and variance of its samples' luminance (Welford's algorithm).
+// A pixel is done when the 95% confidence interval of its mean, in output (gamma 2) units, is narrower
+//  than `threshold`, so a flat sky stops after the first few samples while glass, fuzzy metal and soft
+//  shadows keep going. The total budget is still samples_per_pixel * number of pixels: the samples
+//  the converged pixels did not need go to the noisiest pixels.
+//
+// Rendering goes in rounds: plan_round() decides how many samples each pixel takes next,
+//  the renderer takes them (calling add_sample() for each), and so on until plan_round() returns false.
+class adaptive_sampling {
+    public:
+        struct options {
+            // Error at which a pixel is done, in output units (ex. 0.01 = within 1% of white, about 2.5/255)
+            double threshold = 0.01;
+            // Samples every pixel takes before its variance is trusted
+            int min_samples = 16;
+            // Average samples per pixel over the image (the budget)
+            int samples_per_pixel = 100;
+            // No pixel takes more than this many
+            int max_samples = 400;
+        };
+
+        // Constructors
+        adaptive_sampling(int width, int height, const options& opts):
+            width(width), height(height), opts(opts),
+            count(static_cast<size_t>(width) * height, 0),
+            mean(count.size(), 0.0), m2(count.size(), 0.0),
+            round_samples(count.size(), 0) {
+            this->budget = static_cast<uint64_t>(opts.samples_per_pixel) * count.size();
+        }
+
+        // Number of samples pixel (i, j) takes this round (0 if it is done)
+        int samples_this_round(int i, int j) const { return this->round_samples[this->index(i, j)]; }
+        // Number of samples pixel (i, j) took in the earlier rounds (the first sample index of this round)
+        int samples_taken(int i, int j) const { return this->count[this->index(i, j)]; }
+
+        // Add one sample of pixel (i, j) to its statistics
+        // Tiles have disjoint pixels, so threads can call this without locking
+        void add_sample(int i, int j, const color& sample) {
+            size_t p = this->index(i, j);
+            double luminance = 0.2126 * sample.r() + 0.7152 * sample.g() + 0.0722 * sample.b();
+            // Welford: update the mean and the sum of squared differences from it in one pass
+            uint32_t n = ++this->count[p];
+            double delta = luminance - this->mean[p];
+            this->mean[p] += delta / n;
+            this->m2[p] += delta * (luminance - this->mean[p]);
+        }
+
+        // Half-width of the 95% confidence interval of pixel p's mean, as seen in the output image
+        // The images are written with gamma 2 (square root), which divides an error at brightness m
+        //  by 2*sqrt(m): the same noise is much more visible in dark pixels than in bright ones
+        double display_error(size_t p) const {
+            uint32_t n = this->count[p];
+            if (n < 2) return infinity;
+            double variance = this->m2[p] / (n - 1);
+            double half_width = 1.96 * std::sqrt(variance / n);
+            // (very dark pixels: compare to a small floor instead of zero)
+            return half_width / (2.0 * std::sqrt(std::max(this->mean[p], 1e-3)));
+        }
+
+        // Decide the samples of the next round; returns false when rendering is done
+        // Round 0: every pixel takes min_samples. After that, the unconverged pixels share the round's
+        //  samples in proportion to their error. Each round is at most as large as everything before it,
+        //  so the errors are re-estimated often while the rounds stay large enough to keep the threads busy.
+        bool plan_round() {
+            const size_t num_pixels = this->count.size();
+            std::fill(this->round_samples.begin(), this->round_samples.end(), 0);
+            uint64_t remaining = this->budget > this->used ? this->budget - this->used : 0;
+            if (remaining == 0) return false;
+
+            if (this->rounds++ == 0) {
+                int first = static_cast<int>(std::min<uint64_t>(this->opts.min_samples, remaining / num_pixels));
+                first = std::max(first, 1);
+                std::fill(this->round_samples.begin(), this->round_samples.end(), first);
+                this->used += static_cast<uint64_t>(first) * num_pixels;
+                return true;
+            }
+
+            // Weights: how far each pixel is from converging
+            std::vector<double> weights(num_pixels, 0.0);
+            double total_weight = 0.0;
+            size_t unconverged = 0;
+            for (size_t p=0; p<num_pixels; p++) {
+                double error = this->display_error(p);
+                if (error > this->opts.threshold && this->count[p] < static_cast<uint32_t>(this->opts.max_samples)) {
+                    weights[p] = std::min(error / this->opts.threshold, 100.0);
+                    total_weight += weights[p];
+                    unconverged++;
+                }
+            }
+            if (unconverged == 0) return false;
+
+            uint64_t round_total = std::min(remaining, std::max<uint64_t>(this->used / 4, unconverged));
+            uint64_t planned = 0;
+            for (size_t p=0; p<num_pixels; p++) {
+                if (weights[p] == 0.0) continue;
+                double share = round_total * (weights[p] / total_weight);
+                int samples = std::max(1, static_cast<int>(share + 0.5));
+                samples = std::min(samples, this->opts.max_samples - static_cast<int>(this->count[p]));
+                samples = static_cast<int>(std::min<uint64_t>(samples, remaining - planned));
+                if (samples == 0) break;
+                this->round_samples[p] = samples;
+                planned += samples;
+            }
+            this->used += planned;
+            return planned > 0;
+        }
+
+        // Summary after rendering
+        void print_stats(std::ostream& out) const {
+            const size_t num_pixels = this->count.size();
+            size_t converged = 0;
+            uint32_t fewest = this->opts.max_samples, most = 0;
+            uint64_t total = 0;
+            for (size_t p=0; p<num_pixels; p++) {
+                if (this->display_error(p) <= this->opts.threshold) converged++;
+                fewest = std::min(fewest, this->count[p]);
+                most = std::max(most, this->count[p]);
+                total += this->count[p];
+            }
+            out << "Adaptive sampling: " << this->rounds << " rounds, " << static_cast<double>(total) / num_pixels
+                << " samples per pixel on average (" << fewest << " to " << most << "), "
+                << 100.0 * converged / num_pixels << "% of pixels converged" << std::endl;
+        }
+
+        // Write the number of samples of every pixel as an image (black = fewest, then red, yellow, white = most)
+        bool write_heatmap(const std::string& filename) const {
+            uint32_t most = 1;
+            for (uint32_t n : this->count) most = std::max(most, n);
+
+            framebuffer heatmap(this->width, this->height);
+            for (int j=0; j<this->height; j++) {
+                for (int i=0; i<this->width; i++) {
+                    double t = static_cast<double>(this->count[this->index(i, j)]) / most;
+                    color c(clamp(3*t, 0.0, 1.0), clamp(3*t - 1, 0.0, 1.0), clamp(3*t - 2, 0.0, 1.0));
+                    // The image writers apply gamma 2; square the ramp so it is linear in the file
+                    heatmap.add_samples(i, j, c * c, 1);
+                }
+            }
+            return write_image(filename, heatmap);
+        }
+
+    private:
+        int width, height;
+        options opts;
+        // Welford state per pixel: sample count, mean luminance, sum of squared differences from the mean
+        std::vector<uint32_t> count;
+        std::vector<double> mean;
+        std::vector<double> m2;
+        std::vector<int> round_samples;
+        uint64_t budget = 0;
+        // Samples planned so far
+        uint64_t used = 0;
+        int rounds = 0;
+
+        size_t index(int i, int j) const { return static_cast<size_t>(j) * this->width + i; }
+};
+
+#endif // header guard
@@ -0,0 +1,159 @@
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "rng.h"
+
+// A tileable blue-noise mask
+// Each texel holds a value in (0, 1); the values are spread so that texels with similar values
+//  are far apart (no low-frequency clumps). Used to dither the sample sequences of neighboring
+//  pixels, so the leftover error looks like fine grain instead of blotches
+//
+// Generated once, on first use, with Ulichney's void-and-cluster method
+//  Ulichney, "The void-and-cluster method for dither array generation" (1993)
+class blue_noise_tile {
+    public:
+        // Width and height of the tile; must be a power of two
+        static const int size = 64;
+
+        // The shared tile (built the first time this is called)
+        static const blue_noise_tile& get() {
+            static const blue_noise_tile tile;
+            return tile;
+        }
+
+        // Value at texel (x, y); the tile repeats in both directions
+        double value(int x, int y) const {
+            return this->values[(y & mask) * size + (x & mask)];
+        }
+
+    private:
+        static const int mask = size - 1;
+        static const int num_texels = size * size;
+
+        std::vector<float> values;
+        // Gaussian weight by (wrapped) offset between two texels
+        std::vector<float> kernel;
+
+        blue_noise_tile(): values(num_texels), kernel(num_texels) {
+            // Width of the Gaussian filter, in texels (1.5 is Ulichney's choice)
+            const double sigma = 1.5;
+            for (int dy=0; dy<size; dy++) {
+                for (int dx=0; dx<size; dx++) {
+                    // Distance on the torus (the tile wraps around)
+                    int wx = std::min(dx, size - dx);
+                    int wy = std::min(dy, size - dy);
+                    this->kernel[dy*size + dx] = static_cast<float>(std::exp(-(wx*wx + wy*wy) / (2*sigma*sigma)));
+                }
+            }
+            this->generate();
+        }
+
+        // Add (sign=+1) or remove (sign=-1) the Gaussian splat of texel `p` to the energy map
+        void splat(std::vector<float>& energy, int p, float sign) const {
+            int px = p % size;
+            int py = p / size;
+            for (int y=0; y<size; y++) {
+                const float* kernel_row = &this->kernel[((y - py) & mask) * size];
+                float* energy_row = &energy[y * size];
+                for (int x=0; x<size; x++) {
+                    energy_row[x] += sign * kernel_row[(x - px) & mask];
+                }
+            }
+        }
+
+        // The set texel with the most energy (the center of the tightest cluster)
+        static int tightest_cluster(const std::vector<uint8_t>& pattern, const std::vector<float>& energy) {
+            int best = -1;
+            for (int i=0; i<num_texels; i++) {
+                if (pattern[i] && (best < 0 || energy[i] > energy[best])) best = i;
+            }
+            return best;
+        }
+
+        // The empty texel with the least energy (the center of the largest void)
+        static int largest_void(const std::vector<uint8_t>& pattern, const std::vector<float>& energy) {
+            int best = -1;
+            for (int i=0; i<num_texels; i++) {
+                if (!pattern[i] && (best < 0 || energy[i] < energy[best])) best = i;
+            }
+            return best;
+        }
+
+        void generate() {
+            std::vector<uint8_t> pattern(num_texels, 0);
+            std::vector<float> energy(num_texels, 0.0f);
+
+            // Initial binary pattern: 10% of the texels set at random
+            // A fixed seed, so the tile (and every render that uses it) is always the same
+            pcg32 rng(0x626c7565ULL);
+            int num_ones = num_texels / 10;
+            for (int placed=0; placed<num_ones; ) {
+                int p = static_cast<int>(rng.next_uint() % num_texels);
+                if (pattern[p]) continue;
+                pattern[p] = 1;
+                this->splat(energy, p, 1.0f);
+                placed++;
+            }
+
+            // Spread the initial pattern out: move the tightest cluster into the largest void
+            //  until that does not change anything (with a cap, in case two moves undo each other forever)
+            for (int iteration=0; iteration<num_texels; iteration++) {
+                int cluster = tightest_cluster(pattern, energy);
+                pattern[cluster] = 0;
+                this->splat(energy, cluster, -1.0f);
+                int hole = largest_void(pattern, energy);
+                pattern[hole] = 1;
+                this->splat(energy, hole, 1.0f);
+                if (hole == cluster) break;
+            }
+
+            std::vector<int> rank(num_texels, 0);
+
+            // Phase 1: rank the initial points, removing the tightest cluster first (highest rank)
+            {
+                std::vector<uint8_t> phase_pattern = pattern;
+                std::vector<float> phase_energy = energy;
+                for (int r=num_ones-1; r>=0; r--) {
+                    int cluster = tightest_cluster(phase_pattern, phase_energy);
+                    phase_pattern[cluster] = 0;
+                    this->splat(phase_energy, cluster, -1.0f);
+                    rank[cluster] = r;
+                }
+            }
+
+            // Phase 2: fill the largest voids until half of the texels are set
+            int r = num_ones;
+            for (; r<num_texels/2; r++) {
+                int hole = largest_void(pattern, energy);
+                pattern[hole] = 1;
+                this->splat(energy, hole, 1.0f);
+                rank[hole] = r;
+            }
+
+            // Phase 3: the empty texels are now the minority; measure the energy of the empty texels
+            //  and fill the tightest cluster of empty texels first
+            std::vector<uint8_t> empty(num_texels);
+            std::fill(energy.begin(), energy.end(), 0.0f);
+            for (int i=0; i<num_texels; i++) {
+                empty[i] = !pattern[i];
+                if (empty[i]) this->splat(energy, i, 1.0f);
+            }
+            for (; r<num_texels; r++) {
+                int cluster = tightest_cluster(empty, energy);
+                empty[cluster] = 0;
+                this->splat(energy, cluster, -1.0f);
+                rank[cluster] = r;
+            }
+
+            for (int i=0; i<num_texels; i++) {
+                this->values[i] = (rank[i] + 0.5f) / num_texels;
+            }
+        }
+};
+
+#endif // header guard
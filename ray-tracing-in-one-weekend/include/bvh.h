@@ -1,10 +1,318 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
+// Statistics about a built BVH, printed after the build
+struct bvh_build_stats {
+    size_t num_primitives = 0;
+    size_t interior_nodes = 0;
+    size_t leaf_nodes = 0;
+    int max_depth = 0;
+    // Expected cost of a random ray, by the surface area heuristic (lower is better)
+    double sah_cost = 0.0;
+    double build_seconds = 0.0;
+
+    void print(std::ostream& out, const char* name) const {
+        out << name << ": " << this->num_primitives << " primitives, "
+            << (this->interior_nodes + this->leaf_nodes) << " nodes ("
+            << this->interior_nodes << " interior, " << this->leaf_nodes << " leaves), depth "
+            << this->max_depth << ", SAH cost " << this->sah_cost << ", built in "
+            << 1000.0 * this->build_seconds << " ms" << std::endl;
+    }
+};
+
+// Deepest tree that bvh_builder makes (the root is at depth 1)
+// The traversals keep the nodes still to visit on fixed stacks of 64 entries (linear_bvh.h, packet.h)
+//  or 64 levels (wide_bvh.h), which push at most one entry per level below the root
+constexpr int bvh_max_depth = 60;
+
+// A node of the tree made by bvh_builder
+// Leaves refer to a range of the builder's primitive_order()
+struct bvh_build_node {
+    aabb box;
+    std::unique_ptr<bvh_build_node> children[2];
+    // Axis (0, 1, 2 => x, y, z) that the children were split along
+    int split_axis = 0;
+    // Leaves only: the range [first_primitive, first_primitive + primitive_count) of primitive_order()
+    size_t first_primitive = 0;
+    size_t primitive_count = 0;
+
+    bool is_leaf() const { return !this->children[0]; }
+};
+
+// Builds a bounding volume hierarchy over a list of bounding boxes with the surface area heuristic (SAH)
+//
+// At each node, the primitives' centroids are dropped into `num_bins` bins along each axis,
+//  and every boundary between two bins is a candidate split. The SAH cost of a split is
+//      traversal_cost + intersection_cost * (area(L)*count(L) + area(R)*count(R)) / area(node)
+//  which is the expected cost of a ray that hits the node: the chance that it hits a child box
+//  is the child's share of the surface area. The cheapest split wins, unless making a leaf is cheaper.
+//  Unlike splitting at the median of a random axis, this keeps clusters of primitives together
+//  and leaves empty space outside of the boxes.
+//
+// Large subtrees are built in parallel: one child on a new thread, the other on the current thread
+//
+// The SAH can split off one primitive at a time (ex. spheres at exponentially growing distances), which makes
+//  a tree as deep as the number of primitives. Once a subtree could no longer fit within bvh_max_depth that
+//  way, it is split at the median instead, which halves the count at every level.
+class bvh_builder {
+    public:
+        struct options {
+            // Leaves hold at most this many primitives
+            int max_leaf_size = 1;
+            int num_bins = 16;
+            // Relative costs of visiting a node and intersecting a primitive
+            double traversal_cost = 1.0;
+            double intersection_cost = 1.0;
+            // Number of threads to build with
+            int num_threads = static_cast<int>(std::thread::hardware_concurrency());
+            // Subtrees with fewer primitives than this are built on the current thread
+            size_t parallel_threshold = 1024;
+        };
+
+        // Constructors
+        bvh_builder(const std::vector<aabb>& boxes, const options& opts): opts(opts) {
+            this->refs.reserve(boxes.size());
+            for (size_t i=0; i<boxes.size(); i++) {
+                this->refs.push_back({boxes[i], boxes[i].centroid(), i});
+            }
+        }
+
+        // Build the tree; returns nullptr if there are no primitives
+        std::unique_ptr<bvh_build_node> build() {
+            auto start_time = std::chrono::steady_clock::now();
+
+            std::unique_ptr<bvh_build_node> root;
+            if (!this->refs.empty()) {
+                // Each level of parallel splits doubles the number of threads in use
+                int parallel_depth = 0;
+                while ((1 << parallel_depth) < this->opts.num_threads) parallel_depth++;
+                root = this->build_recursive(0, this->refs.size(), 1, parallel_depth);
+            }
+
+            this->order.resize(this->refs.size());
+            for (size_t i=0; i<this->refs.size(); i++) {
+                this->order[i] = this->refs[i].index;
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+            this->build_stats = bvh_build_stats();
+            this->build_stats.num_primitives = this->refs.size();
+            this->build_stats.build_seconds = elapsed.count();
+            if (root) {
+                this->collect_stats(*root, 1);
+                this->build_stats.sah_cost /= root->box.surface_area() > 0 ? root->box.surface_area() : 1.0;
+            }
+            return root;
+        }
+
+        // Leaves refer to primitives by position in this list, which holds the original indices
+        //  of the boxes (primitives of a leaf are next to each other)
+        const std::vector<size_t>& primitive_order() const { return this->order; }
+
+        const bvh_build_stats& stats() const { return this->build_stats; }
+
+    private:
+        // A primitive while building: its box, the center of its box, and its index in the input
+        struct primitive_ref {
+            aabb box;
+            point3 centroid;
+            size_t index;
+        };
+
+        struct bin {
+            aabb box = aabb::empty();
+            size_t count = 0;
+        };
+
+        options opts;
+        std::vector<primitive_ref> refs;
+        std::vector<size_t> order;
+        bvh_build_stats build_stats;
+
+        // Build the subtree of refs[start, end), whose root is at `depth`
+        // Parallel subtrees work on disjoint ranges of `refs`, so they need no locking
+        std::unique_ptr<bvh_build_node> build_recursive(size_t start, size_t end, int depth, int parallel_depth) {
+            auto node = std::make_unique<bvh_build_node>();
+            const size_t count = end - start;
+
+            aabb box = aabb::empty();
+            aabb centroid_box = aabb::empty();
+            for (size_t i=start; i<end; i++) {
+                box = surrounding_box(box, this->refs[i].box);
+                centroid_box = surrounding_box(centroid_box, aabb(this->refs[i].centroid, this->refs[i].centroid));
+            }
+            node->box = box;
+
+            // Median splits reach single primitives in ceil(log2(count)) levels; an SAH split is only made
+            //  while its children can still fall back to them without going past bvh_max_depth
+            int median_levels = 0;
+            while ((static_cast<size_t>(1) << median_levels) < count) median_levels++;
+            const bool median_split = depth + 1 + median_levels > bvh_max_depth;
+
+            // Pick the split
+            int best_axis = -1;
+            int best_split = 0;
+            double best_cost = infinity;
+            if (count > 1 && !median_split) {
+                this->find_sah_split(start, end, box, centroid_box, best_axis, best_split, best_cost);
+            }
+
+            double leaf_cost = this->opts.intersection_cost * count;
+            bool fits_in_leaf = count <= static_cast<size_t>(this->opts.max_leaf_size);
+            if (count == 1 || (fits_in_leaf && (median_split || leaf_cost <= best_cost))) {
+                node->first_primitive = start;
+                node->primitive_count = count;
+                return node;
+            }
+
+            size_t middle;
+            if (median_split) {
+                // Half of the primitives on each side, along the axis where the centroids spread the most
+                int axis = 0;
+                for (int a=1; a<3; a++) {
+                    if (centroid_box.max()[a] - centroid_box.min()[a] > centroid_box.max()[axis] - centroid_box.min()[axis]) {
+                        axis = a;
+                    }
+                }
+                middle = start + count/2;
+                std::nth_element(
+                    this->refs.begin() + start, this->refs.begin() + middle, this->refs.begin() + end,
+                    [axis](const primitive_ref& a, const primitive_ref& b) {
+                        return a.centroid[axis] < b.centroid[axis];
+                    }
+                );
+                node->split_axis = axis;
+            } else if (best_axis < 0) {
+                // All centroids are at the same spot; no plane can separate them, so split the list in half
+                middle = start + count/2;
+                node->split_axis = 0;
+            } else {
+                const double axis_min = centroid_box.min()[best_axis];
+                const double axis_extent = centroid_box.max()[best_axis] - axis_min;
+                const int num_bins = this->opts.num_bins;
+                auto middle_it = std::partition(
+                    this->refs.begin() + start, this->refs.begin() + end,
+                    [&](const primitive_ref& ref) {
+                        return bin_index(ref.centroid[best_axis], axis_min, axis_extent, num_bins) <= best_split;
+                    }
+                );
+                middle = static_cast<size_t>(middle_it - this->refs.begin());
+                node->split_axis = best_axis;
+            }
+
+            if (parallel_depth > 0 && count >= this->opts.parallel_threshold) {
+                // Build the left child on another thread while this thread builds the right child
+                auto left = std::async(std::launch::async, [this, start, middle, depth, parallel_depth] {
+                    return this->build_recursive(start, middle, depth+1, parallel_depth-1);
+                });
+                node->children[1] = this->build_recursive(middle, end, depth+1, parallel_depth-1);
+                node->children[0] = left.get();
+            } else {
+                node->children[0] = this->build_recursive(start, middle, depth+1, 0);
+                node->children[1] = this->build_recursive(middle, end, depth+1, 0);
+            }
+            return node;
+        }
+
+        // Which bin a centroid coordinate falls into
+        static int bin_index(double value, double axis_min, double axis_extent, int num_bins) {
+            int b = static_cast<int>(num_bins * ((value - axis_min) / axis_extent));
+            return std::min(std::max(b, 0), num_bins-1);
+        }
+
+        // Find the cheapest binned SAH split of refs[start, end)
+        // A split is (axis, bin): bins [0, bin] go to the left child, the rest to the right
+        void find_sah_split(
+            size_t start, size_t end, const aabb& box, const aabb& centroid_box,
+            int& best_axis, int& best_split, double& best_cost
+        ) const {
+            const int num_bins = this->opts.num_bins;
+            const double parent_area = box.surface_area();
+            // Bins of all three axes, filled in one pass over the primitives
+            std::vector<bin> bins(3 * num_bins);
+            // Area and count of everything right of each split
+            std::vector<double> right_area(num_bins);
+            std::vector<size_t> right_count(num_bins);
+
+            double axis_min[3], axis_extent[3];
+            for (int axis=0; axis<3; axis++) {
+                axis_min[axis] = centroid_box.min()[axis];
+                axis_extent[axis] = centroid_box.max()[axis] - axis_min[axis];
+            }
+            for (size_t i=start; i<end; i++) {
+                const primitive_ref& ref = this->refs[i];
+                for (int axis=0; axis<3; axis++) {
+                    if (axis_extent[axis] <= 0.0) continue;
+                    bin& b = bins[axis*num_bins + bin_index(ref.centroid[axis], axis_min[axis], axis_extent[axis], num_bins)];
+                    b.box = surrounding_box(b.box, ref.box);
+                    b.count++;
+                }
+            }
+
+            for (int axis=0; axis<3; axis++) {
+                // All centroids at the same spot along this axis; nothing to split
+                if (axis_extent[axis] <= 0.0) continue;
+                const bin* axis_bins = &bins[axis*num_bins];
+
+                // Sweep from the right to get the right side of every split
+                aabb right_box = aabb::empty();
+                size_t count = 0;
+                for (int b=num_bins-1; b>0; b--) {
+                    right_box = surrounding_box(right_box, axis_bins[b].box);
+                    count += axis_bins[b].count;
+                    right_area[b-1] = right_box.surface_area();
+                    right_count[b-1] = count;
+                }
+
+                // Sweep from the left and cost every split
+                aabb left_box = aabb::empty();
+                count = 0;
+                for (int b=0; b<num_bins-1; b++) {
+                    left_box = surrounding_box(left_box, axis_bins[b].box);
+                    count += axis_bins[b].count;
+                    // A split with an empty side does not split anything
+                    if (count == 0 || right_count[b] == 0) continue;
+
+                    double cost = this->opts.traversal_cost + this->opts.intersection_cost
+                        * (left_box.surface_area() * count + right_area[b] * right_count[b])
+                        / (parent_area > 0 ? parent_area : 1.0);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+        }
+
+        // Walk the finished tree to count nodes and sum the SAH cost (un-normalized)
+        void collect_stats(const bvh_build_node& node, int depth) {
+            this->build_stats.max_depth = std::max(this->build_stats.max_depth, depth);
+            double area = node.box.surface_area();
+            if (node.is_leaf()) {
+                this->build_stats.leaf_nodes++;
+                this->build_stats.sah_cost += area * this->opts.intersection_cost * node.primitive_count;
+                return;
+            }
+            this->build_stats.interior_nodes++;
+            this->build_stats.sah_cost += area * this->opts.traversal_cost;
+            this->collect_stats(*node.children[0], depth+1);
+            this->collect_stats(*node.children[1], depth+1);
+        }
+};
+
 // The representation of a bounding box hierarchy (BVH)
 // A container of hittables organized in a tree hierarchy
 // Since this tree can answer the query "does this ray hit you?", it is a hittable
@@ -17,128 +325,87 @@ class bvh_node : public hittable {
         aabb box;
 
         // Constructors
-        bvh_node();
+        bvh_node() {}
         // A wrapper to unpack the list of hittables and the list size
         bvh_node(
-            const hittable_list& list, double time0, double time1
-        ): bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+            const hittable_list& list, double time0, double time1, int num_threads=1
+        ): bvh_node(list.objects, 0, list.objects.size(), time0, time1, num_threads) {}
         // The actual constructor logic
         bvh_node(
             const std::vector<shared_ptr<hittable>>& source_objects,
-            size_t start, size_t end, double time0, double time1
+            size_t start, size_t end, double time0, double time1, int num_threads=1
         );
+        // Create the node for a node of a finished build
+        bvh_node(const bvh_build_node& node, const std::vector<shared_ptr<hittable>>& ordered_objects);
 
         // Virtual functions to override
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
-};
-
-// Comparator function for a hittable using its bounding boxes
-// If a<b, return True
-bool box_compare(
-    const shared_ptr<hittable> a,
-    const shared_ptr<hittable> b,
-    int axis,
-) {
-    // Obtain the bounding boxes of each hittable
-    aabb box_a, box_b;
-    bool a_valid, b_valid;
-    a_valid = a.bounding_box(0, 0, box_a);
-    b_valid = b.bounding_box(0, 0, box_b);
-
-    // TODO: handle the case where both are invalid, or either one of them is invalid
-    if (!a_valid || !b_valid) {
-        std::cerr << "No bounding box in bvh_node constructor" << std::endl;
-    }
 
-    // Make the comparison with the axis value of the bounding boxes
-    return box_a.min()[axis] < box_b.min()[axis];
-}
+        // Statistics of the last build (of the root node)
+        bvh_build_stats stats;
 
-// Axis-specific comparison functions
-// We have to create these since the comparison function
-//  can only take in the operands as arguments
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
-}
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
-}
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
-}
+    private:
+        // A leaf of the build (one primitive) becomes the primitive itself; anything else becomes a bvh_node
+        static shared_ptr<hittable> make_child(
+            const bvh_build_node& node, const std::vector<shared_ptr<hittable>>& ordered_objects
+        ) {
+            if (node.is_leaf()) return ordered_objects[node.first_primitive];
+            return make_shared<bvh_node>(node, ordered_objects);
+        }
+};
 
 /*
     BVH constructor
 
-    1. Randomly choose an axis (x,y,z)
-    2. Sort the objects/primitives/hittables
-    3. Split the sorted list in half and put each half into its own subtree (the child nodes)
+    1. Compute the bounding box of every object (once)
+    2. Build the tree with the binned surface area heuristic (bvh_builder), one object per leaf
+    3. Turn the build tree into bvh_nodes; the leaves are the objects themselves
 */
 bvh_node::bvh_node(
-    std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+    const std::vector<shared_ptr<hittable>>& src_objects,
+    size_t start, size_t end, double time0, double time1, int num_threads
 ) {
-    
-    size_t object_span = end - start;
-    // We only have one object
-    if (object_span == 1) {
-        // Set both children to the same object
-        this->left = src_objects[start];
-        this->right = src_objects[start];
-    } else { // More than one object
-        // Create a copy of the objects (since we will modify its order)
-        auto objects = src_objects;
-        
-        // 0, 1, 2 => x, y, z
-        int axis = random_int(0, 2);
-    
-        // Sort the objects along the axis
-        switch(axis) {
-            case 0:
-                std::sort(objects.at(start), objects.at(end), box_x_compare);
-                break;
-            case 1:
-                std::sort(objects.at(start), objects.at(end), box_y_compare);
-                break;
-            default:
-                std::sort(objects.at(start), objects.at(end), box_z_compare);
-                break;
+    std::vector<shared_ptr<hittable>> objects(src_objects.begin() + start, src_objects.begin() + end);
+    std::vector<aabb> boxes(objects.size());
+    for (size_t i=0; i<objects.size(); i++) {
+        if (!objects[i]->bounding_box(time0, time1, boxes[i])) {
+            std::cerr << "No bounding box in bvh_node constructor" << std::endl;
         }
+    }
 
-        if (object_span == 2) {
-            // If there are only two children, we can just set the lesser hittable
-            //  on the left and the other on the right
-            this->left = objects[start];
-            this->right = objects[start+1];
-        } else {
-            // More than 2 objects, we have to create two halves
-            
-            // Get the array index of the middle object
-            // Note that `start` might not be zero, so we have to do start + length of half the list
-            size_t middle = start + (end-start)/2;
-            
-            // Create a node for the left-child and right child
-            this->left = make_shared<bvh_node>(objects, start, middle, time0, time1);
-            this->right = make_shared<bvh_node>(objects, middle, end, time0, time1);           
-        }
-    } // More than one object; end
-    
-    // Create the bounding box for this node
-    // This bounding box will encapsulate both child node's bounding boxes
-    aabb box_left, box_right;
-    bool box_left_valid = this->left->bounding_box(time0, time1, box_left);
-    bool box_right_valid = this->right->bounding_box(time0, time1, box_right);
-
-    if (!box_left_valid || !box_right_valid) {
-        std::cerr << "No bounding box in bvh_node constructor" std::endl;
+    bvh_builder::options opts;
+    opts.num_threads = num_threads;
+    bvh_builder builder(boxes, opts);
+    std::unique_ptr<bvh_build_node> root = builder.build();
+    this->stats = builder.stats();
+    if (!root) return;
+
+    // Put the objects in the order of the leaves
+    std::vector<shared_ptr<hittable>> ordered_objects;
+    ordered_objects.reserve(objects.size());
+    for (size_t index : builder.primitive_order()) {
+        ordered_objects.push_back(objects[index]);
+    }
+
+    this->box = root->box;
+    if (root->is_leaf()) {
+        // We only have one object; set both children to the same object
+        this->left = ordered_objects[root->first_primitive];
+        this->right = this->left;
+    } else {
+        this->left = make_child(*root->children[0], ordered_objects);
+        this->right = make_child(*root->children[1], ordered_objects);
     }
+}
 
-    // Set the bounding box for this node
-    this->box = surrounding_box(box_left, box_right);
+bvh_node::bvh_node(const bvh_build_node& node, const std::vector<shared_ptr<hittable>>& ordered_objects) {
+    this->box = node.box;
+    this->left = make_child(*node.children[0], ordered_objects);
+    this->right = make_child(*node.children[1], ordered_objects);
 }
 
-bool bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool bvh_node::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
     // Check if the ray even hits the tree's bounding box
     if (!this->box.hit(r, t_min, t_max)) {
         return false;
@@ -146,31 +413,43 @@ bool bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
 
     // Since the ray hits the bounding box, do a search through the node's children
     // to find the precise object that was hit
-    hit_record temp_hit_record;
-    // Check if the ray hits anything within the bounds defined by the left-half
     // Recall that the BVH does not split the space physically in two ordered halves (left and right halves)
     //  ex. the left-child of a BVH node does not literally mean the left-half of the space
     //  The objects referenced by the child node are inside the bounds defined by the parent node
     //  Bounding boxes can overlap
-    bool hit_left = this->left.hit(r, t_min, t_max, temp_hit_record);
-    
-    // If there was an object on the left-half's bounds, use the t value that hit that object
-    double t = hit_left ? temp_hit_record.t : t_max;
+    bool hit_left = this->left->intersect(r, t_min, t_max, hit);
 
-    bool hit_right = this->right.hit(r, t_min, t, temp_hit_record);
+    // If there was an object on the left-half's bounds, only look for objects in front of it
+    double t = hit_left ? hit.t : t_max;
+    bool hit_right = this->right->intersect(r, t_min, t, hit);
 
-    // Update the return hit_record if an object was hit
-    bool object_hit = hit_left || hit_right;
-    if (object_hit) {
-        rec = temp_hit_record;
-    }
-
-    return object_hit;
+    return hit_left || hit_right;
 }
 
-bool bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = this->box;
     return true;
 }
 
+// Put the objects of `list` in a BVH
+// Objects without a bounding box (ex. infinite planes) cannot go in the tree;
+//  they stay next to it in the returned list
+hittable_list build_bvh(const hittable_list& list, double time0, double time1, int num_threads) {
+    hittable_list bounded, result;
+    aabb box;
+    for (const shared_ptr<hittable>& object : list.objects) {
+        if (object->bounding_box(time0, time1, box)) {
+            bounded.add(object);
+        } else {
+            result.add(object);
+        }
+    }
+    if (bounded.objects.empty()) return list;
+
+    shared_ptr<bvh_node> tree = make_shared<bvh_node>(bounded, time0, time1, num_threads);
+    tree->stats.print(std::cerr, "BVH");
+    result.add(tree);
+    return result;
+}
+
 #endif // header guard
@@ -2,6 +2,7 @@
 #define CAMERA_H
 
 #include "rtweekend.h"
+#include "sampler.h"
 
 
 class camera {
@@ -28,6 +29,20 @@ class camera {
         //  to create the motion blur effect
         double time0, time1; 
 
+        // Distance between neighbouring pixels, in (s, t) units, for the ray differentials (0 = no differentials)
+        double pixel_ds = 0.0;
+        double pixel_dt = 0.0;
+
+        // Add the rays through the neighbouring pixels (from the same point on the lens) to `r`
+        void add_differentials(ray_differential& r) const {
+            if (this->pixel_ds <= 0.0) return;
+            r.has_differentials = true;
+            r.rx_origin = r.origin();
+            r.ry_origin = r.origin();
+            r.rx_direction = r.direction() + this->pixel_ds * this->horizontal;
+            r.ry_direction = r.direction() + this->pixel_dt * this->vertical;
+        }
+
     public:
         // Constructor
         camera(
@@ -92,7 +107,15 @@ class camera {
         // To create the focus blur effect, we randomize where the ray origin is,
         //  by choosing a point within the area of the lens.
         // To have no focus blur effect (the original camera), the lens radius can simply be set to zero.
-        ray get_ray(double s, double t) const {
+        // Give the camera rays differentials toward the pixels `ds` to the right and `dt` up (in (s, t) units)
+        // With many samples per pixel, each sample only needs to cover its share of the pixel,
+        //  so the spacing can be scaled down (see run_ray_tracer())
+        void set_pixel_spacing(double ds, double dt) {
+            this->pixel_ds = ds;
+            this->pixel_dt = dt;
+        }
+
+        ray_differential get_ray(double s, double t) const {
             // Create a random vector with length of the len's radius
             vec3 rd = this->lens_radius * random_in_unit_disk();
             // `u` is the "x-axis" of the camera
@@ -104,7 +127,25 @@ class camera {
             vec3 direction = (this->lower_left_corner + s*this->horizontal + t*this->vertical) - (this->origin + offset);
             // Generate a random time between when the camera shutter interval
             double timestamp = random_double(this->time0, this->time1);
-            return ray(this->origin + offset, direction, timestamp);
+            ray_differential r(ray(this->origin + offset, direction, timestamp));
+            this->add_differentials(r);
+            return r;
+        }
+
+        // Same as above, but the lens position and time come from the sampler
+        //  (2D lens sample, then 1D time sample)
+        ray_differential get_ray(double s, double t, sampler& smp) const {
+            point2 lens_sample = smp.get_2d();
+            double time_sample = smp.get_1d();
+
+            vec3 rd = this->lens_radius * sample_unit_disk(lens_sample.x, lens_sample.y);
+            vec3 offset = this->u * rd.x() + this->v * rd.y();
+
+            vec3 direction = (this->lower_left_corner + s*this->horizontal + t*this->vertical) - (this->origin + offset);
+            double timestamp = this->time0 + (this->time1 - this->time0) * time_sample;
+            ray_differential r(ray(this->origin + offset, direction, timestamp));
+            this->add_differentials(r);
+            return r;
         }
 };
 
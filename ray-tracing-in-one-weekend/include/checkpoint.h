@@ -0,0 +1,226 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+#include "image_io.h"
+
+// Checkpoints of a progressive render
+// A progressive render takes its samples in passes (samples [0, n), [n, 2n), ...). After a pass,
+//  the whole state of the render can be saved to a small binary file, and a later run can load it
+//  and go on with the next pass as if it had never stopped.
+//
+// The state is:
+//   the framebuffer: the sum of every pixel's samples and how many there were
+//   the random state: every sample re-seeds its generator from (seed, pixel, sample index)
+//     (see sampler::start_sample()), so the seed, the sampler and the next sample index are enough
+//     to continue every pixel's random numbers exactly where they stopped
+//   what was rendered (scene, image size, aperture, ...) and how (integrator, light sampling, roulette,
+//     texture filter), so a checkpoint is not resumed into a different render or finished with another estimator
+//
+// File layout (native byte order; the magic number doubles as a byte order check):
+//   uint32 magic, uint32 version
+//   int32 width, height, scene, samples_per_pass, samples_done, roulette_depth
+//   uint64 seed
+//   double aperture
+//   the sampler, integrator, light sampling and texture filter names, each as a uint32 length followed by
+//     its characters
+//   float sums[3 * width * height], float counts[width * height]
+//   uint32 CRC-32 of everything before it
+struct render_checkpoint {
+    // What was rendered
+    int width = 0;
+    int height = 0;
+    int scene = 0;
+    uint64_t seed = 0;
+    // The lens aperture actually used (the scene's own, or --aperture)
+    double aperture = 0.0;
+    std::string sampler_name;
+    int samples_per_pass = 0;
+    // How the samples were estimated (--integrator, --light-sampling, --roulette, --texture-filter)
+    std::string integrator;
+    std::string light_sampling;
+    int roulette_depth = 0;
+    std::string texture_filter;
+    // Every pixel has samples [0, samples_done); the next pass starts at this sample index
+    int samples_done = 0;
+    // The accumulation buffer
+    std::vector<float> sums;
+    std::vector<float> counts;
+
+    static constexpr uint32_t magic = 0x4b435452; // "RTCK" in a little-endian file
+    static constexpr uint32_t version = 3;
+
+    // True if this checkpoint can be resumed by a render of `other` (everything but the progress matches)
+    bool same_render(const render_checkpoint& other) const {
+        return this->width == other.width && this->height == other.height && this->scene == other.scene
+            && this->seed == other.seed && this->sampler_name == other.sampler_name
+            && this->samples_per_pass == other.samples_per_pass && this->integrator == other.integrator
+            && this->light_sampling == other.light_sampling && this->roulette_depth == other.roulette_depth
+            && this->aperture == other.aperture && this->texture_filter == other.texture_filter;
+    }
+};
+
+// The checkpoint file is built in memory and written with one write
+template <typename T>
+void append_bytes(std::vector<uint8_t>& buffer, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+void append_string(std::vector<uint8_t>& buffer, const std::string& value) {
+    append_bytes(buffer, static_cast<uint32_t>(value.size()));
+    buffer.insert(buffer.end(), value.begin(), value.end());
+}
+
+void append_floats(std::vector<uint8_t>& buffer, const std::vector<float>& values) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values.data());
+    buffer.insert(buffer.end(), bytes, bytes + values.size() * sizeof(float));
+}
+
+// Reads values off the front of a buffer; `ok` turns false if the buffer runs out
+struct byte_reader {
+    const std::vector<uint8_t>& buffer;
+    size_t offset = 0;
+    bool ok = true;
+
+    template <typename T>
+    T read() {
+        T value{};
+        this->read_bytes(&value, sizeof(T));
+        return value;
+    }
+
+    void read_bytes(void* destination, size_t size) {
+        if (!this->ok || this->buffer.size() - this->offset < size) {
+            this->ok = false;
+            return;
+        }
+        std::memcpy(destination, this->buffer.data() + this->offset, size);
+        this->offset += size;
+    }
+
+    // A string written by append_string()
+    std::string read_string() {
+        uint32_t length = this->read<uint32_t>();
+        if (!this->ok || this->buffer.size() - this->offset < length) {
+            this->ok = false;
+            return "";
+        }
+        std::string value(reinterpret_cast<const char*>(this->buffer.data() + this->offset), length);
+        this->offset += length;
+        return value;
+    }
+};
+
+// Write `checkpoint` to `filename`
+// The file is written next to it first and then renamed over it, so a job that is killed while
+//  writing leaves the previous checkpoint intact
+bool write_checkpoint(const std::string& filename, const render_checkpoint& checkpoint) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(
+        128 + checkpoint.sampler_name.size() + checkpoint.integrator.size() + checkpoint.light_sampling.size()
+        + checkpoint.texture_filter.size()
+        + (checkpoint.sums.size() + checkpoint.counts.size()) * sizeof(float)
+    );
+    append_bytes(buffer, render_checkpoint::magic);
+    append_bytes(buffer, render_checkpoint::version);
+    for (int value : {
+        checkpoint.width, checkpoint.height, checkpoint.scene, checkpoint.samples_per_pass, checkpoint.samples_done,
+        checkpoint.roulette_depth
+    }) {
+        append_bytes(buffer, static_cast<int32_t>(value));
+    }
+    append_bytes(buffer, checkpoint.seed);
+    append_bytes(buffer, checkpoint.aperture);
+    append_string(buffer, checkpoint.sampler_name);
+    append_string(buffer, checkpoint.integrator);
+    append_string(buffer, checkpoint.light_sampling);
+    append_string(buffer, checkpoint.texture_filter);
+    append_floats(buffer, checkpoint.sums);
+    append_floats(buffer, checkpoint.counts);
+    append_bytes(buffer, crc32_update(0, buffer.data(), buffer.size()));
+
+    const std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        out.flush();
+        if (!out) {
+            std::cerr << "Cannot write checkpoint: " << temporary << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Cannot rename " << temporary << " to " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Read a checkpoint written by write_checkpoint()
+// Fails on anything that is not a complete, uncorrupted checkpoint of this version
+bool read_checkpoint(const std::string& filename, render_checkpoint& checkpoint) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open checkpoint: " << filename << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    if (buffer.size() < 2 * sizeof(uint32_t) + sizeof(uint32_t)) {
+        std::cerr << "Checkpoint is too short: " << filename << std::endl;
+        return false;
+    }
+    uint32_t stored_crc;
+    std::memcpy(&stored_crc, buffer.data() + buffer.size() - sizeof(uint32_t), sizeof(uint32_t));
+    buffer.resize(buffer.size() - sizeof(uint32_t));
+
+    byte_reader in_buffer{buffer};
+    if (in_buffer.read<uint32_t>() != render_checkpoint::magic || in_buffer.read<uint32_t>() != render_checkpoint::version) {
+        std::cerr << "Not a checkpoint of this version (or of another byte order): " << filename << std::endl;
+        return false;
+    }
+    if (crc32_update(0, buffer.data(), buffer.size()) != stored_crc) {
+        std::cerr << "Checkpoint is corrupted: " << filename << std::endl;
+        return false;
+    }
+
+    checkpoint.width = in_buffer.read<int32_t>();
+    checkpoint.height = in_buffer.read<int32_t>();
+    checkpoint.scene = in_buffer.read<int32_t>();
+    checkpoint.samples_per_pass = in_buffer.read<int32_t>();
+    checkpoint.samples_done = in_buffer.read<int32_t>();
+    checkpoint.roulette_depth = in_buffer.read<int32_t>();
+    checkpoint.seed = in_buffer.read<uint64_t>();
+    checkpoint.aperture = in_buffer.read<double>();
+    checkpoint.sampler_name = in_buffer.read_string();
+    checkpoint.integrator = in_buffer.read_string();
+    checkpoint.light_sampling = in_buffer.read_string();
+    checkpoint.texture_filter = in_buffer.read_string();
+    if (!in_buffer.ok || checkpoint.width <= 0 || checkpoint.height <= 0) {
+        std::cerr << "Checkpoint header is not valid: " << filename << std::endl;
+        return false;
+    }
+
+    const size_t num_pixels = static_cast<size_t>(checkpoint.width) * checkpoint.height;
+    checkpoint.sums.resize(3 * num_pixels);
+    checkpoint.counts.resize(num_pixels);
+    in_buffer.read_bytes(checkpoint.sums.data(), checkpoint.sums.size() * sizeof(float));
+    in_buffer.read_bytes(checkpoint.counts.data(), checkpoint.counts.size() * sizeof(float));
+    if (!in_buffer.ok || in_buffer.offset != buffer.size()) {
+        std::cerr << "Checkpoint size does not match its image size: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif // header guard
@@ -0,0 +1,533 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "material_table.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "image_io.h"
+#include "tile_renderer.h"
+#include "thread_pool.h"
+#include "simd.h"
+
+// Feature (auxiliary) buffers: what the camera rays hit first, averaged over each pixel's samples
+//   albedo: the surface's own color (material::albedo_at()); white where the ray hit nothing
+//   normal: the surface normal (facing the camera); zero where the ray hit nothing
+//   depth:  distance from the camera to the hit; zero where the ray hit nothing
+// They are nearly noise-free after a few samples, and show where the edges of the image are,
+//  which is what the denoiser needs to know to blur the noise but not the edges
+// On mirrors and glass, the features are those of the surface seen in (or through) them, tinted by
+//  the mirror's color: otherwise the reflections would look like one smooth surface and be blurred
+// Each is kept in a framebuffer (depth in all three channels), so they can be written as images
+struct feature_buffers {
+    framebuffer albedo;
+    framebuffer normal;
+    framebuffer depth;
+
+    feature_buffers(int width, int height): albedo(width, height), normal(width, height), depth(width, height) {}
+
+    // Write the buffers to <prefix>_albedo.pfm, <prefix>_normal.pfm and <prefix>_depth.pfm
+    bool write(const std::string& prefix) const {
+        return write_image(prefix + "_albedo.pfm", this->albedo)
+            && write_image(prefix + "_normal.pfm", this->normal)
+            && write_image(prefix + "_depth.pfm", this->depth);
+    }
+};
+
+// Number of mirror/glass bounces the feature rays follow before they take whatever they hit
+const int max_specular_feature_bounces = 4;
+// Camera rays per pixel for the feature buffers (the first samples of the render, or all of them if it has fewer)
+// Past 16 the feature pass costs about as much as rendering without lighting, for a small gain
+//  (scene 1 at 64 spp: 0.79 s and 33.6 dB PSNR with all 64, 0.19 s and 32.4 dB with 16)
+const int max_feature_samples = 16;
+
+// Fill in the feature buffers of tile `t` with samples [0, num_samples) of every pixel
+// The samples use the same sampler and sample indices as the render, so they are the same camera rays
+void render_feature_tile(
+    const tile& t, const camera& cam, const hittable_list& world, const material_table& materials,
+    int image_width, int image_height, const sampler& pixel_sampler, int num_samples, feature_buffers& features
+) {
+    std::unique_ptr<sampler> smp = pixel_sampler.clone();
+    for (int j=t.y0; j<t.y1; j++) {
+        for (int i=t.x0; i<t.x1; i++) {
+            smp->start_pixel(i, j);
+            color albedo(0, 0, 0);
+            vec3 normal(0, 0, 0);
+            double depth = 0.0;
+            for (int s=0; s<num_samples; s++) {
+                smp->start_sample(s);
+                point2 jitter = smp->get_2d();
+                double u = (double(i) + jitter.x) / (image_width-1);
+                double v = (double(j) + jitter.y) / (image_height-1);
+                ray_differential camera_ray = cam.get_ray(u, v, *smp);
+                ray r = camera_ray;
+
+                // Tint of the mirrors and glass on the way, and the distance travelled
+                color tint(1, 1, 1);
+                double distance = 0.0;
+                hit_record rec;
+                for (int bounce=0; ; bounce++) {
+                    if (!world.hit(r, 0.001, infinity, rec)) {
+                        albedo += tint;
+                        depth += distance;
+                        break;
+                    }
+                    distance += rec.t * r.direction().length();
+                    // (the pixel's footprint is only known for the camera ray; the texture is not filtered in reflections)
+                    if (bounce == 0) {
+                        rec.compute_differentials(camera_ray);
+                    } else {
+                        rec.dudx = rec.dvdx = rec.dudy = rec.dvdy = 0.0;
+                    }
+                    const material& mat = materials[rec.material_id];
+                    ray reflected;
+                    if (bounce < max_specular_feature_bounces && mat.specular_ray(r, rec, reflected)) {
+                        tint = tint * mat.albedo_at(rec);
+                        r = reflected;
+                        continue;
+                    }
+                    albedo += tint * mat.albedo_at(rec);
+                    normal += rec.normal;
+                    depth += distance;
+                    break;
+                }
+            }
+            features.albedo.add_samples(i, j, albedo, num_samples);
+            features.normal.add_samples(i, j, normal, num_samples);
+            features.depth.add_samples(i, j, color(depth, depth, depth), num_samples);
+        }
+    }
+}
+
+// Edge-avoiding à-trous wavelet denoiser ("Edge-Avoiding À-Trous Wavelet Transform for fast
+//  Global Illumination Filtering", Dammertz et al. 2010)
+// Each iteration blurs the image with a 5x5 B3-spline kernel whose taps are `step` pixels apart
+//  (1, 2, 4, 8, 16: the "holes" of à trous), so 5 iterations of 25 taps cover a 125x125 area.
+// Every tap is weighted by how similar the neighbour is to the pixel: in color, normal, albedo and depth.
+//  Noise (neighbours that differ only in color, a little) is averaged out; edges
+//  (neighbours with another normal, albedo or depth, or a very different color) are not.
+// The image is first divided by the albedo, so textures are not blurred (only the lighting is),
+//  and multiplied by it again at the end.
+//
+// How different a color may be is relative to the pixel's noise, as in SVGF ("Spatiotemporal
+//  Variance-Guided Filtering", Schied et al. 2017): glass and caustics are far noisier than a lit wall,
+//  so one fixed tolerance would either leave them noisy or blur the wall's shading.
+//  The noise is estimated from the spread of the brightness of the pixel's neighbours on the same
+//  surface, and every iteration carries it along (a weighted average of n pixels has less variance).
+//
+// The planes are padded by `border` pixels on every side with invalid pixels (valid = 0),
+//  so the 25 taps never need a bounds check, and the rows are filtered 4 or 8 pixels at a time with SIMD.
+// As in wide_bvh.h, the scalar, SSE and AVX2 versions do the same float operations in the same order.
+class atrous_denoiser {
+    public:
+        struct options {
+            // Number of iterations (the last one has taps 2^(iterations-1) pixels apart)
+            int iterations = 5;
+            // How different (after dividing by the albedo) a neighbour's color can be and still count,
+            //  in standard deviations of the pixel's noise
+            float sigma_color = 16.0f;
+            // Same for normals (the length of the difference of the two normals)
+            float sigma_normal = 0.3f;
+            // Same for albedo
+            float sigma_albedo = 0.1f;
+            // Depth difference, relative to the pixel's depth
+            float sigma_depth = 0.1f;
+        };
+
+        atrous_denoiser(const options& opts, int num_threads, simd_level level):
+            opts(opts), num_threads(num_threads), level(level) {}
+
+        // Denoise the framebuffer's image; returns the average linear color of every pixel
+        //  as RGB floats, bottom row first (like framebuffer::resolve_linear())
+        std::vector<float> denoise(const framebuffer& fb, const feature_buffers& features) {
+            this->setup(fb, features);
+
+            // One pool for all passes; each pass is split into bands of rows
+            thread_pool pool(this->num_threads);
+            auto for_each_row = [&](const std::function<void(int)>& filter) {
+                const int rows_per_band = 8;
+                for (int y0=0; y0<this->height; y0+=rows_per_band) {
+                    pool.submit([&, y0] {
+                        const int y1 = std::min(y0 + rows_per_band, this->height);
+                        for (int y=y0; y<y1; y++) filter(y);
+                    });
+                }
+                pool.wait();
+            };
+
+            for_each_row([&](int y) { this->estimate_variance_row(y); });
+
+            atrous_weights weights;
+            weights.sigma_color2 = this->opts.sigma_color * this->opts.sigma_color;
+            weights.inverse_sigma_normal2 = 1.0f / (this->opts.sigma_normal * this->opts.sigma_normal);
+            weights.inverse_sigma_albedo2 = 1.0f / (this->opts.sigma_albedo * this->opts.sigma_albedo);
+            int from = 0;
+            for (int iteration=0; iteration<this->opts.iterations; iteration++) {
+                const int step = 1 << iteration;
+                for_each_row([&](int y) { this->filter_row(from, y, step, weights); });
+                from = 1 - from;
+            }
+
+            // Multiply the albedo back in
+            std::vector<float> out(3 * static_cast<size_t>(this->width) * this->height);
+            for (int y=0; y<this->height; y++) {
+                for (int x=0; x<this->width; x++) {
+                    size_t p = this->index(x, y);
+                    size_t o = 3 * (static_cast<size_t>(y) * this->width + x);
+                    for (int c=0; c<3; c++) {
+                        out[o + c] = this->color[from][c][p] * this->demodulation[c][p];
+                    }
+                }
+            }
+            return out;
+        }
+
+    private:
+        // Constants of the edge-stopping weights
+        struct atrous_weights {
+            float sigma_color2;
+            float inverse_sigma_normal2;
+            float inverse_sigma_albedo2;
+        };
+
+        options opts;
+        int num_threads;
+        simd_level level;
+        int width = 0, height = 0;
+        // Padding on every side, and the padded row length
+        int border = 0, stride = 0;
+        // Guide planes (structure-of-arrays, padded)
+        std::vector<float> albedo[3], normal[3], depth;
+        // 1 / (sigma_depth * depth + epsilon) of each pixel, so the depth weight is a multiplication
+        std::vector<float> inverse_depth_scale;
+        // 1 for pixels of the image, 0 for the padding
+        std::vector<float> valid;
+        // The albedo the image was divided by
+        std::vector<float> demodulation[3];
+        // The image being filtered and the variance of its noise,
+        //  ping-ponged between the iterations: color[from] -> color[1 - from]
+        std::vector<float> color[2][3];
+        std::vector<float> variance[2];
+
+        size_t index(int x, int y) const {
+            return static_cast<size_t>(y + this->border) * this->stride + (x + this->border);
+        }
+
+        // Fill in the padded planes
+        void setup(const framebuffer& fb, const feature_buffers& features) {
+            this->width = fb.get_width();
+            this->height = fb.get_height();
+            // The widest tap reaches 2 * step pixels away; SIMD rows can run up to 7 pixels past the image
+            this->border = 2 * (1 << (this->opts.iterations - 1)) + 8;
+            this->stride = this->width + 2 * this->border;
+            const size_t plane_size = static_cast<size_t>(this->stride) * (this->height + 2 * this->border);
+
+            for (int c=0; c<3; c++) {
+                this->albedo[c].assign(plane_size, 0.0f);
+                this->normal[c].assign(plane_size, 0.0f);
+                this->demodulation[c].assign(plane_size, 1.0f);
+                this->color[0][c].assign(plane_size, 0.0f);
+                this->color[1][c].assign(plane_size, 0.0f);
+            }
+            this->variance[0].assign(plane_size, 0.0f);
+            this->variance[1].assign(plane_size, 0.0f);
+            this->depth.assign(plane_size, 0.0f);
+            this->inverse_depth_scale.assign(plane_size, 0.0f);
+            this->valid.assign(plane_size, 0.0f);
+
+            const std::vector<float> image = fb.resolve_linear();
+            const std::vector<float> albedo_image = features.albedo.resolve_linear();
+            const std::vector<float> normal_image = features.normal.resolve_linear();
+            const std::vector<float> depth_image = features.depth.resolve_linear();
+            for (int y=0; y<this->height; y++) {
+                for (int x=0; x<this->width; x++) {
+                    const size_t p = this->index(x, y);
+                    const size_t pixel = static_cast<size_t>(y) * this->width + x;
+                    for (int c=0; c<3; c++) {
+                        const float a = albedo_image[3*pixel + c];
+                        this->albedo[c][p] = a;
+                        this->normal[c][p] = normal_image[3*pixel + c];
+                        // Dark albedo: divide by a small floor instead (the lighting there barely shows anyway)
+                        this->demodulation[c][p] = std::max(a, 0.01f);
+                        this->color[0][c][p] = image[3*pixel + c] / this->demodulation[c][p];
+                    }
+                    this->depth[p] = depth_image[3*pixel];
+                    this->inverse_depth_scale[p] = 1.0f / (this->opts.sigma_depth * depth_image[3*pixel] + 1e-4f);
+                    this->valid[p] = 1.0f;
+                }
+            }
+        }
+
+        // B3-spline kernel weights of taps -2..2
+        static constexpr float kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+
+        // Edge-stopping weight of the features alone (no color), as an exponent: the weight is exp(-x)
+        float feature_distance(size_t p, size_t q, const atrous_weights& weights) const {
+            float nx = this->normal[0][q] - this->normal[0][p];
+            float ny = this->normal[1][q] - this->normal[1][p];
+            float nz = this->normal[2][q] - this->normal[2][p];
+            float ar = this->albedo[0][q] - this->albedo[0][p];
+            float ag = this->albedo[1][q] - this->albedo[1][p];
+            float ab = this->albedo[2][q] - this->albedo[2][p];
+            return (nx*nx + ny*ny + nz*nz) * weights.inverse_sigma_normal2
+                + (ar*ar + ag*ag + ab*ab) * weights.inverse_sigma_albedo2
+                + std::fabs(this->depth[q] - this->depth[p]) * this->inverse_depth_scale[p];
+        }
+
+        // Noise variance of the pixels of row y: the variance of the brightness of the 5x5 neighbours
+        //  on the same surface (weighted by the features), per the difference of a pixel from the
+        //  neighbourhood's mean. Real detail in the lighting (ex. a shadow edge) counts as noise here,
+        //  which only makes the filter more careful there.
+        void estimate_variance_row(int y) {
+            atrous_weights weights;
+            weights.inverse_sigma_normal2 = 1.0f / (this->opts.sigma_normal * this->opts.sigma_normal);
+            weights.inverse_sigma_albedo2 = 1.0f / (this->opts.sigma_albedo * this->opts.sigma_albedo);
+            auto luminance = [this](size_t p) {
+                return 0.2126f * this->color[0][0][p] + 0.7152f * this->color[0][1][p] + 0.0722f * this->color[0][2][p];
+            };
+            for (int x=0; x<this->width; x++) {
+                const size_t p = this->index(x, y);
+                float sum = 0.0f, sum_squares = 0.0f, sum_weight = 0.0f;
+                for (int dy=-2; dy<=2; dy++) {
+                    for (int dx=-2; dx<=2; dx++) {
+                        const size_t q = p + static_cast<ptrdiff_t>(dy) * this->stride + dx;
+                        float w = this->valid[q] * exp_negative_scalar(this->feature_distance(p, q, weights));
+                        float l = luminance(q);
+                        sum += w * l;
+                        sum_squares += w * l * l;
+                        sum_weight += w;
+                    }
+                }
+                float mean = sum / sum_weight;
+                this->variance[0][p] = std::max(sum_squares / sum_weight - mean * mean, 0.0f);
+            }
+        }
+
+        void filter_row(int from, int y, int step, const atrous_weights& weights) {
+#if RT_X86_SIMD
+            if (this->level == simd_level::avx2) return this->filter_row_avx2(from, y, step, weights);
+            if (this->level == simd_level::sse) return this->filter_row_sse(from, y, step, weights);
+#endif
+            this->filter_row_scalar(from, y, step, weights);
+        }
+
+        // exp(-x) for x in [0, exp_limit]; larger x are clamped (the weight is 0 to float precision anyway)
+        static constexpr float exp_limit = 87.0f;
+        // Polynomial for 2^f, f in (-1, 0] (Taylor series of e^(f ln 2), 6 terms; relative error < 2e-4)
+        static constexpr float exp2_coefficients[6] = {
+            1.0f, 0.693147181f, 0.240226507f, 0.0555041087f, 0.00961812911f, 0.00133335581f
+        };
+        static constexpr float log2e = 1.44269504f;
+        // Keeps the color tolerance above zero where there is no noise at all
+        static constexpr float min_variance = 1e-6f;
+
+        // exp(-x): 2^y with y = -x log2(e), split into an integer part n (truncated toward zero) and
+        //  a fraction f in (-1, 0]; 2^n is put straight into the float's exponent bits
+        static float exp_negative_scalar(float x) {
+            x = x < exp_limit ? x : exp_limit;
+            float y = x * -log2e;
+            int32_t n = static_cast<int32_t>(y);
+            float f = y - static_cast<float>(n);
+            float p = exp2_coefficients[5];
+            for (int k=4; k>=0; k--) p = p * f + exp2_coefficients[k];
+            int32_t bits = (n + 127) << 23;
+            float scale;
+            std::memcpy(&scale, &bits, sizeof(float));
+            return p * scale;
+        }
+
+        // One iteration for row y: color[from] -> color[1 - from], and the same for the variance
+        void filter_row_scalar(int from, int y, int step, const atrous_weights& weights) {
+            const std::vector<float>* in = this->color[from];
+            std::vector<float>* out = this->color[1 - from];
+            const std::vector<float>& variance_in = this->variance[from];
+            for (int x=0; x<this->width; x++) {
+                const size_t p = this->index(x, y);
+                const float inverse_color_scale = 1.0f / (weights.sigma_color2 * variance_in[p] + min_variance);
+                float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f, sum_weight = 0.0f, sum_variance = 0.0f;
+                for (int dy=-2; dy<=2; dy++) {
+                    for (int dx=-2; dx<=2; dx++) {
+                        const size_t q = p + static_cast<ptrdiff_t>(dy) * step * this->stride + dx * step;
+                        float dr = in[0][q] - in[0][p], dg = in[1][q] - in[1][p], db = in[2][q] - in[2][p];
+                        float nx = this->normal[0][q] - this->normal[0][p];
+                        float ny = this->normal[1][q] - this->normal[1][p];
+                        float nz = this->normal[2][q] - this->normal[2][p];
+                        float ar = this->albedo[0][q] - this->albedo[0][p];
+                        float ag = this->albedo[1][q] - this->albedo[1][p];
+                        float ab = this->albedo[2][q] - this->albedo[2][p];
+                        float depth_distance = std::fabs(this->depth[q] - this->depth[p]);
+
+                        float x_exp = (dr*dr + dg*dg + db*db) * inverse_color_scale
+                            + (nx*nx + ny*ny + nz*nz) * weights.inverse_sigma_normal2
+                            + (ar*ar + ag*ag + ab*ab) * weights.inverse_sigma_albedo2
+                            + depth_distance * this->inverse_depth_scale[p];
+                        float w = (kernel[dy+2] * kernel[dx+2]) * this->valid[q] * exp_negative_scalar(x_exp);
+                        sum_r += w * in[0][q];
+                        sum_g += w * in[1][q];
+                        sum_b += w * in[2][q];
+                        sum_weight += w;
+                        sum_variance += (w * w) * variance_in[q];
+                    }
+                }
+                // (the center tap always counts, so sum_weight > 0 inside the image)
+                sum_weight = sum_weight > 1e-30f ? sum_weight : 1e-30f;
+                out[0][p] = sum_r / sum_weight;
+                out[1][p] = sum_g / sum_weight;
+                out[2][p] = sum_b / sum_weight;
+                this->variance[1 - from][p] = sum_variance / (sum_weight * sum_weight);
+            }
+        }
+
+#if RT_X86_SIMD
+        static __m128 exp_negative_sse(__m128 x) {
+            x = _mm_min_ps(x, _mm_set1_ps(exp_limit));
+            __m128 y = _mm_mul_ps(x, _mm_set1_ps(-log2e));
+            __m128i n = _mm_cvttps_epi32(y);
+            __m128 f = _mm_sub_ps(y, _mm_cvtepi32_ps(n));
+            __m128 p = _mm_set1_ps(exp2_coefficients[5]);
+            for (int k=4; k>=0; k--) p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(exp2_coefficients[k]));
+            __m128i bits = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+            return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+        }
+
+        // Squared length of the difference of two 3-plane vectors at q and p
+        static __m128 distance2_sse(const std::vector<float>* planes, size_t q, size_t p) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(&planes[0][q]), _mm_loadu_ps(&planes[0][p]));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(&planes[1][q]), _mm_loadu_ps(&planes[1][p]));
+            __m128 d2 = _mm_sub_ps(_mm_loadu_ps(&planes[2][q]), _mm_loadu_ps(&planes[2][p]));
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2));
+        }
+
+        // 4 pixels at a time
+        void filter_row_sse(int from, int y, int step, const atrous_weights& weights) {
+            const std::vector<float>* in = this->color[from];
+            std::vector<float>* out = this->color[1 - from];
+            const std::vector<float>& variance_in = this->variance[from];
+            const __m128 sign_mask = _mm_set1_ps(-0.0f);
+            for (int x=0; x<this->width; x+=4) {
+                const size_t p = this->index(x, y);
+                const __m128 inverse_color_scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(
+                    _mm_mul_ps(_mm_set1_ps(weights.sigma_color2), _mm_loadu_ps(&variance_in[p])), _mm_set1_ps(min_variance)
+                ));
+                const __m128 inverse_depth_scale = _mm_loadu_ps(&this->inverse_depth_scale[p]);
+                const __m128 depth_p = _mm_loadu_ps(&this->depth[p]);
+                __m128 sum_r = _mm_setzero_ps(), sum_g = _mm_setzero_ps(), sum_b = _mm_setzero_ps();
+                __m128 sum_weight = _mm_setzero_ps(), sum_variance = _mm_setzero_ps();
+                for (int dy=-2; dy<=2; dy++) {
+                    for (int dx=-2; dx<=2; dx++) {
+                        const size_t q = p + static_cast<ptrdiff_t>(dy) * step * this->stride + dx * step;
+                        __m128 depth_distance = _mm_andnot_ps(sign_mask, _mm_sub_ps(_mm_loadu_ps(&this->depth[q]), depth_p));
+                        __m128 x_exp = _mm_add_ps(
+                            _mm_add_ps(
+                                _mm_add_ps(
+                                    _mm_mul_ps(distance2_sse(in, q, p), inverse_color_scale),
+                                    _mm_mul_ps(distance2_sse(this->normal, q, p), _mm_set1_ps(weights.inverse_sigma_normal2))
+                                ),
+                                _mm_mul_ps(distance2_sse(this->albedo, q, p), _mm_set1_ps(weights.inverse_sigma_albedo2))
+                            ),
+                            _mm_mul_ps(depth_distance, inverse_depth_scale)
+                        );
+                        __m128 w = _mm_mul_ps(
+                            _mm_mul_ps(_mm_set1_ps(kernel[dy+2] * kernel[dx+2]), _mm_loadu_ps(&this->valid[q])),
+                            exp_negative_sse(x_exp)
+                        );
+                        sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, _mm_loadu_ps(&in[0][q])));
+                        sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, _mm_loadu_ps(&in[1][q])));
+                        sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, _mm_loadu_ps(&in[2][q])));
+                        sum_weight = _mm_add_ps(sum_weight, w);
+                        sum_variance = _mm_add_ps(sum_variance, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(&variance_in[q])));
+                    }
+                }
+                sum_weight = _mm_max_ps(sum_weight, _mm_set1_ps(1e-30f));
+                _mm_storeu_ps(&out[0][p], _mm_div_ps(sum_r, sum_weight));
+                _mm_storeu_ps(&out[1][p], _mm_div_ps(sum_g, sum_weight));
+                _mm_storeu_ps(&out[2][p], _mm_div_ps(sum_b, sum_weight));
+                _mm_storeu_ps(&this->variance[1 - from][p], _mm_div_ps(sum_variance, _mm_mul_ps(sum_weight, sum_weight)));
+            }
+        }
+
+        RT_TARGET_AVX2
+        static __m256 exp_negative_avx2(__m256 x) {
+            x = _mm256_min_ps(x, _mm256_set1_ps(exp_limit));
+            __m256 y = _mm256_mul_ps(x, _mm256_set1_ps(-log2e));
+            __m256i n = _mm256_cvttps_epi32(y);
+            __m256 f = _mm256_sub_ps(y, _mm256_cvtepi32_ps(n));
+            __m256 p = _mm256_set1_ps(exp2_coefficients[5]);
+            for (int k=4; k>=0; k--) p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(exp2_coefficients[k]));
+            __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+            return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+        }
+
+        RT_TARGET_AVX2
+        static __m256 distance2_avx2(const std::vector<float>* planes, size_t q, size_t p) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(&planes[0][q]), _mm256_loadu_ps(&planes[0][p]));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(&planes[1][q]), _mm256_loadu_ps(&planes[1][p]));
+            __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(&planes[2][q]), _mm256_loadu_ps(&planes[2][p]));
+            return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d0, d0), _mm256_mul_ps(d1, d1)), _mm256_mul_ps(d2, d2));
+        }
+
+        // 8 pixels at a time
+        RT_TARGET_AVX2
+        void filter_row_avx2(int from, int y, int step, const atrous_weights& weights) {
+            const std::vector<float>* in = this->color[from];
+            std::vector<float>* out = this->color[1 - from];
+            const std::vector<float>& variance_in = this->variance[from];
+            const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+            for (int x=0; x<this->width; x+=8) {
+                const size_t p = this->index(x, y);
+                const __m256 inverse_color_scale = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(
+                    _mm256_mul_ps(_mm256_set1_ps(weights.sigma_color2), _mm256_loadu_ps(&variance_in[p])), _mm256_set1_ps(min_variance)
+                ));
+                const __m256 inverse_depth_scale = _mm256_loadu_ps(&this->inverse_depth_scale[p]);
+                const __m256 depth_p = _mm256_loadu_ps(&this->depth[p]);
+                __m256 sum_r = _mm256_setzero_ps(), sum_g = _mm256_setzero_ps(), sum_b = _mm256_setzero_ps();
+                __m256 sum_weight = _mm256_setzero_ps(), sum_variance = _mm256_setzero_ps();
+                for (int dy=-2; dy<=2; dy++) {
+                    for (int dx=-2; dx<=2; dx++) {
+                        const size_t q = p + static_cast<ptrdiff_t>(dy) * step * this->stride + dx * step;
+                        __m256 depth_distance = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(_mm256_loadu_ps(&this->depth[q]), depth_p));
+                        __m256 x_exp = _mm256_add_ps(
+                            _mm256_add_ps(
+                                _mm256_add_ps(
+                                    _mm256_mul_ps(distance2_avx2(in, q, p), inverse_color_scale),
+                                    _mm256_mul_ps(distance2_avx2(this->normal, q, p), _mm256_set1_ps(weights.inverse_sigma_normal2))
+                                ),
+                                _mm256_mul_ps(distance2_avx2(this->albedo, q, p), _mm256_set1_ps(weights.inverse_sigma_albedo2))
+                            ),
+                            _mm256_mul_ps(depth_distance, inverse_depth_scale)
+                        );
+                        __m256 w = _mm256_mul_ps(
+                            _mm256_mul_ps(_mm256_set1_ps(kernel[dy+2] * kernel[dx+2]), _mm256_loadu_ps(&this->valid[q])),
+                            exp_negative_avx2(x_exp)
+                        );
+                        sum_r = _mm256_add_ps(sum_r, _mm256_mul_ps(w, _mm256_loadu_ps(&in[0][q])));
+                        sum_g = _mm256_add_ps(sum_g, _mm256_mul_ps(w, _mm256_loadu_ps(&in[1][q])));
+                        sum_b = _mm256_add_ps(sum_b, _mm256_mul_ps(w, _mm256_loadu_ps(&in[2][q])));
+                        sum_weight = _mm256_add_ps(sum_weight, w);
+                        sum_variance = _mm256_add_ps(sum_variance, _mm256_mul_ps(_mm256_mul_ps(w, w), _mm256_loadu_ps(&variance_in[q])));
+                    }
+                }
+                sum_weight = _mm256_max_ps(sum_weight, _mm256_set1_ps(1e-30f));
+                _mm256_storeu_ps(&out[0][p], _mm256_div_ps(sum_r, sum_weight));
+                _mm256_storeu_ps(&out[1][p], _mm256_div_ps(sum_g, sum_weight));
+                _mm256_storeu_ps(&out[2][p], _mm256_div_ps(sum_b, sum_weight));
+                _mm256_storeu_ps(&this->variance[1 - from][p], _mm256_div_ps(sum_variance, _mm256_mul_ps(sum_weight, sum_weight)));
+            }
+        }
+#endif
+};
+
+#endif // header guard
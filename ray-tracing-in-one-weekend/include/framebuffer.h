@@ -0,0 +1,110 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+
+// In-memory accumulation buffer for the rendered image
+// Each pixel keeps the sum of its samples' colors (linear, before gamma) and how many samples were added,
+//  so the image can be written out at any time, in any format, with one pass over the buffer
+// Pixel (0, 0) is the lower-left corner of the image (row 0 is the bottom row)
+class framebuffer {
+    public:
+        // Constructors
+        framebuffer(): width(0), height(0) {}
+        framebuffer(int width, int height):
+            width(width), height(height),
+            sums(3 * static_cast<size_t>(width) * height, 0.0f),
+            counts(static_cast<size_t>(width) * height, 0.0f) {}
+        // A buffer with samples already in it (ex. read back from a checkpoint)
+        framebuffer(int width, int height, std::vector<float> sums, std::vector<float> counts):
+            width(width), height(height), sums(std::move(sums)), counts(std::move(counts)) {}
+
+        int get_width() const { return this->width; }
+        int get_height() const { return this->height; }
+        // The raw accumulation state: per-pixel sums (RGB interleaved, bottom row first) and sample counts
+        const std::vector<float>& get_sums() const { return this->sums; }
+        const std::vector<float>& get_counts() const { return this->counts; }
+
+        // Add the sum of `num_samples` samples to pixel (i, j)
+        // Tiles write to disjoint pixels, so threads can call this without locking
+        void add_samples(int i, int j, const color& sum, int num_samples) {
+            size_t index = this->pixel_index(i, j);
+            this->sums[3*index + 0] += static_cast<float>(sum.r());
+            this->sums[3*index + 1] += static_cast<float>(sum.g());
+            this->sums[3*index + 2] += static_cast<float>(sum.b());
+            this->counts[index] += static_cast<float>(num_samples);
+        }
+
+        // Average (linear) color of pixel (i, j)
+        color average(int i, int j) const {
+            size_t index = this->pixel_index(i, j);
+            float count = this->counts[index];
+            if (count <= 0.0f) return color(0, 0, 0);
+            return color(this->sums[3*index + 0], this->sums[3*index + 1], this->sums[3*index + 2]) / count;
+        }
+
+        // The average linear color of every pixel, as RGB floats (bottom row first)
+        std::vector<float> resolve_linear() const {
+            std::vector<float> out(this->sums.size());
+            std::vector<float> scales = this->sample_scales();
+            const size_t num_pixels = this->counts.size();
+            for (size_t p=0; p<num_pixels; p++) {
+                for (int c=0; c<3; c++) {
+                    out[3*p + c] = this->sums[3*p + c] * scales[p];
+                }
+            }
+            return out;
+        }
+
+        // The image as 8-bit RGB, top row first (the order image files want)
+        // Same math as write_color(): average the samples, gamma 2 (square root), clamp, scale to [0, 255]
+        // The loop is branch-free over the whole buffer, so the compiler turns it into SIMD code
+        std::vector<uint8_t> resolve_8bit() const {
+            std::vector<float> linear = this->resolve_linear();
+            const size_t num_values = linear.size();
+            for (size_t k=0; k<num_values; k++) {
+                float v = std::sqrt(std::fmax(linear[k], 0.0f));
+                v = std::fmin(v, 0.999f);
+                linear[k] = 256.0f * v;
+            }
+
+            std::vector<uint8_t> out(num_values);
+            const size_t row_values = 3 * static_cast<size_t>(this->width);
+            for (int row=0; row<this->height; row++) {
+                // Flip vertically: the first row in the file is the top of the image
+                const float* src = &linear[(this->height - 1 - row) * row_values];
+                uint8_t* dst = &out[row * row_values];
+                for (size_t k=0; k<row_values; k++) {
+                    dst[k] = static_cast<uint8_t>(src[k]);
+                }
+            }
+            return out;
+        }
+
+    private:
+        int width, height;
+        // Sum of the sample colors, RGB interleaved
+        std::vector<float> sums;
+        // Number of samples per pixel
+        std::vector<float> counts;
+
+        size_t pixel_index(int i, int j) const {
+            return static_cast<size_t>(j) * this->width + i;
+        }
+
+        // 1/count for each pixel (0 for pixels without samples)
+        std::vector<float> sample_scales() const {
+            std::vector<float> scales(this->counts.size());
+            for (size_t p=0; p<scales.size(); p++) {
+                scales[p] = this->counts[p] > 0.0f ? 1.0f / this->counts[p] : 0.0f;
+            }
+            return scales;
+        }
+};
+
+#endif // header guard
@@ -1,20 +1,38 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include <cmath>
+#include <cstdint>
+
 #include "rtweekend.h"
 #include "ray.h"
 #include "aabb.h"
 
 // Forward declaration of the the material class in material.h
 class material;
+// (and of the scene's table of materials, in material_table.h)
+class material_table;
+class hittable;
 
-// Result if the ray hits the hittable object at `t`
-struct hit_record {
+// The answer of the closest-hit query (see hittable::intersect()): where along the ray, and what was hit
+// Lists and BVHs overwrite it for every closer candidate they find, so it stays small (32 bytes)
+struct closest_hit {
+    double t;
+    // The primitive that was hit, which computes the surface interaction (see compute_interaction())
+    const hittable* object = nullptr;
+    // Which of the object's primitives was hit (ex. the sphere of a sphere soup; 0 for single primitives)
+    uint32_t primitive = 0;
+    // If `object` is an instance (see instance.h): the object of its shared geometry that was hit
+    const hittable* instanced_object = nullptr;
+};
+
+// The surface at the closest hit: what the materials and the shading code need
+// Computed once, by the primitive that was hit (see hittable::compute_interaction())
+struct surface_interaction {
     point3 p;
     vec3 normal;
-    // The type of material that was hit
-    shared_ptr<material> mat_ptr;
-    double t;
+    // The type of material that was hit: its ID in the scene's material_table
+    uint32_t material_id = 0;
     
     // The location of the surface (the surface coordinate) that the ray hit the object
     // (u,v) is the texture coordinate: the position of the texture that the ray hit (?)
@@ -25,6 +43,12 @@ struct hit_record {
     // False if the ray came from inside the sphere
     bool front_face;
 
+    // How the hit point moves along the surface when u and v change (zero if the object has no (u,v))
+    vec3 dpdu, dpdv;
+    // How much u and v change from this pixel to the next one to the right (x) and up (y)
+    //  (zero unless compute_differentials() found them)
+    double dudx = 0.0, dvdx = 0.0, dudy = 0.0, dvdy = 0.0;
+
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         // If the dot product is negative, the ray and the normal are facing different directions
         //  which means the ray came from outside the sphere
@@ -33,19 +57,70 @@ struct hit_record {
         //  front_face will retaining the information of where the ray came from (outside or inside the sphere)
         this->normal = this->front_face ? outward_normal : -1 * outward_normal;
     }
+
+    // Find dudx, dvdx, dudy and dvdy from the ray differentials of `r` (the camera ray that hit)
+    // The neighbouring pixels' rays are intersected with the plane tangent to the surface at the hit point,
+    //  which gives how far the hit point moves from one pixel to the next (dp/dx, dp/dy). That is then
+    //  written in terms of dp/du and dp/dv (least squares, since the two are not always orthogonal).
+    void compute_differentials(const ray_differential& r) {
+        this->dudx = this->dvdx = this->dudy = this->dvdy = 0.0;
+        if (!r.has_differentials) return;
+
+        // Tangent plane: dot(normal, x) = d
+        double d = dot_product(this->normal, this->p);
+        double tx = (d - dot_product(this->normal, r.rx_origin)) / dot_product(this->normal, r.rx_direction);
+        double ty = (d - dot_product(this->normal, r.ry_origin)) / dot_product(this->normal, r.ry_direction);
+        if (!std::isfinite(tx) || !std::isfinite(ty)) return;
+        vec3 dpdx = (r.rx_origin + tx * r.rx_direction) - this->p;
+        vec3 dpdy = (r.ry_origin + ty * r.ry_direction) - this->p;
+
+        // Solve [dpdu dpdv] * (du, dv) = dpdx (and dpdy) in the least squares sense
+        double a00 = dot_product(this->dpdu, this->dpdu);
+        double a01 = dot_product(this->dpdu, this->dpdv);
+        double a11 = dot_product(this->dpdv, this->dpdv);
+        double determinant = a00*a11 - a01*a01;
+        if (!(std::fabs(determinant) > 1e-20)) return;
+        double inverse_determinant = 1.0 / determinant;
+
+        double bx0 = dot_product(this->dpdu, dpdx), bx1 = dot_product(this->dpdv, dpdx);
+        double by0 = dot_product(this->dpdu, dpdy), by1 = dot_product(this->dpdv, dpdy);
+        this->dudx = (a11*bx0 - a01*bx1) * inverse_determinant;
+        this->dvdx = (a00*bx1 - a01*bx0) * inverse_determinant;
+        this->dudy = (a11*by0 - a01*by1) * inverse_determinant;
+        this->dvdy = (a00*by1 - a01*by0) * inverse_determinant;
+    }
 };
 
+// Both halves of a hit, as hittable::hit() fills them in
+struct hit_record : closest_hit, surface_interaction {};
+
 
 // Abstract class for objects that can be hit by a ray
 //  ex. a sphere, a list of spheres
 class hittable {
     public:
         // Given a ray P(t) = A + tb, return True if the ray hits this hittable object
-        //  given an interval of the input `t`
+        //  given an interval of the input `t`, and fill in the whole hit record
+        // Intersection is done in two phases: intersect() finds the closest hit, then the primitive that was
+        //  hit computes the point, normal, (u, v) and material, once. Candidate hits that a closer object
+        //  replaces later (in lists and BVHs) never pay for the normal or the trigonometric (u, v) mapping.
+        bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            if (!this->intersect(r, t_min, t_max, rec)) return false;
+            rec.object->compute_interaction(r, rec, rec);
+            return true;
+        }
+
+        // Closest-hit query: if the ray hits this object within [t_min, t_max], fill in `hit` (t, object,
+        //  primitive) and return true; otherwise return false and leave `hit` as it is
         // method() = 0 means this function is a pure virtual function.
         //  subclasses must implement this method, otherwise they will remain abstract
         //  and cannot be instantiated
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const = 0;
+
+        // Fill in `surface` (p, normal, u, v, dpdu, dpdv, material_id) for a hit that intersect() found on
+        //  this object (hit.object == this)
+        // Lists and BVHs never set hit.object to themselves, so they have nothing to compute
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {}
 
         // Compute the bounding box that encloses this hittable
         // Individual primitives (like spheres) become the leaves in the hierarchy
@@ -55,6 +130,29 @@ class hittable {
         // If True, the bounding box was created. The bounding box will fail to be created
         //  for objects such as infinite planes
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // Give this object (and the objects inside it) the IDs of their materials in `table`
+        // Called once, after the scene is made and before its objects go into sphere soups and BVHs
+        //  (which keep no per-object material); the hits then carry the ID (see material_table.h)
+        virtual void register_materials(material_table& table) {}
+
+        // Light sampling (see lights.h)
+        // Objects that can be sampled as lights return their material here; nullptr means the object
+        //  is only found by rays that happen to hit it (ex. moving spheres, lists of objects)
+        virtual const material* get_material() const {
+            return nullptr;
+        }
+
+        // The probability density, per unit of solid angle, that sample_direction() from `origin`
+        //  returns `direction` (0 if the direction does not point at this object)
+        virtual double pdf_value(const point3& origin, const vec3& direction) const {
+            return 0.0;
+        }
+
+        // A direction from `origin` toward a point on this object, given two numbers in [0, 1)
+        virtual vec3 sample_direction(const point3& origin, double u1, double u2) const {
+            return vec3(1, 0, 0);
+        }
 };
 
 #endif // header guard
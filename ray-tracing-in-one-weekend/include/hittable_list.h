@@ -34,26 +34,30 @@ class hittable_list : public hittable {
         void add(shared_ptr<hittable> object) { this->objects.push_back(object); }
 
         // Indicate that the virtual function will be implemented
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+        virtual void register_materials(material_table& table) override {
+            for (const shared_ptr<hittable>& object : this->objects) {
+                object->register_materials(table);
+            }
+        }
 };
 
 // If any of the objects in the list was hit by the ray, return True,
-//  and set the hit_record of the closest object (the lowest t value that hits an object)
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+//  and set `hit` to the closest object (the lowest t value that hits an object)
+bool hittable_list::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
     // Want to find the smallest t value (which is the closest object that was hit)
     double t_closest = t_max;
     bool hit_any_object = false;
 
-    hit_record temp_rec;
     for (const shared_ptr<hittable>& object: this->objects) {
         // Check if there is a hit object that is closer than what we've already seen
-        bool is_hit = object->hit(r, t_min, t_closest, temp_rec);
+        // (intersect() only writes `hit` when it finds a closer hit, so there is no temporary to copy)
+        bool is_hit = object->intersect(r, t_min, t_closest, hit);
         if (is_hit) {
             hit_any_object = true;
-            // Save the hit_record of this closer object
-            t_closest = temp_rec.t;
-            rec = temp_rec;
+            t_closest = hit.t;
         }
     }
 
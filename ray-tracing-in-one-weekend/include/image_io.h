@@ -0,0 +1,224 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+
+// Writing the framebuffer to image files
+// Every writer takes the whole image and writes it with a few large writes (no per-pixel formatting or flushing)
+
+// Binary PPM ("P6"): the same header as the ASCII P3 format, followed by raw RGB bytes
+bool write_ppm(std::ostream& out, const framebuffer& fb) {
+    std::vector<uint8_t> pixels = fb.resolve_8bit();
+    out << "P6\n" << fb.get_width() << ' ' << fb.get_height() << "\n255\n";
+    out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+// Portable float map (PFM): linear 32-bit float RGB, no gamma or clamping (HDR)
+// Rows are stored bottom to top, the same order as the framebuffer
+// A negative scale in the header means the floats are little-endian
+bool write_pfm(std::ostream& out, const framebuffer& fb) {
+    std::vector<float> pixels = fb.resolve_linear();
+    uint16_t endian_test = 1;
+    bool little_endian = *reinterpret_cast<uint8_t*>(&endian_test) == 1;
+    out << "PF\n" << fb.get_width() << ' ' << fb.get_height() << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+    out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float));
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+// Read a PFM file (as written by write_pfm()) into `pixels` (RGB floats, bottom row first)
+bool read_pfm(const std::string& filename, int& width, int& height, std::vector<float>& pixels) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    double scale;
+    in >> magic >> width >> height >> scale;
+    // Exactly one whitespace character separates the header from the data
+    in.get();
+    if (!in || magic != "PF" || width <= 0 || height <= 0) {
+        std::cerr << "Not an RGB PFM file: " << filename << std::endl;
+        return false;
+    }
+
+    pixels.resize(3 * static_cast<size_t>(width) * height);
+    in.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(float));
+    if (!in) {
+        std::cerr << "PFM file is too short: " << filename << std::endl;
+        return false;
+    }
+
+    // Swap the bytes if the file's endianness is not ours
+    uint16_t endian_test = 1;
+    bool little_endian = *reinterpret_cast<uint8_t*>(&endian_test) == 1;
+    if ((scale < 0) != little_endian) {
+        for (float& value : pixels) {
+            uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+    }
+    return true;
+}
+
+// How far an image is from a reference image (ex. a render with many more samples)
+struct image_error {
+    // Mean squared error of the linear values
+    double mse;
+    // Mean squared error and peak signal-to-noise ratio (dB) of the displayed values
+    //  (gamma 2 and clamped to [0, 1), as written to 8-bit images)
+    double display_mse;
+    double psnr;
+};
+
+// Compare two RGB float images of the same size (ex. framebuffer::resolve_linear() and read_pfm())
+image_error compare_images(const std::vector<float>& image, const std::vector<float>& reference) {
+    auto display = [](float v) { return std::sqrt(std::min(std::max(static_cast<double>(v), 0.0), 0.999)); };
+    double squared_error = 0.0, display_squared_error = 0.0;
+    const size_t num_values = std::min(image.size(), reference.size());
+    for (size_t k=0; k<num_values; k++) {
+        double difference = static_cast<double>(image[k]) - reference[k];
+        double display_difference = display(image[k]) - display(reference[k]);
+        squared_error += difference * difference;
+        display_squared_error += display_difference * display_difference;
+    }
+    image_error error;
+    error.mse = squared_error / std::max<size_t>(num_values, 1);
+    error.display_mse = display_squared_error / std::max<size_t>(num_values, 1);
+    error.psnr = error.display_mse > 0 ? 10.0 * std::log10(1.0 / error.display_mse) : infinity;
+    return error;
+}
+
+// PNG helpers
+// PNG stores big-endian integers and checks every chunk with a CRC-32
+// The pixel data is a zlib stream; we use "stored" (uncompressed) deflate blocks,
+//  so no compression library is needed (the file is about as big as a PPM)
+
+// CRC-32 (the polynomial used by PNG and zip)
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t length) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n=0; n<256; n++) {
+            uint32_t c = n;
+            for (int k=0; k<8; k++) {
+                c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i=0; i<length; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void append_u32_be(std::vector<uint8_t>& buffer, uint32_t value) {
+    buffer.push_back(static_cast<uint8_t>(value >> 24));
+    buffer.push_back(static_cast<uint8_t>(value >> 16));
+    buffer.push_back(static_cast<uint8_t>(value >> 8));
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+// Write one PNG chunk: length, type, data, CRC of (type + data)
+void write_png_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> chunk;
+    chunk.reserve(data.size() + 12);
+    append_u32_be(chunk, static_cast<uint32_t>(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    uint32_t crc = crc32_update(0, chunk.data() + 4, chunk.size() - 4);
+    append_u32_be(chunk, crc);
+    out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+// 8-bit RGB PNG
+bool write_png(std::ostream& out, const framebuffer& fb) {
+    const int width = fb.get_width();
+    const int height = fb.get_height();
+    std::vector<uint8_t> pixels = fb.resolve_8bit();
+
+    // Raw scanlines: each row starts with a filter type byte (0 = no filter)
+    const size_t row_bytes = 3 * static_cast<size_t>(width);
+    std::vector<uint8_t> raw;
+    raw.reserve(height * (row_bytes + 1));
+    for (int row=0; row<height; row++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), pixels.begin() + row*row_bytes, pixels.begin() + (row+1)*row_bytes);
+    }
+
+    // zlib stream: header, stored deflate blocks (at most 65535 bytes each), Adler-32 checksum
+    std::vector<uint8_t> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    size_t offset = 0;
+    do {
+        size_t block = std::min<size_t>(65535, raw.size() - offset);
+        bool last = (offset + block == raw.size());
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(static_cast<uint8_t>(block & 0xff));
+        zlib.push_back(static_cast<uint8_t>(block >> 8));
+        zlib.push_back(static_cast<uint8_t>(~block & 0xff));
+        zlib.push_back(static_cast<uint8_t>((~block >> 8) & 0xff));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + block);
+        offset += block;
+    } while (offset < raw.size());
+
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    append_u32_be(zlib, (b << 16) | a);
+
+    // Header: width, height, bit depth 8, color type 2 (RGB), compression, filter, no interlace
+    std::vector<uint8_t> header;
+    append_u32_be(header, static_cast<uint32_t>(width));
+    append_u32_be(header, static_cast<uint32_t>(height));
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    write_png_chunk(out, "IHDR", header);
+    write_png_chunk(out, "IDAT", zlib);
+    write_png_chunk(out, "IEND", {});
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+// Return true if `filename` ends with `extension`
+bool has_extension(const std::string& filename, const std::string& extension) {
+    return filename.size() >= extension.size()
+        && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// Write the framebuffer to `filename`; the format is picked by the extension (.ppm, .pfm, .png)
+// An empty filename or "-" writes a binary PPM to standard out
+bool write_image(const std::string& filename, const framebuffer& fb) {
+    if (filename.empty() || filename == "-") {
+        return write_ppm(std::cout, fb);
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "Cannot open output file: " << filename << std::endl;
+        return false;
+    }
+    if (has_extension(filename, ".pfm")) return write_pfm(out, fb);
+    if (has_extension(filename, ".png")) return write_png(out, fb);
+    return write_ppm(out, fb);
+}
+
+#endif // header guard
@@ -0,0 +1,238 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <cmath>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "material_table.h"
+#include "linear_bvh.h"
+
+// Instancing (a two-level acceleration structure)
+// Scenes often repeat the same geometry in many places (ex. the small spheres of random_scene()). Instead of
+//  a copy of the geometry per placement, the geometry is built once, in its own coordinates (object space),
+//  with its own BVH: the bottom level (BLAS). Every placement is an `instance`: a pointer to the shared
+//  geometry plus an affine transform, and the world's BVH (built by --accel as for any other objects) is the
+//  top level (TLAS) over the instances' boxes.
+// A ray that reaches an instance is moved into object space (by the inverse transform) and traced through the
+//  geometry's BVH. The direction is transformed without normalizing it, so the distance t along the ray is the
+//  same in both spaces and instances and other objects compare their hits directly.
+// Memory grows with the number of distinct geometries, plus about 380 bytes per instance: 240 for the
+//  instance itself, about 50 for its allocation and the list's pointer to it, and about 90 for its share of
+//  the linear BVH over the instances.
+
+// An affine transform: p -> linear * p + translation, as the 3x4 matrix [linear | translation]
+struct affine_transform {
+    double m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    static affine_transform translate(const vec3& offset) {
+        affine_transform t;
+        for (int i=0; i<3; i++) t.m[i][3] = offset[i];
+        return t;
+    }
+
+    static affine_transform scale(double x, double y, double z) {
+        affine_transform t;
+        t.m[0][0] = x;
+        t.m[1][1] = y;
+        t.m[2][2] = z;
+        return t;
+    }
+
+    static affine_transform scale(double s) { return scale(s, s, s); }
+
+    // Rotation by `degrees` about `axis` (counterclockwise when the axis points at the viewer)
+    static affine_transform rotate(const vec3& axis, double degrees) {
+        const vec3 a = unit_vector(axis);
+        const double theta = degrees_to_radians(degrees);
+        const double c = std::cos(theta), s = std::sin(theta), k = 1.0 - c;
+        const double x = a.x(), y = a.y(), z = a.z();
+        affine_transform t;
+        // Rodrigues' rotation formula
+        t.m[0][0] = c + x*x*k;   t.m[0][1] = x*y*k - z*s; t.m[0][2] = x*z*k + y*s;
+        t.m[1][0] = y*x*k + z*s; t.m[1][1] = c + y*y*k;   t.m[1][2] = y*z*k - x*s;
+        t.m[2][0] = z*x*k - y*s; t.m[2][1] = z*y*k + x*s; t.m[2][2] = c + z*z*k;
+        return t;
+    }
+
+    // This transform after `other` (apply `other` first)
+    affine_transform operator*(const affine_transform& other) const {
+        affine_transform t;
+        for (int i=0; i<3; i++) {
+            for (int j=0; j<4; j++) {
+                double sum = j == 3 ? this->m[i][3] : 0.0;
+                for (int k=0; k<3; k++) sum += this->m[i][k] * other.m[k][j];
+                t.m[i][j] = sum;
+            }
+        }
+        return t;
+    }
+
+    // The inverse transform; false if there is none (the linear part is singular, ex. a scale of 0)
+    bool inverse(affine_transform& out) const {
+        const double (*a)[4] = this->m;
+        const double c00 = a[1][1]*a[2][2] - a[1][2]*a[2][1];
+        const double c01 = a[1][2]*a[2][0] - a[1][0]*a[2][2];
+        const double c02 = a[1][0]*a[2][1] - a[1][1]*a[2][0];
+        const double determinant = a[0][0]*c00 + a[0][1]*c01 + a[0][2]*c02;
+        if (!(std::fabs(determinant) > 1e-300)) return false;
+        const double d = 1.0 / determinant;
+        // The inverse of the linear part is the transposed matrix of cofactors over the determinant
+        out.m[0][0] = c00 * d;
+        out.m[0][1] = (a[0][2]*a[2][1] - a[0][1]*a[2][2]) * d;
+        out.m[0][2] = (a[0][1]*a[1][2] - a[0][2]*a[1][1]) * d;
+        out.m[1][0] = c01 * d;
+        out.m[1][1] = (a[0][0]*a[2][2] - a[0][2]*a[2][0]) * d;
+        out.m[1][2] = (a[0][2]*a[1][0] - a[0][0]*a[1][2]) * d;
+        out.m[2][0] = c02 * d;
+        out.m[2][1] = (a[0][1]*a[2][0] - a[0][0]*a[2][1]) * d;
+        out.m[2][2] = (a[0][0]*a[1][1] - a[0][1]*a[1][0]) * d;
+        // and the translation is undone after the linear part: -inverse(linear) * translation
+        for (int i=0; i<3; i++) {
+            out.m[i][3] = -(out.m[i][0]*a[0][3] + out.m[i][1]*a[1][3] + out.m[i][2]*a[2][3]);
+        }
+        return true;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(
+            this->m[0][0]*p.x() + this->m[0][1]*p.y() + this->m[0][2]*p.z() + this->m[0][3],
+            this->m[1][0]*p.x() + this->m[1][1]*p.y() + this->m[1][2]*p.z() + this->m[1][3],
+            this->m[2][0]*p.x() + this->m[2][1]*p.y() + this->m[2][2]*p.z() + this->m[2][3]
+        );
+    }
+
+    // Directions and tangents (no translation)
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            this->m[0][0]*v.x() + this->m[0][1]*v.y() + this->m[0][2]*v.z(),
+            this->m[1][0]*v.x() + this->m[1][1]*v.y() + this->m[1][2]*v.z(),
+            this->m[2][0]*v.x() + this->m[2][1]*v.y() + this->m[2][2]*v.z()
+        );
+    }
+
+    // Normals go through the transposed linear part of the inverse transform; call this on the inverse
+    //  (the result is not normalized)
+    vec3 transposed_vector(const vec3& n) const {
+        return vec3(
+            this->m[0][0]*n.x() + this->m[1][0]*n.y() + this->m[2][0]*n.z(),
+            this->m[0][1]*n.x() + this->m[1][1]*n.y() + this->m[2][1]*n.z(),
+            this->m[0][2]*n.x() + this->m[1][2]*n.y() + this->m[2][2]*n.z()
+        );
+    }
+
+    // A box around the transformed box (around its 8 transformed corners)
+    aabb box(const aabb& b) const {
+        aabb result = aabb::empty();
+        for (int corner=0; corner<8; corner++) {
+            const point3 p(
+                (corner & 1) ? b.max().x() : b.min().x(),
+                (corner & 2) ? b.max().y() : b.min().y(),
+                (corner & 4) ? b.max().z() : b.min().z()
+            );
+            const point3 q = this->point(p);
+            result = surrounding_box(result, aabb(q, q));
+        }
+        return result;
+    }
+};
+
+// Geometry shared by instances (the bottom level): objects in object space with a linear BVH of their own
+// A single triangle_mesh already has its own BVH and can be instanced directly
+class bottom_level_bvh : public hittable {
+    public:
+        // Constructors
+        bottom_level_bvh(const hittable_list& objects, double time0, double time1, int num_threads=1)
+            : objects(objects), tree(objects, time0, time1, num_threads)
+        {}
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            return this->tree.intersect(r, t_min, t_max, hit);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return this->tree.bounding_box(time0, time1, output_box);
+        }
+
+        // Every instance passes this on; the objects are only registered the first time
+        virtual void register_materials(material_table& table) override {
+            if (this->registered_in == &table) return;
+            this->registered_in = &table;
+            this->objects.register_materials(table);
+        }
+
+    private:
+        // (the same objects as the tree's leaves; kept as a list to register their materials)
+        hittable_list objects;
+        linear_bvh tree;
+        const material_table* registered_in = nullptr;
+};
+
+// One placement of shared geometry
+// The geometry must not contain instances itself (one level of instancing, like one TLAS over BLASes)
+// Instances are not sampled as lights (get_material() is nullptr); emissive geometry still glows when hit
+class instance : public hittable {
+    public:
+        // Constructors
+        // `object_to_world` places the geometry in the world; with a material `m`, every surface of this
+        //  instance is made of `m` instead of the geometry's own materials
+        instance(shared_ptr<hittable> geometry, const affine_transform& object_to_world, shared_ptr<material> m=nullptr)
+            : geometry(geometry), object_to_world(object_to_world), mat_ptr(m)
+        {
+            if (!object_to_world.inverse(this->world_to_object)) {
+                std::cerr << "Instance transform has no inverse" << std::endl;
+                this->geometry = nullptr;
+            }
+        }
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            if (!this->geometry || !this->geometry->intersect(this->to_object_space(r), t_min, t_max, hit)) return false;
+            // The geometry set hit.object to what it hit; keep that for compute_interaction()
+            hit.instanced_object = hit.object;
+            hit.object = this;
+            return true;
+        }
+
+        // The interaction of the object that was hit, in object space, moved back into the world
+        // (the object only reads hit.t and hit.primitive, which are the same in both spaces)
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override {
+            hit.instanced_object->compute_interaction(this->to_object_space(r), hit, surface);
+
+            // (front_face stays right: dot(normal, direction) keeps its sign through the transform)
+            surface.p = r.at(hit.t);
+            surface.normal = unit_vector(this->world_to_object.transposed_vector(surface.normal));
+            surface.dpdu = this->object_to_world.vector(surface.dpdu);
+            surface.dpdv = this->object_to_world.vector(surface.dpdv);
+            if (this->mat_ptr) surface.material_id = this->material_id;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            aabb object_box;
+            if (!this->geometry || !this->geometry->bounding_box(time0, time1, object_box)) return false;
+            output_box = this->object_to_world.box(object_box);
+            return true;
+        }
+
+        virtual void register_materials(material_table& table) override {
+            if (this->geometry) this->geometry->register_materials(table);
+            if (this->mat_ptr) this->material_id = table.add(this->mat_ptr);
+        }
+
+    private:
+        shared_ptr<hittable> geometry;
+        affine_transform object_to_world;
+        affine_transform world_to_object;
+        // The material of this instance (nullptr: the geometry's own)
+        shared_ptr<material> mat_ptr;
+        uint32_t material_id = 0;
+
+        ray to_object_space(const ray& r) const {
+            return ray(this->world_to_object.point(r.origin()), this->world_to_object.vector(r.direction()), r.time());
+        }
+};
+
+#endif // header guard
@@ -0,0 +1,107 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <algorithm>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "material_table.h"
+#include "sampler.h"
+
+// Next-event estimation (light sampling)
+// A diffuse surface that is lit by a small light only finds it when its random bounce happens to hit it,
+//  which is why such scenes stay noisy for hundreds of samples. At every diffuse hit we also pick a point
+//  on a light and send a shadow ray to it: if nothing is in the way, the light it sees is added directly.
+// Both ways of finding a light (the bounce and the shadow ray) are kept and weighted by
+//  multiple importance sampling, with the power heuristic: each gets most of the weight where its pdf
+//  is larger (light samples for small or far lights, bounces for large lights seen up close).
+//
+// The two pdfs are over directions (per unit of solid angle) from the hit point:
+//   bounce: material::scattering_pdf()
+//   light:  the mixture pdf of the light list, (1/N) * sum of hittable::pdf_value() over the N lights
+// A shadow ray returns the emitted light of whatever it hits first, so the light samples and the bounces
+//  estimate the same integral over directions and the weights of the two add up to 1 in every direction.
+
+// The emissive objects of a scene
+class light_list {
+    public:
+        void add(shared_ptr<hittable> light) { this->lights.push_back(light); }
+        bool empty() const { return this->lights.empty(); }
+        size_t size() const { return this->lights.size(); }
+
+        // Mixture pdf of sample_direction() (each light is picked with probability 1/N)
+        double pdf_value(const point3& origin, const vec3& direction) const {
+            double sum = 0.0;
+            for (const shared_ptr<hittable>& light : this->lights) {
+                sum += light->pdf_value(origin, direction);
+            }
+            return sum / this->lights.size();
+        }
+
+        // Pick a light with `u_select` and a direction toward it with (u1, u2)
+        vec3 sample_direction(const point3& origin, double u_select, double u1, double u2) const {
+            size_t index = std::min(static_cast<size_t>(u_select * this->lights.size()), this->lights.size() - 1);
+            return this->lights[index]->sample_direction(origin, u1, u2);
+        }
+
+    private:
+        std::vector<shared_ptr<hittable>> lights;
+};
+
+// Find the objects of `world` that can be sampled as lights (see hittable::get_material())
+// Called before the objects are moved into sphere soups and BVHs, which keep no per-object material
+void gather_lights(const hittable_list& world, light_list& lights) {
+    for (const shared_ptr<hittable>& object : world.objects) {
+        if (const hittable_list* list = dynamic_cast<const hittable_list*>(object.get())) {
+            gather_lights(*list, lights);
+            continue;
+        }
+        const material* mat = object->get_material();
+        if (mat && mat->is_emissive()) lights.add(object);
+    }
+}
+
+// Power heuristic (exponent 2): the weight of a sample taken with pdf `pdf` when the other strategy
+//  could have taken it with pdf `other_pdf`
+inline double power_heuristic(double pdf, double other_pdf) {
+    double pdf_squared = pdf * pdf;
+    double other_squared = other_pdf * other_pdf;
+    return pdf_squared / (pdf_squared + other_squared);
+}
+
+// Weight of emitted light found by a bounce (`r` is the bounced ray)
+// `bounce_pdf` is the pdf of the bounce that made `r`, or 0 if the bounce could not have been
+//  replaced by a light sample (the camera ray, mirrors, glass): then it is the only way to the light
+inline double emission_weight(const light_list& lights, const ray& r, double bounce_pdf) {
+    if (bounce_pdf <= 0 || lights.empty()) return 1.0;
+    return power_heuristic(bounce_pdf, lights.pdf_value(r.origin(), r.direction()));
+}
+
+// A light sample from hit `rec`: the shadow ray toward the light, and the factor to multiply the
+//  emitted light it finds by (the surface's reflectance times the sample's weight, over its pdf)
+// Returns false if the material is not lit by light samples or the sample cannot reach the light
+// Draws one 1D and one 2D sample from this thread's sampler (whether or not it returns true),
+//  so the following bounce uses the same sample dimensions either way
+inline bool sample_light(
+    const ray& r_in, const surface_interaction& rec, const material_table& materials, const light_list& lights,
+    ray& shadow, color& factor
+) {
+    const material& mat = materials[rec.material_id];
+    double u_select = sample_bounce_1d();
+    point2 u = sample_bounce_2d();
+    vec3 direction = lights.sample_direction(rec.p, u_select, u.x, u.y);
+
+    double bounce_pdf = mat.scattering_pdf(r_in, rec, direction);
+    if (bounce_pdf <= 0) return false;
+    double light_pdf = lights.pdf_value(rec.p, direction);
+    if (light_pdf <= 0) return false;
+
+    shadow = ray(rec.p, direction, r_in.time());
+    factor = mat.albedo_at(rec) * (bounce_pdf * power_heuristic(light_pdf, bounce_pdf) / light_pdf);
+    return true;
+}
+
+#endif // header guard
@@ -0,0 +1,84 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Streaming line reader for the text formats (scene files, OBJ meshes)
+// The file is read in chunks into one buffer; every complete line of a chunk is passed to `line` as a view
+//  into the buffer (without the newline), and the unfinished last line is moved to the front for the next chunk.
+//  Files of any size are read with one 64 KiB buffer (larger only if a single line is).
+// `line` returns false to stop; for_each_line() returns false if it did, or if the file could not be read
+template <typename line_function>
+bool for_each_line(const std::string& path, const char* kind, line_function&& line) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Cannot open " << kind << ": " << path << std::endl;
+        return false;
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    size_t filled = 0;
+    bool ok = true;
+    bool at_end = false;
+    while (ok && !at_end) {
+        // A line longer than the buffer: make room for it
+        if (filled == buffer.size()) buffer.resize(2 * buffer.size());
+        size_t count = std::fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+        filled += count;
+        at_end = count == 0;
+
+        // Every complete line (and at the end of the file, the last one even without a newline)
+        size_t start = 0;
+        while (ok) {
+            const char* newline = static_cast<const char*>(std::memchr(buffer.data() + start, '\n', filled - start));
+            if (!newline && !(at_end && start < filled)) break;
+            size_t end = newline ? newline - buffer.data() : filled;
+            ok = line(std::string_view(buffer.data() + start, end - start));
+            start = newline ? end + 1 : filled;
+        }
+        std::memmove(buffer.data(), buffer.data() + start, filled - start);
+        filled -= start;
+    }
+    if (ok && std::ferror(file)) {
+        std::cerr << "Cannot read " << kind << ": " << path << std::endl;
+        ok = false;
+    }
+    std::fclose(file);
+    return ok;
+}
+
+// Splits a line into whitespace-separated tokens
+struct token_reader {
+    std::string_view rest;
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    // The next token; empty at the end of the line
+    std::string_view next() {
+        size_t i = 0;
+        while (i < this->rest.size() && is_space(this->rest[i])) i++;
+        size_t j = i;
+        while (j < this->rest.size() && !is_space(this->rest[j])) j++;
+        std::string_view token = this->rest.substr(i, j - i);
+        this->rest.remove_prefix(j);
+        return token;
+    }
+};
+
+// Parse a whole token as a number (locale-independent); false if it is not one
+template <typename T>
+bool parse_number(std::string_view token, T& value) {
+    // (from_chars does not take a leading '+')
+    if (!token.empty() && token[0] == '+') token.remove_prefix(1);
+    const char* end = token.data() + token.size();
+    std::from_chars_result result = std::from_chars(token.data(), end, value);
+    return !token.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+#endif // header guard
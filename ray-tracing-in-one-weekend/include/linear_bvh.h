@@ -0,0 +1,357 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include <cmath>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+// Round a double to a float that is not larger (min bounds) or not smaller (max bounds),
+//  so a float box always contains the double box it came from
+inline float round_down_to_float(double x) {
+    float f = static_cast<float>(x);
+    return (f > x) ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float round_up_to_float(double x) {
+    float f = static_cast<float>(x);
+    return (f < x) ? std::nextafter(f, INFINITY) : f;
+}
+
+// One node of a linear BVH: 32 bytes, so two nodes fit in a 64-byte cache line
+// The nodes are stored depth-first: an interior node's first child is the next node in the array,
+//  and `offset` is the index of its second child. A leaf refers to the primitives
+//  [offset, offset + primitive_count) of the BVH's primitive list.
+struct alignas(32) linear_bvh_node {
+    float box_min[3];
+    float box_max[3];
+    // Interior: index of the second child; leaf: index of the first primitive
+    uint32_t offset;
+    // 0 for interior nodes
+    uint16_t primitive_count;
+    // Axis the children were split along (0, 1, 2 => x, y, z)
+    uint8_t axis;
+    uint8_t padding;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+// Slab test of a ray against a node's box, with the reciprocal direction precomputed
+inline bool linear_bvh_node_hit(
+    const linear_bvh_node& node, const point3& origin, const double inverse_direction[3],
+    double t_min, double t_max
+) {
+    for (int a=0; a<3; a++) {
+        double t0 = (node.box_min[a] - origin[a]) * inverse_direction[a];
+        double t1 = (node.box_max[a] - origin[a]) * inverse_direction[a];
+        if (inverse_direction[a] < 0) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min) return false;
+    }
+    return true;
+}
+
+// Walk the nodes of a linear BVH with a loop and a fixed-size stack, nearer child first
+// For every leaf the ray reaches, calls leaf(first, count, t_max), which tests the primitives
+//  [first, first + count), lowers t_max to the closest hit and returns true if it found one
+// Returns true if any leaf did
+template <typename leaf_function>
+bool traverse_linear_bvh(
+    const std::vector<linear_bvh_node>& nodes, const ray& r, double t_min, double t_max, leaf_function&& leaf
+) {
+    if (nodes.empty()) return false;
+
+    // Precompute per ray (instead of per node): the reciprocal of the direction, and
+    //  whether the ray goes in the negative direction along each axis
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const double inverse_direction[3] = {1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z()};
+    const bool direction_is_negative[3] = {
+        inverse_direction[0] < 0, inverse_direction[1] < 0, inverse_direction[2] < 0
+    };
+
+    bool hit_anything = false;
+    // Nodes to visit later; at most one per level, and bvh_builder stops at bvh_max_depth levels
+    uint32_t stack[64];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        if (linear_bvh_node_hit(node, origin, inverse_direction, t_min, t_max)) {
+            if (node.primitive_count > 0) {
+                if (leaf(node.offset, static_cast<uint32_t>(node.primitive_count), t_max)) {
+                    hit_anything = true;
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else {
+                // Visit the child on the ray's side of the split first;
+                //  its hits shrink t_max, so the far child is often skipped
+                assert(stack_size < 64);
+                if (direction_is_negative[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+// Append the subtree of `node` to `nodes` in depth-first order; returns the index of `node`
+// Leaves keep their range of the builder's primitive_order()
+uint32_t flatten_bvh(const bvh_build_node& node, std::vector<linear_bvh_node>& nodes) {
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    {
+        linear_bvh_node& flat = nodes[index];
+        for (int a=0; a<3; a++) {
+            flat.box_min[a] = round_down_to_float(node.box.min()[a]);
+            flat.box_max[a] = round_up_to_float(node.box.max()[a]);
+        }
+        flat.axis = static_cast<uint8_t>(node.split_axis);
+        flat.padding = 0;
+        flat.primitive_count = static_cast<uint16_t>(node.primitive_count);
+        flat.offset = static_cast<uint32_t>(node.first_primitive);
+    }
+
+    if (!node.is_leaf()) {
+        // The first child goes right after this node
+        flatten_bvh(*node.children[0], nodes);
+        // (nodes may have moved; index again instead of keeping a reference)
+        nodes[index].offset = flatten_bvh(*node.children[1], nodes);
+    }
+    return index;
+}
+
+// Motion BVHs
+// The box of a moving object over the whole shutter interval is the box of everything it sweeps through:
+//  for the small, fast spheres of random_scene(), a tall column. Every node above them gets as tall, and rays
+//  test spheres that are nowhere near them at the ray's time.
+// A segmented BVH splits the shutter interval into motion_bvh_segment_count segments and keeps one copy of the
+//  nodes per segment: the same tree (so the same primitive order), with every box refit to what its primitives
+//  sweep through during that segment only. A ray walks the copy of the segment its time() falls in, with the
+//  usual slab test, so culling improves at no cost per node. (Interpolating per-node boxes at the ray's time
+//  culls a little more, but the extra work in every node test made renders slower than static boxes.)
+// The tree itself is built over the boxes of the objects at the middle of the interval, so that objects
+//  that are close to each other while they move share nodes (over the boxes of the whole interval, the
+//  long boxes of moving objects get grouped with whatever they sweep past).
+// Packets (see packet.h) hold rays of different times, so they keep using the nodes of the whole interval
+constexpr int motion_bvh_segment_count = 4;
+
+inline bool same_box(const aabb& a, const aabb& b) {
+    for (int i=0; i<3; i++) {
+        if (a.min()[i] != b.min()[i] || a.max()[i] != b.max()[i]) return false;
+    }
+    return true;
+}
+
+// Set the boxes of `nodes` (made by flatten_bvh()) from the boxes of their primitives, where leaf_boxes[i] is
+//  the box of the i-th primitive in leaf order
+void refit_linear_bvh(std::vector<linear_bvh_node>& nodes, const std::vector<aabb>& leaf_boxes) {
+    // Children come after their parent, so walking backwards finishes them first
+    for (size_t i=nodes.size(); i-- > 0; ) {
+        linear_bvh_node& node = nodes[i];
+        if (node.primitive_count > 0) {
+            aabb box = aabb::empty();
+            for (uint32_t p=node.offset; p<node.offset + node.primitive_count; p++) box = surrounding_box(box, leaf_boxes[p]);
+            for (int a=0; a<3; a++) {
+                node.box_min[a] = round_down_to_float(box.min()[a]);
+                node.box_max[a] = round_up_to_float(box.max()[a]);
+            }
+        } else {
+            const linear_bvh_node& first = nodes[i + 1];
+            const linear_bvh_node& second = nodes[node.offset];
+            for (int a=0; a<3; a++) {
+                node.box_min[a] = std::min(first.box_min[a], second.box_min[a]);
+                node.box_max[a] = std::max(first.box_max[a], second.box_max[a]);
+            }
+        }
+    }
+}
+
+// The per-segment copies of a linear BVH's nodes (see above); empty if nothing moves
+class segmented_motion_bvh {
+    public:
+        // Make the copies of `nodes` for the shutter interval [time0, time1], and refit `nodes` itself to the
+        //  whole interval (the tree may have been built over other boxes, see above)
+        // box(i, t0, t1) is the box of the i-th primitive in leaf order during [t0, t1]
+        // Nothing is kept (or refit) if every primitive's box is the same in every segment (no motion)
+        template <typename box_function>
+        void build(std::vector<linear_bvh_node>& nodes, size_t primitive_count, double time0, double time1, box_function&& box) {
+            this->clear();
+            if (nodes.empty() || !(time1 > time0)) return;
+            this->time0 = time0;
+            this->segment_length = (time1 - time0) / motion_bvh_segment_count;
+
+            std::vector<aabb> leaf_boxes[motion_bvh_segment_count];
+            bool moves = false;
+            for (int k=0; k<motion_bvh_segment_count; k++) {
+                const double start = time0 + k * this->segment_length;
+                const double end = k + 1 == motion_bvh_segment_count ? time1 : start + this->segment_length;
+                leaf_boxes[k].resize(primitive_count);
+                for (size_t i=0; i<primitive_count; i++) {
+                    leaf_boxes[k][i] = box(i, start, end);
+                    moves = moves || (k > 0 && !same_box(leaf_boxes[k][i], leaf_boxes[0][i]));
+                }
+            }
+            if (!moves) return;
+            for (int k=0; k<motion_bvh_segment_count; k++) {
+                this->segments[k] = nodes;
+                refit_linear_bvh(this->segments[k], leaf_boxes[k]);
+            }
+            for (size_t i=0; i<primitive_count; i++) leaf_boxes[0][i] = box(i, time0, time1);
+            refit_linear_bvh(nodes, leaf_boxes[0]);
+        }
+
+        bool empty() const { return this->segments[0].empty(); }
+
+        void clear() {
+            for (std::vector<linear_bvh_node>& segment : this->segments) segment.clear();
+        }
+
+        // The nodes for a ray at `time` (times outside the shutter interval use the first or last segment)
+        const std::vector<linear_bvh_node>& at(double time) const {
+            int k = static_cast<int>((time - this->time0) / this->segment_length);
+            k = k < 0 ? 0 : (k >= motion_bvh_segment_count ? motion_bvh_segment_count - 1 : k);
+            return this->segments[k];
+        }
+
+    private:
+        std::vector<linear_bvh_node> segments[motion_bvh_segment_count];
+        double time0 = 0.0;
+        double segment_length = 1.0;
+};
+
+// Flattened, cache-friendly BVH
+// Same tree as bvh_node (binned SAH, parallel build), but:
+//  * all nodes live in one contiguous array instead of separate shared_ptr allocations
+//  * leaves hold up to 4 primitives, so there are fewer nodes to visit
+//  * traversal is a loop with a fixed-size stack instead of recursion, visits the nearer child first,
+//    and makes no virtual calls until it reaches a leaf
+// With `motion`, moving objects also get per-segment boxes (see segmented_motion_bvh)
+class linear_bvh : public hittable {
+    public:
+        // Constructors
+        linear_bvh(const hittable_list& list, double time0, double time1, int num_threads=1, bool motion=false) {
+            std::vector<aabb> boxes(list.objects.size());
+            for (size_t i=0; i<list.objects.size(); i++) {
+                if (!list.objects[i]->bounding_box(time0, time1, boxes[i])) {
+                    std::cerr << "No bounding box in linear_bvh constructor" << std::endl;
+                }
+            }
+
+            // Moving objects are placed in the tree by where they are in the middle of the interval
+            //  (see segmented_motion_bvh); the nodes are refit to the whole interval after the build
+            std::vector<aabb> build_boxes;
+            if (motion && time1 > time0) {
+                const double middle = 0.5 * (time0 + time1);
+                bool moves = false;
+                build_boxes.resize(boxes.size());
+                for (size_t i=0; i<list.objects.size(); i++) {
+                    list.objects[i]->bounding_box(middle, middle, build_boxes[i]);
+                    moves = moves || !same_box(build_boxes[i], boxes[i]);
+                }
+                if (!moves) build_boxes.clear();
+            }
+
+            bvh_builder::options opts;
+            opts.max_leaf_size = 4;
+            opts.num_threads = num_threads;
+            bvh_builder builder(build_boxes.empty() ? boxes : build_boxes, opts);
+            std::unique_ptr<bvh_build_node> root = builder.build();
+            this->stats = builder.stats();
+            if (!root) return;
+
+            for (size_t index : builder.primitive_order()) {
+                this->objects.push_back(list.objects[index]);
+                this->primitives.push_back(list.objects[index].get());
+            }
+            this->nodes.reserve(this->stats.interior_nodes + this->stats.leaf_nodes);
+            flatten_bvh(*root, this->nodes);
+            this->box = root->box;
+
+            if (!build_boxes.empty()) {
+                this->motion.build(this->nodes, this->primitives.size(), time0, time1, [this](size_t i, double t0, double t1) {
+                    aabb box;
+                    this->primitives[i]->bounding_box(t0, t1, box);
+                    return box;
+                });
+                this->box = aabb::empty();
+                for (const aabb& b : boxes) this->box = surrounding_box(this->box, b);
+            }
+        }
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            const std::vector<linear_bvh_node>& nodes = this->motion.empty() ? this->nodes : this->motion.at(r.time());
+            return traverse_linear_bvh(nodes, r, t_min, t_max, [&](uint32_t first, uint32_t count, double& t_closest) {
+                // Leaf: test the primitives; every hit shrinks t_closest
+                bool hit_leaf = false;
+                for (uint32_t i=0; i<count; i++) {
+                    if (this->primitives[first + i]->intersect(r, t_min, t_closest, hit)) {
+                        hit_leaf = true;
+                        t_closest = hit.t;
+                    }
+                }
+                return hit_leaf;
+            });
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = this->box;
+            return true;
+        }
+
+        // The node array (for the whole shutter interval) and leaf primitives, for other traversals (see packet.h)
+        const std::vector<linear_bvh_node>& get_nodes() const { return this->nodes; }
+        const hittable* get_primitive(size_t index) const { return this->primitives[index]; }
+        bool has_motion_segments() const { return !this->motion.empty(); }
+
+        bvh_build_stats stats;
+
+    private:
+        std::vector<linear_bvh_node> nodes;
+        // The same nodes per segment of the shutter interval, if the objects move
+        segmented_motion_bvh motion;
+        // The primitives in leaf order; `objects` owns them, `primitives` is what traversal reads
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<const hittable*> primitives;
+        aabb box;
+};
+
+// Put the objects of `list` in a linear BVH (see build_bvh() in bvh.h), with motion segments if `motion`
+hittable_list build_linear_bvh(const hittable_list& list, double time0, double time1, int num_threads, bool motion=false) {
+    hittable_list bounded, result;
+    aabb box;
+    for (const shared_ptr<hittable>& object : list.objects) {
+        if (object->bounding_box(time0, time1, box)) {
+            bounded.add(object);
+        } else {
+            result.add(object);
+        }
+    }
+    if (bounded.objects.empty()) return list;
+
+    shared_ptr<linear_bvh> tree = make_shared<linear_bvh>(bounded, time0, time1, num_threads, motion);
+    tree->stats.print(std::cerr, tree->has_motion_segments() ? "Linear BVH (motion segments)" : "Linear BVH");
+    result.add(tree);
+    return result;
+}
+
+#endif // header guard
@@ -0,0 +1,99 @@
+#ifndef LOW_DISCREPANCY_H
+#define LOW_DISCREPANCY_H
+
+#include <cstdint>
+
+#include "rng.h"
+
+// Building blocks for low-discrepancy (quasi-Monte Carlo) samplers
+// Points are 32-bit fixed-point numbers: the most significant bit is the first binary digit after the point
+//  ex. 0x80000000 = 0.5, 0x40000000 = 0.25
+
+// 2^-32; converts a 32-bit fixed-point number to a double in [0, 1)
+const double one_over_2_to_32 = 0x1p-32;
+
+// Reverse the order of the bits (bit 0 <-> bit 31, bit 1 <-> bit 30, ...)
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// First dimension of the Sobol sequence (the van der Corput sequence in base 2)
+// The binary digits of the index are mirrored around the point: 1 -> 0.1b, 2 -> 0.01b, 3 -> 0.11b, ...
+inline uint32_t sobol_dimension_0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+// Second dimension of the Sobol sequence
+// Kollig and Keller, "Efficient Multidimensional Sampling" (2002)
+inline uint32_t sobol_dimension_1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) result ^= v;
+    }
+    return result;
+}
+
+// Hash-based approximation of a random base-2 Owen scramble
+// Each binary digit is flipped (or not) depending only on the digits above it,
+//  so the scrambled points keep the stratification of the original points
+//  but look random from one seed to the next
+// Burley, "Practical Hash-based Owen Scrambling" (2020)
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    // In reversed bit order, the Laine-Karras permutation only lets lower bits affect higher bits
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Return the i-th element of a random permutation of [0, length), chosen by `seed`
+// Every i in [0, length) maps to a different element, without storing the permutation
+// Kensler, "Correlated Multi-Jittered Sampling" (2013)
+inline uint32_t permutation_element(uint32_t i, uint32_t length, uint32_t seed) {
+    // Smallest (power of two - 1) that covers every index
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+
+    // Hash within [0, w] until the result lands inside [0, length) ("cycle walking")
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+
+    return (i + seed) % length;
+}
+
+// A uniform number in [0, 1) from a hash value
+inline double hash_to_unit(uint64_t h) {
+    return static_cast<uint32_t>(h >> 32) * one_over_2_to_32;
+}
+
+#endif // header guard
@@ -3,10 +3,11 @@
 
 #include "texture.h"
 #include "rtweekend.h"
+#include "sampler.h"
 
 // Forward declaration (tells the C++ compiler that the actual definition
 // is going to be defined in a different file)
-struct hit_record;
+struct surface_interaction;
 
 // The material defines how the incident (incoming) ray is reflected/absored.
 // (how the ray interacts with the surface)
@@ -17,7 +18,7 @@ class material {
         // = 0 means pure virtual function
         // Return true if the reflected ray is outside the surface ???
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const surface_interaction& rec, color& attenuation, ray& scattered
         ) const = 0;
 
         // By default, don't have the material emit any light
@@ -25,6 +26,37 @@ class material {
             // Return black
             return color(0,0,0);
         }
+
+        // The surface's own color at the hit point, without any lighting (for the denoiser's albedo buffer)
+        // By default white: the material does not tint the light (ex. glass)
+        virtual color albedo_at(const surface_interaction& rec) const {
+            return color(1,1,1);
+        }
+
+        // Mirrors and glass: what the camera sees on them is another surface, so the denoiser's
+        //  feature buffers follow the ray to it. Returns true and the direction most of the light
+        //  comes from (without randomness) for such materials; false for everything else
+        virtual bool specular_ray(const ray& r_in, const surface_interaction& rec, ray& out) const {
+            return false;
+        }
+
+        // Light sampling (see lights.h)
+        // True for materials that emit light, so the objects made of them are sampled as lights
+        virtual bool is_emissive() const {
+            return false;
+        }
+
+        // The probability density, per unit of solid angle, that scatter() sends the ray to `direction`
+        // 0 for materials that are not lit by light samples: their scatter() picks directions
+        //  that a light sample would almost never match (mirrors, glass, fuzzy metal)
+        // Materials that return a density also have to scatter with attenuation albedo_at(), so that
+        //  albedo_at() * scattering_pdf() is the light they reflect toward the incoming ray (BRDF * cosine)
+        virtual double scattering_pdf(const ray& r_in, const surface_interaction& rec, const vec3& direction) const {
+            return 0.0;
+        }
+
+        // Register the textures that the material's textures refer to (see texture_table in texture.h)
+        virtual void register_textures(texture_table& table) {}
 };
 
 // Diffuse materials (ray is randomly scattered)
@@ -45,9 +77,11 @@ class lambertian: public material {
 
         // Reflect in random direction (not influenced by the incoming ray)
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const surface_interaction& rec, color& attenuation, ray& scattered
         ) const override {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
+            // The random unit vector comes from the sampler's bounce dimensions
+            point2 bounce = sample_bounce_2d();
+            vec3 scatter_direction = rec.normal + sample_unit_vector(bounce.x, bounce.y);
             
             // If the vector is close to zero (which could result in undefined behavior later)
             // then use the normal vector
@@ -58,9 +92,29 @@ class lambertian: public material {
             scattered = ray(rec.p, scatter_direction, r_in.time());
             // If the texture is a solid color, the hit record values are not used
             //  and a solid color is returned
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            attenuation = this->albedo_at(rec);
             return true;
         }
+
+        // (image textures are averaged over the pixel's footprint, when the ray had differentials)
+        virtual color albedo_at(const surface_interaction& rec) const override {
+            texture_footprint footprint;
+            footprint.dudx = rec.dudx;
+            footprint.dvdx = rec.dvdx;
+            footprint.dudy = rec.dudy;
+            footprint.dvdy = rec.dvdy;
+            return this->albedo->filtered_value(rec.u, rec.v, rec.p, footprint);
+        }
+
+        // scatter() picks normal + a random unit vector: cosine-weighted directions, cos(theta) / pi
+        virtual double scattering_pdf(const ray& r_in, const surface_interaction& rec, const vec3& direction) const override {
+            double cosine = dot_product(rec.normal, unit_vector(direction));
+            return cosine > 0 ? cosine / pi : 0.0;
+        }
+
+        virtual void register_textures(texture_table& table) override {
+            this->albedo->register_textures(table);
+        }
 };
 
 // The angle between the incoming ray and the normal will be equal to
@@ -86,7 +140,7 @@ class metal : public material {
 
         // Implement virtual/abstract method
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const surface_interaction& rec, color& attenuation, ray& scattered
         ) const override {
             // The direction of the reflected ray
             // r_in might not be a unit vector
@@ -103,6 +157,17 @@ class metal : public material {
             bool is_outside_surface = dot_product(scattered.direction(), rec.normal) > 0;
             return is_outside_surface;
         }
+
+        virtual color albedo_at(const surface_interaction& rec) const override {
+            return this->albedo;
+        }
+
+        // (fuzzy metal blurs its reflection enough to count as a surface of its own)
+        virtual bool specular_ray(const ray& r_in, const surface_interaction& rec, ray& out) const override {
+            if (this->fuzz >= 0.1) return false;
+            out = ray(rec.p, reflect(unit_vector(r_in.direction()), rec.normal), r_in.time());
+            return true;
+        }
 };
 
 // Dielectric (water, glass); materials that refract light
@@ -116,7 +181,7 @@ class dielectric : public material {
 
         // Implemented virtual functions
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const surface_interaction& rec, color& attenuation, ray& scattered
         ) const override {
             // Always white, since the glass surface absorbs nothing
             attenuation = color(1.0, 1.0, 1.0);
@@ -148,6 +213,19 @@ class dielectric : public material {
             return true;
         }
 
+        // Refraction when there is one (most of the light, except at grazing angles), otherwise reflection
+        virtual bool specular_ray(const ray& r_in, const surface_interaction& rec, ray& out) const override {
+            double refraction_ratio = rec.front_face ? (1.0/this->ir) : this->ir;
+            vec3 unit_direction = unit_vector(r_in.direction());
+            double cos_theta = fmin(dot_product(-1 * unit_direction, rec.normal), 1.0);
+            double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+            vec3 direction = refraction_ratio * sin_theta > 1.0
+                ? reflect(unit_direction, rec.normal)
+                : refract(unit_direction, rec.normal, refraction_ratio);
+            out = ray(rec.p, direction, r_in.time());
+            return true;
+        }
+
     private:
         // Glass has reflectivity that depends on the angle of view(?)
         // Schlick Approximation
@@ -176,7 +254,7 @@ class diffuse_light: public material {
         // Implement abtract base class methods
         // Material performs no reflection
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const surface_interaction& rec, color& attenuation, ray& scattered
         ) const override {
             return false;
         }
@@ -184,6 +262,14 @@ class diffuse_light: public material {
         virtual color emitted(double u, double v, const point3& p) const override {
             return this->emit->value(u, v, p);
         }
-}
+
+        virtual bool is_emissive() const override {
+            return true;
+        }
+
+        virtual void register_textures(texture_table& table) override {
+            this->emit->register_textures(table);
+        }
+};
 
 #endif // header guard
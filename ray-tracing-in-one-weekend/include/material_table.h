@@ -0,0 +1,60 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "material.h"
+
+// The materials of a scene, addressed by 32-bit IDs
+// The scene functions make materials with make_shared<>(), and every object keeps its shared_ptr.
+// Before rendering, register_materials() adds them all to one table and gives each object the ID of its
+//  material. From then on, hits only carry the ID (surface_interaction::material_id) and the renderer looks the
+//  material up in the table: copying a hit record no longer copies a shared_ptr, whose reference count
+//  is an atomic that every thread increments and decrements on every closer hit.
+// The table is not changed during rendering, so all threads read it without locks or atomics.
+// It also holds the textures that other textures refer to (see texture_table in texture.h), which keep a
+//  pointer to it: the table must stay where it is while the scene is used
+class material_table {
+    public:
+        // Constructors
+        material_table() = default;
+        // (not copyable: the textures point to this table's texture_table)
+        material_table(const material_table&) = delete;
+        material_table& operator=(const material_table&) = delete;
+
+        // The ID of `mat`, adding it if it is new (objects that share a material share its ID)
+        uint32_t add(const shared_ptr<material>& mat) {
+            auto found = this->lookup.find(mat.get());
+            if (found != this->lookup.end()) return found->second;
+            mat->register_textures(this->textures);
+            uint32_t id = static_cast<uint32_t>(this->materials.size());
+            this->materials.push_back(mat);
+            this->pointers.push_back(mat.get());
+            this->lookup[mat.get()] = id;
+            return id;
+        }
+
+        // Make room for `count` more materials (ex. before adding those of a scene file)
+        void reserve(size_t count) {
+            count += this->size();
+            this->materials.reserve(count);
+            this->pointers.reserve(count);
+            this->lookup.reserve(count);
+        }
+
+        const material& operator[](uint32_t id) const { return *this->pointers[id]; }
+        size_t size() const { return this->pointers.size(); }
+
+    private:
+        // The table keeps the materials alive
+        std::vector<shared_ptr<material>> materials;
+        // (the same materials as plain pointers: a lookup is one load from this array)
+        std::vector<const material*> pointers;
+        std::unordered_map<const material*, uint32_t> lookup;
+        texture_table textures;
+};
+
+#endif // header guard
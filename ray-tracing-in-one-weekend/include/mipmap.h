@@ -0,0 +1,153 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+// Mip pyramid of an RGB image
+// Level 0 is the image; every next level is half the size, each texel the average of 2x2 texels of the level
+//  below it, down to 1x1. A lookup that covers n texels of level 0 reads level log2(n) instead, so a far away
+//  texture is averaged over the pixel's footprint (no aliasing) and only touches a small, cached level.
+//
+// Each level is stored as linear float RGB in 8x8 tiles: the tiles go row by row, and the 64 texels of a tile
+//  go in Morton (Z) order. A bilinear lookup reads a 2x2 block of texels, which is then (almost always) in one
+//  tile: 768 bytes, instead of two rows that are a whole image row apart.
+class mipmap {
+    public:
+        // Constructors
+        mipmap() {}
+        // `texels`: width * height linear RGB texels (3 floats each), row by row from the top
+        mipmap(int width, int height, const std::vector<float>& texels) {
+            int level_width = width;
+            int level_height = height;
+            std::vector<float> rows = texels;
+            while (true) {
+                this->pyramid.push_back(make_level(level_width, level_height, rows));
+                if (level_width == 1 && level_height == 1) break;
+                rows = downsample(level_width, level_height, rows);
+                level_width = std::max(1, level_width / 2);
+                level_height = std::max(1, level_height / 2);
+            }
+        }
+
+        bool empty() const { return this->pyramid.empty(); }
+        int levels() const { return static_cast<int>(this->pyramid.size()); }
+        int width() const { return this->pyramid.empty() ? 0 : this->pyramid[0].width; }
+        int height() const { return this->pyramid.empty() ? 0 : this->pyramid[0].height; }
+
+        // The color at (s, t) in [0, 1] (t = 0 is the top row), averaged over a footprint `texel_width`
+        //  texels of level 0 wide: bilinear in the two levels around log2(texel_width), and linear between them
+        //  (trilinear filtering). A footprint of 1 texel or less is a bilinear lookup of level 0.
+        color lookup(double s, double t, double texel_width) const {
+            if (this->pyramid.empty()) return color(0,0,0);
+            const int last = this->levels() - 1;
+            if (!(texel_width > 1.0)) return this->bilinear(0, s, t);
+
+            double level = std::log2(texel_width);
+            if (level >= last) return this->bilinear(last, s, t);
+            int below = static_cast<int>(level);
+            double delta = level - below;
+            return (1.0 - delta) * this->bilinear(below, s, t) + delta * this->bilinear(below + 1, s, t);
+        }
+
+        // The color at (s, t) interpolated between the 4 nearest texels of one level
+        color bilinear(int level_index, double s, double t) const {
+            const level& lvl = this->pyramid[level_index];
+            // Texel centers are at half-integer coordinates
+            double x = s * lvl.width - 0.5;
+            double y = t * lvl.height - 0.5;
+            double x_floor = std::floor(x);
+            double y_floor = std::floor(y);
+            double dx = x - x_floor;
+            double dy = y - y_floor;
+            // (the edges clamp: the texture does not repeat)
+            int x0 = clamp_index(static_cast<int>(x_floor), lvl.width);
+            int x1 = clamp_index(static_cast<int>(x_floor) + 1, lvl.width);
+            int y0 = clamp_index(static_cast<int>(y_floor), lvl.height);
+            int y1 = clamp_index(static_cast<int>(y_floor) + 1, lvl.height);
+
+            return (1.0 - dy) * ((1.0 - dx) * lvl.texel(x0, y0) + dx * lvl.texel(x1, y0))
+                + dy * ((1.0 - dx) * lvl.texel(x0, y1) + dx * lvl.texel(x1, y1));
+        }
+
+    private:
+        static constexpr int tile_size = 8;
+        static constexpr int tile_shift = 3;
+
+        struct level {
+            int width = 0;
+            int height = 0;
+            // Number of tiles in a row of tiles
+            int tiles_x = 0;
+            // 3 floats per texel, tile by tile (see index())
+            std::vector<float> texels;
+
+            // Offset of texel (x, y) in `texels`: its tile, then its Morton index in the tile
+            size_t index(int x, int y) const {
+                size_t tile = static_cast<size_t>(y >> tile_shift) * this->tiles_x + (x >> tile_shift);
+                uint32_t in_tile = morton_bits[x & (tile_size - 1)] | (morton_bits[y & (tile_size - 1)] << 1);
+                return 3 * ((tile << (2 * tile_shift)) | in_tile);
+            }
+
+            color texel(int x, int y) const {
+                const float* rgb = this->texels.data() + this->index(x, y);
+                return color(rgb[0], rgb[1], rgb[2]);
+            }
+        };
+
+        // The bits of 0..7 spread out to every other bit (0b101 -> 0b10001), to interleave x and y
+        static constexpr uint32_t morton_bits[tile_size] = {0, 1, 4, 5, 16, 17, 20, 21};
+
+        std::vector<level> pyramid;
+
+        static int clamp_index(int i, int size) {
+            return i < 0 ? 0 : (i >= size ? size - 1 : i);
+        }
+
+        // Copy a row-by-row level into tiles (the last row and column of tiles is padded)
+        static level make_level(int width, int height, const std::vector<float>& rows) {
+            level lvl;
+            lvl.width = width;
+            lvl.height = height;
+            lvl.tiles_x = (width + tile_size - 1) / tile_size;
+            int tiles_y = (height + tile_size - 1) / tile_size;
+            lvl.texels.assign(3 * static_cast<size_t>(lvl.tiles_x) * tiles_y * tile_size * tile_size, 0.0f);
+            for (int y=0; y<height; y++) {
+                for (int x=0; x<width; x++) {
+                    const float* source = rows.data() + 3 * (static_cast<size_t>(y) * width + x);
+                    std::copy(source, source + 3, lvl.texels.data() + lvl.index(x, y));
+                }
+            }
+            return lvl;
+        }
+
+        // Next level, row by row: every texel is the average of a 2x2 block
+        //  (an odd last row or column is left out; a side of 1 texel stays 1 texel)
+        static std::vector<float> downsample(int width, int height, const std::vector<float>& rows) {
+            const int next_width = std::max(1, width / 2);
+            const int next_height = std::max(1, height / 2);
+            std::vector<float> next(3 * static_cast<size_t>(next_width) * next_height);
+            for (int y=0; y<next_height; y++) {
+                const int y0 = std::min(2*y, height - 1);
+                const int y1 = std::min(2*y + 1, height - 1);
+                for (int x=0; x<next_width; x++) {
+                    const int x0 = std::min(2*x, width - 1);
+                    const int x1 = std::min(2*x + 1, width - 1);
+                    for (int c=0; c<3; c++) {
+                        float sum = rows[3 * (static_cast<size_t>(y0) * width + x0) + c]
+                            + rows[3 * (static_cast<size_t>(y0) * width + x1) + c]
+                            + rows[3 * (static_cast<size_t>(y1) * width + x0) + c]
+                            + rows[3 * (static_cast<size_t>(y1) * width + x1) + c];
+                        next[3 * (static_cast<size_t>(y) * next_width + x) + c] = 0.25f * sum;
+                    }
+                }
+            }
+            return next;
+        }
+};
+
+#endif // header guard
@@ -3,6 +3,8 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "material_table.h"
+#include "sphere.h"
 
 
 // A sphere that has its center move linearly from center0 at time0
@@ -17,6 +19,8 @@ class moving_sphere : public hittable {
         double radius;
         // The material of the sphere
         shared_ptr<material> mat_ptr;
+        // Its ID in the scene's material table
+        uint32_t material_id = 0;
 
         moving_sphere() {}
         moving_sphere(
@@ -28,8 +32,12 @@ class moving_sphere : public hittable {
         radius(radius), mat_ptr(mat_ptr) {};
 
         // Abstract method to override
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->mat_ptr);
+        }
         
         // Return the center of the sphere at timestamp `time`
         point3 center(double time) const;
@@ -51,9 +59,9 @@ point3 moving_sphere::center(double time) const {
     return this->center0 + distance;
 }
 
-// Implementation of the virtual function hit()
-// Nearly identical to the hit() method in sphere.h, but we get the center at timestamp `time`
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Implementation of the virtual function intersect()
+// Nearly identical to the intersect() method in sphere.h, but we get the center at timestamp `time`
+bool moving_sphere::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
     // Get the current center at the time the ray was shot
     point3 current_center = this->center(r.time());
     vec3 oc = r.origin() - current_center;
@@ -85,18 +93,29 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
         }
     }
 
-    // A valid intersection is found, populate the hit_record that describes this intersection
+    // A valid intersection is found
     // `t` is the point on the ray where it hit the sphere
-    rec.t = root;
-    rec.p = r.at(rec.t);
+    hit.t = root;
+    hit.object = this;
+    hit.primitive = 0;
+
+    return true;
+}
+
+// Populate the surface interaction of the closest intersection
+void moving_sphere::compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {
+    // (the center at the time the ray was shot, as in intersect())
+    point3 current_center = this->center(r.time());
+    surface.p = r.at(hit.t);
     
     // Normalize the normal vector
-    auto outward_normal = (rec.p - current_center) / radius;
+    auto outward_normal = (surface.p - current_center) / radius;
     
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = this->mat_ptr;
-
-    return true;
+    surface.set_face_normal(r, outward_normal);
+    // Texture coordinates around the current center, as for a sphere that does not move
+    sphere::get_sphere_uv(outward_normal, surface.u, surface.v);
+    sphere_uv_partials(outward_normal, this->radius, surface.dpdu, surface.dpdv);
+    surface.material_id = this->material_id;
 }
 
 // Compute the bounding box that encapsulates all positions of this sphere
@@ -0,0 +1,382 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <typeinfo>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "sphere.h"
+#include "sphere_soup.h"
+#include "wide_bvh.h"
+#include "simd.h"
+
+// Ray packets
+// Camera rays of neighbouring pixels start at (about) the same point and go in (about) the same direction,
+//  so they visit mostly the same BVH nodes. A packet traces N of them together: each node is fetched once
+//  for the whole packet, and its box is tested against all N rays with SIMD instructions. Spheres in the
+//  leaves are tested against the rays of the packet with SIMD instructions too (AVX2, double precision).
+//  A sphere soup in a leaf is entered by the packet as well: its own nodes are tested against the packet,
+//  and each ray that reaches one of its leaves tests that batch of spheres at once (see sphere_soup.h).
+// The camera rays are traced this way, and so are the shadow rays from their first hits toward the lights
+//  (see lights.h), which start close together and head for the same few lights. After a bounce the rays go
+//  in unrelated directions and are traced one at a time again.
+
+// Up to N rays; lanes [size, N) are unused
+template <int N>
+struct ray_packet {
+    ray_differential rays[N];
+    int size = 0;
+};
+
+// The rays of a packet as structure-of-arrays floats, for the slab tests
+// t_max of an unused lane (or a lane that cannot hit anything closer) is -inf, so its tests always fail
+template <int N>
+struct alignas(32) packet_slab_data {
+    float origin[3][N];
+    float inverse_direction[3][N];
+    float t_max[N];
+};
+
+// The rays of a packet as structure-of-arrays doubles, for the sphere tests
+template <int N>
+struct alignas(32) packet_ray_data {
+    double origin[3][N];
+    double direction[3][N];
+};
+
+// Slab test of a node's box against every ray of the packet; returns a bit mask of the lanes that hit it
+// As in wide_bvh.h, all versions do the same float operations in the same order
+template <int N>
+uint32_t packet_node_hit_scalar(const linear_bvh_node& node, const packet_slab_data<N>& data, float t_min) {
+    uint32_t mask = 0;
+    for (int k=0; k<N; k++) {
+        float t0 = t_min;
+        float t1 = data.t_max[k];
+        for (int a=0; a<3; a++) {
+            float ta = (node.box_min[a] - data.origin[a][k]) * data.inverse_direction[a][k];
+            float tb = (node.box_max[a] - data.origin[a][k]) * data.inverse_direction[a][k];
+            float t_enter = ta < tb ? ta : tb;
+            float t_exit = (ta > tb ? ta : tb) * wide_bvh_exit_scale;
+            t0 = t_enter > t0 ? t_enter : t0;
+            t1 = t_exit < t1 ? t_exit : t1;
+        }
+        if (t0 <= t1) mask |= 1u << k;
+    }
+    return mask;
+}
+
+#if RT_X86_SIMD
+// SSE: 4 rays per instruction
+template <int N>
+uint32_t packet_node_hit_sse(const linear_bvh_node& node, const packet_slab_data<N>& data, float t_min) {
+    const __m128 exit_scale = _mm_set1_ps(wide_bvh_exit_scale);
+    uint32_t mask = 0;
+    for (int c=0; c<N; c+=4) {
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_load_ps(data.t_max + c);
+        for (int a=0; a<3; a++) {
+            const __m128 origin = _mm_load_ps(data.origin[a] + c);
+            const __m128 inverse_direction = _mm_load_ps(data.inverse_direction[a] + c);
+            __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.box_min[a]), origin), inverse_direction);
+            __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.box_max[a]), origin), inverse_direction);
+            __m128 t_enter = _mm_min_ps(ta, tb);
+            __m128 t_exit = _mm_mul_ps(_mm_max_ps(ta, tb), exit_scale);
+            t0 = _mm_max_ps(t_enter, t0);
+            t1 = _mm_min_ps(t_exit, t1);
+        }
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << c;
+    }
+    return mask;
+}
+
+// AVX2: 8 rays per instruction (packets of 8 and 16)
+template <int N>
+RT_TARGET_AVX2
+uint32_t packet_node_hit_avx2(const linear_bvh_node& node, const packet_slab_data<N>& data, float t_min) {
+    const __m256 exit_scale = _mm256_set1_ps(wide_bvh_exit_scale);
+    uint32_t mask = 0;
+    for (int c=0; c<N; c+=8) {
+        __m256 t0 = _mm256_set1_ps(t_min);
+        __m256 t1 = _mm256_load_ps(data.t_max + c);
+        for (int a=0; a<3; a++) {
+            const __m256 origin = _mm256_load_ps(data.origin[a] + c);
+            const __m256 inverse_direction = _mm256_load_ps(data.inverse_direction[a] + c);
+            __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.box_min[a]), origin), inverse_direction);
+            __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.box_max[a]), origin), inverse_direction);
+            __m256 t_enter = _mm256_min_ps(ta, tb);
+            __m256 t_exit = _mm256_mul_ps(_mm256_max_ps(ta, tb), exit_scale);
+            t0 = _mm256_max_ps(t_enter, t0);
+            t1 = _mm256_min_ps(t_exit, t1);
+        }
+        mask |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))) << c;
+    }
+    return mask;
+}
+
+// Closest-hit test of a sphere against the rays `mask` of the packet, 4 rays per instruction
+// These are the double operations of sphere::intersect() in the same order (and with its NaN behaviour:
+//  !(root < t_min || root > t_max) is the unordered comparisons), so every ray finds exactly the hit
+//  it finds on its own. Returns the mask of the rays that hit within [t_min, t_max[k]], at t_hit[k].
+template <int N>
+RT_TARGET_AVX2
+uint32_t packet_sphere_hit_avx2(
+    const sphere& s, const packet_ray_data<N>& rays, double t_min, const double* t_max, uint32_t mask, double* t_hit
+) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d minimum = _mm256_set1_pd(t_min);
+    const __m256d radius_squared = _mm256_set1_pd(s.radius * s.radius);
+    uint32_t hits = 0;
+    for (int c=0; c<N; c+=4) {
+        if (((mask >> c) & 0xf) == 0) continue;
+        // a = |direction|^2, half_b = dot(direction, origin - center), |origin - center|^2
+        __m256d a = zero, half_b = zero, oc_squared = zero;
+        for (int axis=0; axis<3; axis++) {
+            const __m256d direction = _mm256_load_pd(rays.direction[axis] + c);
+            const __m256d oc = _mm256_sub_pd(_mm256_load_pd(rays.origin[axis] + c), _mm256_set1_pd(s.center[axis]));
+            a = _mm256_add_pd(a, _mm256_mul_pd(direction, direction));
+            half_b = _mm256_add_pd(half_b, _mm256_mul_pd(direction, oc));
+            oc_squared = _mm256_add_pd(oc_squared, _mm256_mul_pd(oc, oc));
+        }
+        const __m256d c_term = _mm256_sub_pd(oc_squared, radius_squared);
+        const __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c_term));
+        const __m256d sqrt_discriminant = _mm256_sqrt_pd(discriminant);
+        const __m256d minus_half_b = _mm256_xor_pd(half_b, sign);
+        const __m256d first_root = _mm256_div_pd(_mm256_sub_pd(minus_half_b, sqrt_discriminant), a);
+        const __m256d second_root = _mm256_div_pd(_mm256_add_pd(minus_half_b, sqrt_discriminant), a);
+
+        const __m256d maximum = _mm256_loadu_pd(t_max + c);
+        const __m256d first_in = _mm256_and_pd(
+            _mm256_cmp_pd(first_root, minimum, _CMP_NLT_UQ), _mm256_cmp_pd(first_root, maximum, _CMP_NGT_UQ)
+        );
+        const __m256d second_in = _mm256_and_pd(
+            _mm256_cmp_pd(second_root, minimum, _CMP_NLT_UQ), _mm256_cmp_pd(second_root, maximum, _CMP_NGT_UQ)
+        );
+        const __m256d hit = _mm256_and_pd(
+            _mm256_cmp_pd(discriminant, zero, _CMP_NLT_UQ), _mm256_or_pd(first_in, second_in)
+        );
+        _mm256_storeu_pd(t_hit + c, _mm256_blendv_pd(second_root, first_root, first_in));
+        hits |= static_cast<uint32_t>(_mm256_movemask_pd(hit)) << c;
+    }
+    return hits & mask;
+}
+#endif
+
+template <int N>
+uint32_t packet_node_hit(const linear_bvh_node& node, const packet_slab_data<N>& data, float t_min, simd_level level) {
+#if RT_X86_SIMD
+    if constexpr (N % 8 == 0) {
+        if (level == simd_level::avx2) return packet_node_hit_avx2<N>(node, data, t_min);
+    }
+    if (level != simd_level::scalar) return packet_node_hit_sse<N>(node, data, t_min);
+#endif
+    return packet_node_hit_scalar<N>(node, data, t_min);
+}
+
+// The rays of a packet as slab test data, each only tested against boxes closer than t_max[k]
+template <int N>
+void fill_slab_data(const ray_packet<N>& packet, const double* t_max, packet_slab_data<N>& data) {
+    for (int k=0; k<N; k++) {
+        const bool used = k < packet.size;
+        for (int a=0; a<3; a++) {
+            data.origin[a][k] = used ? static_cast<float>(packet.rays[k].origin()[a]) : 0.0f;
+            data.inverse_direction[a][k] = used ? 1.0f / static_cast<float>(packet.rays[k].direction()[a]) : 1.0f;
+        }
+        data.t_max[k] = used ? round_up_to_float(t_max[k]) : -infinity;
+    }
+}
+
+// Walk the nodes of a linear BVH with the rays `lanes` of a packet
+// For every leaf that some of them reach, calls leaf(first, count, mask) with the mask of those rays; the leaf
+//  lowers data.t_max of the rays that hit something, so they skip the boxes behind it
+template <int N, typename leaf_function>
+void traverse_packet(
+    const std::vector<linear_bvh_node>& nodes, const ray_packet<N>& packet, const packet_slab_data<N>& data,
+    float t_min, uint32_t lanes, simd_level level, leaf_function&& leaf
+) {
+    if (nodes.empty() || lanes == 0) return;
+
+    // The packet visits the children in the order that suits its first ray
+    const vec3 first_direction = packet.rays[__builtin_ctz(lanes)].direction();
+    const bool direction_is_negative[3] = {
+        first_direction.x() < 0, first_direction.y() < 0, first_direction.z() < 0
+    };
+
+    uint32_t stack[64];
+    int stack_size = 0;
+    uint32_t current = 0;
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        uint32_t mask = packet_node_hit<N>(node, data, t_min, level) & lanes;
+        if (mask != 0 && node.primitive_count > 0) {
+            // Leaf: only the rays that hit the box test its primitives
+            leaf(node.offset, static_cast<uint32_t>(node.primitive_count), mask);
+        } else if (mask != 0) {
+            // At most one entry per level, and bvh_builder stops at bvh_max_depth levels
+            assert(stack_size < 64);
+            if (direction_is_negative[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+            continue;
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+}
+
+// Trace the rays `lanes` of a packet through a sphere soup
+// Lane k only finds spheres closer than t_max[k]; on a hit, closest[k], hits[k], t_max[k] and data.t_max[k] are updated
+template <int N>
+void hit_packet_soup(
+    const sphere_soup& soup, const ray_packet<N>& packet, packet_slab_data<N>& data, double t_min, double* t_max,
+    uint32_t lanes, closest_hit* closest, bool* hits, simd_level level
+) {
+    const std::vector<linear_bvh_node>& nodes = soup.get_nodes();
+    if (nodes.empty()) {
+        // (no tree: every ray tests every batch anyway)
+        for (; lanes; lanes &= lanes - 1) {
+            int k = __builtin_ctz(lanes);
+            if (soup.intersect(packet.rays[k], t_min, t_max[k], closest[k])) {
+                hits[k] = true;
+                t_max[k] = closest[k].t;
+                data.t_max[k] = round_up_to_float(closest[k].t);
+            }
+        }
+        return;
+    }
+    traverse_packet<N>(nodes, packet, data, round_down_to_float(t_min), lanes, level,
+        [&](uint32_t first, uint32_t count, uint32_t mask) {
+            for (; mask; mask &= mask - 1) {
+                int k = __builtin_ctz(mask);
+                if (soup.batch_hit(first, count, packet.rays[k], t_min, t_max[k], closest[k])) {
+                    hits[k] = true;
+                    data.t_max[k] = round_up_to_float(t_max[k]);
+                }
+            }
+        }
+    );
+}
+
+// Trace a packet through a linear BVH
+// Lane k is only tested against primitives closer than t_max[k]; on a hit, closest[k], hits[k] and t_max[k] are updated
+template <int N>
+void hit_packet(
+    const linear_bvh& bvh, const ray_packet<N>& packet, double t_min, double* t_max,
+    closest_hit* closest, bool* hits, simd_level level
+) {
+    packet_slab_data<N> data;
+    fill_slab_data<N>(packet, t_max, data);
+    const float t_min_float = round_down_to_float(t_min);
+
+    // Spheres are tested with SIMD when the rays are double (not with RT_PRECISION=float) and AVX2 is on
+    constexpr bool double_rays = std::is_same<real, double>::value;
+    const bool simd_spheres = double_rays && RT_X86_SIMD && level == simd_level::avx2;
+    packet_ray_data<N> ray_data;
+    if (simd_spheres) {
+        for (int k=0; k<N; k++) {
+            const bool used = k < packet.size;
+            for (int a=0; a<3; a++) {
+                ray_data.origin[a][k] = used ? packet.rays[k].origin()[a] : 0.0;
+                ray_data.direction[a][k] = used ? packet.rays[k].direction()[a] : 1.0;
+            }
+        }
+    }
+
+    const uint32_t all_lanes = (1u << packet.size) - 1;
+    traverse_packet<N>(bvh.get_nodes(), packet, data, t_min_float, all_lanes, level,
+        [&](uint32_t first, uint32_t count, uint32_t mask) {
+            for (uint32_t i=0; i<count; i++) {
+                const hittable* primitive = bvh.get_primitive(first + i);
+                // (exactly these classes: a subclass could intersect differently)
+                if (typeid(*primitive) == typeid(sphere_soup)) {
+                    hit_packet_soup<N>(
+                        *static_cast<const sphere_soup*>(primitive), packet, data, t_min, t_max, mask, closest, hits, level
+                    );
+                    continue;
+                }
+#if RT_X86_SIMD
+                if constexpr (double_rays) {
+                    if (simd_spheres && typeid(*primitive) == typeid(sphere)) {
+                        const sphere* s = static_cast<const sphere*>(primitive);
+                        double t_hit[N];
+                        uint32_t hit_lanes = packet_sphere_hit_avx2<N>(*s, ray_data, t_min, t_max, mask, t_hit);
+                        for (; hit_lanes; hit_lanes &= hit_lanes - 1) {
+                            int k = __builtin_ctz(hit_lanes);
+                            closest[k].t = t_hit[k];
+                            closest[k].object = s;
+                            closest[k].primitive = 0;
+                            hits[k] = true;
+                            t_max[k] = t_hit[k];
+                            data.t_max[k] = round_up_to_float(t_hit[k]);
+                        }
+                        continue;
+                    }
+                }
+#endif
+                for (uint32_t lanes=mask; lanes; lanes &= lanes - 1) {
+                    int k = __builtin_ctz(lanes);
+                    if (primitive->intersect(packet.rays[k], t_min, t_max[k], closest[k])) {
+                        hits[k] = true;
+                        t_max[k] = closest[k].t;
+                        data.t_max[k] = round_up_to_float(closest[k].t);
+                    }
+                }
+            }
+        }
+    );
+}
+
+// Find the closest hit of every ray of the packet in the world
+// Linear BVHs and sphere soups in the world are traced as a packet; anything else one ray at a time
+template <int N>
+void trace_packet(
+    const hittable_list& world, const ray_packet<N>& packet, double t_min,
+    hit_record* recs, bool* hits, simd_level level
+) {
+    double t_max[N];
+    // (the traversal only writes the small closest_hit half of each record)
+    closest_hit closest[N];
+    for (int k=0; k<N; k++) {
+        t_max[k] = infinity;
+        hits[k] = false;
+    }
+
+    for (const shared_ptr<hittable>& object : world.objects) {
+        if (const linear_bvh* bvh = dynamic_cast<const linear_bvh*>(object.get())) {
+            hit_packet<N>(*bvh, packet, t_min, t_max, closest, hits, level);
+        } else if (typeid(*object) == typeid(sphere_soup)) {
+            packet_slab_data<N> data;
+            fill_slab_data<N>(packet, t_max, data);
+            const uint32_t all_lanes = (1u << packet.size) - 1;
+            hit_packet_soup<N>(
+                static_cast<const sphere_soup&>(*object), packet, data, t_min, t_max, all_lanes, closest, hits, level
+            );
+        } else {
+            for (int k=0; k<packet.size; k++) {
+                if (object->intersect(packet.rays[k], t_min, t_max[k], closest[k])) {
+                    hits[k] = true;
+                    t_max[k] = closest[k].t;
+                }
+            }
+        }
+    }
+
+    // The surface interaction of the closest hits only
+    for (int k=0; k<packet.size; k++) {
+        if (!hits[k]) continue;
+        static_cast<closest_hit&>(recs[k]) = closest[k];
+        recs[k].object->compute_interaction(packet.rays[k], recs[k], recs[k]);
+    }
+}
+
+#endif // header guard
@@ -1,17 +1,33 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 #include "rtweekend.h"
+#include "simd.h"
 
 // Perlin Noise
+// noise() and turbulence() of one point are the reference (double) versions.
+// The batched versions evaluate many points at once with SSE or AVX2 (see noise_lanes()):
+//  the lattice lookups and the interpolation are done in float, 4 or 8 points per instruction.
+//  The floor and the fractional part are still taken in double, so the result only differs
+//  from the reference by float rounding (about 1e-6), even far from the origin.
+// turbulence() of one point is batched too: its octaves are independent points (p, 2p, 4p, ...),
+//  so they are evaluated together as one batch.
 class perlin {
     public:
         // Constructor
-        perlin() {
+        perlin(): level(perlin::default_simd_level()) {
             // Generate random unit vectors at the lattice/grid points
             this->random_vectors = new vec3[perlin::point_count];
             for (int i=0; i<perlin::point_count; i++) {
                 this->random_vectors[i] = unit_vector(vec3::random(-1, 1));
+                // (the same vectors in float, one table per axis, for the batched noise)
+                this->gradient_x[i] = static_cast<float>(this->random_vectors[i].x());
+                this->gradient_y[i] = static_cast<float>(this->random_vectors[i].y());
+                this->gradient_z[i] = static_cast<float>(this->random_vectors[i].z());
             }
 
             // Generate integer Perlin permutations for each axis: x, y, z
@@ -85,6 +101,13 @@ class perlin {
         // Turbulence = composite noise that has sums of multiple frequencies
         // Returns a value between [0, 1)
         double turbulence(const point3& p, int depth=7) const {
+            // All octaves in one batch
+            if (this->level != simd_level::scalar) {
+                double result;
+                this->turbulence(&p, &result, 1, depth);
+                return result;
+            }
+
             double accum = 0.0;
             point3 temp_p = p;
             double weight = 1.0;
@@ -101,6 +124,73 @@ class perlin {
             return fabs(accum);
         }
 
+        // Batched noise: out[n] = noise(points[n]) for `count` points
+        void noise(const point3* points, double* out, int count) const {
+            noise_lanes lanes;
+            for (int start=0; start<count; start+=lane_count) {
+                int used = std::min(lane_count, count - start);
+                for (int n=0; n<used; n++) {
+                    lanes.set(n, points[start + n]);
+                }
+                lanes.pad(used);
+                this->evaluate(lanes);
+                for (int n=0; n<used; n++) {
+                    out[start + n] = lanes.result[n];
+                }
+            }
+        }
+
+        // Batched turbulence: out[n] = turbulence(points[n], depth) for `count` points
+        // The octaves of all the points are put in the lanes one after the other (fused octave loop),
+        //  so the lanes stay full whatever `depth` is
+        void turbulence(const point3* points, double* out, int count, int depth=7) const {
+            for (int n=0; n<count; n++) {
+                out[n] = 0.0;
+            }
+            noise_lanes lanes;
+            // The point and weight of every lane
+            int lane_point[lane_count];
+            double lane_weight[lane_count];
+            int used = 0;
+            for (int n=0; n<count; n++) {
+                point3 octave_p = points[n];
+                double weight = 1.0;
+                for (int i=0; i<depth; i++) {
+                    lanes.set(used, octave_p);
+                    lane_point[used] = n;
+                    lane_weight[used] = weight;
+                    used++;
+                    // (the last point fills the last batch)
+                    if (used == lane_count || (n == count - 1 && i == depth - 1)) {
+                        lanes.pad(used);
+                        this->evaluate(lanes);
+                        for (int l=0; l<used; l++) {
+                            out[lane_point[l]] += lane_weight[l] * lanes.result[l];
+                        }
+                        used = 0;
+                    }
+                    weight *= 0.5;
+                    octave_p *= 2;
+                }
+            }
+            for (int n=0; n<count; n++) {
+                out[n] = fabs(out[n]);
+            }
+        }
+
+        // Instruction set of the batched versions
+        // (scalar: the batched versions run the float code one lane at a time, and turbulence() of one point
+        //  is the double reference loop)
+        simd_level get_simd_level() const { return this->level; }
+        void set_simd_level(simd_level l) { this->level = l; }
+
+        // The instruction set new perlin objects start with (the scenes make their own textures,
+        //  so the program sets this before it builds the scene; see --simd)
+        static simd_level& default_simd_level() {
+            static simd_level level = detect_simd_level();
+            return level;
+        }
+
     private:
         // Number of random samples to generate
         // `static` means any object of this class can access this value
@@ -111,6 +201,215 @@ class perlin {
         int* perm_x = nullptr;
         int* perm_y = nullptr;
         int* perm_z = nullptr;
+        // random_vectors in float, by axis (structure of arrays, for gathers)
+        float gradient_x[point_count];
+        float gradient_y[point_count];
+        float gradient_z[point_count];
+
+        simd_level level;
+
+        // Points per batch (the width of AVX2; SSE does two groups of 4)
+        static const int lane_count = 8;
+
+        // A batch of points, split into the lattice cell and the position in the cell
+        struct alignas(32) noise_lanes {
+            // The two lattice coordinates around the point on each axis, already wrapped to [0, point_count)
+            int32_t x0[lane_count], x1[lane_count];
+            int32_t y0[lane_count], y1[lane_count];
+            int32_t z0[lane_count], z1[lane_count];
+            // The fractional part of the point's coordinates, in [0, 1]
+            float u[lane_count], v[lane_count], w[lane_count];
+            float result[lane_count];
+
+            // (the floor is taken in double, so the fraction keeps its precision far from the origin)
+            void set(int lane, const point3& p) {
+                const int mask = point_count - 1;
+                double floor_x = floor(p.x());
+                double floor_y = floor(p.y());
+                double floor_z = floor(p.z());
+                int i = static_cast<int>(floor_x);
+                int j = static_cast<int>(floor_y);
+                int k = static_cast<int>(floor_z);
+                this->x0[lane] = i & mask;
+                this->x1[lane] = (i + 1) & mask;
+                this->y0[lane] = j & mask;
+                this->y1[lane] = (j + 1) & mask;
+                this->z0[lane] = k & mask;
+                this->z1[lane] = (k + 1) & mask;
+                this->u[lane] = static_cast<float>(p.x() - floor_x);
+                this->v[lane] = static_cast<float>(p.y() - floor_y);
+                this->w[lane] = static_cast<float>(p.z() - floor_z);
+            }
+
+            // Unused lanes get a valid point (the origin); their results are ignored
+            void pad(int used) {
+                for (int lane=used; lane<lane_count; lane++) {
+                    this->set(lane, point3(0, 0, 0));
+                }
+            }
+        };
+
+        // Noise of every lane, into lanes.result
+        void evaluate(noise_lanes& lanes) const {
+#if RT_X86_SIMD
+            if (this->level == simd_level::avx2) {
+                this->evaluate_avx2(lanes);
+                return;
+            }
+            if (this->level == simd_level::sse) {
+                this->evaluate_sse(lanes, 0);
+                this->evaluate_sse(lanes, 4);
+                return;
+            }
+#endif
+            for (int lane=0; lane<lane_count; lane++) {
+                this->evaluate_lane(lanes, lane);
+            }
+        }
+
+        // One lane in float: the same operations as the SIMD versions
+        void evaluate_lane(noise_lanes& lanes, int lane) const {
+            const int32_t xs[2] = {lanes.x0[lane], lanes.x1[lane]};
+            const int32_t ys[2] = {lanes.y0[lane], lanes.y1[lane]};
+            const int32_t zs[2] = {lanes.z0[lane], lanes.z1[lane]};
+            const float u = lanes.u[lane];
+            const float v = lanes.v[lane];
+            const float w = lanes.w[lane];
+            float influence[2][2][2];
+            for (int di=0; di<2; di++) {
+                for (int dj=0; dj<2; dj++) {
+                    for (int dk=0; dk<2; dk++) {
+                        int index = this->perm_x[xs[di]] ^ this->perm_y[ys[dj]] ^ this->perm_z[zs[dk]];
+                        influence[di][dj][dk] = this->gradient_x[index] * (u - di)
+                            + this->gradient_y[index] * (v - dj)
+                            + this->gradient_z[index] * (w - dk);
+                    }
+                }
+            }
+            float uu = u * u * (3.0f - 2.0f * u);
+            float vv = v * v * (3.0f - 2.0f * v);
+            float ww = w * w * (3.0f - 2.0f * w);
+            float c00 = influence[0][0][0] + uu * (influence[1][0][0] - influence[0][0][0]);
+            float c01 = influence[0][1][0] + uu * (influence[1][1][0] - influence[0][1][0]);
+            float c10 = influence[0][0][1] + uu * (influence[1][0][1] - influence[0][0][1]);
+            float c11 = influence[0][1][1] + uu * (influence[1][1][1] - influence[0][1][1]);
+            float c0 = c00 + vv * (c01 - c00);
+            float c1 = c10 + vv * (c11 - c10);
+            lanes.result[lane] = c0 + ww * (c1 - c0);
+        }
+
+#if RT_X86_SIMD
+        // SSE2 has no gathers: the table lookups are scalar, the arithmetic is 4 lanes at a time
+        void evaluate_sse(noise_lanes& lanes, int first) const {
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 u = _mm_load_ps(lanes.u + first);
+            const __m128 v = _mm_load_ps(lanes.v + first);
+            const __m128 w = _mm_load_ps(lanes.w + first);
+            const __m128 du[2] = {u, _mm_sub_ps(u, one)};
+            const __m128 dv[2] = {v, _mm_sub_ps(v, one)};
+            const __m128 dw[2] = {w, _mm_sub_ps(w, one)};
+            const int32_t* xs[2] = {lanes.x0 + first, lanes.x1 + first};
+            const int32_t* ys[2] = {lanes.y0 + first, lanes.y1 + first};
+            const int32_t* zs[2] = {lanes.z0 + first, lanes.z1 + first};
+
+            __m128 influence[2][2][2];
+            for (int di=0; di<2; di++) {
+                for (int dj=0; dj<2; dj++) {
+                    for (int dk=0; dk<2; dk++) {
+                        alignas(16) float gx[4], gy[4], gz[4];
+                        for (int l=0; l<4; l++) {
+                            int index = this->perm_x[xs[di][l]] ^ this->perm_y[ys[dj][l]] ^ this->perm_z[zs[dk][l]];
+                            gx[l] = this->gradient_x[index];
+                            gy[l] = this->gradient_y[index];
+                            gz[l] = this->gradient_z[index];
+                        }
+                        __m128 dot = _mm_add_ps(
+                            _mm_add_ps(_mm_mul_ps(_mm_load_ps(gx), du[di]), _mm_mul_ps(_mm_load_ps(gy), dv[dj])),
+                            _mm_mul_ps(_mm_load_ps(gz), dw[dk])
+                        );
+                        influence[di][dj][dk] = dot;
+                    }
+                }
+            }
+
+            const __m128 three = _mm_set1_ps(3.0f);
+            const __m128 two = _mm_set1_ps(2.0f);
+            __m128 uu = _mm_mul_ps(_mm_mul_ps(u, u), _mm_sub_ps(three, _mm_mul_ps(two, u)));
+            __m128 vv = _mm_mul_ps(_mm_mul_ps(v, v), _mm_sub_ps(three, _mm_mul_ps(two, v)));
+            __m128 ww = _mm_mul_ps(_mm_mul_ps(w, w), _mm_sub_ps(three, _mm_mul_ps(two, w)));
+            auto lerp4 = [](__m128 low, __m128 high, __m128 t) {
+                return _mm_add_ps(low, _mm_mul_ps(t, _mm_sub_ps(high, low)));
+            };
+            __m128 c00 = lerp4(influence[0][0][0], influence[1][0][0], uu);
+            __m128 c01 = lerp4(influence[0][1][0], influence[1][1][0], uu);
+            __m128 c10 = lerp4(influence[0][0][1], influence[1][0][1], uu);
+            __m128 c11 = lerp4(influence[0][1][1], influence[1][1][1], uu);
+            __m128 c0 = lerp4(c00, c01, vv);
+            __m128 c1 = lerp4(c10, c11, vv);
+            _mm_store_ps(lanes.result + first, lerp4(c0, c1, ww));
+        }
+
+        // AVX2: 8 lanes, with gathers for the permutation and gradient tables
+        RT_TARGET_AVX2
+        void evaluate_avx2(noise_lanes& lanes) const {
+            const __m256 one = _mm256_set1_ps(1.0f);
+            const __m256 u = _mm256_load_ps(lanes.u);
+            const __m256 v = _mm256_load_ps(lanes.v);
+            const __m256 w = _mm256_load_ps(lanes.w);
+            const __m256 du[2] = {u, _mm256_sub_ps(u, one)};
+            const __m256 dv[2] = {v, _mm256_sub_ps(v, one)};
+            const __m256 dw[2] = {w, _mm256_sub_ps(w, one)};
+            // The permutation of each axis' two lattice coordinates
+            const __m256i px[2] = {
+                _mm256_i32gather_epi32(this->perm_x, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.x0)), 4),
+                _mm256_i32gather_epi32(this->perm_x, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.x1)), 4)
+            };
+            const __m256i py[2] = {
+                _mm256_i32gather_epi32(this->perm_y, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.y0)), 4),
+                _mm256_i32gather_epi32(this->perm_y, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.y1)), 4)
+            };
+            const __m256i pz[2] = {
+                _mm256_i32gather_epi32(this->perm_z, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.z0)), 4),
+                _mm256_i32gather_epi32(this->perm_z, _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.z1)), 4)
+            };
+
+            __m256 influence[2][2][2];
+            for (int di=0; di<2; di++) {
+                for (int dj=0; dj<2; dj++) {
+                    __m256i pxy = _mm256_xor_si256(px[di], py[dj]);
+                    for (int dk=0; dk<2; dk++) {
+                        __m256i index = _mm256_xor_si256(pxy, pz[dk]);
+                        __m256 gx = _mm256_i32gather_ps(this->gradient_x, index, 4);
+                        __m256 gy = _mm256_i32gather_ps(this->gradient_y, index, 4);
+                        __m256 gz = _mm256_i32gather_ps(this->gradient_z, index, 4);
+                        // (separate multiplies and adds, no FMA: the same rounding as the other versions)
+                        influence[di][dj][dk] = _mm256_add_ps(
+                            _mm256_add_ps(_mm256_mul_ps(gx, du[di]), _mm256_mul_ps(gy, dv[dj])),
+                            _mm256_mul_ps(gz, dw[dk])
+                        );
+                    }
+                }
+            }
+
+            const __m256 three = _mm256_set1_ps(3.0f);
+            const __m256 two = _mm256_set1_ps(2.0f);
+            __m256 uu = _mm256_mul_ps(_mm256_mul_ps(u, u), _mm256_sub_ps(three, _mm256_mul_ps(two, u)));
+            __m256 vv = _mm256_mul_ps(_mm256_mul_ps(v, v), _mm256_sub_ps(three, _mm256_mul_ps(two, v)));
+            __m256 ww = _mm256_mul_ps(_mm256_mul_ps(w, w), _mm256_sub_ps(three, _mm256_mul_ps(two, w)));
+            __m256 c00 = perlin::lerp8(influence[0][0][0], influence[1][0][0], uu);
+            __m256 c01 = perlin::lerp8(influence[0][1][0], influence[1][1][0], uu);
+            __m256 c10 = perlin::lerp8(influence[0][0][1], influence[1][0][1], uu);
+            __m256 c11 = perlin::lerp8(influence[0][1][1], influence[1][1][1], uu);
+            __m256 c0 = perlin::lerp8(c00, c01, vv);
+            __m256 c1 = perlin::lerp8(c10, c11, vv);
+            _mm256_store_ps(lanes.result, perlin::lerp8(c0, c1, ww));
+        }
+
+        RT_TARGET_AVX2
+        static __m256 lerp8(__m256 low, __m256 high, __m256 t) {
+            return _mm256_add_ps(low, _mm256_mul_ps(t, _mm256_sub_ps(high, low)));
+        }
+#endif
 
         // Generate a Perlin permutation (integers with range [0, point_count] (for an axis: x, y, z)
         static int* perlin_generate_perm() {
@@ -0,0 +1,23 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// Scalar types of the geometry
+// vec3, ray and aabb are templates on their scalar type (vec3_t, ray_t, aabb_t); which one the renderer
+//  uses is chosen when the project is configured, with cmake -DRT_PRECISION=double|float:
+//   double: the geometry in double (the default)
+//   float:  the geometry in float; half the memory per vector and twice the values per SIMD register,
+//           but hit points far from the origin lose precision
+// "The geometry" is vectors, rays, bounding boxes, and the sphere soup's centers and radii and the triangle
+//  meshes' vertex positions (whose intersection math widens them to double)
+// Everything else (t values, colors of the framebuffer, sampling) stays in double
+// (The linear, bvh4 and bvh8 accelerators keep float boxes in both)
+
+#if defined(RT_PRECISION_FLOAT)
+using real = float;
+#define RT_PRECISION_NAME "float"
+#else
+using real = double;
+#define RT_PRECISION_NAME "double"
+#endif
+
+#endif // header guard
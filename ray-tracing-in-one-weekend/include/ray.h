@@ -12,32 +12,54 @@
         * t is the input argument (a real number; in this program it is a double)
             * Positive values of t will move P along the ray in different directions
         * P is the resulting 3D position alone the ray/line
+    The ray is a template on the scalar type of its origin and direction (see precision.h)
 */
-class ray {
+template <typename T>
+class ray_t {
     public:
         // Class fields
         // P(t) = A + tb; A=origin, b=direction
-        point3 orig; // origin
-        vec3 dir; // direction
+        vec3_t<T> orig; // origin
+        vec3_t<T> dir; // direction
         double tm; // the time when the ray exists (used for motion blur)
 
         // Constructors
-        ray() {}
-        ray(const point3& origin, const vec3 direction, double time=0.0)
+        ray_t() {}
+        ray_t(const vec3_t<T>& origin, const vec3_t<T> direction, double time=0.0)
             : orig(origin), dir(direction), tm(time)
         {}
 
         // Getters
-        point3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
+        vec3_t<T> origin() const { return orig; }
+        vec3_t<T> direction() const { return dir; }
         double time() const { return tm; }
 
         // Compute position P(t) = A + tb
-        point3 at(double t) const {
+        vec3_t<T> at(double t) const {
             return orig + t*dir;
         }
 
 }; // class ray 
 
+// The rays of the renderer (see precision.h)
+using ray = ray_t<real>;
+
+/*
+    A camera ray with its ray differentials: the rays through the neighbouring pixels,
+    one to the right (x) and one up (y).
+    At the hit point they tell the textures how much of the surface one pixel sees
+    (see surface_interaction::compute_differentials()). Bounced rays are plain rays, so they stay small.
+*/
+class ray_differential : public ray {
+    public:
+        // False if the camera does not make differentials (see camera::set_pixel_spacing())
+        bool has_differentials = false;
+        point3 rx_origin, ry_origin;
+        vec3 rx_direction, ry_direction;
+
+        ray_differential() {}
+        ray_differential(const ray& r): ray(r) {}
+};
+
 // Header guard
 #endif
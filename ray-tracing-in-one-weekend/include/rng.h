@@ -0,0 +1,80 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// Random number generation
+// rand() shares one global state between all threads (and is slow and not very random),
+//  so every thread gets its own small, fast generator instead
+
+// Scramble the bits of a 64-bit integer (the SplitMix64 finalizer)
+// Nearby inputs (ex. neighboring pixels) give unrelated outputs
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
+
+// Combine a seed with another value into a new seed
+inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+    return mix_bits(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+// PCG32 random number generator (Melissa O'Neill, pcg-random.org)
+// 64 bits of state, 32-bit outputs: a multiply, an add, and a few shifts per number
+// The `inc` value selects one of 2^63 independent streams
+class pcg32 {
+    public:
+        // Constructors
+        pcg32() { this->seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+        pcg32(uint64_t initial_state, uint64_t stream=1) { this->seed(initial_state, stream); }
+
+        // Restart the generator at `initial_state` on stream `stream`
+        void seed(uint64_t initial_state, uint64_t stream=1) {
+            this->state = 0;
+            // The increment has to be odd
+            this->inc = (stream << 1u) | 1u;
+            this->next_uint();
+            this->state += initial_state;
+            this->next_uint();
+        }
+
+        // Return a uniformly distributed 32-bit integer
+        uint32_t next_uint() {
+            uint64_t old_state = this->state;
+            this->state = old_state * 0x5851f42d4c957f2dULL + this->inc;
+            uint32_t xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+            uint32_t rotation = static_cast<uint32_t>(old_state >> 59u);
+            return (xor_shifted >> rotation) | (xor_shifted << ((-rotation) & 31));
+        }
+
+        // Return a real number in [0, 1)
+        double next_double() {
+            // 0x1p-32 = 1/2^32, so the largest value is (2^32-1)/2^32 < 1
+            return this->next_uint() * 0x1p-32;
+        }
+
+        // The full generator state, so it can be saved and restored
+        uint64_t get_state() const { return this->state; }
+        uint64_t get_inc() const { return this->inc; }
+        void set_state(uint64_t state, uint64_t inc) {
+            this->state = state;
+            this->inc = inc;
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+// The generator of the calling thread
+// random_double() (and everything built on it) draws from this generator
+inline pcg32& thread_rng() {
+    thread_local pcg32 rng;
+    return rng;
+}
+
+#endif // header guard
@@ -0,0 +1,28 @@
+#ifndef ROULETTE_H
+#define ROULETTE_H
+
+#include <cmath>
+
+#include "rtweekend.h"
+
+// Russian roulette
+// A path that has bounced off a few dark surfaces carries almost no light (its throughput, the product
+//  of the attenuations so far, is near zero), but tracing it costs as much as tracing a bright one.
+// After `min_bounces` bounces, a path goes on with probability equal to its largest throughput channel
+//  (capped at 1) and is dropped otherwise. The paths that go on divide their throughput by that
+//  probability, which makes up for the dropped ones: the image stays the same on average (unbiased).
+// Bright paths (ex. through glass, throughput 1) always go on; paths through black surfaces always stop.
+//
+// Returns true if the path goes on (and scales `throughput`); `bounces` is the number of bounces so far
+// The decision uses this thread's generator, not the sampler, so the bounces keep their sample dimensions
+inline bool survives_roulette(color& throughput, int bounces, int min_bounces) {
+    if (min_bounces <= 0 || bounces < min_bounces) return true;
+
+    double survival = std::fmin(1.0, std::fmax(throughput.r(), std::fmax(throughput.g(), throughput.b())));
+    if (survival >= 1.0) return true;
+    if (survival <= 0.0 || random_double() >= survival) return false;
+    throughput = throughput / survival;
+    return true;
+}
+
+#endif // header guard
@@ -8,6 +8,8 @@
 #include <memory>
 #include <cstdlib>
 
+#include "rng.h"
+
 
 // Usings
 using std::shared_ptr;
@@ -24,9 +26,10 @@ inline double degrees_to_radians(double degrees) {
 }
 
 // Return a random real number in [0, 1)
+// Every random number in the ray tracer (camera, materials, vec3, perlin, bvh) comes from here,
+//  drawn from the calling thread's own generator (see rng.h)
 inline double random_double() {
-    double num = rand() / (RAND_MAX + 1.0); // add +1 since excluding 1
-    return num;
+    return thread_rng().next_double();
 }
 
 // Return a random real number in [min, max)
@@ -0,0 +1,289 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "rtweekend.h"
+#include "low_discrepancy.h"
+#include "blue_noise.h"
+
+// A 2D sample, each component in [0, 1)
+struct point2 {
+    double x, y;
+};
+
+// Abstract base class for a sampler
+// A sampler hands out the random numbers ("sample dimensions") for one pixel sample at a time
+// Before the samples of a pixel, call start_pixel(); before each sample, call start_sample()
+//
+// start_sample() also re-seeds the calling thread's generator (see rng.h) from
+//  (seed, pixel, sample index), so every random_double() drawn while tracing that sample
+//  is the same no matter which thread renders the pixel or in what order.
+//  A render with a given seed is reproducible bit for bit with any number of threads
+//
+// The dimensions of a sample are handed out in this order:
+//  pixel jitter (2D), lens position (2D), shutter time (1D), then one 2D sample per diffuse bounce
+//  Low-discrepancy samplers stratify each dimension (or pair of dimensions) on its own and
+//  shuffle them per pixel and per dimension ("padding"), so the dimensions are not correlated
+class sampler;
+
+// The sampler of the sample that is being traced on this thread (nullptr if none)
+// Lets materials draw their bounce directions from the sampler without passing it through every hit()
+inline sampler*& thread_sampler() {
+    thread_local sampler* active = nullptr;
+    return active;
+}
+
+class sampler {
+    public:
+        // Constructors
+        sampler(int samples_per_pixel, uint64_t seed):
+            samples_per_pixel(samples_per_pixel), seed(seed) {}
+        virtual ~sampler() {
+            if (thread_sampler() == this) thread_sampler() = nullptr;
+        }
+
+        // Begin the samples of pixel (i, j)
+        virtual void start_pixel(int i, int j) {
+            this->pixel_i = i;
+            this->pixel_j = j;
+        }
+
+        // Begin sample number `index` (in [0, samples_per_pixel)) of the current pixel
+        // Also makes this the sampler of the calling thread (see thread_sampler())
+        virtual void start_sample(int index) {
+            this->sample_index = index;
+            this->dimension = 0;
+            this->pixel_seed = hash_combine(
+                hash_combine(this->seed, static_cast<uint64_t>(this->pixel_i)),
+                static_cast<uint64_t>(this->pixel_j)
+            );
+            // Use the pixel as the stream, so two pixels never share a sequence
+            thread_rng().seed(hash_combine(this->pixel_seed, static_cast<uint64_t>(index)), this->pixel_seed);
+            thread_sampler() = this;
+        }
+
+        // The next sample dimension, in [0, 1)
+        virtual double get_1d() = 0;
+        // The next two sample dimensions, in [0, 1)^2
+        virtual point2 get_2d() = 0;
+
+        // A fresh sampler with the same settings (each render thread needs its own)
+        virtual std::unique_ptr<sampler> clone() const = 0;
+
+        int get_samples_per_pixel() const { return this->samples_per_pixel; }
+
+    protected:
+        int samples_per_pixel;
+        uint64_t seed;
+        int pixel_i = 0;
+        int pixel_j = 0;
+        int sample_index = 0;
+        // The next dimension to hand out for the current sample
+        int dimension = 0;
+        // Hash of (seed, pixel)
+        uint64_t pixel_seed = 0;
+
+        // Hash of (seed, pixel, dimension); the per-pixel, per-dimension scramble
+        uint64_t dimension_hash(int d) const {
+            return hash_combine(this->pixel_seed, static_cast<uint64_t>(d));
+        }
+
+        // Shuffle the sample indices of this pixel for dimension hash `h`
+        // Indices past samples_per_pixel (ex. extra adaptive samples) are shuffled within their block
+        uint32_t shuffled_index(uint64_t h) const {
+            uint32_t spp = static_cast<uint32_t>(this->samples_per_pixel);
+            uint32_t index = static_cast<uint32_t>(this->sample_index);
+            uint32_t block = index / spp;
+            return block * spp + permutation_element(index % spp, spp, static_cast<uint32_t>(h));
+        }
+};
+
+// Every dimension is an independent uniform random number
+class independent_sampler : public sampler {
+    public:
+        // Constructors
+        independent_sampler(int samples_per_pixel, uint64_t seed): sampler(samples_per_pixel, seed) {}
+
+        // Implement abstract base class methods
+        virtual double get_1d() override {
+            return random_double();
+        }
+
+        virtual point2 get_2d() override {
+            // Two statements, so the x and y draws happen in a fixed order
+            double x = random_double();
+            double y = random_double();
+            return {x, y};
+        }
+
+        virtual std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<independent_sampler>(*this);
+        }
+};
+
+// Jittered stratified sampling
+// Each dimension is split into samples_per_pixel strata (intervals) and every sample of a pixel
+//  falls into a different stratum, at a random spot inside it
+// 2D dimensions use an n x n grid when samples_per_pixel = n^2, otherwise a Latin hypercube
+//  (every column and every row of the samples_per_pixel x samples_per_pixel grid has one sample)
+class stratified_sampler : public sampler {
+    public:
+        // Constructors
+        stratified_sampler(int samples_per_pixel, uint64_t seed): sampler(samples_per_pixel, seed) {
+            this->grid_size = static_cast<int>(std::sqrt(static_cast<double>(samples_per_pixel)));
+            // Fix up floating point error in sqrt()
+            while ((this->grid_size+1) * (this->grid_size+1) <= samples_per_pixel) this->grid_size++;
+            while (this->grid_size * this->grid_size > samples_per_pixel) this->grid_size--;
+        }
+
+        // Implement abstract base class methods
+        virtual double get_1d() override {
+            uint64_t h = this->dimension_hash(this->dimension++);
+            uint32_t stratum = this->shuffled_index(h) % this->samples_per_pixel;
+            double jitter = hash_to_unit(hash_combine(h, this->sample_index));
+            return (stratum + jitter) / this->samples_per_pixel;
+        }
+
+        virtual point2 get_2d() override {
+            uint64_t h = this->dimension_hash(this->dimension);
+            this->dimension += 2;
+            uint64_t jitter = hash_combine(h, this->sample_index);
+            double jitter_x = hash_to_unit(jitter);
+            double jitter_y = static_cast<uint32_t>(jitter) * one_over_2_to_32;
+
+            int spp = this->samples_per_pixel;
+            if (this->grid_size * this->grid_size == spp) {
+                // n x n grid of strata
+                uint32_t stratum = this->shuffled_index(h) % spp;
+                return {
+                    (stratum % this->grid_size + jitter_x) / this->grid_size,
+                    (stratum / this->grid_size + jitter_y) / this->grid_size
+                };
+            }
+            // Latin hypercube: shuffle the x and y strata independently
+            uint32_t stratum_x = this->shuffled_index(h) % spp;
+            uint32_t stratum_y = this->shuffled_index(mix_bits(h)) % spp;
+            return {(stratum_x + jitter_x) / spp, (stratum_y + jitter_y) / spp};
+        }
+
+        virtual std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<stratified_sampler>(*this);
+        }
+
+    private:
+        // Number of strata along each axis of a 2D dimension
+        int grid_size;
+};
+
+// Owen-scrambled Sobol sampling
+// Every dimension (or pair of dimensions) uses the first samples_per_pixel points of the 2D Sobol
+//  sequence, shuffled and Owen-scrambled with a different seed per pixel and per dimension
+// Converges fastest when samples_per_pixel is a power of two
+class sobol_sampler : public sampler {
+    public:
+        // Constructors
+        sobol_sampler(int samples_per_pixel, uint64_t seed): sampler(samples_per_pixel, seed) {}
+
+        // Implement abstract base class methods
+        virtual double get_1d() override {
+            uint64_t h = this->dimension_hash(this->dimension++);
+            uint32_t index = this->shuffled_index(h);
+            return owen_scramble(sobol_dimension_0(index), static_cast<uint32_t>(h >> 32)) * one_over_2_to_32;
+        }
+
+        virtual point2 get_2d() override {
+            uint64_t h = this->dimension_hash(this->dimension);
+            this->dimension += 2;
+            uint32_t index = this->shuffled_index(h);
+            uint64_t scramble = mix_bits(h);
+            return {
+                owen_scramble(sobol_dimension_0(index), static_cast<uint32_t>(scramble)) * one_over_2_to_32,
+                owen_scramble(sobol_dimension_1(index), static_cast<uint32_t>(scramble >> 32)) * one_over_2_to_32
+            };
+        }
+
+        virtual std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<sobol_sampler>(*this);
+        }
+};
+
+// Blue-noise dithered Sobol sampling
+// All pixels share the same Sobol points per dimension, but every pixel shifts them
+//  (wrapping around at 1) by its value in a blue-noise tile ("Cranley-Patterson rotation")
+// Neighboring pixels get very different shifts, so the error of neighboring pixels is negatively
+//  correlated and the noise looks like fine, even grain at low sample counts
+// Georgiev and Fajardo, "Blue-noise Dithered Sampling" (2016)
+class blue_noise_sampler : public sampler {
+    public:
+        // Constructors
+        blue_noise_sampler(int samples_per_pixel, uint64_t seed):
+            sampler(samples_per_pixel, seed), tile(blue_noise_tile::get()) {}
+
+        // Implement abstract base class methods
+        virtual double get_1d() override {
+            int d = this->dimension++;
+            uint64_t h = hash_combine(this->seed, static_cast<uint64_t>(d));
+            double point = owen_scramble(sobol_dimension_0(this->sample_index), static_cast<uint32_t>(h)) * one_over_2_to_32;
+            return this->dither(point, h);
+        }
+
+        virtual point2 get_2d() override {
+            int d = this->dimension;
+            this->dimension += 2;
+            uint64_t h = hash_combine(this->seed, static_cast<uint64_t>(d));
+            uint64_t scramble = mix_bits(h);
+            double x = owen_scramble(sobol_dimension_0(this->sample_index), static_cast<uint32_t>(scramble)) * one_over_2_to_32;
+            double y = owen_scramble(sobol_dimension_1(this->sample_index), static_cast<uint32_t>(scramble >> 32)) * one_over_2_to_32;
+            return {this->dither(x, h), this->dither(y, mix_bits(scramble))};
+        }
+
+        virtual std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<blue_noise_sampler>(*this);
+        }
+
+    private:
+        const blue_noise_tile& tile;
+
+        // Shift `point` by the blue-noise value of this pixel
+        // Each dimension reads the tile at its own offset (from hash `h`), so the shifts of
+        //  different dimensions are not correlated
+        double dither(double point, uint64_t h) const {
+            int offset_x = static_cast<int>(h & 0xffff);
+            int offset_y = static_cast<int>((h >> 16) & 0xffff);
+            double shifted = point + this->tile.value(this->pixel_i + offset_x, this->pixel_j + offset_y);
+            return shifted < 1.0 ? shifted : shifted - 1.0;
+        }
+};
+
+// Create a sampler by name: "independent", "stratified", "sobol", or "bluenoise"
+// Returns nullptr if the name is unknown
+std::unique_ptr<sampler> make_sampler(const std::string& name, int samples_per_pixel, uint64_t seed) {
+    if (name == "independent") return std::make_unique<independent_sampler>(samples_per_pixel, seed);
+    if (name == "stratified") return std::make_unique<stratified_sampler>(samples_per_pixel, seed);
+    if (name == "sobol") return std::make_unique<sobol_sampler>(samples_per_pixel, seed);
+    if (name == "bluenoise") return std::make_unique<blue_noise_sampler>(samples_per_pixel, seed);
+    return nullptr;
+}
+
+// Next 1D sample for a bounce (ex. which light to sample), like sample_bounce_2d()
+inline double sample_bounce_1d() {
+    sampler* active = thread_sampler();
+    if (active) return active->get_1d();
+    return random_double();
+}
+
+// Next 2D sample for a bounce direction: from this thread's sampler if a sample is being traced,
+//  otherwise two independent random numbers
+inline point2 sample_bounce_2d() {
+    sampler* active = thread_sampler();
+    if (active) return active->get_2d();
+    double x = random_double();
+    double y = random_double();
+    return {x, y};
+}
+
+#endif // header guard
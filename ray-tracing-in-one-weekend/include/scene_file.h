@@ -0,0 +1,793 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RT_SCENE_MMAP 1
+#else
+#define RT_SCENE_MMAP 0
+#endif
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "material.h"
+#include "material_table.h"
+#include "texture.h"
+#include "sphere_soup.h"
+#include "triangle_mesh.h"
+#include "instance.h"
+#include "image_io.h"
+#include "line_reader.h"
+
+// Scene files
+// A scene (camera, textures, materials and objects) can be read from a file instead of being built by one of the
+//  scene functions in main.cpp, so changing it does not mean recompiling. There are two formats:
+//
+// Text (ex. scenes/tutorial.scene), one statement per line; `#` starts a comment:
+//   camera [lookfrom X Y Z] [lookat X Y Z] [up X Y Z] [vfov DEGREES] [aperture A] [focus DISTANCE]
+//   background R G B
+//   texture NAME solid R G B
+//   texture NAME checker EVEN ODD                  (EVEN and ODD: names of textures)
+//   texture NAME noise SCALE
+//   texture NAME image PATH                        (relative to the working directory, like the scene functions)
+//   material NAME lambertian TEXTURE | R G B
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric INDEX_OF_REFRACTION
+//   material NAME diffuse_light TEXTURE | R G B    (the objects made of it are the lights)
+//   sphere X Y Z RADIUS MATERIAL
+//   moving_sphere X0 Y0 Z0 X1 Y1 Z1 TIME0 TIME1 RADIUS MATERIAL
+//   xy_rect X0 X1 Y0 Y1 Z MATERIAL
+//   xz_rect X0 X1 Z0 Z1 Y MATERIAL
+//   yz_rect Y0 Y1 Z0 Z1 X MATERIAL
+//   mesh PATH MATERIAL [X Y Z [SCALE]]             (a Wavefront OBJ file, scaled and then moved to X Y Z;
+//                                                   the uses of one file share its triangles, see build())
+// Names have to be declared before they are used. The parser streams the file through a fixed buffer and
+//  turns every line into a fixed-size record (below) as it goes; nothing is built until the whole file is read.
+//
+// Binary (written with --write-scene): the same records, as arrays in one file
+//   scene_binary_header (with the offset and count of every array)
+//   scene_texture_record[], scene_material_record[], scene_sphere_record[], scene_rect_record[],
+//   scene_mesh_record[]
+//   the texture and mesh paths, each followed by a 0 byte
+// (meshes are kept as the paths of their OBJ files, which are read by build())
+// Every array starts at a multiple of 8 bytes, so the file is memory-mapped and its records are read in place:
+//  no parsing, no copy, and the pages are shared by every render job that maps the same file.
+//  Native byte order; the magic number doubles as a byte order check.
+//
+// Both formats are turned into objects by scene_file::build(). Spheres go straight into the sphere soup
+//  (unless --spheres objects), so a scene of a million spheres takes no heap object per sphere.
+
+// The camera and background of the scene
+// (the defaults are those of the scene functions in main.cpp)
+struct scene_settings {
+    double lookfrom[3] = {13, 2, 3};
+    double lookat[3] = {0, 0, 0};
+    double view_up[3] = {0, 1, 0};
+    // Vertical field of view, in degrees
+    double vfov = 20.0;
+    double aperture = 0.0;
+    double focus_distance = 10.0;
+    double background[3] = {0.70, 0.80, 1.00};
+};
+
+enum scene_texture_type : uint32_t { scene_solid = 0, scene_checker = 1, scene_noise = 2, scene_image = 3 };
+
+struct scene_texture_record {
+    uint32_t type;
+    // checker: the indices of the even and odd textures (earlier in the array)
+    uint32_t even;
+    uint32_t odd;
+    // image: offset of its path in the strings
+    uint32_t path;
+    // solid: the color; noise: the scale
+    double values[3];
+};
+
+enum scene_material_type : uint32_t {
+    scene_lambertian = 0, scene_metal = 1, scene_dielectric = 2, scene_diffuse_light = 3
+};
+
+struct scene_material_record {
+    uint32_t type;
+    // lambertian and diffuse_light: the index of the texture
+    uint32_t texture;
+    // metal: the albedo and the fuzz; dielectric: the index of refraction
+    double values[4];
+};
+
+// A sphere that moves (moving = 1) or not (moving = 0; center1 = center0)
+struct scene_sphere_record {
+    double center0[3];
+    double center1[3];
+    double time0;
+    double time1;
+    double radius;
+    uint32_t material;
+    uint32_t moving;
+};
+
+// An axis-aligned rectangle: [a0, a1] x [b0, b1] on the plane where `axis` is k (see aarect.h)
+struct scene_rect_record {
+    uint32_t axis;
+    uint32_t material;
+    double a0, a1, b0, b1;
+    double k;
+};
+
+// A triangle mesh read from an OBJ file (see load_obj() in triangle_mesh.h)
+struct scene_mesh_record {
+    // Offset of its path in the strings
+    uint32_t path;
+    uint32_t material;
+    double offset[3];
+    double scale;
+};
+
+struct scene_binary_header {
+    uint32_t magic;
+    uint32_t version;
+    scene_settings settings;
+    uint64_t texture_offset, texture_count;
+    uint64_t material_offset, material_count;
+    uint64_t sphere_offset, sphere_count;
+    uint64_t rect_offset, rect_count;
+    uint64_t mesh_offset, mesh_count;
+    uint64_t string_offset, string_size;
+
+    static constexpr uint32_t magic_number = 0x53435452; // "RTCS" in a little-endian file
+    static constexpr uint32_t current_version = 2;
+};
+
+// The records of a text scene, as the parser reads them
+struct scene_records {
+    scene_settings settings;
+    std::vector<scene_texture_record> textures;
+    std::vector<scene_material_record> materials;
+    std::vector<scene_sphere_record> spheres;
+    std::vector<scene_rect_record> rects;
+    std::vector<scene_mesh_record> meshes;
+    // The texture and mesh paths, each followed by a 0 byte
+    std::string strings;
+};
+
+// The solid colors and materials that scene_file::build() makes, in one array per type instead of one heap
+//  object each (a scene with a material per sphere has a million of them)
+// The objects get shared_ptrs that share the ownership of the whole storage (the aliasing constructor)
+struct scene_object_storage {
+    std::vector<solid_color> solid_colors;
+    std::vector<lambertian> lambertians;
+    std::vector<metal> metals;
+    std::vector<dielectric> dielectrics;
+    std::vector<diffuse_light> diffuse_lights;
+};
+
+// Streaming parser of the text format
+// The lines are parsed in place as for_each_line() reads them (tokens are views into its buffer)
+class scene_text_parser {
+    public:
+        scene_text_parser(const std::string& path, scene_records& out): path(path), out(out) {}
+
+        bool parse() {
+            return for_each_line(this->path, "scene file", [this](std::string_view line) {
+                this->line_number++;
+                return this->parse_line(line);
+            });
+        }
+
+    private:
+        const std::string& path;
+        scene_records& out;
+        int line_number = 0;
+        // The tokens of the current line
+        token_reader tokens;
+        std::unordered_map<std::string, uint32_t> texture_names;
+        std::unordered_map<std::string, uint32_t> material_names;
+
+        bool error(const std::string& message) {
+            std::cerr << this->path << ":" << this->line_number << ": " << message << std::endl;
+            return false;
+        }
+
+        // The next whitespace-separated token of the line; empty at the end of the line
+        std::string_view next_token() { return this->tokens.next(); }
+
+        bool next_number(double& value) {
+            std::string_view token = this->next_token();
+            if (parse_number(token, value)) return true;
+            return this->error(token.empty() ? "expected a number" : "not a number: " + std::string(token));
+        }
+
+        bool next_numbers(double* values, int count) {
+            for (int i=0; i<count; i++) {
+                if (!this->next_number(values[i])) return false;
+            }
+            return true;
+        }
+
+        bool next_name(const std::unordered_map<std::string, uint32_t>& names, const char* kind, uint32_t& index) {
+            std::string_view token = this->next_token();
+            auto found = names.find(std::string(token));
+            if (found == names.end()) {
+                return this->error(std::string("unknown ") + kind + ": " + std::string(token));
+            }
+            index = found->second;
+            return true;
+        }
+
+        // A path (of an image or a mesh), added to the strings; `offset` is where it starts
+        bool next_path(const char* kind, uint32_t& offset) {
+            std::string_view token = this->next_token();
+            if (token.empty()) return this->error(std::string("expected the path of the ") + kind);
+            offset = static_cast<uint32_t>(this->out.strings.size());
+            this->out.strings.append(token);
+            this->out.strings.push_back('\0');
+            return true;
+        }
+
+        // True if the line has more tokens
+        bool has_more() const {
+            token_reader peek = this->tokens;
+            return !peek.next().empty();
+        }
+
+        // A texture name, or a color R G B (which becomes a solid texture of its own)
+        bool next_texture(uint32_t& index) {
+            std::string_view token = this->next_token();
+            double red;
+            if (parse_number(token, red)) {
+                scene_texture_record solid = {scene_solid, 0, 0, 0, {red, 0, 0}};
+                if (!this->next_numbers(solid.values + 1, 2)) return false;
+                index = static_cast<uint32_t>(this->out.textures.size());
+                this->out.textures.push_back(solid);
+                return true;
+            }
+            auto found = this->texture_names.find(std::string(token));
+            if (found == this->texture_names.end()) {
+                return this->error("unknown texture: " + std::string(token));
+            }
+            index = found->second;
+            return true;
+        }
+
+        // A new name for a texture or material (names cannot be numbers, which would read as colors)
+        bool new_name(std::unordered_map<std::string, uint32_t>& names, const char* kind, uint32_t index) {
+            std::string_view token = this->next_token();
+            double number;
+            if (token.empty() || parse_number(token, number)) return this->error(std::string("expected a ") + kind + " name");
+            if (!names.emplace(std::string(token), index).second) {
+                return this->error(std::string("duplicate ") + kind + ": " + std::string(token));
+            }
+            return true;
+        }
+
+        bool parse_line(std::string_view line) {
+            // Strip the comment
+            size_t comment = line.find('#');
+            if (comment != std::string_view::npos) line = line.substr(0, comment);
+            this->tokens.rest = line;
+
+            std::string_view keyword = this->next_token();
+            bool ok;
+            if (keyword.empty()) {
+                return true;
+            } else if (keyword == "sphere") {
+                // (the most common statement first)
+                scene_sphere_record s = {};
+                ok = this->next_numbers(s.center0, 3) && this->next_number(s.radius)
+                    && this->next_name(this->material_names, "material", s.material);
+                std::copy(s.center0, s.center0 + 3, s.center1);
+                s.time1 = 1.0;
+                if (ok) this->out.spheres.push_back(s);
+            } else if (keyword == "moving_sphere") {
+                scene_sphere_record s = {};
+                ok = this->next_numbers(s.center0, 3) && this->next_numbers(s.center1, 3)
+                    && this->next_number(s.time0) && this->next_number(s.time1) && this->next_number(s.radius)
+                    && this->next_name(this->material_names, "material", s.material);
+                s.moving = 1;
+                if (ok && s.time1 == s.time0) return this->error("moving_sphere needs TIME1 != TIME0");
+                if (ok) this->out.spheres.push_back(s);
+            } else if (keyword == "xy_rect" || keyword == "xz_rect" || keyword == "yz_rect") {
+                scene_rect_record rect = {};
+                rect.axis = keyword == "xy_rect" ? 2 : (keyword == "xz_rect" ? 1 : 0);
+                ok = this->next_number(rect.a0) && this->next_number(rect.a1)
+                    && this->next_number(rect.b0) && this->next_number(rect.b1) && this->next_number(rect.k)
+                    && this->next_name(this->material_names, "material", rect.material);
+                if (ok) this->out.rects.push_back(rect);
+            } else if (keyword == "mesh") {
+                ok = this->parse_mesh();
+            } else if (keyword == "material") {
+                ok = this->parse_material();
+            } else if (keyword == "texture") {
+                ok = this->parse_texture();
+            } else if (keyword == "camera") {
+                ok = this->parse_camera();
+            } else if (keyword == "background") {
+                ok = this->next_numbers(this->out.settings.background, 3);
+            } else {
+                return this->error("unknown statement: " + std::string(keyword));
+            }
+            if (ok && !this->next_token().empty()) return this->error("unexpected values at the end of the line");
+            return ok;
+        }
+
+        bool parse_texture() {
+            scene_texture_record t = {};
+            uint32_t index = static_cast<uint32_t>(this->out.textures.size());
+            if (!this->new_name(this->texture_names, "texture", index)) return false;
+            std::string_view type = this->next_token();
+            bool ok;
+            if (type == "solid") {
+                t.type = scene_solid;
+                ok = this->next_numbers(t.values, 3);
+            } else if (type == "checker") {
+                t.type = scene_checker;
+                ok = this->next_name(this->texture_names, "texture", t.even)
+                    && this->next_name(this->texture_names, "texture", t.odd);
+            } else if (type == "noise") {
+                t.type = scene_noise;
+                ok = this->next_number(t.values[0]);
+            } else if (type == "image") {
+                t.type = scene_image;
+                ok = this->next_path("image", t.path);
+            } else {
+                return this->error("unknown texture type: " + std::string(type));
+            }
+            if (ok) this->out.textures.push_back(t);
+            return ok;
+        }
+
+        bool parse_mesh() {
+            scene_mesh_record m = {};
+            m.scale = 1.0;
+            if (!this->next_path("mesh", m.path) || !this->next_name(this->material_names, "material", m.material)) return false;
+            // The optional position and scale
+            if (this->has_more() && !this->next_numbers(m.offset, 3)) return false;
+            if (this->has_more() && !this->next_number(m.scale)) return false;
+            this->out.meshes.push_back(m);
+            return true;
+        }
+
+        bool parse_material() {
+            scene_material_record m = {};
+            uint32_t index = static_cast<uint32_t>(this->out.materials.size());
+            if (!this->new_name(this->material_names, "material", index)) return false;
+            std::string_view type = this->next_token();
+            bool ok;
+            if (type == "lambertian") {
+                m.type = scene_lambertian;
+                ok = this->next_texture(m.texture);
+            } else if (type == "metal") {
+                m.type = scene_metal;
+                ok = this->next_numbers(m.values, 4);
+            } else if (type == "dielectric") {
+                m.type = scene_dielectric;
+                ok = this->next_number(m.values[0]);
+            } else if (type == "diffuse_light") {
+                m.type = scene_diffuse_light;
+                ok = this->next_texture(m.texture);
+            } else {
+                return this->error("unknown material type: " + std::string(type));
+            }
+            if (ok) this->out.materials.push_back(m);
+            return ok;
+        }
+
+        bool parse_camera() {
+            scene_settings& settings = this->out.settings;
+            for (std::string_view key = this->next_token(); !key.empty(); key = this->next_token()) {
+                bool ok;
+                if (key == "lookfrom") {
+                    ok = this->next_numbers(settings.lookfrom, 3);
+                } else if (key == "lookat") {
+                    ok = this->next_numbers(settings.lookat, 3);
+                } else if (key == "up") {
+                    ok = this->next_numbers(settings.view_up, 3);
+                } else if (key == "vfov") {
+                    ok = this->next_number(settings.vfov);
+                } else if (key == "aperture") {
+                    ok = this->next_number(settings.aperture);
+                } else if (key == "focus") {
+                    ok = this->next_number(settings.focus_distance);
+                } else {
+                    return this->error("unknown camera setting: " + std::string(key));
+                }
+                if (!ok) return false;
+            }
+            return true;
+        }
+};
+
+// A scene read from a text or binary scene file
+// The records are either owned (text) or point into the mapped file (binary); build() does not care which
+class scene_file {
+    public:
+        scene_file() {}
+        ~scene_file() { this->unmap(); }
+        scene_file(const scene_file&) = delete;
+        scene_file& operator=(const scene_file&) = delete;
+
+        // Read `path`: a binary scene if it starts with the magic number, a text scene otherwise
+        bool open(const std::string& path) {
+            uint32_t magic = 0;
+            {
+                std::ifstream in(path, std::ios::binary);
+                if (!in) {
+                    std::cerr << "Cannot open scene file: " << path << std::endl;
+                    return false;
+                }
+                in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+            }
+            if (magic == scene_binary_header::magic_number) return this->map_binary(path);
+
+            scene_text_parser parser(path, this->records);
+            if (!parser.parse()) return false;
+            this->settings = &this->records.settings;
+            this->textures = this->records.textures.data();
+            this->texture_count = this->records.textures.size();
+            this->materials = this->records.materials.data();
+            this->material_count = this->records.materials.size();
+            this->spheres = this->records.spheres.data();
+            this->sphere_count = this->records.spheres.size();
+            this->rects = this->records.rects.data();
+            this->rect_count = this->records.rects.size();
+            this->meshes = this->records.meshes.data();
+            this->mesh_count = this->records.meshes.size();
+            this->strings = this->records.strings.data();
+            this->string_size = this->records.strings.size();
+            return true;
+        }
+
+        const scene_settings& get_settings() const { return *this->settings; }
+        size_t object_count() const { return this->sphere_count + this->rect_count + this->mesh_count; }
+
+        // Create the scene's materials (adding them to `table`) and objects, into `world`
+        // With a `soup`, the spheres go straight into it (except emissive ones, which stay objects so that
+        //  gather_lights() finds them); the soup still has to be finished (see gather_spheres())
+        // Meshes are read from their OBJ files here (their BVHs built with `num_threads`); false if one cannot be
+        bool build(material_table& table, sphere_soup* soup, int num_threads, simd_level level, hittable_list& world) const {
+            // (the arrays are sized first: the objects must not move once they are handed out)
+            shared_ptr<scene_object_storage> storage = make_shared<scene_object_storage>();
+            size_t solid_count = 0, type_counts[4] = {0, 0, 0, 0};
+            for (size_t i=0; i<this->texture_count; i++) {
+                if (this->textures[i].type == scene_solid) solid_count++;
+            }
+            for (size_t i=0; i<this->material_count; i++) type_counts[this->materials[i].type]++;
+            storage->solid_colors.reserve(solid_count);
+            storage->lambertians.reserve(type_counts[scene_lambertian]);
+            storage->metals.reserve(type_counts[scene_metal]);
+            storage->dielectrics.reserve(type_counts[scene_dielectric]);
+            storage->diffuse_lights.reserve(type_counts[scene_diffuse_light]);
+            // A shared_ptr to the last object of `objects`, which keeps the whole storage alive
+            auto share_last = [&storage](auto& objects) {
+                return shared_ptr<typename std::decay_t<decltype(objects)>::value_type>(storage, &objects.back());
+            };
+
+            std::vector<shared_ptr<texture>> texture_objects(this->texture_count);
+            for (size_t i=0; i<this->texture_count; i++) {
+                const scene_texture_record& t = this->textures[i];
+                switch (t.type) {
+                    case scene_checker:
+                        texture_objects[i] = make_shared<checker_texture>(texture_objects[t.even], texture_objects[t.odd]);
+                        break;
+                    case scene_noise:
+                        texture_objects[i] = make_shared<noise_texture>(t.values[0]);
+                        break;
+                    case scene_image:
+                        texture_objects[i] = make_shared<image_texture>(this->strings + t.path);
+                        break;
+                    default:
+                        storage->solid_colors.emplace_back(t.values[0], t.values[1], t.values[2]);
+                        texture_objects[i] = share_last(storage->solid_colors);
+                        break;
+                }
+            }
+
+            std::vector<shared_ptr<material>> material_objects(this->material_count);
+            std::vector<uint32_t> material_ids(this->material_count);
+            table.reserve(this->material_count);
+            for (size_t i=0; i<this->material_count; i++) {
+                const scene_material_record& m = this->materials[i];
+                switch (m.type) {
+                    case scene_metal:
+                        storage->metals.emplace_back(color(m.values[0], m.values[1], m.values[2]), m.values[3]);
+                        material_objects[i] = share_last(storage->metals);
+                        break;
+                    case scene_dielectric:
+                        storage->dielectrics.emplace_back(m.values[0]);
+                        material_objects[i] = share_last(storage->dielectrics);
+                        break;
+                    case scene_diffuse_light:
+                        storage->diffuse_lights.emplace_back(texture_objects[m.texture]);
+                        material_objects[i] = share_last(storage->diffuse_lights);
+                        break;
+                    default:
+                        storage->lambertians.emplace_back(texture_objects[m.texture]);
+                        material_objects[i] = share_last(storage->lambertians);
+                        break;
+                }
+                material_ids[i] = table.add(material_objects[i]);
+            }
+
+            world.clear();
+            if (soup) soup->reserve(this->sphere_count);
+            // (rectangles first: the lights are sampled in the order of the objects, and the scene functions
+            //  make their light rectangles before their light spheres)
+            for (size_t i=0; i<this->rect_count; i++) {
+                const scene_rect_record& r = this->rects[i];
+                const shared_ptr<material>& mat = material_objects[r.material];
+                if (r.axis == 2) {
+                    world.add(make_shared<xy_rect>(r.a0, r.a1, r.b0, r.b1, r.k, mat));
+                } else if (r.axis == 1) {
+                    world.add(make_shared<xz_rect>(r.a0, r.a1, r.b0, r.b1, r.k, mat));
+                } else {
+                    world.add(make_shared<yz_rect>(r.a0, r.a1, r.b0, r.b1, r.k, mat));
+                }
+            }
+            for (size_t i=0; i<this->sphere_count; i++) {
+                const scene_sphere_record& s = this->spheres[i];
+                const point3 center0(s.center0[0], s.center0[1], s.center0[2]);
+                const point3 center1(s.center1[0], s.center1[1], s.center1[2]);
+                if (soup && this->materials[s.material].type != scene_diffuse_light) {
+                    if (s.moving) {
+                        soup->add(center0, center1, s.time0, s.time1, s.radius, material_ids[s.material]);
+                    } else {
+                        soup->add(center0, s.radius, material_ids[s.material]);
+                    }
+                } else if (s.moving) {
+                    world.add(make_shared<moving_sphere>(center0, center1, s.time0, s.time1, s.radius, material_objects[s.material]));
+                } else {
+                    world.add(make_shared<sphere>(center0, s.radius, material_objects[s.material]));
+                }
+            }
+            // An OBJ file used once is read straight into place. One used more often is read once, as it is
+            //  in the file, and every use becomes an instance of it (see instance.h)
+            std::unordered_map<std::string, int> uses;
+            for (size_t i=0; i<this->mesh_count; i++) uses[this->strings + this->meshes[i].path]++;
+            std::unordered_map<std::string, shared_ptr<triangle_mesh>> shared_meshes;
+            for (size_t i=0; i<this->mesh_count; i++) {
+                const scene_mesh_record& m = this->meshes[i];
+                const std::string path = this->strings + m.path;
+                const vec3 offset(m.offset[0], m.offset[1], m.offset[2]);
+                if (uses[path] == 1) {
+                    shared_ptr<triangle_mesh> mesh = load_obj(path, material_objects[m.material], m.scale, offset, num_threads, level);
+                    if (!mesh) return false;
+                    world.add(mesh);
+                    continue;
+                }
+                shared_ptr<triangle_mesh>& mesh = shared_meshes[path];
+                if (!mesh) mesh = load_obj(path, material_objects[m.material], 1.0, vec3(0,0,0), num_threads, level);
+                if (!mesh) return false;
+                world.add(make_shared<instance>(
+                    mesh, affine_transform::translate(offset) * affine_transform::scale(m.scale), material_objects[m.material]
+                ));
+            }
+            return true;
+        }
+
+        // Write the scene in the binary format
+        // As with checkpoints, the file is written next to `path` and renamed over it, so a render job that
+        //  maps `path` never sees half a file
+        bool write_binary(const std::string& path) const {
+            scene_binary_header header = {};
+            header.magic = scene_binary_header::magic_number;
+            header.version = scene_binary_header::current_version;
+            header.settings = *this->settings;
+            uint64_t offset = sizeof(scene_binary_header);
+            auto place = [&offset](uint64_t& section_offset, size_t size) {
+                offset = (offset + 7) & ~uint64_t(7);
+                section_offset = offset;
+                offset += size;
+            };
+            header.texture_count = this->texture_count;
+            place(header.texture_offset, this->texture_count * sizeof(scene_texture_record));
+            header.material_count = this->material_count;
+            place(header.material_offset, this->material_count * sizeof(scene_material_record));
+            header.sphere_count = this->sphere_count;
+            place(header.sphere_offset, this->sphere_count * sizeof(scene_sphere_record));
+            header.rect_count = this->rect_count;
+            place(header.rect_offset, this->rect_count * sizeof(scene_rect_record));
+            header.mesh_count = this->mesh_count;
+            place(header.mesh_offset, this->mesh_count * sizeof(scene_mesh_record));
+            header.string_size = this->string_size;
+            place(header.string_offset, this->string_size);
+
+            std::vector<char> file(offset, 0);
+            std::memcpy(file.data(), &header, sizeof(header));
+            auto copy = [&file](uint64_t section_offset, const void* data, size_t size) {
+                if (size > 0) std::memcpy(file.data() + section_offset, data, size);
+            };
+            copy(header.texture_offset, this->textures, this->texture_count * sizeof(scene_texture_record));
+            copy(header.material_offset, this->materials, this->material_count * sizeof(scene_material_record));
+            copy(header.sphere_offset, this->spheres, this->sphere_count * sizeof(scene_sphere_record));
+            copy(header.rect_offset, this->rects, this->rect_count * sizeof(scene_rect_record));
+            copy(header.mesh_offset, this->meshes, this->mesh_count * sizeof(scene_mesh_record));
+            copy(header.string_offset, this->strings, this->string_size);
+
+            const std::string temporary = path + ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::binary);
+                out.write(file.data(), file.size());
+                out.flush();
+                if (!out) {
+                    std::cerr << "Cannot write scene file: " << temporary << std::endl;
+                    return false;
+                }
+            }
+            if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+                std::cerr << "Cannot rename " << temporary << " to " << path << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // CRC-32 of the scene's records, for checkpoints (so a render is not resumed with another scene file)
+        uint32_t fingerprint() const {
+            uint32_t crc = crc32_update(0, reinterpret_cast<const uint8_t*>(this->settings), sizeof(scene_settings));
+            crc = crc32_update(crc, reinterpret_cast<const uint8_t*>(this->textures), this->texture_count * sizeof(scene_texture_record));
+            crc = crc32_update(crc, reinterpret_cast<const uint8_t*>(this->materials), this->material_count * sizeof(scene_material_record));
+            crc = crc32_update(crc, reinterpret_cast<const uint8_t*>(this->spheres), this->sphere_count * sizeof(scene_sphere_record));
+            crc = crc32_update(crc, reinterpret_cast<const uint8_t*>(this->rects), this->rect_count * sizeof(scene_rect_record));
+            crc = crc32_update(crc, reinterpret_cast<const uint8_t*>(this->meshes), this->mesh_count * sizeof(scene_mesh_record));
+            return crc32_update(crc, reinterpret_cast<const uint8_t*>(this->strings), this->string_size);
+        }
+
+    private:
+        // The records of a text scene
+        scene_records records;
+        // The mapped binary scene (or, without mmap, a copy of it)
+        void* mapping = nullptr;
+        size_t mapping_size = 0;
+        std::vector<uint64_t> file_copy;
+
+        // The records, wherever they are
+        const scene_settings* settings = nullptr;
+        const scene_texture_record* textures = nullptr;
+        size_t texture_count = 0;
+        const scene_material_record* materials = nullptr;
+        size_t material_count = 0;
+        const scene_sphere_record* spheres = nullptr;
+        size_t sphere_count = 0;
+        const scene_rect_record* rects = nullptr;
+        size_t rect_count = 0;
+        const scene_mesh_record* meshes = nullptr;
+        size_t mesh_count = 0;
+        const char* strings = nullptr;
+        size_t string_size = 0;
+
+        void unmap() {
+#if RT_SCENE_MMAP
+            if (this->mapping) munmap(this->mapping, this->mapping_size);
+#endif
+            this->mapping = nullptr;
+        }
+
+        bool map_binary(const std::string& path) {
+            const unsigned char* data = nullptr;
+            size_t size = 0;
+#if RT_SCENE_MMAP
+            int descriptor = ::open(path.c_str(), O_RDONLY);
+            struct stat info;
+            if (descriptor < 0 || fstat(descriptor, &info) != 0) {
+                if (descriptor >= 0) close(descriptor);
+                std::cerr << "Cannot open scene file: " << path << std::endl;
+                return false;
+            }
+            size = static_cast<size_t>(info.st_size);
+            void* mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+            // (the mapping stays valid after the file is closed)
+            close(descriptor);
+            if (mapped == MAP_FAILED) {
+                std::cerr << "Cannot map scene file: " << path << std::endl;
+                return false;
+            }
+            this->mapping = mapped;
+            this->mapping_size = size;
+            data = static_cast<const unsigned char*>(mapped);
+#else
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            size = static_cast<size_t>(in.tellg());
+            in.seekg(0);
+            // (uint64_t elements, so the records are aligned)
+            this->file_copy.resize((size + 7) / 8);
+            in.read(reinterpret_cast<char*>(this->file_copy.data()), size);
+            if (!in) {
+                std::cerr << "Cannot read scene file: " << path << std::endl;
+                return false;
+            }
+            data = reinterpret_cast<const unsigned char*>(this->file_copy.data());
+#endif
+            if (!this->check_binary(data, size)) {
+                std::cerr << "Not a valid binary scene file (or of another version): " << path << std::endl;
+                this->unmap();
+                return false;
+            }
+            return true;
+        }
+
+        // Point the records into the binary file, checking that they are all inside it
+        //  and that every index they hold is in range (build() trusts them)
+        bool check_binary(const unsigned char* data, size_t size) {
+            if (size < sizeof(scene_binary_header)) return false;
+            const scene_binary_header& header = *reinterpret_cast<const scene_binary_header*>(data);
+            if (header.magic != scene_binary_header::magic_number || header.version != scene_binary_header::current_version) {
+                return false;
+            }
+            auto section = [data, size](uint64_t offset, uint64_t count, size_t record_size, const void*& out) {
+                if (offset % 8 != 0 || offset > size || count > (size - offset) / record_size) return false;
+                out = data + offset;
+                return true;
+            };
+            const void* textures;
+            const void* materials;
+            const void* spheres;
+            const void* rects;
+            const void* meshes;
+            const void* strings;
+            if (!section(header.texture_offset, header.texture_count, sizeof(scene_texture_record), textures)
+                || !section(header.material_offset, header.material_count, sizeof(scene_material_record), materials)
+                || !section(header.sphere_offset, header.sphere_count, sizeof(scene_sphere_record), spheres)
+                || !section(header.rect_offset, header.rect_count, sizeof(scene_rect_record), rects)
+                || !section(header.mesh_offset, header.mesh_count, sizeof(scene_mesh_record), meshes)
+                || !section(header.string_offset, header.string_size, 1, strings)) {
+                return false;
+            }
+            this->settings = &header.settings;
+            this->textures = static_cast<const scene_texture_record*>(textures);
+            this->texture_count = header.texture_count;
+            this->materials = static_cast<const scene_material_record*>(materials);
+            this->material_count = header.material_count;
+            this->spheres = static_cast<const scene_sphere_record*>(spheres);
+            this->sphere_count = header.sphere_count;
+            this->rects = static_cast<const scene_rect_record*>(rects);
+            this->rect_count = header.rect_count;
+            this->meshes = static_cast<const scene_mesh_record*>(meshes);
+            this->mesh_count = header.mesh_count;
+            this->strings = static_cast<const char*>(strings);
+            this->string_size = header.string_size;
+
+            // Checkers only refer to textures before them; paths end inside the strings
+            auto valid_path = [this](uint32_t path) {
+                return path < this->string_size && std::memchr(this->strings + path, '\0', this->string_size - path);
+            };
+            for (size_t i=0; i<this->texture_count; i++) {
+                const scene_texture_record& t = this->textures[i];
+                if (t.type > scene_image) return false;
+                if (t.type == scene_checker && (t.even >= i || t.odd >= i)) return false;
+                if (t.type == scene_image && !valid_path(t.path)) return false;
+            }
+            for (size_t i=0; i<this->material_count; i++) {
+                const scene_material_record& m = this->materials[i];
+                if (m.type > scene_diffuse_light) return false;
+                if ((m.type == scene_lambertian || m.type == scene_diffuse_light) && m.texture >= this->texture_count) return false;
+            }
+            for (size_t i=0; i<this->sphere_count; i++) {
+                if (this->spheres[i].material >= this->material_count) return false;
+            }
+            for (size_t i=0; i<this->rect_count; i++) {
+                if (this->rects[i].material >= this->material_count || this->rects[i].axis > 2) return false;
+            }
+            for (size_t i=0; i<this->mesh_count; i++) {
+                if (this->meshes[i].material >= this->material_count || !valid_path(this->meshes[i].path)) return false;
+            }
+            return true;
+        }
+};
+
+#endif // header guard
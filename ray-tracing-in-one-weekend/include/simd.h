@@ -0,0 +1,88 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <algorithm>
+#include <string>
+
+// Runtime selection of SIMD code paths
+// The program is compiled for the baseline x86-64 instruction set (SSE2), and functions that use AVX2
+//  are compiled with __attribute__((target("avx2"))), so one binary runs on every x86-64 CPU
+//  and picks the widest instructions the CPU has when it starts
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_X86_SIMD 1
+#include <immintrin.h>
+// Compile one function for AVX2 (only call it if the CPU has AVX2)
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RT_X86_SIMD 0
+#define RT_TARGET_AVX2
+#endif
+
+// Instruction sets, from narrowest to widest
+enum class simd_level {
+    scalar,
+    sse,
+    avx2
+};
+
+// The widest instruction set this CPU supports
+simd_level detect_simd_level() {
+#if RT_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+    return simd_level::sse;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+const char* simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::avx2: return "avx2";
+        case simd_level::sse: return "sse";
+        default: return "scalar";
+    }
+}
+
+// Parse "auto", "scalar", "sse" or "avx2" into `level`
+// Asking for more than the CPU has gives the CPU's best; returns false for an unknown name
+bool parse_simd_level(const std::string& name, simd_level& level) {
+    simd_level best = detect_simd_level();
+    if (name == "auto") {
+        level = best;
+    } else if (name == "scalar") {
+        level = simd_level::scalar;
+    } else if (name == "sse") {
+        level = std::min(simd_level::sse, best);
+    } else if (name == "avx2") {
+        level = std::min(simd_level::avx2, best);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#if RT_X86_SIMD
+// Loads of geometry stored as `real` (double, or float with RT_PRECISION=float, see precision.h), widened to
+//  double: the intersection math is in double either way
+// 2 values (SSE2)
+__m128d load2_pd(const double* p) { return _mm_loadu_pd(p); }
+__m128d load2_pd(const float* p) {
+    return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+}
+// 4 values (AVX2)
+RT_TARGET_AVX2 __m256d load4_pd(const double* p) { return _mm256_loadu_pd(p); }
+RT_TARGET_AVX2 __m256d load4_pd(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+// 4 values at base[index[0]], ..., base[index[3]] (AVX2)
+// (the masked form, with all lanes on: GCC's _mm256_i32gather_pd() starts from _mm256_undefined_pd(), and
+//  -Wmaybe-uninitialized warns about that wherever it is inlined)
+RT_TARGET_AVX2 __m256d gather4_pd(const double* base, __m128i index) {
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, index, all, 8);
+}
+RT_TARGET_AVX2 __m256d gather4_pd(const float* base, __m128i index) {
+    return _mm256_cvtps_pd(_mm_i32gather_ps(base, index, 4));
+}
+#endif
+
+#endif // header guard
@@ -2,8 +2,19 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material_table.h"
 #include "ray.h"
 
+// Partial derivatives of a point on a sphere along the texture coordinates of sphere::get_sphere_uv()
+// `n` is the point on a sphere of radius 1 centered at the origin (the outward normal)
+// With phi = 2*pi*u - pi and theta = pi*v, the point is center + radius * (sin(theta) cos(phi), -cos(theta), -sin(theta) sin(phi))
+inline void sphere_uv_partials(const vec3& n, double radius, vec3& dpdu, vec3& dpdv) {
+    dpdu = (2*pi*radius) * vec3(n.z(), 0, -n.x());
+    // sin(theta) (0 at the poles, where u has no effect)
+    double sin_theta = fmax(sqrt(n.x()*n.x() + n.z()*n.z()), 1e-8);
+    dpdv = (pi*radius) * vec3(-n.x()*n.y() / sin_theta, sin_theta, -n.y()*n.z() / sin_theta);
+}
+
 // public inheritance: make the parent/base class's public methods public in this child/derived class
 //  and protected members in the base class remain protected in the derived class
 class sphere : public hittable {
@@ -14,6 +25,8 @@ class sphere : public hittable {
         // The material type of this sphere, which tells us how incident rays
         // that hit the sphere surface will be reflected/absored
         shared_ptr<material> mat_ptr;
+        // Its ID in the scene's material table (see register_materials())
+        uint32_t material_id = 0;
 
         // Constructors
         sphere() {}
@@ -21,10 +34,18 @@ class sphere : public hittable {
             center(center), radius(radius), mat_ptr(m) {};
 
         // Indicate that the virtual method will be implemented by replacing `= 0` with `override`
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override;
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->mat_ptr);
+        }
+
+        // Light sampling: directions are sampled uniformly in the cone of directions that see the sphere
+        virtual const material* get_material() const override { return this->mat_ptr.get(); }
+        virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+        virtual vec3 sample_direction(const point3& origin, double u1, double u2) const override;
 
-    private:
         // Convert a Cartesian coordinate on the sphere's surface to texture coordinates (u,v)
         // Args:
         //  p: a point on the surface of a sphere of radius 1, centered around the origin
@@ -49,6 +70,17 @@ class sphere : public hittable {
             // theta's range is [0, pi]
             v = theta / pi; 
         }
+
+    private:
+        // Cosine of the half-angle of the cone from `origin` that the sphere fills
+        //  (returns false if `origin` is inside the sphere, where the whole sphere of directions sees it)
+        bool cos_theta_max(const point3& origin, double& cos_theta) const {
+            double distance_squared = (this->center - origin).length_squared();
+            double radius_squared = this->radius * this->radius;
+            if (distance_squared <= radius_squared) return false;
+            cos_theta = sqrt(1.0 - radius_squared / distance_squared);
+            return true;
+        }
 };
 
 // Implementation of virtual function
@@ -62,7 +94,8 @@ class sphere : public hittable {
 //  and where h = B dot (A - C) (from the quadtratic equation we want to solve)
 //  b = 2 * (B(A-C))
 //  b = 2h -> h = B(A-C)
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Only finds `t`; compute_interaction() fills in the rest of the hit record
+bool sphere::intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const {
     // Solve quadratic equation: ax^2 + bx + c = 0
     
     // A - C, where A is from the ray equation: P(t) = A + t*b
@@ -83,8 +116,6 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     if (discriminant < 0.0) {
         return false;
     } else {
-        // Populate the hit_record
-
         // Solve the quadratic equation and compute the closest `t`
         //  within the range t_min and t_max
         // Compute the first root
@@ -97,37 +128,44 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
                 // Both roots are out of range
                 return false;
             } else {
-                rec.t = second_root;
+                hit.t = second_root;
             }
         } else {
-            rec.t = first_root;
+            hit.t = first_root;
         }
-
-        // Get the normal vector at the point where the ray intersects the sphere
-        rec.p = r.at(rec.t); // point of intersection
-        
-        // Get each component (x, y, z) to be in range -1 to 1 (unit vector)
-        // The hit_point - sphere_center gives us the direction from the center to the surface
-        //  where the ray intersects the sphere
-        vec3 outward_normal = (rec.p - this->center) / radius;
-        // Surface-side determination.
-        //  Retain the information of where the ray came from (inside or outside the sphere)
-        //   and set the normal to be in the opposite direction of the ray.
-        rec.set_face_normal(r, outward_normal);
-
-        // Set the textured coordinate values
-        // (my guess) Here we use the outward_normal (instead of the hit point),
-        //  because it still points to the surface of the sphere
-        //  and it is normalized (length=1)
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-
-        // Set the material type of this sphere to the hit record
-        rec.mat_ptr = this->mat_ptr;
+        hit.object = this;
+        hit.primitive = 0;
 
         return true;
     }
 }
 
+// The surface interaction at hit.t, once intersect() found that it is the closest hit
+void sphere::compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const {
+    // Get the normal vector at the point where the ray intersects the sphere
+    surface.p = r.at(hit.t); // point of intersection
+
+
+    // Get each component (x, y, z) to be in range -1 to 1 (unit vector)
+    // The hit_point - sphere_center gives us the direction from the center to the surface
+    //  where the ray intersects the sphere
+    vec3 outward_normal = (surface.p - this->center) / radius;
+    // Surface-side determination.
+    //  Retain the information of where the ray came from (inside or outside the sphere)
+    //   and set the normal to be in the opposite direction of the ray.
+    surface.set_face_normal(r, outward_normal);
+
+    // Set the textured coordinate values
+    // (my guess) Here we use the outward_normal (instead of the hit point),
+    //  because it still points to the surface of the sphere
+    //  and it is normalized (length=1)
+    get_sphere_uv(outward_normal, surface.u, surface.v);
+    sphere_uv_partials(outward_normal, this->radius, surface.dpdu, surface.dpdv);
+
+    // Set the material type of this sphere to the surface interaction
+    surface.material_id = this->material_id;
+}
+
 // Create a bounding box that encapsulates this sphere
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     // The slab of the bounding box for each axis:
@@ -139,4 +177,37 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     return true; 
 }
 
+// Solid angle pdf of the cone sampling in sample_direction(): 1 / (solid angle of the cone)
+// Points inside the sphere are not sampled toward it (pdf 0)
+// (only whether the direction hits the sphere matters, so the surface interaction is skipped)
+double sphere::pdf_value(const point3& origin, const vec3& direction) const {
+    closest_hit hit;
+    double cos_theta;
+    if (!this->cos_theta_max(origin, cos_theta) || !this->intersect(ray(origin, direction), 0.001, infinity, hit)) {
+        return 0.0;
+    }
+    double solid_angle = 2*pi * (1.0 - cos_theta);
+    return 1.0 / solid_angle;
+}
+
+// A direction uniformly in the cone around the direction to the center, whose half-angle is
+//  the angle from that direction to the sphere's silhouette
+vec3 sphere::sample_direction(const point3& origin, double u1, double u2) const {
+    vec3 to_center = this->center - origin;
+    double cos_theta;
+    if (!this->cos_theta_max(origin, cos_theta)) return to_center;
+
+    // Orthonormal basis (u, v, w) with w toward the center
+    vec3 w = unit_vector(to_center);
+    vec3 a = (fabs(w.x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 v = unit_vector(cross(w, a));
+    vec3 u = cross(w, v);
+
+    // Uniform in the cone: cos(angle from w) is uniform in [cos_theta, 1]
+    double z = 1.0 + u2 * (cos_theta - 1.0);
+    double phi = 2*pi * u1;
+    double r = sqrt(fmax(0.0, 1.0 - z*z));
+    return r*cos(phi) * u + r*sin(phi) * v + z * w;
+}
+
 #endif // header guard
@@ -0,0 +1,494 @@
+#ifndef SPHERE_SOUP_H
+#define SPHERE_SOUP_H
+
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "simd.h"
+
+// Spheres tested in batches of this many
+constexpr int sphere_batch_size = 8;
+
+// Read-only view of a soup's arrays, for the batch intersection functions
+// The geometry is stored as `real` (see precision.h) and widened to double for the math
+struct sphere_soup_arrays {
+    const real* center[3];
+    // center1 - center0 (0 for spheres that do not move)
+    const real* motion[3];
+    const double* time0;
+    // time1 - time0
+    const double* time_interval;
+    const real* radius;
+    // Every sphere has the same time0 and time_interval (then the time percent is computed once per ray)
+    bool uniform_time;
+};
+
+// Intersect a ray with the spheres [first, first + count) (count <= sphere_batch_size) and write each sphere's
+//  nearest root in [t_min, t_max] to roots (infinity if it misses)
+// The SIMD versions round count up to whole vectors
+// The math is the same as sphere::intersect() and moving_sphere::intersect(), operation for operation,
+//  so every version finds exactly the same roots
+// Lanes past the end of the soup read padding spheres whose center is NaN, which never hit
+void sphere_batch_roots_scalar(
+    const sphere_soup_arrays& s, size_t first, int count, const ray& r, double t_min, double t_max, double* roots
+) {
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const double time = r.time();
+    const double uniform_time_percent = (time - s.time0[first]) / s.time_interval[first];
+    for (int k=0; k<count; k++) {
+        size_t i = first + k;
+        double time_percent = s.uniform_time ? uniform_time_percent : (time - s.time0[i]) / s.time_interval[i];
+        double oc[3];
+        for (int a=0; a<3; a++) {
+            double center = s.center[a][i] + time_percent * s.motion[a][i];
+            oc[a] = origin[a] - center;
+        }
+        double a = direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2];
+        double half_b = direction[0]*oc[0] + direction[1]*oc[1] + direction[2]*oc[2];
+        double radius = s.radius[i];
+        double c = (oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2]) - radius*radius;
+        double discriminant = half_b*half_b - a*c;
+
+        roots[k] = infinity;
+        if (!(discriminant >= 0.0)) continue;
+        double sqrt_discriminant = std::sqrt(discriminant);
+        double first_root = (-half_b - sqrt_discriminant) / a;
+        double second_root = (-half_b + sqrt_discriminant) / a;
+        if (first_root >= t_min && first_root <= t_max) {
+            roots[k] = first_root;
+        } else if (second_root >= t_min && second_root <= t_max) {
+            roots[k] = second_root;
+        }
+    }
+}
+
+#if RT_X86_SIMD
+// SSE2: 2 spheres per instruction
+void sphere_batch_roots_sse(
+    const sphere_soup_arrays& s, size_t first, int count, const ray& r, double t_min, double t_max, double* roots
+) {
+    const __m128d origin[3] = {
+        _mm_set1_pd(r.origin()[0]), _mm_set1_pd(r.origin()[1]), _mm_set1_pd(r.origin()[2])
+    };
+    const __m128d direction[3] = {
+        _mm_set1_pd(r.direction()[0]), _mm_set1_pd(r.direction()[1]), _mm_set1_pd(r.direction()[2])
+    };
+    const __m128d time = _mm_set1_pd(r.time());
+    const __m128d t_min_v = _mm_set1_pd(t_min);
+    const __m128d t_max_v = _mm_set1_pd(t_max);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d miss = _mm_set1_pd(infinity);
+    const __m128d a = _mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(direction[0], direction[0]), _mm_mul_pd(direction[1], direction[1])),
+        _mm_mul_pd(direction[2], direction[2])
+    );
+
+    const __m128d uniform_time_percent = _mm_set1_pd((r.time() - s.time0[first]) / s.time_interval[first]);
+
+    for (int k=0; k<count; k+=2) {
+        size_t i = first + k;
+        __m128d time_percent = s.uniform_time ? uniform_time_percent : _mm_div_pd(
+            _mm_sub_pd(time, _mm_loadu_pd(s.time0 + i)), _mm_loadu_pd(s.time_interval + i)
+        );
+        __m128d oc[3];
+        for (int axis=0; axis<3; axis++) {
+            __m128d center = _mm_add_pd(
+                load2_pd(s.center[axis] + i), _mm_mul_pd(time_percent, load2_pd(s.motion[axis] + i))
+            );
+            oc[axis] = _mm_sub_pd(origin[axis], center);
+        }
+        __m128d half_b = _mm_add_pd(_mm_add_pd(
+            _mm_mul_pd(direction[0], oc[0]), _mm_mul_pd(direction[1], oc[1])), _mm_mul_pd(direction[2], oc[2])
+        );
+        __m128d radius = load2_pd(s.radius + i);
+        __m128d c = _mm_sub_pd(
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(oc[0], oc[0]), _mm_mul_pd(oc[1], oc[1])), _mm_mul_pd(oc[2], oc[2])),
+            _mm_mul_pd(radius, radius)
+        );
+        __m128d discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        __m128d has_roots = _mm_cmpge_pd(discriminant, zero);
+        // Most spheres miss: skip the square root and divisions if all of them do
+        if (_mm_movemask_pd(has_roots) == 0) {
+            _mm_storeu_pd(roots + k, miss);
+            continue;
+        }
+        // Negative discriminants give NaN roots, which fail the range tests below
+        __m128d sqrt_discriminant = _mm_sqrt_pd(discriminant);
+        __m128d minus_half_b = _mm_sub_pd(zero, half_b);
+        __m128d first_root = _mm_div_pd(_mm_sub_pd(minus_half_b, sqrt_discriminant), a);
+        __m128d second_root = _mm_div_pd(_mm_add_pd(minus_half_b, sqrt_discriminant), a);
+        __m128d first_ok = _mm_and_pd(_mm_cmpge_pd(first_root, t_min_v), _mm_cmple_pd(first_root, t_max_v));
+        __m128d second_ok = _mm_and_pd(_mm_cmpge_pd(second_root, t_min_v), _mm_cmple_pd(second_root, t_max_v));
+        // first root if it is in range, else the second root if it is, else a miss
+        __m128d root = _mm_or_pd(_mm_and_pd(second_ok, second_root), _mm_andnot_pd(second_ok, miss));
+        root = _mm_or_pd(_mm_and_pd(first_ok, first_root), _mm_andnot_pd(first_ok, root));
+        root = _mm_or_pd(_mm_and_pd(has_roots, root), _mm_andnot_pd(has_roots, miss));
+        _mm_storeu_pd(roots + k, root);
+    }
+}
+
+// AVX2: 4 spheres per instruction, the batch of 8 in two steps
+RT_TARGET_AVX2
+void sphere_batch_roots_avx2(
+    const sphere_soup_arrays& s, size_t first, int count, const ray& r, double t_min, double t_max, double* roots
+) {
+    const __m256d origin[3] = {
+        _mm256_set1_pd(r.origin()[0]), _mm256_set1_pd(r.origin()[1]), _mm256_set1_pd(r.origin()[2])
+    };
+    const __m256d direction[3] = {
+        _mm256_set1_pd(r.direction()[0]), _mm256_set1_pd(r.direction()[1]), _mm256_set1_pd(r.direction()[2])
+    };
+    const __m256d time = _mm256_set1_pd(r.time());
+    const __m256d t_min_v = _mm256_set1_pd(t_min);
+    const __m256d t_max_v = _mm256_set1_pd(t_max);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d miss = _mm256_set1_pd(infinity);
+    const __m256d a = _mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(direction[0], direction[0]), _mm256_mul_pd(direction[1], direction[1])),
+        _mm256_mul_pd(direction[2], direction[2])
+    );
+
+    const __m256d uniform_time_percent = _mm256_set1_pd((r.time() - s.time0[first]) / s.time_interval[first]);
+
+    for (int k=0; k<count; k+=4) {
+        size_t i = first + k;
+        __m256d time_percent = s.uniform_time ? uniform_time_percent : _mm256_div_pd(
+            _mm256_sub_pd(time, _mm256_loadu_pd(s.time0 + i)), _mm256_loadu_pd(s.time_interval + i)
+        );
+        __m256d oc[3];
+        for (int axis=0; axis<3; axis++) {
+            __m256d center = _mm256_add_pd(
+                load4_pd(s.center[axis] + i),
+                _mm256_mul_pd(time_percent, load4_pd(s.motion[axis] + i))
+            );
+            oc[axis] = _mm256_sub_pd(origin[axis], center);
+        }
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(
+            _mm256_mul_pd(direction[0], oc[0]), _mm256_mul_pd(direction[1], oc[1])),
+            _mm256_mul_pd(direction[2], oc[2])
+        );
+        __m256d radius = load4_pd(s.radius + i);
+        __m256d c = _mm256_sub_pd(
+            _mm256_add_pd(_mm256_add_pd(
+                _mm256_mul_pd(oc[0], oc[0]), _mm256_mul_pd(oc[1], oc[1])), _mm256_mul_pd(oc[2], oc[2])
+            ),
+            _mm256_mul_pd(radius, radius)
+        );
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+        __m256d has_roots = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+        if (_mm256_movemask_pd(has_roots) == 0) {
+            _mm256_storeu_pd(roots + k, miss);
+            continue;
+        }
+        __m256d sqrt_discriminant = _mm256_sqrt_pd(discriminant);
+        __m256d minus_half_b = _mm256_sub_pd(zero, half_b);
+        __m256d first_root = _mm256_div_pd(_mm256_sub_pd(minus_half_b, sqrt_discriminant), a);
+        __m256d second_root = _mm256_div_pd(_mm256_add_pd(minus_half_b, sqrt_discriminant), a);
+        __m256d first_ok = _mm256_and_pd(
+            _mm256_cmp_pd(first_root, t_min_v, _CMP_GE_OQ), _mm256_cmp_pd(first_root, t_max_v, _CMP_LE_OQ)
+        );
+        __m256d second_ok = _mm256_and_pd(
+            _mm256_cmp_pd(second_root, t_min_v, _CMP_GE_OQ), _mm256_cmp_pd(second_root, t_max_v, _CMP_LE_OQ)
+        );
+        __m256d root = _mm256_blendv_pd(miss, second_root, second_ok);
+        root = _mm256_blendv_pd(root, first_root, first_ok);
+        root = _mm256_blendv_pd(miss, root, has_roots);
+        _mm256_storeu_pd(roots + k, root);
+    }
+}
+#endif
+
+// Many spheres (still or moving) in one hittable, stored as structure-of-arrays
+// Instead of one heap object per sphere behind a virtual hit(), the centers, motion, radii and
+//  material IDs sit in flat arrays, and 8 spheres are intersected at a time with SIMD instructions.
+// With `build_tree`, the spheres are put in a linear BVH whose leaves are (at most) one batch of 8;
+//  otherwise every ray tests every batch (a flat list).
+class sphere_soup : public hittable {
+    public:
+        // Constructors
+        sphere_soup(simd_level level=detect_simd_level()): level(level) {}
+
+        // Add a sphere that does not move
+        // (`material_id`: the sphere's material in the scene's material table)
+        void add(const point3& center, double radius, uint32_t material_id) {
+            this->add(center, center, 0.0, 1.0, radius, material_id);
+        }
+
+        // Add a sphere that moves from center0 at time0 to center1 at time1
+        void add(
+            const point3& center0, const point3& center1, double time0, double time1,
+            double radius, uint32_t material_id
+        ) {
+            for (int a=0; a<3; a++) {
+                this->center[a].push_back(center0[a]);
+                this->motion[a].push_back(center1[a] - center0[a]);
+            }
+            this->time0.push_back(time0);
+            this->time_interval.push_back(time1 - time0);
+            this->radius.push_back(radius);
+            this->material_ids.push_back(material_id);
+        }
+
+        // Number of spheres (without the padding)
+        size_t size() const { return this->material_ids.size(); }
+
+        // Make room for `count` more spheres (and the padding), ex. before adding a whole scene file
+        void reserve(size_t count) {
+            count += this->size() + sphere_batch_size;
+            for (int a=0; a<3; a++) {
+                this->center[a].reserve(count);
+                this->motion[a].reserve(count);
+            }
+            this->time0.reserve(count);
+            this->time_interval.reserve(count);
+            this->radius.reserve(count);
+            this->material_ids.reserve(count);
+        }
+
+        // Call after the last add(): pad the arrays to whole batches, and build the BVH if asked
+        // With `motion_segments`, a BVH over moving spheres also gets per-segment boxes (see segmented_motion_bvh)
+        void finish(double time0, double time1, bool build_tree, int num_threads=1, bool motion_segments=false) {
+            const size_t count = this->size();
+
+            if (build_tree && count > 0) {
+                // (with motion, the tree is built over the spheres in the middle of the interval and refit
+                //  afterwards, see segmented_motion_bvh)
+                bool any_moving = false;
+                for (size_t i=0; i<count && !any_moving; i++) {
+                    any_moving = this->motion[0][i] != 0.0 || this->motion[1][i] != 0.0 || this->motion[2][i] != 0.0;
+                }
+                const bool segmented = motion_segments && any_moving && time1 > time0;
+                const double middle = 0.5 * (time0 + time1);
+                std::vector<aabb> boxes(count);
+                for (size_t i=0; i<count; i++) {
+                    boxes[i] = segmented ? this->sphere_box(i, middle, middle) : this->sphere_box(i, time0, time1);
+                }
+                bvh_builder::options opts;
+                opts.max_leaf_size = 8;
+                // A batch of 8 costs about as much as 2 spheres tested one at a time
+                opts.intersection_cost = 0.25;
+                opts.num_threads = num_threads;
+                bvh_builder builder(boxes, opts);
+                std::unique_ptr<bvh_build_node> root = builder.build();
+                this->stats = builder.stats();
+                this->reorder(builder.primitive_order());
+                flatten_bvh(*root, this->nodes);
+                if (segmented) {
+                    this->segments.build(this->nodes, count, time0, time1, [this](size_t i, double t0, double t1) {
+                        return this->sphere_box(i, t0, t1);
+                    });
+                }
+            }
+
+            // Still spheres take the time range of the moving ones, so that usually all spheres share one
+            //  (a still sphere is at its center at any time)
+            this->uniform_time = true;
+            bool found_moving = false;
+            double shared_time0 = 0.0, shared_interval = 1.0;
+            for (size_t i=0; i<count; i++) {
+                bool moves = this->motion[0][i] != 0.0 || this->motion[1][i] != 0.0 || this->motion[2][i] != 0.0;
+                if (!moves) continue;
+                if (!found_moving) {
+                    shared_time0 = this->time0[i];
+                    shared_interval = this->time_interval[i];
+                    found_moving = true;
+                } else if (this->time0[i] != shared_time0 || this->time_interval[i] != shared_interval) {
+                    this->uniform_time = false;
+                }
+            }
+            if (this->uniform_time) {
+                std::fill(this->time0.begin(), this->time0.end(), shared_time0);
+                std::fill(this->time_interval.begin(), this->time_interval.end(), shared_interval);
+            }
+
+            this->box = aabb::empty();
+            for (size_t i=0; i<count; i++) {
+                this->box = surrounding_box(this->box, this->sphere_box(i, time0, time1));
+            }
+
+            // A batch can start at any sphere, so pad with a whole batch of spheres that never hit
+            const real nan = std::numeric_limits<real>::quiet_NaN();
+            for (int k=0; k<sphere_batch_size; k++) {
+                for (int a=0; a<3; a++) {
+                    this->center[a].push_back(nan);
+                    this->motion[a].push_back(0.0);
+                }
+                this->time0.push_back(shared_time0);
+                this->time_interval.push_back(shared_interval);
+                this->radius.push_back(0.0);
+            }
+        }
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            if (this->nodes.empty()) {
+                bool hit_anything = false;
+                const size_t count = this->size();
+                for (size_t first=0; first<count; first+=sphere_batch_size) {
+                    size_t batch = std::min<size_t>(sphere_batch_size, count - first);
+                    if (this->batch_hit(first, batch, r, t_min, t_max, hit)) hit_anything = true;
+                }
+                return hit_anything;
+            }
+            const std::vector<linear_bvh_node>& nodes = this->segments.empty() ? this->nodes : this->segments.at(r.time());
+            return traverse_linear_bvh(nodes, r, t_min, t_max, [&](uint32_t first, uint32_t count, double& t_closest) {
+                return this->batch_hit(first, count, r, t_min, t_closest, hit);
+            });
+        }
+
+        // The closest sphere of [first, first + count) (at most one batch) within [t_min, t_max], if any;
+        //  on a hit, `hit` is set and t_max lowered to it
+        bool batch_hit(size_t first, size_t count, const ray& r, double t_min, double& t_max, closest_hit& hit) const {
+            alignas(32) double roots[sphere_batch_size];
+            this->batch_roots(first, static_cast<int>(count), r, t_min, t_max, roots);
+            bool hit_batch = false;
+            // In order, and a tie goes to the later sphere, as when testing one sphere at a time
+            for (size_t k=0; k<count; k++) {
+                if (roots[k] <= t_max && roots[k] != infinity) {
+                    t_max = roots[k];
+                    hit.primitive = static_cast<uint32_t>(first + k);
+                    hit_batch = true;
+                }
+            }
+            if (hit_batch) {
+                hit.t = t_max;
+                hit.object = this;
+            }
+            return hit_batch;
+        }
+
+        // The point, normal, texture coordinates and material of the closest sphere only
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override {
+            const size_t i = hit.primitive;
+            point3 current_center = this->center_at(i, r.time());
+            surface.p = r.at(hit.t);
+            vec3 outward_normal = (surface.p - current_center) / this->radius[i];
+            surface.set_face_normal(r, outward_normal);
+            sphere::get_sphere_uv(outward_normal, surface.u, surface.v);
+            sphere_uv_partials(outward_normal, this->radius[i], surface.dpdu, surface.dpdv);
+            surface.material_id = this->material_ids[i];
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = this->box;
+            return true;
+        }
+
+        // The BVH nodes for the whole shutter interval (empty without a tree), whose leaves are batches for
+        //  batch_hit(), for other traversals (see packet.h)
+        const std::vector<linear_bvh_node>& get_nodes() const { return this->nodes; }
+
+        // Statistics of the BVH build (if there is a tree)
+        bvh_build_stats stats;
+
+    private:
+        // Structure-of-arrays sphere data (index = sphere), padded by one batch in finish()
+        // Positions and radii in the precision of the geometry (float with RT_PRECISION=float), times in double
+        std::vector<real> center[3];
+        std::vector<real> motion[3];
+        std::vector<double> time0;
+        std::vector<double> time_interval;
+        std::vector<real> radius;
+        // ID in the scene's material table (many spheres share a material)
+        std::vector<uint32_t> material_ids;
+
+        std::vector<linear_bvh_node> nodes;
+        // The same nodes per segment of the shutter interval, if spheres move
+        segmented_motion_bvh segments;
+        aabb box;
+        simd_level level;
+        bool uniform_time = false;
+
+        point3 center_at(size_t i, double time) const {
+            double time_percent = (time - this->time0[i]) / this->time_interval[i];
+            return point3(
+                this->center[0][i] + time_percent * this->motion[0][i],
+                this->center[1][i] + time_percent * this->motion[1][i],
+                this->center[2][i] + time_percent * this->motion[2][i]
+            );
+        }
+
+        aabb sphere_box(size_t i, double time0, double time1) const {
+            // (hollow glass spheres have a negative radius)
+            double r = std::fabs(this->radius[i]);
+            vec3 extent(r, r, r);
+            point3 c0 = this->center_at(i, time0);
+            point3 c1 = this->center_at(i, time1);
+            return surrounding_box(aabb(c0 - extent, c0 + extent), aabb(c1 - extent, c1 + extent));
+        }
+
+        // Put the spheres in the order of the BVH leaves
+        void reorder(const std::vector<size_t>& order) {
+            auto permute = [&order](auto& values) {
+                auto old_values = values;
+                for (size_t i=0; i<order.size(); i++) {
+                    values[i] = old_values[order[i]];
+                }
+            };
+            for (int a=0; a<3; a++) {
+                permute(this->center[a]);
+                permute(this->motion[a]);
+            }
+            permute(this->time0);
+            permute(this->time_interval);
+            permute(this->radius);
+            permute(this->material_ids);
+        }
+
+        void batch_roots(size_t first, int count, const ray& r, double t_min, double t_max, double* roots) const {
+            const sphere_soup_arrays arrays = {
+                {this->center[0].data(), this->center[1].data(), this->center[2].data()},
+                {this->motion[0].data(), this->motion[1].data(), this->motion[2].data()},
+                this->time0.data(), this->time_interval.data(), this->radius.data(), this->uniform_time
+            };
+#if RT_X86_SIMD
+            if (this->level == simd_level::avx2) return sphere_batch_roots_avx2(arrays, first, count, r, t_min, t_max, roots);
+            if (this->level == simd_level::sse) return sphere_batch_roots_sse(arrays, first, count, r, t_min, t_max, roots);
+#endif
+            sphere_batch_roots_scalar(arrays, first, count, r, t_min, t_max, roots);
+        }
+};
+
+// Move the spheres and moving spheres of `list` into one sphere soup
+// Other objects are left as they are; returns the list unchanged if it has no spheres
+// (call after register_materials(): the soup keeps the spheres' material IDs)
+// `soup` may already hold spheres that never were objects (ex. from a scene file, see scene_file.h);
+//  the spheres of the list join them
+// With `motion`, the soup's BVH gets motion segments if any of its spheres move
+hittable_list gather_spheres(
+    const hittable_list& list, double time0, double time1, bool build_tree, int num_threads, simd_level level,
+    shared_ptr<sphere_soup> soup = nullptr, bool motion = false
+) {
+    if (!soup) soup = make_shared<sphere_soup>(level);
+    hittable_list others;
+    for (const shared_ptr<hittable>& object : list.objects) {
+        if (const sphere* s = dynamic_cast<const sphere*>(object.get())) {
+            soup->add(s->center, s->radius, s->material_id);
+        } else if (const moving_sphere* m = dynamic_cast<const moving_sphere*>(object.get())) {
+            soup->add(m->center0, m->center1, m->time0, m->time1, m->radius, m->material_id);
+        } else {
+            others.add(object);
+        }
+    }
+    if (soup->size() == 0) return list;
+
+    soup->finish(time0, time1, build_tree, num_threads, motion);
+    if (build_tree) soup->stats.print(std::cerr, "Sphere soup BVH");
+    std::cerr << "Sphere soup: " << soup->size() << " spheres, " << simd_level_name(level) << " batches" << std::endl;
+    others.add(soup);
+    return others;
+}
+
+#endif // header guard
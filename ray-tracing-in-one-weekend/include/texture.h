@@ -1,16 +1,70 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
 #include "rtweekend.h"
 #include "perlin.h"
 #include "rtw_stb_image.h" // image utility stb_image
+#include "mipmap.h"
+
+
+// The part of a texture that a lookup covers: how much (u,v) changes from the pixel to its neighbours
+//  to the right (x) and above (y) (see surface_interaction::compute_differentials()); all zeros is a single point
+struct texture_footprint {
+    double dudx = 0.0;
+    double dvdx = 0.0;
+    double dudy = 0.0;
+    double dvdy = 0.0;
+};
 
+class texture_table;
 
 // Abstract base class for a texture
 class texture {
     public:
         // (u,v) is the surface coordinate of the ray hit point
         virtual color value(double u, double v, const point3& p) const = 0;
+
+        // value() averaged over `footprint`, for textures that can filter (ex. image_texture)
+        // The others ignore the footprint
+        virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const {
+            return this->value(u, v, p);
+        }
+
+        // Textures made of other textures (ex. checker_texture) add them to `table` and keep their IDs
+        //  (called when the texture itself is added, see texture_table)
+        virtual void register_textures(texture_table& table) {}
+};
+
+// The textures of a scene, addressed by 32-bit IDs (like material_table, which owns one)
+// Textures that refer to other textures look them up here by ID instead of through their shared_ptr.
+// The table is not changed during rendering, so all threads read it without locks or atomics.
+class texture_table {
+    public:
+        // The ID of `tex`, adding it (and the textures it refers to) if it is new
+        uint32_t add(const shared_ptr<texture>& tex) {
+            auto found = this->lookup.find(tex.get());
+            if (found != this->lookup.end()) return found->second;
+            tex->register_textures(*this);
+            uint32_t id = static_cast<uint32_t>(this->textures.size());
+            this->textures.push_back(tex);
+            this->pointers.push_back(tex.get());
+            this->lookup[tex.get()] = id;
+            return id;
+        }
+
+        const texture& operator[](uint32_t id) const { return *this->pointers[id]; }
+        size_t size() const { return this->pointers.size(); }
+
+    private:
+        // The table keeps the textures alive
+        std::vector<shared_ptr<texture>> textures;
+        // (the same textures as plain pointers: a lookup is one load from this array)
+        std::vector<const texture*> pointers;
+        std::unordered_map<const texture*, uint32_t> lookup;
 };
 
 // Constant texture
@@ -46,18 +100,38 @@ class checker_texture: public texture {
             even(make_shared<solid_color>(_even)), odd(make_shared<solid_color>(_odd)) {}
         
         // Implement abstract methods of parent class
-        // Use the alternating sign of sine and cosine to create a checkered pattern ?!! (wasssss)
         virtual color value(double u, double v, const point3& p) const override {
+            return this->square(p).value(u, v, p);
+        }
+
+        // (the squares themselves are not filtered, but their textures can be)
+        virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const override {
+            return this->square(p).filtered_value(u, v, p, footprint);
+        }
+
+        virtual void register_textures(texture_table& table) override {
+            this->even_id = table.add(this->even);
+            this->odd_id = table.add(this->odd);
+            this->table = &table;
+        }
+
+    private:
+        // The IDs of even and odd in `table`, once the texture is registered
+        const texture_table* table = nullptr;
+        uint32_t even_id = 0;
+        uint32_t odd_id = 0;
+
+        // The texture of the square that `p` falls in
+        // Use the alternating sign of sine and cosine to create a checkered pattern ?!! (wasssss)
+        const texture& square(const point3& p) const {
             // Multiply by 10 so that the coordinates are greater than pi (where the signs change)
             double sines = sin(10*p.x()) * sin(10*p.y()) * sin(10*p.z());
             //double sines = cos(10*p.x()) * cos(10*p.y()) * cos(10*p.z());
             
             // Each axis is alternating signs, which creates a checker patterns when multiplying across axes
-            if (sines < 0) {
-                return odd->value(u, v, p);
-            } else {
-                return even->value(u, v, p);
-            }
+            // (through the shared_ptrs only if the texture was not registered, ex. outside of a scene)
+            if (!this->table) return (sines < 0) ? *this->odd : *this->even;
+            return (*this->table)[(sines < 0) ? this->odd_id : this->even_id];
         }
 };
 
@@ -98,43 +172,54 @@ class noise_texture: public texture {
 };
 
 // Texture class that holds an image texture
+// The image is decoded once into a mip pyramid of linear float texels (see mipmap.h);
+//  lookups with a footprint (from the camera's ray differentials) read the level that matches its size
 class image_texture : public texture {
     private:
-        // Texture image as an array of unsigned char (packed RGBs, each component in range [0, 255])
-        unsigned char* data;
-        // Dimensions of the texture image, in pixels
-        int width, height;
-        int bytes_per_scanline;
+        mipmap texels;
+
+        // sRGB (the encoding of 8-bit images) to linear light
+        static float srgb_to_linear(unsigned char value) {
+            double c = value / 255.0;
+            return static_cast<float>(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+        }
 
     public:
         // RBG (1 byte per color channel ?)
         const static int bytes_per_pixel = 3;
 
         // Constructors
-        image_texture(): data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+        image_texture() {}
         
         image_texture(const char* filename) {
             // An stb_image "component" = an 8-bit value = a byte
             int components_per_pixel = this->bytes_per_pixel;
+            int width, height;
             
-            // Save the image's pixel data
-            this->data = stbi_load(filename, &this->width, &this->height, &components_per_pixel, components_per_pixel);
-            if (!this->data) {
+            // Read the image's pixel data
+            unsigned char* data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+            if (!data) {
                 std::cerr << "Failed to read texture image: " << filename << std::endl;
-                this->width = this->height = 0;
+                return;
             }
 
-            this->bytes_per_scanline = bytes_per_pixel * this->width;
-        }
+            // 8-bit sRGB to linear floats, once, instead of on every lookup
+            float linear[256];
+            for (int i=0; i<256; i++) linear[i] = srgb_to_linear(static_cast<unsigned char>(i));
+            std::vector<float> rows(static_cast<size_t>(bytes_per_pixel) * width * height);
+            for (size_t i=0; i<rows.size(); i++) rows[i] = linear[data[i]];
+            stbi_image_free(data);
 
-        // Destructor
-        ~image_texture() {
-            delete this->data;
+            this->texels = mipmap(width, height, rows);
         }
 
         // Implement abstract base class method
         virtual color value(double u, double v, const point3& p) const override {
-            if (!this->data) {
+            return this->filtered_value(u, v, p, texture_footprint());
+        }
+
+        virtual color filtered_value(double u, double v, const point3& p, const texture_footprint& footprint) const override {
+            if (this->texels.empty()) {
                 // If no image data has been loaded, color pixel with constant color for debugging
                 return color(0,1,1); // cyan
             }
@@ -150,27 +235,10 @@ class image_texture : public texture {
             // (???) Flip v to image coordinates
             v = 1.0 - clamp(v, 0.0, 1.0);
 
-            // Pixel coordinates
-            int i = static_cast<int>(u * width);
-            int j = static_cast<int>(v * height);
-
-            // More clamping in case i ==  width or j == height (?)
-            //  since both u and v could == 1.0
-            if (i >= width) i = width - 1;
-            if (j >= height) j = height - 1;
-
-            // Get the starting address of pixel (i, j) in the image data
-            // start + num_rows + num_columns
-            unsigned char* pixel = data + j*this->bytes_per_scanline + i*image_texture::bytes_per_pixel;
-
-            // The color class expects each color channel (R, B, B) to be values between [0, 1)
-            // So we divide the image data pixel value by 255 (max color value)
-            const double color_scale = 1.0 / 255.0;
-            return color(
-                color_scale * pixel[0], // red
-                color_scale * pixel[1], // green
-                color_scale * pixel[2] // blue
-            );
+            // The footprint's size in texels: the longest of its sides, along u and v
+            double texels_x = fmax(fabs(footprint.dudx), fabs(footprint.dudy)) * this->texels.width();
+            double texels_y = fmax(fabs(footprint.dvdx), fabs(footprint.dvdy)) * this->texels.height();
+            return this->texels.lookup(u, v, fmax(texels_x, texels_y));
         }
 };
 
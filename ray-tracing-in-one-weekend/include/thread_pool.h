@@ -0,0 +1,145 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed-size pool of worker threads with work stealing
+// Each worker owns a double-ended queue (deque) of tasks:
+//  * The owner pops tasks from the back of its own deque (last in, first out)
+//  * When its deque is empty, the worker steals from the front of another worker's deque
+// Stealing from the opposite end keeps the owner and the thief from fighting over the same tasks,
+//  and lets idle workers take over the expensive tasks that are stuck behind a slow one
+class thread_pool {
+    public:
+        using task = std::function<void()>;
+
+        // Constructors
+        explicit thread_pool(int num_threads) {
+            if (num_threads < 1) num_threads = 1;
+
+            for (int i=0; i<num_threads; i++) {
+                this->queues.push_back(std::make_unique<worker_queue>());
+            }
+            for (int i=0; i<num_threads; i++) {
+                this->workers.emplace_back(&thread_pool::worker_loop, this, i);
+            }
+        }
+
+        // Destructor; finishes all queued tasks before joining the workers
+        ~thread_pool() {
+            this->wait();
+            {
+                std::lock_guard<std::mutex> guard(this->sleep_lock);
+                this->stopping = true;
+            }
+            this->wake.notify_all();
+            for (std::thread& worker : this->workers) {
+                worker.join();
+            }
+        }
+
+        // The pool cannot be copied (the workers hold a pointer to it)
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return static_cast<int>(this->workers.size()); }
+
+        // Add a task to the pool
+        // Tasks are dealt out round-robin across the worker deques;
+        //  work stealing evens out whatever imbalance is left
+        void submit(task t) {
+            size_t index = this->next_queue++ % this->queues.size();
+            {
+                std::lock_guard<std::mutex> guard(this->queues[index]->lock);
+                this->queues[index]->tasks.push_back(std::move(t));
+            }
+            this->pending++;
+            {
+                // Take the lock so a worker that is about to sleep cannot miss this wake up
+                std::lock_guard<std::mutex> guard(this->sleep_lock);
+                this->queued++;
+            }
+            this->wake.notify_one();
+        }
+
+        // Block until every submitted task has finished
+        void wait() {
+            std::unique_lock<std::mutex> lock(this->sleep_lock);
+            this->done.wait(lock, [this] { return this->pending.load() == 0; });
+        }
+
+    private:
+        // A worker's deque of tasks
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<task> tasks;
+        };
+
+        std::vector<std::unique_ptr<worker_queue>> queues;
+        std::vector<std::thread> workers;
+
+        // Tasks submitted but not finished yet
+        std::atomic<int> pending{0};
+        // Tasks sitting in a deque (not picked up by a worker yet)
+        std::atomic<int> queued{0};
+        std::atomic<size_t> next_queue{0};
+        bool stopping = false;
+
+        // Idle workers sleep on `wake`; wait() sleeps on `done`
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        // Pop from the back of the worker's own deque
+        bool try_pop(int index, task& t) {
+            worker_queue& q = *this->queues[index];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) return false;
+            t = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+
+        // Steal from the front of another worker's deque
+        bool try_steal(int thief, task& t) {
+            int num_queues = static_cast<int>(this->queues.size());
+            for (int offset=1; offset<num_queues; offset++) {
+                worker_queue& q = *this->queues[(thief + offset) % num_queues];
+                std::lock_guard<std::mutex> guard(q.lock);
+                if (q.tasks.empty()) continue;
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+            return false;
+        }
+
+        void worker_loop(int index) {
+            while (true) {
+                task t;
+                if (this->try_pop(index, t) || this->try_steal(index, t)) {
+                    this->queued--;
+                    t();
+                    if (--this->pending == 0) {
+                        std::lock_guard<std::mutex> guard(this->sleep_lock);
+                        this->done.notify_all();
+                    }
+                    continue;
+                }
+
+                // Nothing to do; sleep until a task is submitted or the pool shuts down
+                std::unique_lock<std::mutex> lock(this->sleep_lock);
+                this->wake.wait(lock, [this] { return this->stopping || this->queued.load() > 0; });
+                if (this->stopping && this->queued.load() == 0) return;
+            }
+        }
+};
+
+#endif // header guard
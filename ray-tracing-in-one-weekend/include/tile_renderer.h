@@ -0,0 +1,101 @@
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "thread_pool.h"
+
+// A rectangular block of pixels, [x0, x1) by [y0, y1)
+// Pixel (0, 0) is the lower-left corner of the image (same as the (u, v) of the camera)
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Split the image into tiles of (at most) tile_size x tile_size pixels
+// Tiles on the right and top edges are cut short to fit the image
+std::vector<tile> make_tiles(int image_width, int image_height, int tile_size) {
+    std::vector<tile> tiles;
+    if (tile_size < 1) tile_size = 1;
+
+    for (int y=0; y<image_height; y+=tile_size) {
+        for (int x=0; x<image_width; x+=tile_size) {
+            tiles.push_back({
+                x, y,
+                std::min(x + tile_size, image_width), std::min(y + tile_size, image_height)
+            });
+        }
+    }
+    return tiles;
+}
+
+// Render every tile of the image on a work-stealing thread pool
+// `render_tile` is called once per tile and must only write the pixels inside its tile,
+//  so the tiles can be rendered in any order by any thread
+// A tile full of background sky finishes quickly and its worker goes on to steal
+//  tiles from workers that are stuck on expensive (ex. glass-heavy) tiles
+void render_tiles(
+    int image_width, int image_height, int tile_size, int num_threads,
+    const std::function<void(const tile&)>& render_tile
+) {
+    std::vector<tile> tiles = make_tiles(image_width, image_height, tile_size);
+    const int num_tiles = static_cast<int>(tiles.size());
+    std::atomic<int> tiles_done{0};
+
+    thread_pool pool(num_threads);
+    for (const tile& t : tiles) {
+        pool.submit([&, t] {
+            render_tile(t);
+            int done = ++tiles_done;
+            // Only one thread gets each count, so the progress lines don't interleave much
+            if (done % 16 == 0 || done == num_tiles) {
+                std::cerr << "\rTiles remaining: " << (num_tiles - done) << ' ' << std::flush;
+            }
+        });
+    }
+    pool.wait();
+    std::cerr << std::endl;
+}
+
+// Render the tiles of the image in groups of consecutive tiles with at least `min_pixels` pixels each
+//  (the wavefront integrator traces the paths of a whole group as one batch)
+// Groups are kept small enough that every thread gets at least 4 of them, if the image has that many tiles
+void render_tile_groups(
+    int image_width, int image_height, int tile_size, int num_threads, size_t min_pixels,
+    const std::function<void(const std::vector<tile>&)>& render_group
+) {
+    std::vector<tile> tiles = make_tiles(image_width, image_height, tile_size);
+    const size_t image_pixels = static_cast<size_t>(image_width) * image_height;
+    const size_t max_group_pixels = std::max<size_t>(image_pixels / (4 * static_cast<size_t>(std::max(num_threads, 1))), 1);
+    min_pixels = std::min(min_pixels, max_group_pixels);
+
+    std::vector<std::vector<tile>> groups(1);
+    size_t group_pixels = 0;
+    for (const tile& t : tiles) {
+        if (group_pixels >= min_pixels) {
+            groups.emplace_back();
+            group_pixels = 0;
+        }
+        groups.back().push_back(t);
+        group_pixels += static_cast<size_t>(t.x1 - t.x0) * (t.y1 - t.y0);
+    }
+    const int num_tiles = static_cast<int>(tiles.size());
+    std::atomic<int> tiles_done{0};
+
+    thread_pool pool(num_threads);
+    for (const std::vector<tile>& group : groups) {
+        pool.submit([&] {
+            render_group(group);
+            int done = tiles_done += static_cast<int>(group.size());
+            std::cerr << "\rTiles remaining: " << (num_tiles - done) << ' ' << std::flush;
+        });
+    }
+    pool.wait();
+    std::cerr << std::endl;
+}
+
+#endif // header guard
@@ -0,0 +1,512 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "material_table.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "simd.h"
+#include "line_reader.h"
+
+// Triangle meshes
+// The vertices are shared by the triangles that meet at them: positions, normals and texture coordinates
+//  are stored once per vertex, and every triangle is three 32-bit indices into them (the index buffer).
+// The mesh is one hittable with its own BVH over its triangles (like the sphere soup), whose leaves are
+//  batches of up to 8 triangles that are intersected together.
+//
+// Intersection is the watertight test of Woop, Benthin and Wald ("Watertight Ray/Triangle Intersection", 2013):
+//  the vertices are moved into a space where the ray starts at the origin and goes along +z, and the hit is
+//  decided by the signs of three 2D edge functions. Two triangles that share an edge compute the same edge
+//  function (with the opposite sign), so a ray that hits the edge is never let through between them.
+//  There is no early exit per triangle, so a batch is evaluated with SIMD lanes just like the scalar loop.
+
+// Triangles tested in batches of this many
+constexpr int triangle_batch_size = 8;
+
+// Per-ray constants of the watertight test
+struct watertight_ray {
+    // The axis the ray goes along the most is kz; kx and ky are the other two, swapped if the ray goes
+    //  toward -kz so that the triangles keep their winding
+    int kx, ky, kz;
+    // Shear that turns the ray's direction into (0, 0, 1)
+    double shear_x, shear_y, shear_z;
+    double origin[3];
+};
+
+inline watertight_ray make_watertight_ray(const ray& r) {
+    watertight_ray w;
+    const vec3 d = r.direction();
+    const double ax = std::fabs(d.x()), ay = std::fabs(d.y()), az = std::fabs(d.z());
+    w.kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    w.kx = (w.kz + 1) % 3;
+    w.ky = (w.kx + 1) % 3;
+    if (d[w.kz] < 0) std::swap(w.kx, w.ky);
+    w.shear_x = d[w.kx] / d[w.kz];
+    w.shear_y = d[w.ky] / d[w.kz];
+    w.shear_z = 1.0 / d[w.kz];
+    for (int a=0; a<3; a++) w.origin[a] = r.origin()[a];
+    return w;
+}
+
+// Read-only view of a mesh's arrays, for the batch intersection functions
+// The positions are stored as `real` (see precision.h) and widened to double for the math
+struct triangle_mesh_arrays {
+    const real* position[3];
+    // Three per triangle
+    const uint32_t* indices;
+};
+
+// The watertight test's edge functions (u, v, w: the weights of vertices 0, 1, 2 times `det`) and
+//  the scaled distance `t_scaled` (the distance times `det`) of triangle `i`
+// The SIMD versions do the same operations in the same order, so every version finds the same hits
+inline void watertight_edges(
+    const triangle_mesh_arrays& m, size_t i, const watertight_ray& w,
+    double& u, double& v, double& e_w, double& t_scaled
+) {
+    const uint32_t* corners = m.indices + 3*i;
+    double x[3], y[3], z[3];
+    for (int c=0; c<3; c++) {
+        // Translate to the ray's origin, then shear so the ray goes along +z
+        const double dz = m.position[w.kz][corners[c]] - w.origin[w.kz];
+        x[c] = (m.position[w.kx][corners[c]] - w.origin[w.kx]) - w.shear_x * dz;
+        y[c] = (m.position[w.ky][corners[c]] - w.origin[w.ky]) - w.shear_y * dz;
+        z[c] = w.shear_z * dz;
+    }
+    u = x[2]*y[1] - y[2]*x[1];
+    v = x[0]*y[2] - y[0]*x[2];
+    e_w = x[1]*y[0] - y[1]*x[0];
+    t_scaled = u*z[0] + v*z[1] + e_w*z[2];
+}
+
+// Intersect a ray with the triangles [first, first + count) (count <= triangle_batch_size) and write each
+//  triangle's distance in [t_min, t_max] to hits (infinity if it misses)
+// The SIMD versions round count up to whole vectors; the index buffer is padded with degenerate triangles,
+//  which never hit
+void triangle_batch_hits_scalar(
+    const triangle_mesh_arrays& m, size_t first, int count, const watertight_ray& w,
+    double t_min, double t_max, double* hits
+) {
+    for (int k=0; k<count; k++) {
+        double u, v, e_w, t_scaled;
+        watertight_edges(m, first + k, w, u, v, e_w, t_scaled);
+        hits[k] = infinity;
+        // Inside if the edge functions do not have different signs (both sides of the triangle hit)
+        const bool outside = (u < 0 || v < 0 || e_w < 0) && (u > 0 || v > 0 || e_w > 0);
+        const double det = u + v + e_w;
+        if (outside || det == 0) continue;
+        const double t = t_scaled / det;
+        if (t >= t_min && t <= t_max) hits[k] = t;
+    }
+}
+
+#if RT_X86_SIMD
+// AVX2: 4 triangles per instruction; the vertices are gathered through the index buffer
+RT_TARGET_AVX2
+void triangle_batch_hits_avx2(
+    const triangle_mesh_arrays& m, size_t first, int count, const watertight_ray& w,
+    double t_min, double t_max, double* hits
+) {
+    const int axes[3] = {w.kx, w.ky, w.kz};
+    const __m256d origin[3] = {
+        _mm256_set1_pd(w.origin[w.kx]), _mm256_set1_pd(w.origin[w.ky]), _mm256_set1_pd(w.origin[w.kz])
+    };
+    const __m256d shear_x = _mm256_set1_pd(w.shear_x);
+    const __m256d shear_y = _mm256_set1_pd(w.shear_y);
+    const __m256d shear_z = _mm256_set1_pd(w.shear_z);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d t_min_v = _mm256_set1_pd(t_min);
+    const __m256d t_max_v = _mm256_set1_pd(t_max);
+    const __m256d miss = _mm256_set1_pd(infinity);
+    // Corner c of 4 consecutive triangles is at indices[3*i + c], 3*(i+1) + c, ...
+    const __m128i stride = _mm_setr_epi32(0, 3, 6, 9);
+
+    for (int k=0; k<count; k+=4) {
+        const int* corners = reinterpret_cast<const int*>(m.indices + 3*(first + k));
+        // Corners relative to the ray (zeroed first, so no lane is ever read before it is set)
+        __m256d x[3] = {zero, zero, zero}, y[3] = {zero, zero, zero}, z[3] = {zero, zero, zero};
+        for (int c=0; c<3; c++) {
+            const __m128i vertex = _mm_i32gather_epi32(corners + c, stride, 4);
+            const __m256d px = gather4_pd(m.position[axes[0]], vertex);
+            const __m256d py = gather4_pd(m.position[axes[1]], vertex);
+            const __m256d pz = gather4_pd(m.position[axes[2]], vertex);
+            const __m256d dz = _mm256_sub_pd(pz, origin[2]);
+            x[c] = _mm256_sub_pd(_mm256_sub_pd(px, origin[0]), _mm256_mul_pd(shear_x, dz));
+            y[c] = _mm256_sub_pd(_mm256_sub_pd(py, origin[1]), _mm256_mul_pd(shear_y, dz));
+            z[c] = _mm256_mul_pd(shear_z, dz);
+        }
+        const __m256d u = _mm256_sub_pd(_mm256_mul_pd(x[2], y[1]), _mm256_mul_pd(y[2], x[1]));
+        const __m256d v = _mm256_sub_pd(_mm256_mul_pd(x[0], y[2]), _mm256_mul_pd(y[0], x[2]));
+        const __m256d e_w = _mm256_sub_pd(_mm256_mul_pd(x[1], y[0]), _mm256_mul_pd(y[1], x[0]));
+        const __m256d t_scaled = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(u, z[0]), _mm256_mul_pd(v, z[1])), _mm256_mul_pd(e_w, z[2])
+        );
+
+        const __m256d any_negative = _mm256_or_pd(_mm256_or_pd(
+            _mm256_cmp_pd(u, zero, _CMP_LT_OQ), _mm256_cmp_pd(v, zero, _CMP_LT_OQ)), _mm256_cmp_pd(e_w, zero, _CMP_LT_OQ)
+        );
+        const __m256d any_positive = _mm256_or_pd(_mm256_or_pd(
+            _mm256_cmp_pd(u, zero, _CMP_GT_OQ), _mm256_cmp_pd(v, zero, _CMP_GT_OQ)), _mm256_cmp_pd(e_w, zero, _CMP_GT_OQ)
+        );
+        const __m256d det = _mm256_add_pd(_mm256_add_pd(u, v), e_w);
+        // Most triangles of a leaf miss: skip the division if all of them do
+        __m256d inside = _mm256_andnot_pd(
+            _mm256_and_pd(any_negative, any_positive), _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ)
+        );
+        if (_mm256_movemask_pd(inside) == 0) {
+            _mm256_storeu_pd(hits + k, miss);
+            continue;
+        }
+        const __m256d t = _mm256_div_pd(t_scaled, det);
+        inside = _mm256_and_pd(inside, _mm256_and_pd(
+            _mm256_cmp_pd(t, t_min_v, _CMP_GE_OQ), _mm256_cmp_pd(t, t_max_v, _CMP_LE_OQ)
+        ));
+        _mm256_storeu_pd(hits + k, _mm256_blendv_pd(miss, t, inside));
+    }
+}
+#endif
+
+class triangle_mesh : public hittable {
+    public:
+        // Constructors
+        triangle_mesh(shared_ptr<material> m, simd_level level=detect_simd_level()): mat_ptr(m), level(level) {}
+
+        // Add a vertex; returns its index
+        // Normals and texture coordinates are optional, but only kept if every vertex has them
+        uint32_t add_vertex(const point3& position) {
+            for (int a=0; a<3; a++) this->position[a].push_back(position[a]);
+            return static_cast<uint32_t>(this->position[0].size() - 1);
+        }
+
+        uint32_t add_vertex(const point3& position, const vec3* normal, const double* uv) {
+            if (normal) this->normals.push_back(*normal);
+            if (uv) {
+                this->uvs.push_back(uv[0]);
+                this->uvs.push_back(uv[1]);
+            }
+            return this->add_vertex(position);
+        }
+
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+            this->indices.push_back(a);
+            this->indices.push_back(b);
+            this->indices.push_back(c);
+        }
+
+        size_t vertex_count() const { return this->position[0].size(); }
+        size_t triangle_count() const { return this->triangles; }
+
+        // Call after the last add_triangle(): build the BVH (triangles in the order of its leaves)
+        //  and pad the index buffer to whole batches
+        void finish(int num_threads=1) {
+            const size_t vertices = this->vertex_count();
+            if (this->normals.size() != vertices) this->normals.clear();
+            if (this->uvs.size() != 2*vertices) this->uvs.clear();
+            // (triangles with an index past the last vertex are dropped)
+            std::vector<uint32_t> valid;
+            valid.reserve(this->indices.size());
+            for (size_t i=0; i+2<this->indices.size(); i+=3) {
+                const uint32_t* corners = this->indices.data() + i;
+                if (corners[0] < vertices && corners[1] < vertices && corners[2] < vertices) {
+                    valid.insert(valid.end(), corners, corners + 3);
+                }
+            }
+            this->indices.swap(valid);
+            this->triangles = this->indices.size() / 3;
+
+            this->box = aabb::empty();
+            if (this->triangles > 0) {
+                std::vector<aabb> boxes(this->triangles);
+                for (size_t i=0; i<this->triangles; i++) {
+                    boxes[i] = this->triangle_box(i);
+                    this->box = surrounding_box(this->box, boxes[i]);
+                }
+                bvh_builder::options opts;
+                opts.max_leaf_size = triangle_batch_size;
+                // A batch of 8 costs about as much as 2 triangles tested one at a time
+                opts.intersection_cost = 0.25;
+                opts.num_threads = num_threads;
+                bvh_builder builder(boxes, opts);
+                std::unique_ptr<bvh_build_node> root = builder.build();
+                this->stats = builder.stats();
+                this->reorder(builder.primitive_order());
+                flatten_bvh(*root, this->nodes);
+
+                // A flat mesh (ex. one quad) still needs some thickness for the aabb slab test
+                point3 lower = this->box.min(), upper = this->box.max();
+                for (int a=0; a<3; a++) {
+                    if (upper[a] - lower[a] < 0.0001) {
+                        lower[a] -= 0.0001;
+                        upper[a] += 0.0001;
+                    }
+                }
+                this->box = aabb(lower, upper);
+            }
+
+            // A batch can start at any triangle: pad with triangles whose three corners are vertex 0,
+            //  whose edge functions are all 0 (no hit)
+            this->indices.resize(this->indices.size() + 3*triangle_batch_size, 0);
+        }
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            if (this->triangles == 0) return false;
+            const watertight_ray w = make_watertight_ray(r);
+            size_t closest = 0;
+            double t_closest = t_max;
+            bool hit_anything = traverse_linear_bvh(this->nodes, r, t_min, t_max,
+                [&](uint32_t first, uint32_t count, double& t_leaf) {
+                    alignas(32) double hits[triangle_batch_size];
+                    this->batch_hits(first, static_cast<int>(count), w, t_min, t_closest, hits);
+                    bool hit_leaf = false;
+                    for (uint32_t k=0; k<count; k++) {
+                        if (hits[k] <= t_closest && hits[k] != infinity) {
+                            t_closest = hits[k];
+                            closest = first + k;
+                            hit_leaf = true;
+                        }
+                    }
+                    t_leaf = t_closest;
+                    return hit_leaf;
+                }
+            );
+
+            if (hit_anything) {
+                hit.t = t_closest;
+                hit.object = this;
+                hit.primitive = static_cast<uint32_t>(closest);
+            }
+            return hit_anything;
+        }
+
+        // The point, normals, texture coordinates and their partials, from the barycentric coordinates of the
+        //  hit (recomputed with the same edge functions as the intersection test)
+        virtual void compute_interaction(const ray& r, const closest_hit& hit, surface_interaction& surface) const override {
+            const size_t i = hit.primitive;
+            const uint32_t* corners = this->indices.data() + 3*i;
+            double u, v, e_w, t_scaled;
+            watertight_edges(this->arrays(), i, make_watertight_ray(r), u, v, e_w, t_scaled);
+            const double det = u + v + e_w;
+            const double b[3] = {u / det, v / det, e_w / det};
+
+            surface.p = r.at(hit.t);
+            const point3 p0 = this->vertex(corners[0]);
+            const point3 p1 = this->vertex(corners[1]);
+            const point3 p2 = this->vertex(corners[2]);
+            surface.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+
+            // Texture coordinates: the vertices' (or, without them, (0, 0), (1, 0) and (0, 1))
+            double uv[3][2] = {{0, 0}, {1, 0}, {0, 1}};
+            if (!this->uvs.empty()) {
+                for (int c=0; c<3; c++) {
+                    uv[c][0] = this->uvs[2*corners[c]];
+                    uv[c][1] = this->uvs[2*corners[c] + 1];
+                }
+            }
+            surface.u = b[0]*uv[0][0] + b[1]*uv[1][0] + b[2]*uv[2][0];
+            surface.v = b[0]*uv[0][1] + b[1]*uv[1][1] + b[2]*uv[2][1];
+
+            // dp/du and dp/dv: solve p0 - p2 = du02 dpdu + dv02 dpdv, p1 - p2 = du12 dpdu + dv12 dpdv
+            const double du02 = uv[0][0] - uv[2][0], dv02 = uv[0][1] - uv[2][1];
+            const double du12 = uv[1][0] - uv[2][0], dv12 = uv[1][1] - uv[2][1];
+            const double uv_det = du02*dv12 - dv02*du12;
+            if (std::fabs(uv_det) > 1e-12) {
+                const vec3 dp02 = p0 - p2, dp12 = p1 - p2;
+                surface.dpdu = (dv12*dp02 - dv02*dp12) / uv_det;
+                surface.dpdv = (du02*dp12 - du12*dp02) / uv_det;
+            } else {
+                surface.dpdu = surface.dpdv = vec3(0,0,0);
+            }
+
+            // Smooth shading: the vertex normals, interpolated, on the side of the surface the ray came from
+            if (!this->normals.empty()) {
+                vec3 shading = b[0]*this->normals[corners[0]] + b[1]*this->normals[corners[1]] + b[2]*this->normals[corners[2]];
+                if (!shading.near_zero()) {
+                    shading = unit_vector(shading);
+                    surface.normal = dot_product(shading, surface.normal) < 0 ? -1 * shading : shading;
+                }
+            }
+
+            surface.material_id = this->material_id;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = this->box;
+            return this->triangles > 0;
+        }
+
+        virtual void register_materials(material_table& table) override {
+            this->material_id = table.add(this->mat_ptr);
+        }
+
+        // Statistics of the BVH build
+        bvh_build_stats stats;
+
+    private:
+        // Vertex positions, as structure-of-arrays (index = vertex), in the precision of the geometry
+        std::vector<real> position[3];
+        // Empty, or one per vertex
+        std::vector<vec3> normals;
+        // Empty, or two (u, v) per vertex
+        std::vector<double> uvs;
+        // Three per triangle, in the order of the BVH leaves (plus one batch of padding, see finish())
+        std::vector<uint32_t> indices;
+        size_t triangles = 0;
+
+        shared_ptr<material> mat_ptr;
+        // Its ID in the scene's material table
+        uint32_t material_id = 0;
+
+        std::vector<linear_bvh_node> nodes;
+        aabb box;
+        simd_level level;
+
+        point3 vertex(uint32_t index) const {
+            return point3(this->position[0][index], this->position[1][index], this->position[2][index]);
+        }
+
+        aabb triangle_box(size_t i) const {
+            const uint32_t* corners = this->indices.data() + 3*i;
+            point3 lower = this->vertex(corners[0]), upper = lower;
+            for (int c=1; c<3; c++) {
+                const point3 p = this->vertex(corners[c]);
+                for (int a=0; a<3; a++) {
+                    lower[a] = std::min(lower[a], p[a]);
+                    upper[a] = std::max(upper[a], p[a]);
+                }
+            }
+            return aabb(lower, upper);
+        }
+
+        // Put the triangles in the order of the BVH leaves (the vertices stay where they are)
+        void reorder(const std::vector<size_t>& order) {
+            std::vector<uint32_t> old_indices = this->indices;
+            for (size_t i=0; i<order.size(); i++) {
+                for (int c=0; c<3; c++) this->indices[3*i + c] = old_indices[3*order[i] + c];
+            }
+        }
+
+        triangle_mesh_arrays arrays() const {
+            return {{this->position[0].data(), this->position[1].data(), this->position[2].data()}, this->indices.data()};
+        }
+
+        void batch_hits(size_t first, int count, const watertight_ray& w, double t_min, double t_max, double* hits) const {
+#if RT_X86_SIMD
+            if (this->level == simd_level::avx2) return triangle_batch_hits_avx2(this->arrays(), first, count, w, t_min, t_max, hits);
+#endif
+            triangle_batch_hits_scalar(this->arrays(), first, count, w, t_min, t_max, hits);
+        }
+};
+
+// Read a Wavefront OBJ file into a mesh made of `m`
+// Reads the vertex positions (v), texture coordinates (vt), normals (vn) and faces (f, with polygons split into
+//  fans of triangles; indices may be negative, counting back from the end). Every distinct position/uv/normal
+//  combination of the faces becomes one vertex of the mesh. Everything else (groups, materials) is skipped.
+// The positions are scaled by `scale` and then moved by `offset`
+// Returns nullptr (after printing why) if the file cannot be read
+shared_ptr<triangle_mesh> load_obj(
+    const std::string& path, shared_ptr<material> m, double scale=1.0, const vec3& offset=vec3(0,0,0),
+    int num_threads=1, simd_level level=detect_simd_level()
+) {
+    std::vector<double> positions, uvs, normals;
+    shared_ptr<triangle_mesh> mesh = make_shared<triangle_mesh>(m, level);
+    // Mesh vertex of each (position, uv, normal) index triple seen so far
+    struct corner_key {
+        int64_t position, uv, normal;
+        bool operator==(const corner_key& other) const {
+            return this->position == other.position && this->uv == other.uv && this->normal == other.normal;
+        }
+    };
+    struct corner_hash {
+        size_t operator()(const corner_key& key) const {
+            uint64_t h = static_cast<uint64_t>(key.position) * 0x9e3779b97f4a7c15ull;
+            h ^= static_cast<uint64_t>(key.uv) + 0x7f4a7c15ull + (h << 6) + (h >> 2);
+            h ^= static_cast<uint64_t>(key.normal) + 0x9e3779b9ull + (h << 6) + (h >> 2);
+            return static_cast<size_t>(h);
+        }
+    };
+    std::unordered_map<corner_key, uint32_t, corner_hash> vertices;
+    std::vector<uint32_t> polygon;
+
+    int line_number = 0;
+    auto error = [&](const std::string& message) {
+        std::cerr << path << ":" << line_number << ": " << message << std::endl;
+        return false;
+    };
+    // OBJ indices start at 1; negative ones count back from the last element read so far
+    auto resolve = [](int64_t index, size_t count, int64_t& out) {
+        out = index > 0 ? index - 1 : static_cast<int64_t>(count) + index;
+        return index != 0 && out >= 0 && out < static_cast<int64_t>(count);
+    };
+
+    bool ok = for_each_line(path, "OBJ file", [&](std::string_view line) {
+        line_number++;
+        token_reader tokens{line};
+        std::string_view keyword = tokens.next();
+        if (keyword == "v" || keyword == "vn" || keyword == "vt") {
+            std::vector<double>& values = keyword == "v" ? positions : (keyword == "vn" ? normals : uvs);
+            const int count = keyword == "vt" ? 2 : 3;
+            for (int a=0; a<count; a++) {
+                double value;
+                if (!parse_number(tokens.next(), value)) return error("expected a number");
+                values.push_back(value);
+            }
+        } else if (keyword == "f") {
+            polygon.clear();
+            for (std::string_view corner = tokens.next(); !corner.empty(); corner = tokens.next()) {
+                // v, v/vt, v//vn or v/vt/vn
+                int64_t index[3] = {0, 0, 0};
+                int64_t resolved[3] = {-1, -1, -1};
+                for (int part=0; part<3 && !corner.empty(); part++) {
+                    size_t slash = corner.find('/');
+                    std::string_view number = corner.substr(0, slash);
+                    if (!number.empty() && !parse_number(number, index[part])) return error("bad face index");
+                    corner = slash == std::string_view::npos ? std::string_view() : corner.substr(slash + 1);
+                }
+                if (!resolve(index[0], positions.size() / 3, resolved[0])) return error("face index out of range");
+                if (index[1] != 0 && !resolve(index[1], uvs.size() / 2, resolved[1])) return error("face index out of range");
+                if (index[2] != 0 && !resolve(index[2], normals.size() / 3, resolved[2])) return error("face index out of range");
+
+                corner_key key = {resolved[0], resolved[1], resolved[2]};
+                auto found = vertices.find(key);
+                if (found == vertices.end()) {
+                    const double* p = positions.data() + 3*resolved[0];
+                    point3 position(scale*p[0] + offset.x(), scale*p[1] + offset.y(), scale*p[2] + offset.z());
+                    vec3 normal;
+                    if (resolved[2] >= 0) {
+                        const double* n = normals.data() + 3*resolved[2];
+                        normal = vec3(n[0], n[1], n[2]);
+                    }
+                    uint32_t vertex = mesh->add_vertex(
+                        position, resolved[2] >= 0 ? &normal : nullptr, resolved[1] >= 0 ? uvs.data() + 2*resolved[1] : nullptr
+                    );
+                    found = vertices.emplace(key, vertex).first;
+                }
+                polygon.push_back(found->second);
+            }
+            if (polygon.size() < 3) return error("a face needs at least 3 corners");
+            for (size_t c=1; c+1<polygon.size(); c++) {
+                mesh->add_triangle(polygon[0], polygon[c], polygon[c+1]);
+            }
+        }
+        return true;
+    });
+    if (!ok) return nullptr;
+
+    mesh->finish(num_threads);
+    mesh->stats.print(std::cerr, "Mesh BVH");
+    std::cerr << "Mesh " << path << ": " << mesh->triangle_count() << " triangles, "
+        << mesh->vertex_count() << " vertices" << std::endl;
+    return mesh;
+}
+
+#endif // header guard
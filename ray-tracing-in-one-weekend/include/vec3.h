@@ -4,53 +4,70 @@
 // cmath puts all names in the `std` namespace
 //  ex. std::pow(), std::sqrt()
 #include <cmath>
+#include <ostream>
+#include <type_traits>
 
-class vec3 {
+#include "precision.h"
+
+// The vector is a template on its scalar type (float or double); the renderer uses
+//  vec3 = vec3_t<real>, with `real` chosen when the project is configured (see precision.h)
+template <typename T>
+class vec3_t {
     public:
+        // The scalar type
+        using scalar_type = T;
+
         // Class fields
-        double e[3];
+        T e[3];
         
         // Class methods
 
         // Constructors
-        vec3(): e{0, 0, 0} {}
-        vec3(double e0, double e1, double e2): e{e0, e1, e2} {}
+        vec3_t(): e{0, 0, 0} {}
+        vec3_t(T e0, T e1, T e2): e{e0, e1, e2} {}
+
+        // Conversion from a vector of another precision
+        // Widening (float to double) is implicit; narrowing loses precision, so it has to be asked for
+        template <typename U, typename std::enable_if<(sizeof(U) < sizeof(T)), int>::type = 0>
+        vec3_t(const vec3_t<U>& v): e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
+        template <typename U, typename std::enable_if<(sizeof(U) > sizeof(T)), int>::type = 0>
+        explicit vec3_t(const vec3_t<U>& v): e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
         // Generate a random vector, with each axis in range, (0,1]
-        inline static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        inline static vec3_t random() {
+            return vec3_t(random_double(), random_double(), random_double());
         }
 
         // Generate a random vector, with each axis in range (min,max]
-        inline static vec3 random(double min, double max) {
-            return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        inline static vec3_t random(double min, double max) {
+            return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
         }
 
         // Getter methods 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
-        double r() const { return this->x(); }
-        double g() const { return this->y(); }
-        double b() const { return this->z(); }
+        T r() const { return this->x(); }
+        T g() const { return this->y(); }
+        T b() const { return this->z(); }
 
         // Operator overloading
 
         // Negative vec3 (note that this is not subtraction)
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+        vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
         
         // Subscript/array indexing
         // Returns a copy of the value
-        double operator[](int index) const { return e[index]; }
+        T operator[](int index) const { return e[index]; }
         // Returns a reference to the value (modifies the object)
-        double& operator[](int index) { return e[index]; }
+        T& operator[](int index) { return e[index]; }
 
         // Sum two vectors together
         // vec3 v0 = vec3();
         // vec3 v1 = vec3();
         // v0 += v1; // v0 = v0 + v1
-        vec3& operator+=(const vec3& v) {
+        vec3_t& operator+=(const vec3_t& v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
@@ -64,7 +81,7 @@ class vec3 {
         // Multiply a vector by a scalar
         // vec3 v = vec3();
         // v *= 5;
-        vec3& operator*=(const double scalar) {
+        vec3_t& operator*=(const T scalar) {
             e[0] *= scalar;
             e[1] *= scalar;
             e[2] *= scalar;
@@ -72,22 +89,22 @@ class vec3 {
         }
 
         // Divide a vector by a scalar
-        vec3& operator/=(const double denominator) {
+        vec3_t& operator/=(const T denominator) {
             return *this *= 1/denominator;
         }
 
         // Math utilities
 
         // Compute the sum of the squares
-        double length_squared() const {
-            double length_sq = 0.0;
+        T length_squared() const {
+            T length_sq = 0.0;
             for (int i=0; i<3; i++) {
-                length_sq += pow(e[i], 2);
+                length_sq += e[i] * e[i];
             }
             return length_sq;
         }
 
-        double length() {
+        T length() {
             return sqrt(length_squared());
         }
 
@@ -95,7 +112,7 @@ class vec3 {
         // Used to check if some vector computation may result in undefined behavior (NaN, infinity, etc).
         bool near_zero() const {
             // If the value is less than this, than it is considered "close to zero"
-            double threshold = 1e-8;
+            T threshold = 1e-8;
             // fabs() returns the absolute value of a double
             return (fabs(this->e[0]) < threshold) && (fabs(this->e[1]) < threshold) && (fabs(this->e[1]) < threshold);
         }
@@ -103,6 +120,7 @@ class vec3 {
 };
 
 // Type aliases for vec3
+using vec3 = vec3_t<real>;
 using point3 = vec3; // 3D point
 using color = vec3; // RGB color
 
@@ -111,16 +129,20 @@ using color = vec3; // RGB color
 */
 
 // Pretty-print
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const vec3_t<T>& v) {
     return out << "vec3(" << v.e[0] << ", " << v.e[1] << ", " << v.e[2] << ")";
 }
 
 // Operator overloads
 // Note that these return a new vec3 object
+// (the scalar arguments are `typename vec3_t<T>::scalar_type`, so that T comes from the vector
+//  and a double or int scalar converts to it, ex. 0.5 * v for a float v)
 
 // Sum two vectors (vl=left, vr=right)
-inline vec3 operator+(const vec3& vl, const vec3& vr) {
-    return vec3(
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T>& vl, const vec3_t<T>& vr) {
+    return vec3_t<T>(
         vl.e[0] + vr.e[0],
         vl.e[1] + vr.e[1],
         vl.e[2] + vr.e[2]
@@ -128,8 +150,9 @@ inline vec3 operator+(const vec3& vl, const vec3& vr) {
 }
 
 // Subtract two vectors
-inline vec3 operator-(const vec3& vl, const vec3& vr) {
-    return vec3(
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T>& vl, const vec3_t<T>& vr) {
+    return vec3_t<T>(
         vl.e[0] - vr.e[0],
         vl.e[1] - vr.e[1],
         vl.e[2] - vr.e[2]
@@ -137,8 +160,9 @@ inline vec3 operator-(const vec3& vl, const vec3& vr) {
 }
 
 // Multiply two vectors
-inline vec3 operator*(const vec3& vl, const vec3& vr) {
-    return vec3(
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T>& vl, const vec3_t<T>& vr) {
+    return vec3_t<T>(
         vl.e[0] * vr.e[0],
         vl.e[1] * vr.e[1],
         vl.e[2] * vr.e[2]
@@ -146,8 +170,9 @@ inline vec3 operator*(const vec3& vl, const vec3& vr) {
 }
 
 // Multply a vector by a scalar as a left argument
-inline vec3 operator*(const double scalar, const vec3& vr) {
-    return vec3(
+template <typename T>
+inline vec3_t<T> operator*(const typename vec3_t<T>::scalar_type scalar, const vec3_t<T>& vr) {
+    return vec3_t<T>(
         scalar * vr.e[0],
         scalar * vr.e[1],
         scalar * vr.e[2]
@@ -155,18 +180,21 @@ inline vec3 operator*(const double scalar, const vec3& vr) {
 }
 
 // Multply a vector by a scalar as a right argument
-inline vec3 operator*(const vec3& vl, const double scalar) {
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T>& vl, const typename vec3_t<T>::scalar_type scalar) {
     return scalar * vl;
 }
 
 // Divide a vector by a scalar
-inline vec3 operator/(vec3 v, double scalar) {
+template <typename T>
+inline vec3_t<T> operator/(vec3_t<T> v, typename vec3_t<T>::scalar_type scalar) {
     return (1/scalar) * v;
 }
 
 // Compute the dot product
-inline double dot_product(vec3 vl, vec3 vr) {
-    double dot_product = 0.0;
+template <typename T>
+inline T dot_product(vec3_t<T> vl, vec3_t<T> vr) {
+    T dot_product = 0.0;
     for (int i=0; i<3; i++) {
         dot_product += (vl.e[i] * vr.e[i]);
     }
@@ -174,8 +202,9 @@ inline double dot_product(vec3 vl, vec3 vr) {
 }
 
 // Compute the cross product
-inline vec3 cross(vec3 vl, vec3 vr) {
-    return vec3(
+template <typename T>
+inline vec3_t<T> cross(vec3_t<T> vl, vec3_t<T> vr) {
+    return vec3_t<T>(
         vl.e[1] * vr.e[2] - vl.e[2] * vr.e[1],
         vl.e[2] * vr.e[0] - vl.e[0] * vr.e[2],
         vl.e[0] * vr.e[1] - vl.e[1] * vr.e[0]
@@ -183,7 +212,8 @@ inline vec3 cross(vec3 vl, vec3 vr) {
 }
 
 // Compute the unit vector (length=1)
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline vec3_t<T> unit_vector(vec3_t<T> v) {
     return v / v.length();
 }
 
@@ -233,6 +263,36 @@ vec3 random_in_unit_disk() {
     }
 }
 
+// Map a 2D sample (u1, u2) in [0, 1)^2 to a point in the unit disk
+// Unlike rejection sampling (random_in_unit_disk()), this keeps stratified samples stratified:
+//  Shirley and Chiu's concentric mapping sends squares around the center of [-1,1]^2 to rings in the disk
+vec3 sample_unit_disk(double u1, double u2) {
+    // Move to [-1, 1]^2
+    double a = 2*u1 - 1;
+    double b = 2*u2 - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+
+    double r, theta;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        theta = (pi/4) * (b/a);
+    } else {
+        r = b;
+        theta = (pi/2) - (pi/4) * (a/b);
+    }
+    return vec3(r*cos(theta), r*sin(theta), 0);
+}
+
+// Map a 2D sample (u1, u2) in [0, 1)^2 to a random vector of length 1
+// (the same distribution as random_unit_vector())
+vec3 sample_unit_vector(double u1, double u2) {
+    // Pick the height uniformly, then the angle around the y-axis
+    double y = 1 - 2*u1;
+    double r = sqrt(fmax(0.0, 1 - y*y));
+    double phi = 2*pi*u2;
+    return vec3(r*cos(phi), y, r*sin(phi));
+}
+
 // Return the reflected vector, which has the same angle to the normal
 // but its direction is reflected
 vec3 reflect(const vec3& v, const vec3 normal) {
@@ -0,0 +1,377 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <typeinfo>
+#include <vector>
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "material_table.h"
+#include "lights.h"
+#include "roulette.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "tile_renderer.h"
+
+// Wavefront path tracer
+// ray_color() follows one path at a time: intersect, call the material, intersect again, ...
+//  so the BVH, the materials' code and the textures all compete for the caches on every bounce.
+// This integrator keeps a large batch of paths in flight (batch_size, 65536 by default) and moves all of
+//  them through one stage at a time:
+//   generate: start new paths (a camera ray each) in the slots of the paths that ended
+//   extend:   intersect every live path's ray with the world
+//   sort:     order the paths that hit something by material type, so the shade
+//             stage runs the same scatter() code over runs of paths instead of jumping between materials
+//   shade:    add the background or emitted light, or scatter and multiply the throughput;
+//             diffuse hits also queue a shadow ray toward a light (see lights.h)
+//   shadow:   trace the queued shadow rays as one batch and add the light they find
+// The paths to trace are every (pixel, sample) of a group of tiles (see render_tile_groups()), handed out
+//  sample by sample over the whole group; a slot whose path ends takes the next one, so the batch stays
+//  full until the group runs out. Each render thread keeps its own integrator (and its path arrays)
+//  from one group to the next.
+// Each path keeps its own generator and sampler, and uses them in the same order as ray_color(), so the
+//  image matches the recursive one up to float rounding (the light along a path is summed in another order).
+// Paths end in any order, so the color of every sample is kept until the group is done, and each pixel's
+//  samples are summed in sample order: the image is the same with any number of threads.
+class wavefront_integrator {
+    public:
+        // Constructors
+        wavefront_integrator(
+            const camera& cam, const hittable_list& world, const material_table& materials,
+            const light_list& lights, const color& background,
+            int image_width, int image_height, int max_depth, int roulette_depth, int batch_size = 65536
+        ):
+            cam(cam), world(world), materials(materials), lights(lights), background(background),
+            image_width(image_width), image_height(image_height),
+            max_depth(max_depth), roulette_depth(roulette_depth), batch_size(std::max(batch_size, 1)) {}
+
+        // Render samples [first_sample, first_sample + num_samples) of every pixel of `tiles`
+        //  into the framebuffer; returns the number of rays traced
+        uint64_t render_tiles(
+            const std::vector<tile>& tiles, const sampler& pixel_sampler, framebuffer& fb,
+            int first_sample, int num_samples
+        ) {
+            this->start_group(tiles, pixel_sampler, first_sample, num_samples);
+            this->rays_traced = 0;
+            this->path_rays_traced = 0;
+
+            while (true) {
+                this->generate();
+                if (this->active.empty()) break;
+                this->extend();
+                this->sort_by_material();
+                this->shade();
+                this->shadow();
+                this->finish_paths();
+            }
+
+            const size_t num_pixels = this->pixel_i.size();
+            for (size_t k=0; k<num_pixels; k++) {
+                color pixel_color(0, 0, 0);
+                for (uint64_t q=k; q<this->total_paths; q+=num_pixels) {
+                    pixel_color += color(this->sample_r[q], this->sample_g[q], this->sample_b[q]);
+                }
+                fb.add_samples(this->pixel_i[k], this->pixel_j[k], pixel_color, num_samples);
+            }
+            return this->rays_traced;
+        }
+
+        // Statistics of the last render_tiles(): paths (pixels * samples), and the rays along them
+        uint64_t get_paths_traced() const { return this->total_paths; }
+        uint64_t get_path_rays_traced() const { return this->path_rays_traced; }
+
+    private:
+        const camera& cam;
+        const hittable_list& world;
+        const material_table& materials;
+        const light_list& lights;
+        color background;
+        int image_width, image_height, max_depth, roulette_depth;
+        // Paths in flight
+        int batch_size;
+        uint64_t rays_traced = 0;
+        // Rays along the paths (camera rays and bounces, without shadow rays)
+        uint64_t path_rays_traced = 0;
+
+        // The pixels of the group
+        std::vector<int> pixel_i, pixel_j;
+        // Paths of the group: path q is sample first_sample + q / (number of pixels) of pixel q % (number of pixels)
+        //  and its color is sample_r/g/b[q]
+        std::vector<double> sample_r, sample_g, sample_b;
+        uint64_t total_paths = 0;
+        uint64_t next_path = 0;
+        int first_sample = 0;
+
+        // Path state, structure-of-arrays (index = slot)
+        // The slot's path (q)
+        std::vector<uint64_t> path_index;
+        std::vector<ray> rays;
+        // The camera ray of the path, for its ray differentials
+        std::vector<ray_differential> camera_rays;
+        // Product of the attenuations so far
+        std::vector<double> throughput_r, throughput_g, throughput_b;
+        // Light that reached the camera along the path
+        std::vector<double> radiance_r, radiance_g, radiance_b;
+        // Bounces left
+        std::vector<int> depth;
+        // Pdf of the bounce that made the path's ray (0 = camera ray or mirror/glass), for the MIS weights
+        std::vector<double> bounce_pdf;
+        // The surface at the path's closest hit (the closest_hit itself is not kept past extend())
+        std::vector<surface_interaction> surfaces;
+        std::vector<uint8_t> has_hit;
+        std::vector<pcg32> generators;
+        // Samplers keep per-pixel state, so every slot gets its own
+        std::vector<std::unique_ptr<sampler>> samplers;
+        const sampler* samplers_from = nullptr;
+        // Sort key of the material that was hit (see material_type())
+        std::vector<size_t> material_keys;
+        std::vector<const std::type_info*> material_types;
+        std::vector<size_t> bucket_starts;
+
+        // Slots of the live paths, of the paths that survive the current shade stage,
+        //  of the paths that ended in it, and of the slots that are free for a new path
+        std::vector<int> active;
+        std::vector<int> next_active;
+        std::vector<int> finished;
+        std::vector<int> free_slots;
+
+        // Shadow rays queued by the shade stage: the path, the ray, and what the light it finds is multiplied by
+        struct shadow_query {
+            int path;
+            ray shadow;
+            color factor;
+        };
+        std::vector<shadow_query> shadow_queue;
+
+        // The pixels and paths of a group of tiles; the slots are (re)allocated the first time only
+        void start_group(const std::vector<tile>& tiles, const sampler& pixel_sampler, int first_sample, int num_samples) {
+            this->pixel_i.clear();
+            this->pixel_j.clear();
+            for (const tile& t : tiles) {
+                for (int j=t.y0; j<t.y1; j++) {
+                    for (int i=t.x0; i<t.x1; i++) {
+                        this->pixel_i.push_back(i);
+                        this->pixel_j.push_back(j);
+                    }
+                }
+            }
+            const size_t num_pixels = this->pixel_i.size();
+            this->total_paths = static_cast<uint64_t>(num_pixels) * num_samples;
+            for (auto* channel : {&this->sample_r, &this->sample_g, &this->sample_b}) {
+                channel->resize(this->total_paths);
+            }
+            this->next_path = 0;
+            this->first_sample = first_sample;
+
+            const size_t num_slots = static_cast<size_t>(this->batch_size);
+            if (this->samplers_from != &pixel_sampler) {
+                this->samplers.clear();
+                this->samplers_from = &pixel_sampler;
+            }
+            if (this->samplers.size() < num_slots) {
+                this->path_index.resize(num_slots);
+                this->rays.resize(num_slots);
+                this->camera_rays.resize(num_slots);
+                for (auto* channel : {
+                    &this->throughput_r, &this->throughput_g, &this->throughput_b,
+                    &this->radiance_r, &this->radiance_g, &this->radiance_b, &this->bounce_pdf
+                }) {
+                    channel->resize(num_slots);
+                }
+                this->depth.resize(num_slots);
+                this->surfaces.resize(num_slots);
+                this->has_hit.resize(num_slots);
+                this->generators.resize(num_slots);
+                this->material_keys.resize(num_slots);
+                while (this->samplers.size() < num_slots) {
+                    this->samplers.push_back(pixel_sampler.clone());
+                }
+            }
+            this->active.clear();
+            this->free_slots.clear();
+            for (int slot=this->batch_size-1; slot>=0; slot--) this->free_slots.push_back(slot);
+        }
+
+        // Start the next paths of the group (camera rays) in the free slots
+        void generate() {
+            const uint64_t num_pixels = this->pixel_i.size();
+            while (!this->free_slots.empty() && this->next_path < this->total_paths) {
+                const int p = this->free_slots.back();
+                this->free_slots.pop_back();
+                const int k = static_cast<int>(this->next_path % num_pixels);
+                const int s = this->first_sample + static_cast<int>(this->next_path / num_pixels);
+                this->next_path++;
+
+                sampler& smp = *this->samplers[p];
+                smp.start_pixel(this->pixel_i[k], this->pixel_j[k]);
+                smp.start_sample(s);
+                point2 jitter = smp.get_2d();
+                double u = (double(this->pixel_i[k]) + jitter.x) / (this->image_width-1);
+                double v = (double(this->pixel_j[k]) + jitter.y) / (this->image_height-1);
+                this->camera_rays[p] = this->cam.get_ray(u, v, smp);
+                this->rays[p] = this->camera_rays[p];
+                this->generators[p] = thread_rng();
+
+                this->path_index[p] = this->next_path - 1;
+                this->throughput_r[p] = 1.0;
+                this->throughput_g[p] = 1.0;
+                this->throughput_b[p] = 1.0;
+                this->radiance_r[p] = 0.0;
+                this->radiance_g[p] = 0.0;
+                this->radiance_b[p] = 0.0;
+                this->depth[p] = this->max_depth;
+                this->bounce_pdf[p] = 0.0;
+                this->active.push_back(p);
+            }
+        }
+
+        // Closest hit of every live path
+        void extend() {
+            for (int p : this->active) {
+                closest_hit hit;
+                this->has_hit[p] = this->world.intersect(this->rays[p], 0.001, infinity, hit);
+                if (!this->has_hit[p]) continue;
+                // (reset: bounces have no differentials)
+                this->surfaces[p] = surface_interaction();
+                hit.object->compute_interaction(this->rays[p], hit, this->surfaces[p]);
+                // (camera rays: the size of the pixel on the surface, for the textures)
+                if (this->depth[p] == this->max_depth) this->surfaces[p].compute_differentials(this->camera_rays[p]);
+            }
+            this->rays_traced += this->active.size();
+            this->path_rays_traced += this->active.size();
+        }
+
+        // Misses first, then the hits grouped by material type (a counting sort; there are only a few types)
+        void sort_by_material() {
+            for (int p : this->active) {
+                this->material_keys[p] = this->has_hit[p] ? this->material_type(this->materials[this->surfaces[p].material_id]) : 0;
+            }
+            this->bucket_starts.assign(this->material_types.size() + 2, 0);
+            for (int p : this->active) {
+                this->bucket_starts[this->material_keys[p] + 1]++;
+            }
+            for (size_t k=1; k<this->bucket_starts.size(); k++) {
+                this->bucket_starts[k] += this->bucket_starts[k-1];
+            }
+            this->next_active.resize(this->active.size());
+            for (int p : this->active) {
+                this->next_active[this->bucket_starts[this->material_keys[p]]++] = p;
+            }
+            std::swap(this->active, this->next_active);
+        }
+
+        // Small number for each material class (1, 2, ...; 0 is for misses)
+        size_t material_type(const material& mat) {
+            const std::type_info* type = &typeid(mat);
+            for (size_t k=0; k<this->material_types.size(); k++) {
+                if (this->material_types[k] == type) return k + 1;
+            }
+            this->material_types.push_back(type);
+            return this->material_types.size();
+        }
+
+        // Same logic as ray_color(): a miss returns the background, a hit either scatters
+        //  (the path goes on with its throughput multiplied by the attenuation) or returns the emitted light
+        // The light sample is drawn before the bounce, as in shade_hit(), so both use the same random numbers
+        void shade() {
+            this->next_active.clear();
+            this->finished.clear();
+            for (int p : this->active) {
+                if (!this->has_hit[p]) {
+                    this->add_radiance(p, this->background);
+                    this->finished.push_back(p);
+                    continue;
+                }
+
+                const surface_interaction& rec = this->surfaces[p];
+                const material& mat = this->materials[rec.material_id];
+                // Continue this path's random numbers where it left off
+                thread_rng() = this->generators[p];
+                thread_sampler() = this->samplers[p].get();
+
+                if (!this->lights.empty() && this->depth[p] > 1) {
+                    shadow_query query;
+                    if (sample_light(this->rays[p], rec, this->materials, this->lights, query.shadow, query.factor)) {
+                        query.path = p;
+                        query.factor = query.factor
+                            * color(this->throughput_r[p], this->throughput_g[p], this->throughput_b[p]);
+                        this->shadow_queue.push_back(query);
+                    }
+                }
+
+                ray scattered;
+                color attenuation;
+                if (mat.scatter(this->rays[p], rec, attenuation, scattered)) {
+                    this->throughput_r[p] *= attenuation.r();
+                    this->throughput_g[p] *= attenuation.g();
+                    this->throughput_b[p] *= attenuation.b();
+                    this->bounce_pdf[p] = mat.scattering_pdf(this->rays[p], rec, scattered.direction());
+                    this->rays[p] = scattered;
+                    // Out of bounces (or out of luck, see roulette.h): the path contributes no more light
+                    if (--this->depth[p] > 0 && this->survives_roulette(p)) {
+                        this->next_active.push_back(p);
+                    } else {
+                        this->finished.push_back(p);
+                    }
+                    this->generators[p] = thread_rng();
+                } else {
+                    color emitted = mat.emitted(rec.u, rec.v, rec.p);
+                    if (this->bounce_pdf[p] > 0 && emitted.length_squared() > 0) {
+                        emitted = emitted * emission_weight(this->lights, this->rays[p], this->bounce_pdf[p]);
+                    }
+                    this->add_radiance(p, emitted);
+                    this->finished.push_back(p);
+                }
+            }
+            std::swap(this->active, this->next_active);
+        }
+
+        // Trace the shadow rays toward the lights; each adds the emitted light of the first thing it hits
+        void shadow() {
+            for (const shadow_query& query : this->shadow_queue) {
+                hit_record rec;
+                if (!this->world.hit(query.shadow, 0.001, infinity, rec)) continue;
+                color light = query.factor * this->materials[rec.material_id].emitted(rec.u, rec.v, rec.p);
+                this->radiance_r[query.path] += light.r();
+                this->radiance_g[query.path] += light.g();
+                this->radiance_b[query.path] += light.b();
+            }
+            this->rays_traced += this->shadow_queue.size();
+            this->shadow_queue.clear();
+        }
+
+        // The paths that ended (after their last shadow rays) keep their color and free their slot
+        void finish_paths() {
+            for (int p : this->finished) {
+                const uint64_t q = this->path_index[p];
+                this->sample_r[q] = this->radiance_r[p];
+                this->sample_g[q] = this->radiance_g[p];
+                this->sample_b[q] = this->radiance_b[p];
+                this->free_slots.push_back(p);
+            }
+        }
+
+        // Russian roulette after a bounce, as in shade_hit()
+        bool survives_roulette(int p) {
+            color throughput(this->throughput_r[p], this->throughput_g[p], this->throughput_b[p]);
+            if (!::survives_roulette(throughput, this->max_depth - this->depth[p], this->roulette_depth)) return false;
+            this->throughput_r[p] = throughput.r();
+            this->throughput_g[p] = throughput.g();
+            this->throughput_b[p] = throughput.b();
+            return true;
+        }
+
+        void add_radiance(int p, const color& light) {
+            this->radiance_r[p] += this->throughput_r[p] * light.r();
+            this->radiance_g[p] += this->throughput_g[p] * light.g();
+            this->radiance_b[p] += this->throughput_b[p] * light.b();
+        }
+};
+
+#endif // header guard
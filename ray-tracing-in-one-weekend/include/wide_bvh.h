@@ -0,0 +1,340 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "simd.h"
+
+// One node of a wide BVH: up to W children, with the children's boxes stored as structure-of-arrays
+//  (box_min[axis][child]), so one SIMD register holds the same plane of 4 or 8 boxes
+// Unused child slots have an empty box (min = +inf, max = -inf) and child 0 (the root, never a child), which no
+//  ray hits except one with a NaN origin or direction (ex. a hit point beyond float's range), whose slab tests
+//  pass everything; traversal skips them
+template <int W>
+struct alignas(64) wide_bvh_node {
+    float box_min[3][W];
+    float box_max[3][W];
+    // Interior child: index of the child node; leaf child: index of its first primitive
+    uint32_t child[W];
+    // Number of primitives of a leaf child; 0 for interior children
+    uint16_t primitive_count[W];
+};
+
+// What a slab test needs from a ray, computed once per ray
+struct wide_ray {
+    float origin[3];
+    float inverse_direction[3];
+    // Whether the ray goes in the negative direction along each axis;
+    //  then it enters a box through the max plane and leaves through the min plane
+    bool negative[3];
+};
+
+// The exit distances are scaled up by this (a few float ulps), so rounding in the float slab test
+//  never misses a box the ray touches (see "Robust BVH Ray Traversal", Ize 2013)
+constexpr float wide_bvh_exit_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+// Slab test of a ray against all W children of a node
+// Writes each child's entry distance to t_near (aligned to 32 bytes) and returns a bit mask of the children hit
+// All versions do the same float operations in the same order, so they give the same answers
+template <int W>
+int wide_node_hit_scalar(const wide_bvh_node<W>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+    int mask = 0;
+    for (int k=0; k<W; k++) {
+        float t0 = t_min;
+        float t1 = t_max;
+        for (int a=0; a<3; a++) {
+            const float* near_plane = wr.negative[a] ? node.box_max[a] : node.box_min[a];
+            const float* far_plane = wr.negative[a] ? node.box_min[a] : node.box_max[a];
+            float t_enter = (near_plane[k] - wr.origin[a]) * wr.inverse_direction[a];
+            float t_exit = ((far_plane[k] - wr.origin[a]) * wr.inverse_direction[a]) * wide_bvh_exit_scale;
+            t0 = t_enter > t0 ? t_enter : t0;
+            t1 = t_exit < t1 ? t_exit : t1;
+        }
+        t_near[k] = t0;
+        if (t0 <= t1) mask |= 1 << k;
+    }
+    return mask;
+}
+
+#if RT_X86_SIMD
+// SSE: 4 children per instruction (two passes for BVH8)
+template <int W>
+int wide_node_hit_sse(const wide_bvh_node<W>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+    const __m128 exit_scale = _mm_set1_ps(wide_bvh_exit_scale);
+    int mask = 0;
+    for (int c=0; c<W; c+=4) {
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_set1_ps(t_max);
+        for (int a=0; a<3; a++) {
+            const float* near_plane = wr.negative[a] ? node.box_max[a] : node.box_min[a];
+            const float* far_plane = wr.negative[a] ? node.box_min[a] : node.box_max[a];
+            const __m128 origin = _mm_set1_ps(wr.origin[a]);
+            const __m128 inverse_direction = _mm_set1_ps(wr.inverse_direction[a]);
+            __m128 t_enter = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane + c), origin), inverse_direction);
+            __m128 t_exit = _mm_mul_ps(
+                _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane + c), origin), inverse_direction), exit_scale
+            );
+            // max/min return the second operand if either is NaN (0 * inf), same as the scalar version
+            t0 = _mm_max_ps(t_enter, t0);
+            t1 = _mm_min_ps(t_exit, t1);
+        }
+        _mm_store_ps(t_near + c, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << c;
+    }
+    return mask;
+}
+
+// AVX2: all 8 children of a BVH8 node at once
+RT_TARGET_AVX2
+int wide_node_hit_avx2(const wide_bvh_node<8>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+    const __m256 exit_scale = _mm256_set1_ps(wide_bvh_exit_scale);
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    for (int a=0; a<3; a++) {
+        const float* near_plane = wr.negative[a] ? node.box_max[a] : node.box_min[a];
+        const float* far_plane = wr.negative[a] ? node.box_min[a] : node.box_max[a];
+        const __m256 origin = _mm256_set1_ps(wr.origin[a]);
+        const __m256 inverse_direction = _mm256_set1_ps(wr.inverse_direction[a]);
+        __m256 t_enter = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_plane), origin), inverse_direction);
+        __m256 t_exit = _mm256_mul_ps(
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane), origin), inverse_direction), exit_scale
+        );
+        t0 = _mm256_max_ps(t_enter, t0);
+        t1 = _mm256_min_ps(t_exit, t1);
+    }
+    _mm256_store_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Wide BVH (BVH4 or BVH8)
+// The binary SAH tree from bvh_builder is collapsed so every node has up to W children:
+//  starting from a node's two children, the interior child with the largest surface area is
+//  replaced by its own two children until there are W of them. The tree is about half (BVH4) or
+//  a third (BVH8) as deep, and one SIMD slab test replaces W scalar box tests.
+// The slab test is picked at runtime (scalar, SSE or AVX2; see simd.h)
+template <int W>
+class wide_bvh : public hittable {
+    static_assert(W == 4 || W == 8, "wide_bvh supports 4 or 8 children per node");
+
+    public:
+        // Constructors
+        wide_bvh(
+            const hittable_list& list, double time0, double time1, int num_threads=1,
+            simd_level level=detect_simd_level()
+        ): level(level) {
+            std::vector<aabb> boxes(list.objects.size());
+            for (size_t i=0; i<list.objects.size(); i++) {
+                if (!list.objects[i]->bounding_box(time0, time1, boxes[i])) {
+                    std::cerr << "No bounding box in wide_bvh constructor" << std::endl;
+                }
+            }
+
+            bvh_builder::options opts;
+            opts.max_leaf_size = 4;
+            opts.num_threads = num_threads;
+            bvh_builder builder(boxes, opts);
+            std::unique_ptr<bvh_build_node> root = builder.build();
+            this->stats = builder.stats();
+            if (!root) return;
+
+            for (size_t index : builder.primitive_order()) {
+                this->objects.push_back(list.objects[index]);
+                this->primitives.push_back(list.objects[index].get());
+            }
+            this->box = root->box;
+            if (root->is_leaf()) {
+                // A single leaf: make a node with one child
+                this->new_node();
+                this->set_child(0, 0, *root);
+                this->nodes[0].child[0] = static_cast<uint32_t>(root->first_primitive);
+                this->nodes[0].primitive_count[0] = static_cast<uint16_t>(root->primitive_count);
+            } else {
+                this->collapse(*root);
+            }
+        }
+
+        // Implement abstract base class methods
+        virtual bool intersect(const ray& r, double t_min, double t_max, closest_hit& hit) const override {
+            if (this->nodes.empty()) return false;
+
+            wide_ray wr;
+            for (int a=0; a<3; a++) {
+                wr.origin[a] = static_cast<float>(r.origin()[a]);
+                wr.inverse_direction[a] = 1.0f / static_cast<float>(r.direction()[a]);
+                wr.negative[a] = wr.inverse_direction[a] < 0;
+            }
+            const float t_min_float = round_down_to_float(t_min);
+
+            // Children still to visit, with the distance where the ray enters their box
+            struct entry {
+                uint32_t child;
+                uint16_t primitive_count;
+                float t_near;
+            };
+            // Each level pushes at most W-1 entries more than it pops, and bvh_builder stops at bvh_max_depth levels
+            static_assert(bvh_max_depth < 64, "the traversal stack holds 64 levels");
+            entry stack[64 * W];
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, t_min_float};
+
+            alignas(32) float t_near[W];
+            bool hit_anything = false;
+            while (stack_size > 0) {
+                const entry e = stack[--stack_size];
+                // A closer hit was found since this child was pushed
+                if (e.t_near > t_max) continue;
+
+                if (e.primitive_count > 0) {
+                    for (uint32_t i=0; i<e.primitive_count; i++) {
+                        if (this->primitives[e.child + i]->intersect(r, t_min, t_max, hit)) {
+                            hit_anything = true;
+                            t_max = hit.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const wide_bvh_node<W>& node = this->nodes[e.child];
+                int mask = this->children_hit(node, wr, t_min_float, round_up_to_float(t_max), t_near);
+
+                // Push the children that were hit, farthest first, so the nearest one is visited next
+                const int first = stack_size;
+                while (mask) {
+                    int k = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    entry child = {node.child[k], node.primitive_count[k], t_near[k]};
+                    // (an unused slot: following it would start over at the root)
+                    if (child.child == 0 && child.primitive_count == 0) continue;
+                    assert(stack_size < 64 * W);
+                    // Insertion sort by decreasing distance (at most W entries)
+                    int position = stack_size++;
+                    while (position > first && stack[position-1].t_near < child.t_near) {
+                        stack[position] = stack[position-1];
+                        position--;
+                    }
+                    stack[position] = child;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = this->box;
+            return true;
+        }
+
+        size_t node_count() const { return this->nodes.size(); }
+
+        bvh_build_stats stats;
+
+    private:
+        std::vector<wide_bvh_node<W>> nodes;
+        // The primitives in leaf order; `objects` owns them, `primitives` is what traversal reads
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<const hittable*> primitives;
+        aabb box;
+        simd_level level;
+
+        int children_hit(const wide_bvh_node<W>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) const {
+#if RT_X86_SIMD
+            if constexpr (W == 8) {
+                if (this->level == simd_level::avx2) return wide_node_hit_avx2(node, wr, t_min, t_max, t_near);
+            }
+            if (this->level != simd_level::scalar) return wide_node_hit_sse<W>(node, wr, t_min, t_max, t_near);
+#endif
+            return wide_node_hit_scalar<W>(node, wr, t_min, t_max, t_near);
+        }
+
+        // Append a node with W empty child slots; returns its index
+        uint32_t new_node() {
+            wide_bvh_node<W> node;
+            for (int k=0; k<W; k++) {
+                for (int a=0; a<3; a++) {
+                    node.box_min[a][k] = infinity;
+                    node.box_max[a][k] = -infinity;
+                }
+                node.child[k] = 0;
+                node.primitive_count[k] = 0;
+            }
+            this->nodes.push_back(node);
+            return static_cast<uint32_t>(this->nodes.size() - 1);
+        }
+
+        // Store the (outward-rounded) box of `child` in slot k of node `index`
+        void set_child(uint32_t index, int k, const bvh_build_node& child) {
+            for (int a=0; a<3; a++) {
+                this->nodes[index].box_min[a][k] = round_down_to_float(child.box.min()[a]);
+                this->nodes[index].box_max[a][k] = round_up_to_float(child.box.max()[a]);
+            }
+        }
+
+        // Make a wide node for the interior build node `node` and its subtree; returns its index
+        uint32_t collapse(const bvh_build_node& node) {
+            // Open up the largest interior children until there are W
+            std::vector<const bvh_build_node*> children = {node.children[0].get(), node.children[1].get()};
+            while (static_cast<int>(children.size()) < W) {
+                int largest = -1;
+                double largest_area = -1.0;
+                for (size_t k=0; k<children.size(); k++) {
+                    double area = children[k]->box.surface_area();
+                    if (!children[k]->is_leaf() && area > largest_area) {
+                        largest = static_cast<int>(k);
+                        largest_area = area;
+                    }
+                }
+                if (largest < 0) break;
+                const bvh_build_node* opened = children[largest];
+                children[largest] = opened->children[0].get();
+                children.push_back(opened->children[1].get());
+            }
+
+            uint32_t index = this->new_node();
+            for (size_t k=0; k<children.size(); k++) {
+                this->set_child(index, static_cast<int>(k), *children[k]);
+                if (children[k]->is_leaf()) {
+                    this->nodes[index].child[k] = static_cast<uint32_t>(children[k]->first_primitive);
+                    this->nodes[index].primitive_count[k] = static_cast<uint16_t>(children[k]->primitive_count);
+                } else {
+                    // (nodes may move while the child is built; index again instead of keeping a reference)
+                    uint32_t child_index = this->collapse(*children[k]);
+                    this->nodes[index].child[k] = child_index;
+                }
+            }
+            return index;
+        }
+};
+
+// Put the objects of `list` in a wide BVH with W children per node (see build_bvh() in bvh.h)
+template <int W>
+hittable_list build_wide_bvh(const hittable_list& list, double time0, double time1, int num_threads, simd_level level) {
+    hittable_list bounded, result;
+    aabb box;
+    for (const shared_ptr<hittable>& object : list.objects) {
+        if (object->bounding_box(time0, time1, box)) {
+            bounded.add(object);
+        } else {
+            result.add(object);
+        }
+    }
+    if (bounded.objects.empty()) return list;
+
+    shared_ptr<wide_bvh<W>> tree = make_shared<wide_bvh<W>>(bounded, time0, time1, num_threads, level);
+    tree->stats.print(std::cerr, W == 4 ? "BVH4 (binary build)" : "BVH8 (binary build)");
+    std::cerr << "BVH" << W << ": " << tree->node_count() << " wide nodes, "
+        << simd_level_name(level) << " slab tests" << std::endl;
+    result.add(tree);
+    return result;
+}
+
+#endif // header guard
@@ -3,6 +3,14 @@
 // TIL (3/6/22): The imagick_r SPEC benchmark is ImageMagik
 #include <string>
 #include <iostream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <mutex>
 
 #include "rtweekend.h" // vec3, ray
 
@@ -10,8 +18,29 @@
 #include "color.h"
 #include "hittable_list.h"
 #include "sphere.h"
+#include "aarect.h"
 #include "moving_sphere.h"
 #include "material.h"
+#include "material_table.h"
+#include "lights.h"
+#include "roulette.h"
+#include "tile_renderer.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "image_io.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "simd.h"
+#include "packet.h"
+#include "sphere_soup.h"
+#include "triangle_mesh.h"
+#include "instance.h"
+#include "wavefront.h"
+#include "adaptive.h"
+#include "checkpoint.h"
+#include "denoiser.h"
+#include "scene_file.h"
 
 
 // Print the PPM header
@@ -56,75 +85,173 @@ void print_ppm_file() {
 }
 
 
-// Return the color of the pixel where the ray points to.
-// If the ray does not hit the sphere, return the background color.
-color ray_color(const ray& r, const color& background, const hittable_list& world, int depth) {
-    // Base case
-    if (depth <= 0) {
-        // Return color that contributes no light.
-        //  ¡¡Voy a ganar la liga Pokémooon!!
-        //  ¡¡La voy a ganar cueste lo que cuesteee!!
-        return color(0,0,0);
-    }
+// Number of rays this thread has traced (camera rays and bounces), for the rays/second report
+thread_local uint64_t rays_traced = 0;
+// Number of paths (camera samples) this thread has traced, and the camera and bounce rays along them
+//  (without shadow rays), for the average path length report
+thread_local uint64_t paths_traced = 0;
+thread_local uint64_t path_rays_traced = 0;
 
-    // Obtain where the ray intersects the sphere
-    
-    hit_record hit_rec = {};
-    // Ignore rays that are near zero (ex. t=-0.000001 or t=0.0000001) to reduce "shadow acne"
-    bool has_hit = world.hit(r, 0.001, infinity, hit_rec);
-    
-    // Base case 
-    if (!has_hit) {
-    
-        // No intersection of the sphere
-        // Return the background color
-        return background; 
-        
-        //// Gradient sky logic
-        //// Get the height (y-value) to range between -1.0 and 1.0
-        //vec3 unit_direction = unit_vector(r.direction());
-        //// Get t to range 0.0 to 1.0
-        //double t = 0.5 * (unit_direction.y() + 1.0);
-        
-        //// Scale t to range between 0.0 and 1.0
-        //// t=0.0 -> white; t=1.0 -> blue; in-between -> blend of white and blue
-        //// This trick is called a "linear blend", "linear interpolation", or "lerp" for short:
-        ////      blendedValue = (1-t)*startValue + t*endValue
-        //// where t goes from 0.0 to 1.0
-        
-        //// Start color (we start at the bottom of the viewport)
-        //color white = color(1.0, 1.0, 1.0); // All channels (R, G, B) at 100%
-        //// End color (we end at the top of the viewport)
-        //color blue = color(0.5, 0.7, 1.0); // Blue channel at 100%, with other colors < 100%
-    
-        //// Blue to white gradient, from top to bottom
-        //// blendedValue = (1-t)*startValue + t*endValue
-        //return (1.0-t)*white + t*blue;
-    }
-    
-    // Ray has hit an object in the world
-    // Recursively keep reflecting new rays until
-    //  we don't hit an object surface or we reach the recursion depth
+// This thread's counters at some point (ex. the start of a tile), to add what it traced since then to the totals
+struct ray_counts {
+    uint64_t rays;
+    uint64_t paths;
+    uint64_t path_rays;
+};
 
-    // Use the populated hit_record to compute the color
-    
-    // Reflected ray
-    ray scattered;
-    // How much the incoming ray/light impacts the resulting color 
-    color attenuation;
+ray_counts thread_ray_counts() {
+    return {rays_traced, paths_traced, path_rays_traced};
+}
 
-    // Emitted light from the material, if material is emissive
-    color emitted = hit_rec.mat_ptr->emitted(hit_rec.u, hit_rec.v, hit_rec.p);
+// Ignore hits that are near zero (ex. t=-0.000001 or t=0.0000001) to reduce "shadow acne"
+const double min_hit_distance = 0.001;
 
-    // If the ray reflects outward from the surface
-    if (hit_rec.mat_ptr->scatter(r, hit_rec, attenuation, scattered)) {
-        return attenuation * ray_color(scattered, world, depth-1);
-    } else {
-        // The material does not reflect any rays; return emitted color
-        // Or the reflected ray inward (inside the surface), which means
-        //  the ray is absorbed (???)
-        return emitted;
+// The light a shadow ray (see lights.h) finds: the emitted light of the first thing it hits
+color shadow_ray_light(const ray& shadow, const hittable_list& world, const material_table& materials) {
+    hit_record shadow_rec = {};
+    rays_traced++;
+    if (!world.hit(shadow, min_hit_distance, infinity, shadow_rec)) return color(0,0,0);
+    return materials[shadow_rec.material_id].emitted(shadow_rec.u, shadow_rec.v, shadow_rec.p);
+}
+
+// The light sample at a path's first hit, taken by the caller (packets trace the shadow rays of their
+//  first hits together, see render_tile_packets())
+struct first_light_sample {
+    // False if sample_light() found no direction worth a shadow ray
+    bool sampled = false;
+    color factor;
+    // What the shadow ray found (see shadow_ray_light())
+    color light;
+};
+
+// Return the color seen along camera ray `camera_ray`, given where it hit the world (`has_hit`, `first_hit`)
+// Split from ray_color() so that packets of camera rays (see packet.h) can find their hits together
+//  and then shade each ray on its own
+// With `first_light`, the light sample at the first hit was already taken (with the same random numbers)
+// The path is followed in a loop instead of recursively (so long paths through glass do not grow the stack):
+//  `throughput` is the product of the attenuations so far, and every light the path finds is added
+//  to `radiance` multiplied by it
+color shade_hit(
+    const ray_differential& camera_ray, bool has_hit, const hit_record& first_hit,
+    const color& background, const hittable_list& world, const material_table& materials, const light_list& lights,
+    int max_depth, int roulette_depth, const first_light_sample* first_light=nullptr
+) {
+    paths_traced++;
+    // (the camera ray was traced by the caller)
+    path_rays_traced++;
+
+    ray r = camera_ray;
+    hit_record hit_rec = first_hit;
+    // The camera ray's differentials give the size of the pixel on the surface, for the textures
+    if (has_hit) hit_rec.compute_differentials(camera_ray);
+    color radiance(0,0,0);
+    color throughput(1,1,1);
+    // Pdf of the bounce that made `r` (0 for camera rays and mirror/glass bounces),
+    //  to weight the light it finds against the light samples (see lights.h)
+    double bounce_pdf = 0.0;
+
+    // `depth` is the number of rays the path can still trace, this one included
+    for (int depth=max_depth; ; depth--) {
+        // Base case
+        if (!has_hit) {
+            // No intersection of the sphere
+            // Add the background color
+            radiance += throughput * background;
+            break;
+
+            //// Gradient sky logic
+            //// Get the height (y-value) to range between -1.0 and 1.0
+            //vec3 unit_direction = unit_vector(r.direction());
+            //// Get t to range 0.0 to 1.0
+            //double t = 0.5 * (unit_direction.y() + 1.0);
+
+            //// Scale t to range between 0.0 and 1.0
+            //// t=0.0 -> white; t=1.0 -> blue; in-between -> blend of white and blue
+            //// This trick is called a "linear blend", "linear interpolation", or "lerp" for short:
+            ////      blendedValue = (1-t)*startValue + t*endValue
+            //// where t goes from 0.0 to 1.0
+
+            //// Start color (we start at the bottom of the viewport)
+            //color white = color(1.0, 1.0, 1.0); // All channels (R, G, B) at 100%
+            //// End color (we end at the top of the viewport)
+            //color blue = color(0.5, 0.7, 1.0); // Blue channel at 100%, with other colors < 100%
+
+            //// Blue to white gradient, from top to bottom
+            //// blendedValue = (1-t)*startValue + t*endValue
+            //radiance += throughput * ((1.0-t)*white + t*blue);
+        }
+
+        // Ray has hit an object in the world
+        // Keep reflecting new rays until we don't hit an object surface or we reach the maximum depth
+
+        // Use the populated hit_record to compute the color
+
+        // Reflected ray
+        ray scattered;
+        // How much the incoming ray/light impacts the resulting color
+        color attenuation;
+
+        // The material that was hit (looked up by ID; see material_table.h)
+        const material& mat = materials[hit_rec.material_id];
+
+        // Emitted light from the material, if material is emissive
+        color emitted = mat.emitted(hit_rec.u, hit_rec.v, hit_rec.p);
+        // A light that the previous bounce found, which a light sample there could have found too
+        if (bounce_pdf > 0 && emitted.length_squared() > 0) {
+            emitted = emitted * emission_weight(lights, r, bounce_pdf);
+        }
+
+        // Next-event estimation: light that reaches this point straight from a light
+        // (only if the bounce could still find lights, so both ways cover the same paths)
+        if (!lights.empty() && depth > 1) {
+            ray shadow;
+            color factor;
+            if (depth == max_depth && first_light) {
+                if (first_light->sampled) radiance += throughput * first_light->factor * first_light->light;
+            } else if (sample_light(r, hit_rec, materials, lights, shadow, factor)) {
+                radiance += throughput * factor * shadow_ray_light(shadow, world, materials);
+            }
+        }
+
+        // If the ray reflects outward from the surface
+        if (!mat.scatter(r, hit_rec, attenuation, scattered)) {
+            // The material does not reflect any rays; add the emitted color
+            // Or the reflected ray inward (inside the surface), which means
+            //  the ray is absorbed (???)
+            radiance += throughput * emitted;
+            break;
+        }
+        throughput = throughput * attenuation;
+        bounce_pdf = mat.scattering_pdf(r, hit_rec, scattered.direction());
+        r = scattered;
+
+        // Out of bounces: the rest of the path contributes no light
+        //  ¡¡Voy a ganar la liga Pokémooon!!
+        //  ¡¡La voy a ganar cueste lo que cuesteee!!
+        if (depth - 1 <= 0) break;
+        // Paths that carry little light stop early (see roulette.h)
+        if (!survives_roulette(throughput, max_depth - (depth - 1), roulette_depth)) break;
+
+        // Obtain where the reflected ray intersects the world
+        hit_rec = {};
+        rays_traced++;
+        path_rays_traced++;
+        has_hit = world.hit(r, min_hit_distance, infinity, hit_rec);
     }
+    return radiance;
+}
+
+// Return the color of the pixel where the ray points to.
+// If the ray does not hit anything, return the background color.
+color ray_color(
+    const ray_differential& r, const color& background, const hittable_list& world,
+    const material_table& materials, const light_list& lights, int max_depth, int roulette_depth
+) {
+    // Obtain where the ray intersects the world
+    hit_record hit_rec = {};
+    rays_traced++;
+    bool has_hit = world.hit(r, min_hit_distance, infinity, hit_rec);
+    return shade_hit(r, has_hit, hit_rec, background, world, materials, lights, max_depth, roulette_depth);
 }
 
 hittable_list image_texture_sphere(const char* filename) {
@@ -293,17 +420,492 @@ hittable_list two_perlin_spheres() {
     return objects;
 }
 
-void run_ray_tracer() {
+// Two Perlin spheres lit by a rectangle and a sphere of light
+hittable_list simple_light() {
+    hittable_list objects = two_perlin_spheres();
+
+    auto light = make_shared<diffuse_light>(color(4, 4, 4));
+    objects.add(
+        make_shared<xy_rect>(3, 5, 1, 3, -2, light)
+    );
+    objects.add(
+        make_shared<sphere>(point3(0, 7, 0), 2, light)
+    );
+
+    return objects;
+}
+
+// A field of 316 x 316 small objects: 99,856 instances (see instance.h) of just two geometries,
+//  a cluster of spheres and an octahedron mesh, each turned, scaled and colored differently
+hittable_list instanced_scene(simd_level level) {
+    hittable_list world;
+
+    color even = color(0.2, 0.3, 0.1);
+    color odd = color(0.9, 0.9, 0.9);
+    shared_ptr<material> material_ground = make_shared<lambertian>(make_shared<checker_texture>(even, odd));
+    world.add(
+        make_shared<sphere>(point3(0, -1000, 0), 1000, material_ground)
+    );
+
+    // The shared geometries, in object space (on the ground, at the origin)
+    // A sphere with four smaller ones around it (its material is replaced by each instance's)
+    shared_ptr<material> unused = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    hittable_list cluster;
+    cluster.add(make_shared<sphere>(point3(0, 0.2, 0), 0.2, unused));
+    for (int i=0; i<4; i++) {
+        double angle = i * pi / 2;
+        cluster.add(make_shared<sphere>(point3(0.25*std::cos(angle), 0.1, 0.25*std::sin(angle)), 0.1, unused));
+    }
+    shared_ptr<hittable> cluster_geometry = make_shared<bottom_level_bvh>(cluster, 0.0, 1.0);
+
+    shared_ptr<triangle_mesh> octahedron = make_shared<triangle_mesh>(unused, level);
+    const point3 corners[6] = {
+        point3(0.25, 0.25, 0), point3(-0.25, 0.25, 0), point3(0, 0.5, 0),
+        point3(0, 0, 0), point3(0, 0.25, 0.25), point3(0, 0.25, -0.25)
+    };
+    for (const point3& corner : corners) octahedron->add_vertex(corner);
+    const uint32_t faces[8][3] = {
+        {0, 2, 4}, {4, 2, 1}, {1, 2, 5}, {5, 2, 0}, {4, 3, 0}, {1, 3, 4}, {5, 3, 1}, {0, 3, 5}
+    };
+    for (const auto& face : faces) octahedron->add_triangle(face[0], face[1], face[2]);
+    octahedron->finish();
+
+    // A few materials, shared by all the instances
+    std::vector<shared_ptr<material>> palette;
+    for (int i=0; i<12; i++) palette.push_back(make_shared<lambertian>(color::random() * color::random()));
+    for (int i=0; i<3; i++) palette.push_back(make_shared<metal>(color::random(0.5, 1), random_double(0, 0.3)));
+    palette.push_back(make_shared<dielectric>(1.5));
+
+    for (int x=-158; x<158; x++) {
+        for (int z=-158; z<158; z++) {
+            point3 position(x + 0.5 + 0.3*random_double(-1, 1), 0, z + 0.5 + 0.3*random_double(-1, 1));
+            affine_transform place = affine_transform::translate(position)
+                * affine_transform::rotate(vec3(0, 1, 0), random_double(0, 360))
+                * affine_transform::scale(random_double(0.7, 1.3));
+            shared_ptr<hittable> geometry = random_double() < 0.5 ? cluster_geometry : octahedron;
+            world.add(make_shared<instance>(geometry, place, palette[random_int(0, static_cast<int>(palette.size()) - 1)]));
+        }
+    }
+
+    return world;
+}
+
+// What every tile needs to render its pixels
+struct render_context {
+    const camera& cam;
+    const hittable_list& world;
+    const material_table& materials;
+    // Lights for next-event estimation (empty = no light sampling)
+    const light_list& lights;
+    color background;
+    int image_width;
+    int image_height;
+    // Every pixel takes samples [first_sample, first_sample + samples_per_pixel)
+    int first_sample;
+    int samples_per_pixel;
+    int max_depth;
+    // Russian roulette after this many bounces (0 = off)
+    int roulette_depth;
+    // Instruction set for packet traversal
+    simd_level level;
+};
+
+// Render a tile with packets of N camera rays (2x2, 4x2 or 4x4 pixels, one sample each)
+// The packet finds the first hits, and a second packet the shadow rays of their light samples; each ray is
+//  then shaded (and bounced) on its own.
+// Every pixel keeps its own sampler and generator state, so the image is the same as without packets.
+template <int N>
+void render_tile_packets(const tile& t, const render_context& ctx, const sampler& pixel_sampler, framebuffer& fb) {
+    constexpr int packet_width = (N == 4) ? 2 : 4;
+    constexpr int packet_height = N / packet_width;
+
+    std::unique_ptr<sampler> samplers[N];
+    for (int k=0; k<N; k++) samplers[k] = pixel_sampler.clone();
+    ray_packet<N> packet;
+    hit_record recs[N];
+    bool hits[N];
+    // The shadow rays of the first hits (packed: lane m is the shadow ray of pixel shadow_pixels[m])
+    ray_packet<N> shadows;
+    int shadow_pixels[N];
+    hit_record shadow_recs[N];
+    bool shadow_hits[N];
+    first_light_sample first_lights[N];
+    const bool light_samples = !ctx.lights.empty() && ctx.max_depth > 1;
+    // Each pixel's generator right after its camera ray was made, to continue from when it is shaded
+    pcg32 generators[N];
+
+    for (int y0=t.y0; y0<t.y1; y0+=packet_height) {
+        for (int x0=t.x0; x0<t.x1; x0+=packet_width) {
+            // The pixels of this packet (fewer at the edge of a tile)
+            int pixel_i[N], pixel_j[N];
+            color pixel_colors[N];
+            packet.size = 0;
+            for (int dy=0; dy<packet_height && y0+dy < t.y1; dy++) {
+                for (int dx=0; dx<packet_width && x0+dx < t.x1; dx++) {
+                    int k = packet.size++;
+                    pixel_i[k] = x0 + dx;
+                    pixel_j[k] = y0 + dy;
+                    pixel_colors[k] = color(0, 0, 0);
+                    samplers[k]->start_pixel(pixel_i[k], pixel_j[k]);
+                }
+            }
+
+            for (int s=ctx.first_sample; s<ctx.first_sample + ctx.samples_per_pixel; s++) {
+                for (int k=0; k<packet.size; k++) {
+                    samplers[k]->start_sample(s);
+                    point2 jitter = samplers[k]->get_2d();
+                    double u = (double(pixel_i[k]) + jitter.x) / (ctx.image_width-1);
+                    double v = (double(pixel_j[k]) + jitter.y) / (ctx.image_height-1);
+                    packet.rays[k] = ctx.cam.get_ray(u, v, *samplers[k]);
+                    generators[k] = thread_rng();
+                }
+
+                trace_packet<N>(ctx.world, packet, min_hit_distance, recs, hits, ctx.level);
+                rays_traced += packet.size;
+
+                // The light samples of the first hits, as shade_hit() would take them, and their shadow rays
+                if (light_samples) {
+                    shadows.size = 0;
+                    for (int k=0; k<packet.size; k++) {
+                        first_lights[k] = first_light_sample();
+                        if (!hits[k]) continue;
+                        thread_rng() = generators[k];
+                        thread_sampler() = samplers[k].get();
+                        recs[k].compute_differentials(packet.rays[k]);
+                        ray shadow;
+                        if (sample_light(packet.rays[k], recs[k], ctx.materials, ctx.lights, shadow, first_lights[k].factor)) {
+                            first_lights[k].sampled = true;
+                            shadow_pixels[shadows.size] = k;
+                            shadows.rays[shadows.size++] = shadow;
+                        }
+                        generators[k] = thread_rng();
+                    }
+                    trace_packet<N>(ctx.world, shadows, min_hit_distance, shadow_recs, shadow_hits, ctx.level);
+                    rays_traced += shadows.size;
+                    for (int m=0; m<shadows.size; m++) {
+                        const hit_record& rec = shadow_recs[m];
+                        first_lights[shadow_pixels[m]].light = shadow_hits[m]
+                            ? ctx.materials[rec.material_id].emitted(rec.u, rec.v, rec.p) : color(0,0,0);
+                    }
+                }
+
+                for (int k=0; k<packet.size; k++) {
+                    thread_rng() = generators[k];
+                    thread_sampler() = samplers[k].get();
+                    pixel_colors[k] += shade_hit(
+                        packet.rays[k], hits[k], recs[k], ctx.background, ctx.world, ctx.materials, ctx.lights,
+                        ctx.max_depth, ctx.roulette_depth, light_samples ? &first_lights[k] : nullptr
+                    );
+                }
+            }
+
+            for (int k=0; k<packet.size; k++) {
+                fb.add_samples(pixel_i[k], pixel_j[k], pixel_colors[k], ctx.samples_per_pixel);
+            }
+        }
+    }
+}
+
+// Command-line options
+struct render_options {
+    // Number of worker threads that render tiles (defaults to the number of cores)
+    int num_threads = static_cast<int>(std::thread::hardware_concurrency());
+    // Width and height of a tile, in pixels
+    int tile_size = 16;
+    // Which scene in run_ray_tracer() to render (1 to 7)
+    int scene = 5;
+    // Scene file to render instead (text or binary, see scene_file.h)
+    std::string scene_path;
+    // Write the scene file in the binary format to this file, instead of rendering
+    std::string write_scene_path;
+    // Image width in pixels (the height follows from the aspect ratio)
+    int image_width = 400;
+    int samples_per_pixel = 100;
+    // Seed for the scene generation and all samples; the same seed gives the same image
+    uint64_t seed = 0;
+    // Sampler for the pixel, lens, time and bounce dimensions (see make_sampler())
+    std::string sampler_name = "independent";
+    // Image file to write (.ppm, .pfm or .png); empty = binary PPM on standard out
+    std::string output_path;
+    // Acceleration structure for the world: "linear" (flattened BVH), "bvh4"/"bvh8" (wide BVHs),
+    //  "bvh" (pointer BVH) or "none" (test every object)
+    std::string accelerator = "linear";
+    // Instruction set for the wide BVH and packet slab tests ("auto" = the best this CPU has)
+    std::string simd = "auto";
+    // "soup": store all spheres in one sphere_soup (SIMD batches); "objects": one hittable per sphere
+    std::string spheres = "soup";
+    // Boxes of moving objects in the linear BVH and the sphere soup: "segments" (one set of boxes per part of
+    //  the shutter interval, see segmented_motion_bvh in linear_bvh.h) or "static" (one box over the whole interval)
+    std::string motion_bounds = "segments";
+    // "recursive" (ray_color()) or "wavefront" (see wavefront.h)
+    std::string integrator = "recursive";
+    // Wavefront: paths in flight per render thread
+    int wavefront_paths = 65536;
+    // Adaptive sampling: stop pixels at this error in output units (0 = off; every pixel takes --spp samples)
+    double adaptive_threshold = 0.0;
+    // Adaptive sampling: samples every pixel takes first
+    int min_samples = 16;
+    // Adaptive sampling: image of the number of samples per pixel
+    std::string spp_map_path;
+    // Lens aperture; negative = the scene's own (0 is a pinhole camera, no depth of field)
+    double aperture = -1.0;
+    // Trace camera rays in packets of this many rays (4, 8 or 16; 0 = one at a time)
+    int packet_size = 0;
+    // Progressive rendering: take the samples in passes of this many per pixel (0 = all at once)
+    int samples_per_pass = 0;
+    // Progressive rendering: save the render's state to this file between passes
+    std::string checkpoint_path;
+    // Progressive rendering: seconds between checkpoints (0 = after every pass)
+    double checkpoint_interval = 0.0;
+    // Progressive rendering: continue the render saved in this checkpoint
+    std::string resume_path;
+    // Denoise the image after rendering, with this strength (scales the color tolerance; 0 = off)
+    double denoise_strength = 0.0;
+    // Write the albedo, normal and depth buffers to <prefix>_albedo.pfm, ...
+    std::string aux_prefix;
+    // PFM image (ex. a high-spp render) to compare the result to
+    std::string reference_path;
+    // Image textures: "trilinear" (mip level from the camera rays' differentials) or "bilinear" (full resolution)
+    std::string texture_filter = "trilinear";
+    // Russian roulette: paths may stop early after this many bounces (0 = off; see roulette.h)
+    int roulette_depth = 3;
+    // "mis": sample the emissive objects at every diffuse hit (see lights.h); "bsdf": only find them by bouncing
+    std::string light_sampling = "mis";
+};
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] [> image.ppm]" << std::endl;
+    std::cerr << "  --threads N     number of render threads (default: number of cores)" << std::endl;
+    std::cerr << "  --tile-size N   tile width/height in pixels (default: 16)" << std::endl;
+    std::cerr << "  --scene N       scene to render (1=random, 2=checker, 3=perlin, 4=earth, 5=lights, 6=tutorial, 7=instances) (default: 5)" << std::endl;
+    std::cerr << "  --scene-file FILE  render the scene in FILE (text or binary) instead of --scene" << std::endl;
+    std::cerr << "  --write-scene FILE  write the --scene-file scene to FILE in the binary format and exit" << std::endl;
+    std::cerr << "  --width N       image width in pixels (default: 400)" << std::endl;
+    std::cerr << "  --spp N         samples per pixel (default: 100)" << std::endl;
+    std::cerr << "  --seed N        random seed (default: 0)" << std::endl;
+    std::cerr << "  --sampler NAME  independent, stratified, sobol or bluenoise (default: independent)" << std::endl;
+    std::cerr << "  --output FILE   write the image to FILE (.ppm, .pfm or .png; default: PPM on standard out)" << std::endl;
+    std::cerr << "  --accel NAME    linear, bvh4, bvh8, bvh or none (default: linear)" << std::endl;
+    std::cerr << "  --simd NAME     auto, scalar, sse or avx2 for the bvh4/bvh8 and packet tests, the sphere soup and triangle"
+        << " mesh batches, the noise textures and the denoiser (default: auto)" << std::endl;
+    std::cerr << "  --spheres NAME  soup (SIMD sphere batches) or objects (one object per sphere) (default: soup)" << std::endl;
+    std::cerr << "  --motion-bounds NAME  segments (boxes follow moving objects) or static, for the linear BVH and sphere soup (default: segments)" << std::endl;
+    std::cerr << "  --integrator NAME  recursive or wavefront (default: recursive)" << std::endl;
+    std::cerr << "  --wavefront-paths N  wavefront: paths in flight per thread (default: 65536)" << std::endl;
+    std::cerr << "  --adaptive X    stop sampling a pixel at error X (ex. 0.01), give its samples to noisy pixels (default: 0 = off)" << std::endl;
+    std::cerr << "  --min-spp N     adaptive: samples every pixel takes first (default: 16)" << std::endl;
+    std::cerr << "  --spp-map FILE  adaptive: write a heatmap of the samples per pixel" << std::endl;
+    std::cerr << "  --aperture X    lens aperture, 0 for a pinhole camera (default: the scene's)" << std::endl;
+    std::cerr << "  --packet N      trace camera rays, and the shadow rays of their first hits, in packets of 4, 8 or 16 (linear BVH) (default: 0 = off)" << std::endl;
+    std::cerr << "  --progressive N render in passes of N samples per pixel (default: 0 = one pass)" << std::endl;
+    std::cerr << "  --checkpoint FILE  progressive: save the render to FILE between passes" << std::endl;
+    std::cerr << "  --checkpoint-every S  progressive: seconds between checkpoints (default: 0 = every pass)" << std::endl;
+    std::cerr << "  --resume FILE   continue the render saved in checkpoint FILE, up to --spp samples per pixel" << std::endl;
+    std::cerr << "  --denoise X     denoise the image with strength X (ex. 1; default: 0 = off)" << std::endl;
+    std::cerr << "  --aux PREFIX    write the albedo, normal and depth buffers to PREFIX_albedo.pfm, ..." << std::endl;
+    std::cerr << "  --reference FILE  print the MSE and PSNR of the image against a PFM reference image" << std::endl;
+    std::cerr << "  --texture-filter NAME  trilinear (mip level from the pixel footprint) or bilinear (default: trilinear)" << std::endl;
+    std::cerr << "  --roulette N    Russian roulette: paths that carry little light may stop after N bounces (default: 3; 0 = off)" << std::endl;
+    std::cerr << "  --light-sampling NAME  mis (shadow rays to lights, weighted with the bounces) or bsdf (default: mis)" << std::endl;
+}
+
+// Parse the command-line arguments into `options`
+// Return false if the arguments are not valid
+bool parse_options(int argc, char* argv[], render_options& options) {
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        // Every option takes one value
+        bool has_value = (i+1 < argc);
+        if (std::strcmp(arg, "--threads") == 0 && has_value) {
+            options.num_threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--tile-size") == 0 && has_value) {
+            options.tile_size = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--scene") == 0 && has_value) {
+            // (anything but a whole number from 1 to 7 becomes 0, which the checks below reject)
+            const char* value = argv[++i];
+            char* end = nullptr;
+            const long scene = std::strtol(value, &end, 10);
+            options.scene = (end != value && *end == '\0' && scene >= 1 && scene <= 7) ? static_cast<int>(scene) : 0;
+        } else if (std::strcmp(arg, "--scene-file") == 0 && has_value) {
+            options.scene_path = argv[++i];
+        } else if (std::strcmp(arg, "--write-scene") == 0 && has_value) {
+            options.write_scene_path = argv[++i];
+        } else if (std::strcmp(arg, "--width") == 0 && has_value) {
+            options.image_width = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--spp") == 0 && has_value) {
+            options.samples_per_pixel = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--seed") == 0 && has_value) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(arg, "--sampler") == 0 && has_value) {
+            options.sampler_name = argv[++i];
+        } else if (std::strcmp(arg, "--output") == 0 && has_value) {
+            options.output_path = argv[++i];
+        } else if (std::strcmp(arg, "--accel") == 0 && has_value) {
+            options.accelerator = argv[++i];
+        } else if (std::strcmp(arg, "--simd") == 0 && has_value) {
+            options.simd = argv[++i];
+        } else if (std::strcmp(arg, "--spheres") == 0 && has_value) {
+            options.spheres = argv[++i];
+        } else if (std::strcmp(arg, "--motion-bounds") == 0 && has_value) {
+            options.motion_bounds = argv[++i];
+        } else if (std::strcmp(arg, "--integrator") == 0 && has_value) {
+            options.integrator = argv[++i];
+        } else if (std::strcmp(arg, "--wavefront-paths") == 0 && has_value) {
+            options.wavefront_paths = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--adaptive") == 0 && has_value) {
+            options.adaptive_threshold = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--min-spp") == 0 && has_value) {
+            options.min_samples = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--spp-map") == 0 && has_value) {
+            options.spp_map_path = argv[++i];
+        } else if (std::strcmp(arg, "--aperture") == 0 && has_value) {
+            options.aperture = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--packet") == 0 && has_value) {
+            options.packet_size = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--progressive") == 0 && has_value) {
+            options.samples_per_pass = std::atoi(argv[++i]);
+        } else if (std::strcmp(arg, "--checkpoint") == 0 && has_value) {
+            options.checkpoint_path = argv[++i];
+        } else if (std::strcmp(arg, "--checkpoint-every") == 0 && has_value) {
+            options.checkpoint_interval = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--resume") == 0 && has_value) {
+            options.resume_path = argv[++i];
+        } else if (std::strcmp(arg, "--denoise") == 0 && has_value) {
+            options.denoise_strength = std::atof(argv[++i]);
+        } else if (std::strcmp(arg, "--aux") == 0 && has_value) {
+            options.aux_prefix = argv[++i];
+        } else if (std::strcmp(arg, "--reference") == 0 && has_value) {
+            options.reference_path = argv[++i];
+        } else if (std::strcmp(arg, "--light-sampling") == 0 && has_value) {
+            options.light_sampling = argv[++i];
+        } else if (std::strcmp(arg, "--texture-filter") == 0 && has_value) {
+            options.texture_filter = argv[++i];
+        } else if (std::strcmp(arg, "--roulette") == 0 && has_value) {
+            options.roulette_depth = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    // hardware_concurrency() can return 0 if the number of cores is unknown
+    if (options.num_threads < 1) options.num_threads = 1;
+    if (options.tile_size < 1 || options.image_width < 2 || options.samples_per_pixel < 1) {
+        std::cerr << "--tile-size and --spp must be at least 1, --width at least 2" << std::endl;
+        return false;
+    }
+    if (options.scene_path.empty() && (options.scene < 1 || options.scene > 7)) {
+        std::cerr << "--scene must be a number from 1 to 7" << std::endl;
+        return false;
+    }
+    if (!options.write_scene_path.empty() && options.scene_path.empty()) {
+        std::cerr << "--write-scene needs --scene-file" << std::endl;
+        return false;
+    }
+    const char* accelerators[] = {"linear", "bvh4", "bvh8", "bvh", "none"};
+    if (std::find(std::begin(accelerators), std::end(accelerators), options.accelerator) == std::end(accelerators)) {
+        std::cerr << "Unknown accelerator: " << options.accelerator << std::endl;
+        return false;
+    }
+    simd_level level;
+    if (!parse_simd_level(options.simd, level)) {
+        std::cerr << "Unknown SIMD level: " << options.simd << std::endl;
+        return false;
+    }
+    if (options.spheres != "soup" && options.spheres != "objects") {
+        std::cerr << "--spheres must be soup or objects" << std::endl;
+        return false;
+    }
+    if (options.motion_bounds != "segments" && options.motion_bounds != "static") {
+        std::cerr << "--motion-bounds must be segments or static" << std::endl;
+        return false;
+    }
+    if (options.adaptive_threshold < 0 || options.min_samples < 2) {
+        std::cerr << "--adaptive must be at least 0 and --min-spp at least 2" << std::endl;
+        return false;
+    }
+    if (options.integrator != "recursive" && options.integrator != "wavefront") {
+        std::cerr << "--integrator must be recursive or wavefront" << std::endl;
+        return false;
+    }
+    if (options.wavefront_paths < 1) {
+        std::cerr << "--wavefront-paths must be at least 1" << std::endl;
+        return false;
+    }
+    if (options.texture_filter != "trilinear" && options.texture_filter != "bilinear") {
+        std::cerr << "--texture-filter must be trilinear or bilinear" << std::endl;
+        return false;
+    }
+    if (options.roulette_depth < 0) {
+        std::cerr << "--roulette must be at least 0" << std::endl;
+        return false;
+    }
+    if (options.light_sampling != "mis" && options.light_sampling != "bsdf") {
+        std::cerr << "--light-sampling must be mis or bsdf" << std::endl;
+        return false;
+    }
+    if (options.packet_size != 0 && options.packet_size != 4 && options.packet_size != 8 && options.packet_size != 16) {
+        std::cerr << "--packet must be 0, 4, 8 or 16" << std::endl;
+        return false;
+    }
+    if (options.denoise_strength < 0) {
+        std::cerr << "--denoise must be at least 0" << std::endl;
+        return false;
+    }
+    if (options.samples_per_pass < 0 || options.checkpoint_interval < 0) {
+        std::cerr << "--progressive and --checkpoint-every must be at least 0" << std::endl;
+        return false;
+    }
+    const bool progressive = options.samples_per_pass > 0 || !options.resume_path.empty();
+    if (!progressive && !options.checkpoint_path.empty()) {
+        std::cerr << "--checkpoint needs --progressive" << std::endl;
+        return false;
+    }
+    if (progressive && options.adaptive_threshold > 0) {
+        std::cerr << "--adaptive cannot be combined with --progressive or --resume" << std::endl;
+        return false;
+    }
+    // (adaptive rounds trace their samples one pixel at a time with ray_color())
+    if (options.adaptive_threshold > 0 && (options.integrator != "recursive" || options.packet_size > 0)) {
+        std::cerr << "--adaptive cannot be combined with --integrator wavefront or --packet" << std::endl;
+        return false;
+    }
+    if (!make_sampler(options.sampler_name, 1, 0)) {
+        std::cerr << "Unknown sampler: " << options.sampler_name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Set by SIGTERM/SIGINT during a progressive render: stop after the current pass
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int signal) {
+    stop_requested = 1;
+    // A second signal stops the program right away
+    std::signal(signal, SIG_DFL);
+}
+
+// Render the image described by `options`; returns false if it could not be rendered or written
+bool run_ray_tracer(const render_options& options) {
     
     // Image attributes 
     const double aspect_ratio = 16.0 / 9.0; // width to height
-    const int image_width = 400; // pixels
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 100;
+    const int image_width = options.image_width; // pixels
+    const int image_height = std::max(2, static_cast<int>(image_width / aspect_ratio));
+    const int samples_per_pixel = options.samples_per_pixel;
     // Maximum number of times a ray can keep reflecting off of a surface
     //  in a row
     const int max_depth = 50;
     
+    // Seed this thread's generator, so the random scenes are the same for the same seed
+    thread_rng().seed(options.seed);
+
+    // Instruction set of the SIMD code paths (the noise textures pick it up when the scene is built)
+    simd_level level;
+    parse_simd_level(options.simd, level);
+    perlin::default_simd_level() = level;
+
     // Our scene
     hittable_list world;
     // Camera settings depending on the scene
@@ -311,71 +913,419 @@ void run_ray_tracer() {
     point3 lookat = point3(0,0,0);
     double vfov = 20.0; // vertical field of view, in degrees
     double aperature = 0.0;
+    vec3 view_up_vector = vec3(0,1,0);
+    double dist_to_focus = 10.0;
     color background(0.70, 0.80, 1.00); // light blue
 
-    switch(0) {
-        case 1: { // Testing out this bracket thing here
-            // Textbook cover
-            world = random_scene();
-            aperature = 0.1;
-        } break;
-        case 2:
-            world = two_spheres();
-            break;
-        case 3:
-            world = two_perlin_spheres();
-            break;
-        case 4:
-            world = earth();
-            //world = image_texture_sphere("images/fur-texture.jpeg");
-            break;
-        default:
-        case 5:
-            // Set the background to black to be able to see emissive materials (emits light)
-            background = color(0,0,0);
-            break;
+    // The scene's materials, by ID (the objects get their IDs before they go into soups and BVHs)
+    material_table materials;
+    // The spheres of a scene file go straight into the soup, without an object each (see scene_file.h)
+    shared_ptr<sphere_soup> soup = make_shared<sphere_soup>(level);
+    scene_file file;
+
+    if (!options.scene_path.empty()) {
+        auto load_start = std::chrono::steady_clock::now();
+        if (!file.open(options.scene_path)) return false;
+        if (!options.write_scene_path.empty()) return file.write_binary(options.write_scene_path);
+        if (!file.build(materials, options.spheres == "soup" ? soup.get() : nullptr, options.num_threads, level, world)) {
+            return false;
+        }
+        const scene_settings& settings = file.get_settings();
+        lookfrom = point3(settings.lookfrom[0], settings.lookfrom[1], settings.lookfrom[2]);
+        lookat = point3(settings.lookat[0], settings.lookat[1], settings.lookat[2]);
+        view_up_vector = vec3(settings.view_up[0], settings.view_up[1], settings.view_up[2]);
+        vfov = settings.vfov;
+        aperature = settings.aperture;
+        dist_to_focus = settings.focus_distance;
+        background = color(settings.background[0], settings.background[1], settings.background[2]);
+        std::chrono::duration<double, std::milli> load_time = std::chrono::steady_clock::now() - load_start;
+        std::cerr << "Loaded " << file.object_count() << " objects from " << options.scene_path
+            << " in " << load_time.count() << " ms" << std::endl;
+    } else {
+        switch(options.scene) {
+            case 1: { // Testing out this bracket thing here
+                // Textbook cover
+                world = random_scene();
+                aperature = 0.1;
+            } break;
+            case 2:
+                world = two_spheres();
+                break;
+            case 3:
+                world = two_perlin_spheres();
+                break;
+            case 4:
+                world = earth();
+                //world = image_texture_sphere("images/fur-texture.jpeg");
+                break;
+            case 6:
+                // The three spheres from the first book
+                world = tutorial_scene();
+                lookfrom = point3(-2, 2, 1);
+                lookat = point3(0, 0, -1);
+                break;
+            case 7:
+                world = instanced_scene(level);
+                lookfrom = point3(9, 3, 5);
+                lookat = point3(0, 0.3, 0);
+                vfov = 30.0;
+                break;
+            case 5:
+                world = simple_light();
+                // Set the background to black to be able to see emissive materials (emits light)
+                background = color(0,0,0);
+                lookfrom = point3(26, 3, 6);
+                lookat = point3(0, 2, 0);
+                break;
+        }
     }
 
-    // Camera
-    vec3 view_up_vector = vec3(0,1,0);
-    double dist_to_focus = 10.0;
+    if (options.aperture >= 0) aperature = options.aperture;
+
+    // Shutter open/close times
     double time0 = 0.0;
     double time1 = 1.0;
-    const camera cam(
+
+    world.register_materials(materials);
+
+    // The emissive objects, sampled at every diffuse hit (before they disappear into soups and BVHs)
+    light_list lights;
+    if (options.light_sampling == "mis") gather_lights(world, lights);
+
+    // Put the objects in a bounding volume hierarchy, so a ray only tests the objects near it
+    // (moving objects get boxes per segment of the shutter interval unless --motion-bounds static;
+    //  the wide and pointer BVHs only have static boxes)
+    const bool motion_bvh = options.motion_bounds == "segments";
+    // Spheres go in a sphere soup, which has its own BVH (unless there is no acceleration structure)
+    if (options.spheres == "soup") {
+        world = gather_spheres(world, time0, time1, options.accelerator != "none", options.num_threads, level, soup, motion_bvh);
+    }
+    if (options.accelerator == "linear") {
+        world = build_linear_bvh(world, time0, time1, options.num_threads, motion_bvh);
+    } else if (options.accelerator == "bvh4" || options.accelerator == "bvh8") {
+        if (options.accelerator == "bvh4") {
+            world = build_wide_bvh<4>(world, time0, time1, options.num_threads, level);
+        } else {
+            world = build_wide_bvh<8>(world, time0, time1, options.num_threads, level);
+        }
+    } else if (options.accelerator == "bvh") {
+        world = build_bvh(world, time0, time1, options.num_threads);
+    }
+
+    // Camera
+    camera cam(
         lookfrom, lookat, view_up_vector, vfov, aspect_ratio, aperature, dist_to_focus,
         time0, time1
     );
-
     // Render
-    print_ppm_header("P3", image_width, image_height, 255);
-    // Start from the upper-left corner of the image
-    for (int j=image_height-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i=0; i<image_width; ++i) {
-            // Sample pixels around position pixel at position (i, j)
-            // Taking the average of these samples creates an anti-aliasing effect
-            color pixel_color(0, 0, 0);
-            for (int s=0; s<samples_per_pixel; s++) {
-                // "Squish" u and v to be in the range 0.0 to 1.0
-                // Pixel = (u, v), where u is horizontal and v is vertical
-                // Get a random neighboring pixel by adding a random_double() (which has range 0 to 1.0)
-                double u = (double(i) + random_double()) / (image_width-1); // Ha, double u
-                double v = (double(j) + random_double()) / (image_height-1);
-                
-                // Get the ray that points from camera origin to (u, v) in the viewport
-                ray r = cam.get_ray(u, v);
-                // Add this sample's color channel values
-                // The average of all samples will be calculated by write_color()
-                pixel_color += ray_color(r, background, world, max_depth);
+    // Each pixel's samples are added to the framebuffer, so tiles can finish in any order
+    // Row 0 of the framebuffer is the bottom of the image
+    framebuffer fb(image_width, image_height);
+    // Adaptive sampling can give a pixel up to 4 times the average, so its sampler has to plan for that many
+    const bool adaptive = options.adaptive_threshold > 0;
+    adaptive_sampling::options adaptive_options;
+    adaptive_options.threshold = options.adaptive_threshold;
+    adaptive_options.min_samples = std::min(options.min_samples, samples_per_pixel);
+    adaptive_options.samples_per_pixel = samples_per_pixel;
+    adaptive_options.max_samples = 4 * samples_per_pixel;
+
+    // Progressive rendering takes the samples in passes, and can save and resume the render between them
+    const bool progressive = options.samples_per_pass > 0 || !options.resume_path.empty();
+    render_checkpoint progress;
+    progress.width = image_width;
+    progress.height = image_height;
+    progress.scene = options.scene;
+    // (a scene file is told apart by its contents; negative, so it never matches a --scene number)
+    if (progressive && !options.scene_path.empty()) progress.scene = static_cast<int>(file.fingerprint() | 0x80000000u);
+    progress.seed = options.seed;
+    progress.sampler_name = options.sampler_name;
+    progress.samples_per_pass = options.samples_per_pass;
+    progress.integrator = options.integrator;
+    progress.light_sampling = options.light_sampling;
+    progress.roulette_depth = options.roulette_depth;
+    progress.aperture = aperature;
+    progress.texture_filter = options.texture_filter;
+    if (!options.resume_path.empty()) {
+        render_checkpoint saved;
+        if (!read_checkpoint(options.resume_path, saved)) return false;
+        // Without --progressive, keep the pass size of the saved render
+        if (options.samples_per_pass == 0) progress.samples_per_pass = saved.samples_per_pass;
+        if (!saved.same_render(progress)) {
+            std::cerr << "The checkpoint is of another render (scene, image size, aperture, seed, sampler, pass size,"
+                << " integrator, light sampling, roulette or texture filter): "
+                << options.resume_path << std::endl;
+            return false;
+        }
+        fb = framebuffer(image_width, image_height, std::move(saved.sums), std::move(saved.counts));
+        progress.samples_done = saved.samples_done;
+        std::cerr << "Resuming " << options.resume_path << " at " << progress.samples_done
+            << " samples per pixel" << std::endl;
+    }
+    const int samples_per_pass = progressive ? progress.samples_per_pass : samples_per_pixel;
+
+    // Ray differentials for texture filtering: each sample covers about 1/sqrt(n) of the pixel's width
+    //  (but not less than 1/8, so the textures are not sharpened past what the samples average out)
+    // n is the pass size and not --spp: a resumed render then filters exactly as one that never stopped,
+    //  whatever --spp each run was given
+    if (options.texture_filter == "trilinear") {
+        const double sample_spacing = std::max(0.125, 1.0 / std::sqrt(static_cast<double>(samples_per_pass)));
+        cam.set_pixel_spacing(sample_spacing / (image_width-1), sample_spacing / (image_height-1));
+    }
+    // Checkpoints go back into the file they were resumed from, unless --checkpoint says otherwise
+    const std::string checkpoint_path = options.checkpoint_path.empty() ? options.resume_path : options.checkpoint_path;
+
+    // The sampler stratifies each pass (or adaptive sampling's largest pixel) on its own;
+    //  sample indices past that go on in the next block of strata
+    const std::unique_ptr<sampler> pixel_sampler = make_sampler(
+        options.sampler_name, adaptive ? adaptive_options.max_samples : samples_per_pass, options.seed
+    );
+    std::cerr << "Rendering with " << options.num_threads << " threads (" << RT_PRECISION_NAME << " geometry)" << std::endl;
+    auto start_time = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> total_rays(0);
+    std::atomic<uint64_t> total_paths(0);
+    std::atomic<uint64_t> total_path_rays(0);
+    // Add what this thread traced since `before` to the totals
+    auto count_rays = [&](const ray_counts& before) {
+        total_rays += rays_traced - before.rays;
+        total_paths += paths_traced - before.paths;
+        total_path_rays += path_rays_traced - before.path_rays;
+    };
+
+    // The color of one sample of pixel (i, j); the sampler has been started for it
+    auto trace_sample = [&](int i, int j, sampler& smp) {
+        // "Squish" u and v to be in the range 0.0 to 1.0
+        // Pixel = (u, v), where u is horizontal and v is vertical
+        // Get a random neighboring pixel by adding a random offset in [0, 1) from the sampler
+        point2 jitter = smp.get_2d();
+        double u = (double(i) + jitter.x) / (image_width-1); // Ha, double u
+        double v = (double(j) + jitter.y) / (image_height-1);
+
+        // Get the ray that points from camera origin to (u, v) in the viewport
+        ray_differential r = cam.get_ray(u, v, smp);
+        return ray_color(r, background, world, materials, lights, max_depth, options.roulette_depth);
+    };
+
+    // Wavefront integrators that no thread is using (there are at most as many as render threads);
+    //  each keeps its path arrays from one group of tiles to the next
+    std::mutex wavefront_lock;
+    std::vector<std::unique_ptr<wavefront_integrator>> idle_integrators;
+
+    // Take samples [first_sample, first_sample + num_samples) of every pixel
+    auto render_pass = [&](int first_sample, int num_samples) {
+        if (options.integrator == "wavefront") {
+            // Enough pixels per group of tiles to fill the integrator's batch of paths
+            const size_t group_pixels = (static_cast<size_t>(options.wavefront_paths) + num_samples - 1) / num_samples;
+            render_tile_groups(image_width, image_height, options.tile_size, options.num_threads, group_pixels,
+                [&](const std::vector<tile>& group) {
+                    std::unique_ptr<wavefront_integrator> integrator;
+                    {
+                        std::lock_guard<std::mutex> guard(wavefront_lock);
+                        if (!idle_integrators.empty()) {
+                            integrator = std::move(idle_integrators.back());
+                            idle_integrators.pop_back();
+                        }
+                    }
+                    if (!integrator) {
+                        integrator = std::make_unique<wavefront_integrator>(
+                            cam, world, materials, lights, background, image_width, image_height, max_depth,
+                            options.roulette_depth, options.wavefront_paths
+                        );
+                    }
+                    total_rays += integrator->render_tiles(group, *pixel_sampler, fb, first_sample, num_samples);
+                    total_paths += integrator->get_paths_traced();
+                    total_path_rays += integrator->get_path_rays_traced();
+                    std::lock_guard<std::mutex> guard(wavefront_lock);
+                    idle_integrators.push_back(std::move(integrator));
+                }
+            );
+            return;
+        }
+
+        const render_context context = {
+            cam, world, materials, lights, background, image_width, image_height, first_sample, num_samples, max_depth,
+            options.roulette_depth, level
+        };
+        render_tiles(image_width, image_height, options.tile_size, options.num_threads, [&](const tile& t) {
+            const ray_counts before = thread_ray_counts();
+            if (options.packet_size > 0) {
+                switch (options.packet_size) {
+                    case 4: render_tile_packets<4>(t, context, *pixel_sampler, fb); break;
+                    case 8: render_tile_packets<8>(t, context, *pixel_sampler, fb); break;
+                    default: render_tile_packets<16>(t, context, *pixel_sampler, fb); break;
+                }
+                count_rays(before);
+                return;
+            }
+
+            // Samplers keep per-pixel state, so every tile gets its own
+            std::unique_ptr<sampler> smp = pixel_sampler->clone();
+            for (int j=t.y0; j<t.y1; j++) {
+                for (int i=t.x0; i<t.x1; i++) {
+                    smp->start_pixel(i, j);
+                    // Sample pixels around position pixel at position (i, j)
+                    // Taking the average of these samples creates an anti-aliasing effect
+                    color pixel_color(0, 0, 0);
+                    for (int s=first_sample; s<first_sample + num_samples; s++) {
+                        smp->start_sample(s);
+                        // Add this sample's color channel values
+                        // The framebuffer keeps the sum and the sample count, and averages them on output
+                        pixel_color += trace_sample(i, j, *smp);
+                    }
+                    fb.add_samples(i, j, pixel_color, num_samples);
+                }
             }
+            count_rays(before);
+        });
+    };
 
-            write_color(std::cout, pixel_color, samples_per_pixel);
+    if (adaptive) {
+        // Rounds of samples until every pixel converged or the budget is spent
+        // Each pixel's samples continue its sample sequence (first index = samples taken so far)
+        adaptive_sampling sampling(image_width, image_height, adaptive_options);
+        while (sampling.plan_round()) {
+            render_tiles(image_width, image_height, options.tile_size, options.num_threads, [&](const tile& t) {
+                const ray_counts before = thread_ray_counts();
+                std::unique_ptr<sampler> smp = pixel_sampler->clone();
+                for (int j=t.y0; j<t.y1; j++) {
+                    for (int i=t.x0; i<t.x1; i++) {
+                        const int num_samples = sampling.samples_this_round(i, j);
+                        if (num_samples == 0) continue;
+                        const int first_sample = sampling.samples_taken(i, j);
+                        smp->start_pixel(i, j);
+                        color pixel_color(0, 0, 0);
+                        for (int s=first_sample; s<first_sample + num_samples; s++) {
+                            smp->start_sample(s);
+                            color sample = trace_sample(i, j, *smp);
+                            sampling.add_sample(i, j, sample);
+                            pixel_color += sample;
+                        }
+                        fb.add_samples(i, j, pixel_color, num_samples);
+                    }
+                }
+                count_rays(before);
+            });
+        }
+        sampling.print_stats(std::cerr);
+        if (!options.spp_map_path.empty() && !sampling.write_heatmap(options.spp_map_path)) {
+            std::cerr << "Failed to write the samples per pixel heatmap" << std::endl;
+        }
+    } else if (progressive) {
+        // Passes until every pixel has --spp samples (a resumed render can be given a larger --spp to refine it)
+        // SIGTERM (ex. a preempted batch job) or Ctrl-C finishes the current pass, saves it and stops
+        stop_requested = 0;
+        std::signal(SIGTERM, request_stop);
+        std::signal(SIGINT, request_stop);
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        while (progress.samples_done < samples_per_pixel && !stop_requested) {
+            const int num_samples = std::min(samples_per_pass, samples_per_pixel - progress.samples_done);
+            render_pass(progress.samples_done, num_samples);
+            progress.samples_done += num_samples;
+            std::cerr << "Pass done: " << progress.samples_done << "/" << samples_per_pixel
+                << " samples per pixel" << std::endl;
+
+            const bool last_pass = progress.samples_done >= samples_per_pixel || stop_requested;
+            std::chrono::duration<double> since_checkpoint = std::chrono::steady_clock::now() - last_checkpoint;
+            if (checkpoint_path.empty() || (!last_pass && since_checkpoint.count() < options.checkpoint_interval)) {
+                continue;
+            }
+            progress.sums = fb.get_sums();
+            progress.counts = fb.get_counts();
+            if (!write_checkpoint(checkpoint_path, progress)) {
+                std::cerr << "Failed to write the checkpoint" << std::endl;
+            }
+            // Keep the image file up to date too (the final image is written below)
+            if (!last_pass && !options.output_path.empty() && options.output_path != "-") {
+                write_image(options.output_path, fb);
+            }
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+        std::signal(SIGTERM, SIG_DFL);
+        std::signal(SIGINT, SIG_DFL);
+        if (stop_requested) {
+            std::cerr << "Stopped at " << progress.samples_done << " samples per pixel";
+            if (!checkpoint_path.empty()) std::cerr << "; continue with --resume " << checkpoint_path;
+            std::cerr << std::endl;
+        }
+    } else {
+        render_pass(0, samples_per_pixel);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cerr << "Rendered in " << elapsed.count() << " seconds ("
+        << total_rays / elapsed.count() / 1e6 << " million rays/second)" << std::endl;
+    if (total_paths > 0) {
+        std::cerr << "Average path length: " << static_cast<double>(total_path_rays) / total_paths
+            << " rays (" << total_paths << " paths, not counting shadow rays)" << std::endl;
+    }
+
+    // Post-processing
+    std::vector<float> reference;
+    if (!options.reference_path.empty()) {
+        int reference_width, reference_height;
+        if (!read_pfm(options.reference_path, reference_width, reference_height, reference)) return false;
+        if (reference_width != image_width || reference_height != image_height) {
+            std::cerr << "The reference image is " << reference_width << "x" << reference_height
+                << ", not " << image_width << "x" << image_height << std::endl;
+            return false;
         }
     }
+    auto report_error = [&](const char* name, const std::vector<float>& image) {
+        if (reference.empty()) return;
+        image_error error = compare_images(image, reference);
+        std::cerr << name << " vs. reference: MSE " << error.mse << ", display MSE " << error.display_mse
+            << ", PSNR " << error.psnr << " dB" << std::endl;
+    };
+    report_error("Rendered", fb.resolve_linear());
+
+    if (options.denoise_strength > 0 || !options.aux_prefix.empty()) {
+        // The first hits of the first max_feature_samples camera rays of every pixel (the same rays as the render's)
+        auto denoise_start = std::chrono::steady_clock::now();
+        feature_buffers features(image_width, image_height);
+        const int feature_samples = std::min(samples_per_pixel, max_feature_samples);
+        render_tiles(image_width, image_height, options.tile_size, options.num_threads, [&](const tile& t) {
+            render_feature_tile(
+                t, cam, world, materials, image_width, image_height, *pixel_sampler, feature_samples, features
+            );
+        });
+        if (!options.aux_prefix.empty() && !features.write(options.aux_prefix)) {
+            std::cerr << "Failed to write the feature buffers" << std::endl;
+        }
+
+        if (options.denoise_strength > 0) {
+            auto filter_start = std::chrono::steady_clock::now();
+            atrous_denoiser::options denoiser_options;
+            denoiser_options.sigma_color *= static_cast<float>(options.denoise_strength);
+            atrous_denoiser denoiser(denoiser_options, options.num_threads, level);
+            std::vector<float> denoised = denoiser.denoise(fb, features);
+            auto denoise_end = std::chrono::steady_clock::now();
+            std::chrono::duration<double> denoise_time = denoise_end - denoise_start;
+            std::chrono::duration<double> filter_time = denoise_end - filter_start;
+            std::cerr << "Denoised in " << denoise_time.count() << " seconds (feature buffers "
+                << (denoise_time - filter_time).count() << " s, " << simd_level_name(level) << " filter "
+                << filter_time.count() << " s)" << std::endl;
+            report_error("Denoised", denoised);
+            fb = framebuffer(
+                image_width, image_height, std::move(denoised),
+                std::vector<float>(static_cast<size_t>(image_width) * image_height, 1.0f)
+            );
+        }
+    }
+
+    // Write the whole image in one pass
+    if (!write_image(options.output_path, fb)) {
+        std::cerr << "Failed to write the image" << std::endl;
+        return false;
+    }
+    return true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    render_options options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
     // print_ppm_file();
-    run_ray_tracer();
-    return 0;
+    return run_ray_tracer(options) ? 0 : 1;
 }
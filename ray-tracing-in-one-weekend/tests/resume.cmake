@@ -0,0 +1,37 @@
+# A progressive render that is stopped and resumed must give the same image, bit for bit, as one that was
+#  never stopped (run by ctest, see CMakeLists.txt)
+# cmake -DRAYTRACER=<RayTracer> -DWORK_DIR=<scratch directory> -P resume.cmake
+# Scene 4 has an image texture, so the texture filter's footprint is checked too
+
+set(common --scene 4 --width 32 --progressive 2 --threads 2)
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# Run RayTracer with the common options plus ARGN; any failure fails the test
+function(render)
+    execute_process(COMMAND ${RAYTRACER} ${common} ${ARGN} RESULT_VARIABLE result OUTPUT_QUIET ERROR_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "RayTracer ${ARGN} failed: ${result}")
+    endif()
+endfunction()
+
+# Fail unless the two files are the same
+function(expect_same a b)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${a} ${b} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${a} and ${b} differ")
+    endif()
+endfunction()
+
+# Never stopped, at 2 and at 6 samples per pixel
+render(--spp 2 --output ${WORK_DIR}/whole_2.pfm)
+render(--spp 6 --output ${WORK_DIR}/whole_6.pfm)
+
+# Stopped after the first pass
+render(--spp 2 --checkpoint ${WORK_DIR}/render.ck --output ${WORK_DIR}/resumed.pfm)
+# Resumed with the same --spp: nothing left to do, the image is unchanged
+render(--spp 2 --resume ${WORK_DIR}/render.ck --output ${WORK_DIR}/resumed.pfm)
+expect_same(${WORK_DIR}/resumed.pfm ${WORK_DIR}/whole_2.pfm)
+# Resumed with a larger --spp: two more passes
+render(--spp 6 --resume ${WORK_DIR}/render.ck --output ${WORK_DIR}/resumed.pfm)
+expect_same(${WORK_DIR}/resumed.pfm ${WORK_DIR}/whole_6.pfm)
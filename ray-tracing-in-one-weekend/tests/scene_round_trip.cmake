@@ -0,0 +1,25 @@
+# A text scene file and the binary file that --write-scene makes of it must render the same image, bit for bit
+#  (run by ctest, see CMakeLists.txt)
+# cmake -DRAYTRACER=<RayTracer> -DSCENE=<text scene file> -DWORK_DIR=<scratch directory> -P scene_round_trip.cmake
+
+set(common --width 32 --spp 2 --threads 2)
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# Run RayTracer with ARGN; any failure fails the test
+function(run)
+    execute_process(COMMAND ${RAYTRACER} ${ARGN} RESULT_VARIABLE result OUTPUT_QUIET ERROR_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "RayTracer ${ARGN} failed: ${result}")
+    endif()
+endfunction()
+
+run(--scene-file ${SCENE} --write-scene ${WORK_DIR}/scene.rtscene)
+run(--scene-file ${SCENE} ${common} --output ${WORK_DIR}/text.pfm)
+run(--scene-file ${WORK_DIR}/scene.rtscene ${common} --output ${WORK_DIR}/binary.pfm)
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/text.pfm ${WORK_DIR}/binary.pfm RESULT_VARIABLE result
+)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${SCENE} renders differently from its binary scene file")
+endif()